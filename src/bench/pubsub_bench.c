@@ -0,0 +1,599 @@
+// pubsub_bench.c — Benchmark de extremo a extremo para broker_tcp / broker_udp
+// Levanta el broker en loopback (o usa uno ya corriendo con --no-spawn), conecta N publicadores y
+// M suscriptores (un hilo cada uno) sobre S temas y mide durante --duration segundos:
+// mensajes/s, bytes/s, pérdida y latencia p50/p99/p99.9 con un histograma estilo HDR.
+//
+// Uso: pubsub_bench [--broker tcp|udp] [--broker-bin PATH] [--broker-args "ARGS"] [--no-spawn]
+//                   [--host H] [--port P] [--pubs N] [--subs M] [--subjects S]
+//                   [--payload N | MIN-MAX | exp:MEDIA] [--rate MSGS_POR_SEG] [--batch N]
+//                   [--duration SEG] [--warmup SEG] [--json ARCHIVO|-]
+//
+// El publicador p envía sus mensajes a los temas en ronda; el suscriptor j se suscribe al tema
+// j % S. Cada payload empieza con el sello de common/latency.h (publicador, secuencia y el instante de
+// envío en CLOCK_MONOTONIC), así la latencia se mide en el mismo reloj. La pérdida es la diferencia
+// entre lo publicado en el tema de cada suscriptor y lo que le llegó.
+
+#define _GNU_SOURCE        // sendmmsg()
+
+#include <arpa/inet.h>     // htons(), inet_pton()
+#include <errno.h>         // errno, EINTR, EAGAIN
+#include <math.h>          // log()
+#include <netinet/in.h>    // struct sockaddr_in
+#include <pthread.h>       // pthread_create(), pthread_join()
+#include <signal.h>        // kill(), SIGTERM, signal(), SIGPIPE
+#include <stdatomic.h>     // atomic_int, atomic_ullong
+#include <stdio.h>         // printf(), fprintf(), fopen()
+#include <stdlib.h>        // strtol(), calloc(), free()
+#include <string.h>        // memset(), memcpy(), strcmp(), strchr()
+#include <sys/socket.h>    // socket(), connect(), send(), recv(), sendto(), sendmmsg()
+#include <sys/time.h>      // struct timeval (SO_RCVTIMEO)
+#include <sys/uio.h>       // struct iovec
+#include <sys/wait.h>      // waitpid()
+#include <time.h>          // clock_gettime(), nanosleep()
+#include <unistd.h>        // fork(), execv(), close()
+
+#include "common/histogram.h" // histograma de latencias
+#include "common/latency.h" // sello de latencia en el payload
+#define MAX_SUBJECT_LEN 64
+#define UDP_MAX_PAYLOAD 1400 // los datagramas del broker UDP son de 2048 bytes como máximo
+#define RECV_BUF (1u << 20)
+#define KEEPALIVE_NS 10000000000ull // PING de los suscriptores UDP (broker_udp olvida a los 30 s sin tráfico)
+
+typedef enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP } size_dist_t;
+
+// Configuración (solo se escribe antes de lanzar los hilos)
+static int use_udp = 0;
+static const char *host = "127.0.0.1";
+static int port = 0;
+static int npubs = 1, nsubs = 1, nsubjects = 1;
+static size_dist_t size_dist = SIZE_FIXED;
+static size_t size_a = 128, size_b = 128; // fijo: a; uniforme: [a, b]; exponencial: media a
+static size_t max_payload = 65536;
+static double rate = 0; // mensajes/s por publicador (0 = sin límite)
+static int batch = 1; // mensajes por escritura
+static double duration_s = 5, warmup_s = 0;
+
+static char (*subjects)[MAX_SUBJECT_LEN];
+static struct sockaddr_in broker_addr;
+
+// Estado compartido entre hilos
+static atomic_int stop_pubs; // los publicadores terminan
+static atomic_int stop_subs; // los suscriptores terminan
+static atomic_int subs_ready; // suscriptores con la suscripción confirmada
+static atomic_ullong *published; // mensajes medidos publicados por tema
+static atomic_ullong measure_start_ns; // muestras anteriores son warmup
+
+typedef struct SubStats {
+    pthread_t thread;
+    int idx;
+    Histogram hist;
+    uint64_t received; // mensajes medidos recibidos
+    uint64_t bytes; // bytes de payload medidos recibidos
+    uint64_t fragments; // MESSAGE sin sello (payload entregado por partes)
+} SubStats;
+
+typedef struct PubStats {
+    pthread_t thread;
+    int idx;
+    uint64_t sent; // mensajes medidos enviados
+    uint64_t bytes; // bytes de payload medidos enviados
+} PubStats;
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = {(time_t) (ns / 1000000000ull), (long) (ns % 1000000000ull)};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+}
+
+// Generador xorshift64* por hilo (tamaños de payload)
+static uint64_t rng_next(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ull;
+}
+
+// Tamaño del próximo payload según la distribución elegida
+static size_t next_size(uint64_t *rng) {
+    size_t n = size_a;
+    if (size_dist == SIZE_UNIFORM) {
+        n = size_a + (size_t) (rng_next(rng) % (size_b - size_a + 1));
+    } else if (size_dist == SIZE_EXP) {
+        double u = ((double) (rng_next(rng) >> 11) + 1.0) / 9007199254740993.0; // (0, 1]
+        n = (size_t) (-log(u) * (double) size_a);
+    }
+    if (n < LAT_HDR_LEN) n = LAT_HDR_LEN;
+    if (n > max_payload) n = max_payload;
+    return n;
+}
+
+static int connect_broker(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *) &broker_addr, sizeof(broker_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Publicadores
+// ---------------------------------------------------------------------------
+
+static void *pub_main(void *arg) {
+    PubStats *ps = (PubStats *) arg;
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (uint64_t) (ps->idx + 1);
+    int fd = use_udp ? socket(AF_INET, SOCK_DGRAM, 0) : connect_broker();
+    if (fd < 0) {
+        perror("publisher connect");
+        return NULL;
+    }
+    if (!use_udp && send_all(fd, "PUB\n", 4) < 0) {
+        close(fd);
+        return NULL;
+    }
+    // Un mensaje ocupa a lo sumo la línea de control más el payload.
+    size_t slot = 32 + MAX_SUBJECT_LEN + max_payload;
+    char *buf = (char *) malloc(slot * (size_t) batch);
+    struct mmsghdr *msgs = (struct mmsghdr *) calloc((size_t) batch, sizeof(struct mmsghdr));
+    struct iovec *iovs = (struct iovec *) calloc((size_t) batch, sizeof(struct iovec));
+    if (!buf || !msgs || !iovs) {
+        perror("malloc");
+        close(fd);
+        return NULL;
+    }
+    for (int i = 0; i < batch; i++) {
+        msgs[i].msg_hdr.msg_name = &broker_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(broker_addr);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint64_t seq = 0;
+    uint64_t start = lat_now_ns();
+    uint64_t measure_from = atomic_load(&measure_start_ns);
+    double gap_ns = rate > 0 ? 1e9 / rate : 0;
+    while (!atomic_load_explicit(&stop_pubs, memory_order_relaxed)) {
+        // Con --rate, el mensaje k sale en start + k / rate (sin acumular el retraso del sleep).
+        if (gap_ns > 0) {
+            uint64_t due = start + (uint64_t) ((double) seq * gap_ns);
+            uint64_t t = lat_now_ns();
+            if (due > t) sleep_ns(due - t);
+        }
+        size_t len = 0;
+        for (int i = 0; i < batch; i++) {
+            int subj = (int) ((seq + (uint64_t) ps->idx) % (uint64_t) nsubjects);
+            size_t plen = next_size(&rng);
+            char *m = buf + (use_udp ? slot * (size_t) i : len);
+            int hlen = snprintf(m, 32 + MAX_SUBJECT_LEN, "PUBLISH %s %zu\n", subjects[subj], plen);
+            char *p = m + hlen;
+            uint64_t t = lat_now_ns();
+            lat_stamp(p, (uint32_t) ps->idx, seq, t);
+            memset(p + LAT_HDR_LEN, 'x', plen - LAT_HDR_LEN);
+            if (t >= measure_from) {
+                atomic_fetch_add_explicit(&published[subj], 1, memory_order_relaxed);
+                ps->sent++;
+                ps->bytes += plen;
+            }
+            if (use_udp) {
+                iovs[i].iov_base = m;
+                iovs[i].iov_len = (size_t) hlen + plen;
+            } else {
+                len += (size_t) hlen + plen;
+            }
+            seq++;
+        }
+        if (use_udp) {
+            // Un datagrama por mensaje, todos en una sola llamada.
+            int done = 0;
+            while (done < batch) {
+                int r = sendmmsg(fd, msgs + done, (unsigned) (batch - done), 0);
+                if (r < 0) {
+                    if (errno != EINTR) done++; // datagrama perdido
+                    continue;
+                }
+                done += r;
+            }
+        } else if (send_all(fd, buf, len) < 0) {
+            break;
+        }
+    }
+    free(buf);
+    free(msgs);
+    free(iovs);
+    close(fd);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Suscriptores
+// ---------------------------------------------------------------------------
+
+// Registrar un MESSAGE recibido
+static void on_message(SubStats *ss, const char *payload, size_t len, uint64_t t) {
+    LatStamp st;
+    if (lat_parse(payload, len, &st) < 0) {
+        ss->fragments++;
+        return;
+    }
+    uint64_t sent = st.sent_ns;
+    if (sent < atomic_load_explicit(&measure_start_ns, memory_order_relaxed)) return; // warmup
+    ss->received++;
+    ss->bytes += len;
+    histogram_record(&ss->hist, t > sent ? t - sent : 0);
+}
+
+// Parsear los MESSAGE completos de buf[0, len); devuelve los bytes consumidos
+static size_t parse_stream(SubStats *ss, char *buf, size_t len, int *ok) {
+    size_t off = 0;
+    uint64_t t = lat_now_ns(); // un instante por lote recibido
+    while (off < len) {
+        char *nl = memchr(buf + off, '\n', len - off);
+        if (!nl) break;
+        if (strncmp(buf + off, "MESSAGE ", 8) != 0) {
+            if (strncmp(buf + off, "OK", 2) == 0) *ok = 1;
+            off = (size_t) (nl - buf) + 1;
+            continue;
+        }
+        // "MESSAGE <tema> <len>[ <seq>]\n": el largo es el campo que sigue al tema
+        char *sp = memchr(buf + off + 8, ' ', (size_t) (nl - (buf + off + 8)));
+        if (!sp) {
+            off = (size_t) (nl - buf) + 1;
+            continue;
+        }
+        size_t plen = strtoul(sp + 1, NULL, 10);
+        size_t hlen = (size_t) (nl - (buf + off)) + 1;
+        if (off + hlen + plen > len) break; // payload incompleto
+        on_message(ss, buf + off + hlen, plen, t);
+        off += hlen + plen;
+    }
+    return off;
+}
+
+static void *sub_main(void *arg) {
+    SubStats *ss = (SubStats *) arg;
+    const char *subject = subjects[ss->idx % nsubjects];
+    char line[32 + MAX_SUBJECT_LEN];
+    int llen = snprintf(line, sizeof(line), "SUBSCRIBE %s\n", subject);
+    char *buf = (char *) malloc(RECV_BUF);
+    if (!buf) return NULL;
+    struct timeval tv = {0, 100000}; // revisar stop_subs cada 100 ms
+    int ok = 0;
+
+    if (use_udp) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        int rcvbuf = 8 << 20;
+        (void) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        // El SUBSCRIBE puede perderse: reintentar hasta ver el OK.
+        for (int tries = 0; !ok && tries < 50; tries++) {
+            (void) sendto(fd, line, (size_t) llen, 0, (struct sockaddr *) &broker_addr, sizeof(broker_addr));
+            ssize_t n = recv(fd, buf, RECV_BUF, 0);
+            if (n >= 2 && strncmp(buf, "OK", 2) == 0) ok = 1;
+        }
+        if (ok) atomic_fetch_add(&subs_ready, 1);
+        uint64_t next_ping = lat_now_ns() + KEEPALIVE_NS;
+        while (!atomic_load(&stop_subs)) {
+            if (lat_now_ns() >= next_ping) {
+                (void) sendto(fd, "PING\n", 5, 0, (struct sockaddr *) &broker_addr, sizeof(broker_addr));
+                next_ping += KEEPALIVE_NS;
+            }
+            ssize_t n = recv(fd, buf, RECV_BUF, 0);
+            if (n <= 0) continue;
+            char *nl = memchr(buf, '\n', (size_t) n);
+            if (!nl || strncmp(buf, "MESSAGE ", 8) != 0) continue;
+            char *sp = memchr(buf + 8, ' ', (size_t) (nl - (buf + 8))); // largo: el campo después del tema
+            if (!sp) continue;
+            size_t plen = strtoul(sp + 1, NULL, 10);
+            size_t hlen = (size_t) (nl - buf) + 1;
+            if (plen > (size_t) n - hlen) plen = (size_t) n - hlen;
+            on_message(ss, buf + hlen, plen, lat_now_ns());
+        }
+        close(fd);
+    } else {
+        int fd = connect_broker();
+        if (fd < 0) {
+            perror("subscriber connect");
+            free(buf);
+            return NULL;
+        }
+        (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (send_all(fd, "SUB\n", 4) < 0 || send_all(fd, line, (size_t) llen) < 0) {
+            close(fd);
+            free(buf);
+            return NULL;
+        }
+        size_t have = 0;
+        int counted = 0;
+        while (!atomic_load(&stop_subs)) {
+            ssize_t n = recv(fd, buf + have, RECV_BUF - have, 0);
+            if (n == 0) break;
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+                break;
+            }
+            have += (size_t) n;
+            size_t used = parse_stream(ss, buf, have, &ok);
+            memmove(buf, buf + used, have - used);
+            have -= used;
+            if (have == RECV_BUF) have = 0; // mensaje mayor al buffer: descartar
+            if (ok && !counted) {
+                counted = 1;
+                atomic_fetch_add(&subs_ready, 1);
+            }
+        }
+        close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Broker
+// ---------------------------------------------------------------------------
+
+// Lanzar el broker como proceso hijo: <bin> <puerto> [args...]
+static pid_t spawn_broker(const char *bin, const char *extra) {
+    char *argv[64];
+    int argc = 0;
+    char portbuf[16];
+    snprintf(portbuf, sizeof(portbuf), "%d", port);
+    argv[argc++] = (char *) bin;
+    argv[argc++] = portbuf;
+    char *copy = extra ? strdup(extra) : NULL;
+    for (char *tok = copy ? strtok(copy, " ") : NULL; tok && argc < 63; tok = strtok(NULL, " ")) argv[argc++] = tok;
+    argv[argc] = NULL;
+    pid_t pid = fork();
+    if (pid == 0) {
+        // La salida del broker no se mezcla con el reporte.
+        if (!freopen("/dev/null", "w", stdout)) _exit(127);
+        execv(bin, argv);
+        perror("execv");
+        _exit(127);
+    }
+    free(copy);
+    return pid;
+}
+
+// Esperar a que el broker acepte conexiones (TCP) o darle un momento para abrir el socket (UDP)
+static int wait_broker(void) {
+    if (use_udp) {
+        sleep_ns(300000000ull);
+        return 0;
+    }
+    for (int i = 0; i < 100; i++) {
+        int fd = connect_broker();
+        if (fd >= 0) {
+            close(fd);
+            return 0;
+        }
+        sleep_ns(20000000ull);
+    }
+    return -1;
+}
+
+// Parsear --payload: "N", "MIN-MAX" o "exp:MEDIA"
+static int parse_payload(const char *s) {
+    char *end;
+    if (strncmp(s, "exp:", 4) == 0) {
+        size_dist = SIZE_EXP;
+        size_a = strtoul(s + 4, &end, 10);
+        return *end || size_a == 0 ? -1 : 0;
+    }
+    size_a = strtoul(s, &end, 10);
+    if (*end == '-') {
+        size_dist = SIZE_UNIFORM;
+        size_b = strtoul(end + 1, &end, 10);
+        return *end || size_b < size_a ? -1 : 0;
+    }
+    size_dist = SIZE_FIXED;
+    size_b = size_a;
+    return *end ? -1 : 0;
+}
+
+// Directorio del ejecutable (los brokers se compilan junto al benchmark)
+static void default_broker_bin(char *out, size_t cap, const char *argv0) {
+    const char *slash = strrchr(argv0, '/');
+    int dirlen = slash ? (int) (slash - argv0) : 1;
+    snprintf(out, cap, "%.*s/%s", dirlen, slash ? argv0 : ".", use_udp ? "broker_udp" : "broker_tcp");
+}
+
+// Escribir 's' como string JSON, entre comillas y con las comillas, barras y controles escapados
+static void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (const unsigned char *p = (const unsigned char *) s; *p; p++) {
+        if (*p == '"' || *p == '\\') fprintf(f, "\\%c", *p);
+        else if (*p == '\n') fputs("\\n", f);
+        else if (*p == '\t') fputs("\\t", f);
+        else if (*p < 0x20) fprintf(f, "\\u%04x", *p);
+        else fputc(*p, f);
+    }
+    fputc('"', f);
+}
+
+int main(int argc, char **argv) {
+    const char *broker_bin = NULL, *broker_args = NULL, *json_path = NULL, *payload_spec = "128";
+    int spawn = 1;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(a, "--no-spawn") == 0) {
+            spawn = 0;
+            continue;
+        }
+        if (!v) {
+            fprintf(stderr, "missing value for %s\n", a);
+            return 1;
+        }
+        i++;
+        if (strcmp(a, "--broker") == 0) use_udp = strcmp(v, "udp") == 0;
+        else if (strcmp(a, "--broker-bin") == 0) broker_bin = v;
+        else if (strcmp(a, "--broker-args") == 0) broker_args = v;
+        else if (strcmp(a, "--host") == 0) host = v;
+        else if (strcmp(a, "--port") == 0) port = atoi(v);
+        else if (strcmp(a, "--pubs") == 0) npubs = atoi(v);
+        else if (strcmp(a, "--subs") == 0) nsubs = atoi(v);
+        else if (strcmp(a, "--subjects") == 0) nsubjects = atoi(v);
+        else if (strcmp(a, "--payload") == 0) payload_spec = v;
+        else if (strcmp(a, "--rate") == 0) rate = atof(v);
+        else if (strcmp(a, "--batch") == 0) batch = atoi(v);
+        else if (strcmp(a, "--duration") == 0) duration_s = atof(v);
+        else if (strcmp(a, "--warmup") == 0) warmup_s = atof(v);
+        else if (strcmp(a, "--json") == 0) json_path = v;
+        else {
+            fprintf(stderr, "unknown option %s\n", a);
+            return 1;
+        }
+    }
+    if (port == 0) port = use_udp ? 5656 : 5655;
+    max_payload = use_udp ? UDP_MAX_PAYLOAD : 65536;
+    if (parse_payload(payload_spec) < 0 || npubs < 1 || nsubs < 0 || nsubjects < 1 || batch < 1 ||
+        batch > 1024 || duration_s <= 0 || warmup_s < 0) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&broker_addr, 0, sizeof(broker_addr));
+    broker_addr.sin_family = AF_INET;
+    broker_addr.sin_port = htons((uint16_t) port);
+    if (inet_pton(AF_INET, host, &broker_addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid host %s\n", host);
+        return 1;
+    }
+
+    subjects = calloc((size_t) nsubjects, MAX_SUBJECT_LEN);
+    published = calloc((size_t) nsubjects, sizeof(*published));
+    PubStats *pubs = calloc((size_t) npubs, sizeof(PubStats));
+    SubStats *subs = calloc((size_t) (nsubs ? nsubs : 1), sizeof(SubStats));
+    if (!subjects || !published || !pubs || !subs) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < nsubjects; i++) snprintf(subjects[i], MAX_SUBJECT_LEN, "bench.%d", i);
+
+    char binbuf[4096];
+    pid_t broker = -1;
+    if (spawn) {
+        if (!broker_bin) {
+            default_broker_bin(binbuf, sizeof(binbuf), argv[0]);
+            broker_bin = binbuf;
+        }
+        broker = spawn_broker(broker_bin, broker_args);
+    }
+    if (wait_broker() < 0) {
+        fprintf(stderr, "broker not reachable on %s:%d\n", host, port);
+        if (broker > 0) kill(broker, SIGTERM);
+        return 1;
+    }
+
+    // Suscriptores primero: los publicadores arrancan cuando todas las suscripciones están confirmadas.
+    atomic_store(&measure_start_ns, UINT64_MAX);
+    for (int i = 0; i < nsubs; i++) {
+        subs[i].idx = i;
+        histogram_reset(&subs[i].hist);
+        pthread_create(&subs[i].thread, NULL, sub_main, &subs[i]);
+    }
+    for (int i = 0; i < 500 && atomic_load(&subs_ready) < nsubs; i++) sleep_ns(10000000ull);
+    if (atomic_load(&subs_ready) < nsubs) fprintf(stderr, "warning: only %d/%d subscriptions confirmed\n",
+                                                 atomic_load(&subs_ready), nsubs);
+
+    uint64_t t0 = lat_now_ns();
+    atomic_store(&measure_start_ns, t0 + (uint64_t) (warmup_s * 1e9));
+    for (int i = 0; i < npubs; i++) {
+        pubs[i].idx = i;
+        pthread_create(&pubs[i].thread, NULL, pub_main, &pubs[i]);
+    }
+    sleep_ns((uint64_t) ((warmup_s + duration_s) * 1e9));
+    atomic_store(&stop_pubs, 1);
+    uint64_t t1 = lat_now_ns();
+    for (int i = 0; i < npubs; i++) pthread_join(pubs[i].thread, NULL);
+    // Dar tiempo a que el broker vacíe sus colas antes de contar la pérdida.
+    sleep_ns(1000000000ull);
+    atomic_store(&stop_subs, 1);
+    for (int i = 0; i < nsubs; i++) pthread_join(subs[i].thread, NULL);
+    if (broker > 0) {
+        kill(broker, SIGTERM);
+        waitpid(broker, NULL, 0);
+    }
+
+    // Totales
+    static Histogram all;
+    histogram_reset(&all);
+    uint64_t sent = 0, sent_bytes = 0, received = 0, bytes = 0, fragments = 0, expected = 0;
+    for (int i = 0; i < npubs; i++) {
+        sent += pubs[i].sent;
+        sent_bytes += pubs[i].bytes;
+    }
+    for (int i = 0; i < nsubs; i++) {
+        histogram_merge(&all, &subs[i].hist);
+        received += subs[i].received;
+        bytes += subs[i].bytes;
+        fragments += subs[i].fragments;
+        expected += atomic_load(&published[i % nsubjects]);
+    }
+    double secs = (double) (t1 - atomic_load(&measure_start_ns)) / 1e9;
+    uint64_t lost = expected > received ? expected - received : 0;
+    double loss_pct = expected ? 100.0 * (double) lost / (double) expected : 0.0;
+
+    printf("broker=%s pubs=%d subs=%d subjects=%d payload=%s rate=%g batch=%d duration=%.2fs\n",
+           use_udp ? "udp" : "tcp", npubs, nsubs, nsubjects, payload_spec, rate, batch, secs);
+    printf("published:  %llu msgs (%.0f msgs/s, %.2f MB/s)\n", (unsigned long long) sent, (double) sent / secs,
+           (double) sent_bytes / secs / 1e6);
+    printf("delivered:  %llu msgs (%.0f msgs/s, %.2f MB/s)\n", (unsigned long long) received,
+           (double) received / secs, (double) bytes / secs / 1e6);
+    printf("loss:       %llu of %llu (%.3f%%)%s\n", (unsigned long long) lost, (unsigned long long) expected,
+           loss_pct, fragments ? " [fragmented deliveries seen]" : "");
+    printf("latency us: min %.1f p50 %.1f p99 %.1f p99.9 %.1f max %.1f mean %.1f\n", (double) all.min / 1e3,
+           (double) histogram_percentile(&all, 50) / 1e3, (double) histogram_percentile(&all, 99) / 1e3,
+           (double) histogram_percentile(&all, 99.9) / 1e3, (double) all.max / 1e3, histogram_mean(&all) / 1e3);
+
+    if (json_path) {
+        FILE *f = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (!f) {
+            perror("json");
+            return 1;
+        }
+        // broker_args y payload vienen de la línea de comandos: pueden traer comillas o barras.
+        fprintf(f, "{\"broker\":\"%s\",\"broker_args\":", use_udp ? "udp" : "tcp");
+        json_string(f, broker_args ? broker_args : "");
+        fprintf(f, ",\"payload\":");
+        json_string(f, payload_spec);
+        fprintf(f,
+                ",\"publishers\":%d,\"subscribers\":%d,\"subjects\":%d,\"rate\":%g,\"batch\":%d,"
+                "\"duration_s\":%.3f,"
+                "\"published\":%llu,\"published_msgs_per_s\":%.1f,\"published_bytes_per_s\":%.1f,"
+                "\"delivered\":%llu,\"expected\":%llu,\"lost\":%llu,\"loss_pct\":%.4f,\"fragments\":%llu,"
+                "\"msgs_per_s\":%.1f,\"bytes_per_s\":%.1f,"
+                "\"latency_ns\":{\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,"
+                "\"max\":%llu,\"mean\":%.1f}}\n",
+                npubs, nsubs, nsubjects, rate, batch, secs, (unsigned long long) sent, (double) sent / secs,
+                (double) sent_bytes / secs,
+                (unsigned long long) received, (unsigned long long) expected, (unsigned long long) lost, loss_pct,
+                (unsigned long long) fragments, (double) received / secs, (double) bytes / secs,
+                (unsigned long long) all.min, (unsigned long long) histogram_percentile(&all, 50),
+                (unsigned long long) histogram_percentile(&all, 90),
+                (unsigned long long) histogram_percentile(&all, 99),
+                (unsigned long long) histogram_percentile(&all, 99.9), (unsigned long long) all.max,
+                histogram_mean(&all));
+        if (f != stdout) fclose(f);
+    }
+    free(subjects);
+    free((void *) published);
+    free(pubs);
+    free(subs);
+    return 0;
+}
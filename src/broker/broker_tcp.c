@@ -2,46 +2,504 @@
 // Protocolo (líneas de control):
 //  1) Cliente envía rol: "PUB\n" o "SUB\n".
 //  2) Publicadores: "PUBLISH <subject> <len>\n<payload>"
-//  3) Suscriptores: "SUBSCRIBE <subject>\n" (pueden enviar varias).
+//     o, para varios mensajes de un tema a la vez, "PUBLISH_BATCH <subject> <bytes>\n<registros>"
+//     con registros "u32 len | payload" (ver common/proto_v2.h).
+//  3) Suscriptores: "SUBSCRIBE <subject>\n" (pueden enviar varias). El tema puede ser un patrón
+//     jerárquico: "*" reemplaza un nivel y ">" (al final) uno o más ("sensors.*.temp", "sensors.>").
+//     "SUBSCRIBE <subject> GROUP <name>\n" une al suscriptor a un grupo de cola: cada mensaje va a un
+//     solo miembro del grupo (en v2, V2_FLAG_GROUP y el nombre del grupo como payload).
 //  4) Broker reenvía a suscriptores del tema:
 //     "MESSAGE <subject> <len>\n<payload>"
+//  Con "PUB2\n" / "SUB2\n" como rol se negocia el framing binario v2 (ver common/proto_v2.h):
+//  PUBLISH/SUBSCRIBE/MESSAGE pasan a ser frames de cabecera fija con ids de tema internados.
+//  Entre brokers: "ROUTE <id>\n" como rol (y como respuesta), "RS+ <subject>\n" / "RS- <subject>\n"
+//  para el interés y los mismos "MESSAGE <subject> <len>\n<payload>" en ambos sentidos. Los grupos de
+//  cola se anuncian con "RG+ <subject> <group>\n" / "RG- <subject> <group>\n" y lo que le toca a un
+//  miembro del otro broker viaja como "GMSG <subject> <group subject> <group> <len>\n<payload>".
+//  Con control de flujo el broker concede crédito a cada publicador: "CREDIT <msgs> <bytes>\n" (en v2,
+//  el frame V2_CREDIT).
+//  Compresión: "PUB COMPRESS <códecs>\n" / "SUB2 COMPRESS <códecs>\n" (códecs separados por comas) y el
+//  broker responde "COMPRESS <códec>\n" (en v2, el frame V2_COMPRESS). Después el publicador puede
+//  enviar "PUBLISH_BATCH <subject> <bytes> <códec>\n<u32 raw_len | bloque>" y el suscriptor recibe
+//  "MESSAGE_BATCH <subject> <bytes>\n<u32 raw_len | bloque>" con los registros comprimidos.
 // TCP hace 3 way handshake/4 way handshake en el kernel, solo usamos SOCK_STREAM.
+//
+// Uso: broker_tcp [puerto] [--backend epoll|select|uring] [--threads N]
+//                  [--slow-policy drop-oldest|drop-newest|disconnect]
+//                  [--max-queue-bytes N] [--max-lag-ms N] [--zerocopy-min BYTES]
+//                  [--retain N] [--retain-bytes B] [--ring-memory B]
+//                  [--data-dir DIR] [--log-segment-bytes B] [--log-max-bytes B] [--log-sync-ms MS]
+//                  [--admin-port N] [--cut-through BYTES] [--group-policy round-robin|least-queued]
+//                  [--route HOST:PORT]... [--credit-msgs N] [--credit-bytes B]
+// El backend por defecto es epoll (sockets no bloqueantes, costo proporcional a las
+// conexiones activas). select() se conserva como alternativa portable, limitado a FD_SETSIZE.
+// uring usa io_uring (common/uring.h): accept y recepciones multishot con buffers provistos y todos
+// los envíos de una iteración en una sola syscall; si el kernel no lo soporta se usa epoll.
+// Cada suscriptor tiene una cola de salida acotada que se vacía cuando el socket admite
+// escritura; la política de consumidor lento decide qué hacer cuando la cola se llena.
+// Cada publicación se copia una sola vez a un buffer con conteo de referencias que comparten
+// todas las colas; las colas se vacían con sendmsg() vectorizado al final de cada iteración.
+// Con --threads N corren N hilos reactor (shards), cada uno con su listener SO_REUSEPORT, su tabla
+// de clientes y su índice de temas. Lo publicado en un shard se reparte a los demás por colas MPSC
+// sin locks, lo que preserva el orden por publicador y tema.
+// Con --retain N cada tema numera sus mensajes ("MESSAGE <subject> <len> <seq>\n" en texto,
+// V2_FLAG_SEQ en v2) y guarda los últimos N (y hasta --retain-bytes B) en un anillo compartido por
+// los shards (common/retain.h). "SUBSCRIBE <subject> FROM <seq|last|-N>\n" (en v2, el argumento va en
+// el payload del SUBSCRIBE) entrega lo retenido desde ahí antes de lo que se publique en vivo, sin
+// huecos ni repetidos entre ambos. Un tema recibe su anillo la primera vez que un mensaje suyo tiene
+// destinatario (o alguien pide FROM); todos los anillos juntos reservan como mucho --ring-memory B.
+// Con --data-dir DIR lo publicado además se agrega a un log durable en disco (common/dlog.h): los
+// números de secuencia continúan tras reiniciar el broker y FROM puede pedir mensajes que ya salieron
+// del anillo. Un hilo confirma lo agregado cada --log-sync-ms (un solo msync para todo el grupo).
+// Con --admin-port N se atiende en 127.0.0.1:N una foto de métricas en texto, JSON o formato
+// Prometheus (common/admin.h): contadores globales, por tema y por cliente (cola, retraso, descartes).
+// Los contadores los suma cada shard sin locks; las tablas las arma cada shard en su hilo a pedido.
+// El payload de un PUBLISH se lee directo en el buffer del mensaje (de un pool por clases de tamaño,
+// common/msgpool.h) y se reparte una sola vez, completo. Con --cut-through BYTES un payload de al
+// menos BYTES empieza a salir hacia los suscriptores del mismo shard mientras todavía llega.
+// Los grupos de cola (common/qgroup.h) son de todo el broker: el shard que publica elige, con un lock,
+// el miembro de cada grupo (en ronda o el de menor cola con --group-policy least-queued) y lo anota en
+// el mensaje; el mensaje viaja a los demás shards como siempre y el dueño de cada elegido lo encola.
+// Entre brokers, cada ruta es un miembro más de los grupos que anunció el otro lado: el broker donde se
+// publica elige a un miembro local y, si no tiene, a una ruta, que lo entrega a uno de sus miembros. Así
+// cada mensaje llega a un solo miembro del grupo en toda la malla.
+// Federación: con --route HOST:PORT el broker mantiene una ruta (conexión con rol ROUTE) hacia otro
+// broker y la reconecta si se cae; las rutas entrantes se aceptan siempre. Cada broker anuncia por sus
+// rutas los temas y patrones que quieren sus clientes (RS+ cuando aparece el primero, RS- cuando se va
+// el último) y la ruta queda suscrita del otro lado como un cliente más, así lo publicado solo cruza
+// hacia los brokers con interés. Lo que llega por una ruta se entrega a los clientes locales y nunca a
+// otra ruta (un salto, como en una malla completa: cada par de brokers necesita su ruta), lo que evita
+// los ciclos; dos rutas entre el mismo par (cada uno configuró al otro) se resuelven por el id.
+// Control de flujo: con --credit-msgs N y/o --credit-bytes B cada publicador tiene una ventana de N
+// mensajes y B bytes de payload retenidos en el broker. El primer CREDIT anuncia la ventana (0 = sin
+// límite en esa dimensión) y los siguientes devuelven lo que se liberó: un mensaje vuelve al crédito
+// de su publicador cuando lo suelta la última cola (o enseguida si no tiene suscriptores). Con el
+// crédito agotado el broker deja de leer el socket del publicador (al terminar el mensaje en curso),
+// así lo retenido por publicador queda acotado y la presión llega hasta quien publica.
+// Compresión: un cliente que negoció el códec lz4 (common/lz4.h) puede publicar lotes comprimidos, y
+// si es suscriptor recibe cada lote de un tema como un solo MESSAGE_BATCH comprimido en lugar de un
+// MESSAGE por registro. El lote se comprime una sola vez (o se reusa tal cual lo mandó comprimido el
+// publicador) y ese buffer lo comparten las colas de todos los suscriptores con compresión, en todos
+// los shards; los demás reciben los registros sueltos como siempre. Solo los PUBLISH_BATCH de temas
+// sin retención (MESSAGE_BATCH no lleva secuencias) y de al menos COMPRESS_MIN_BYTES.
 
-#include <arpa/inet.h>     // htonl(), htons(), INADDR_ANY
-#include <netinet/in.h>    // struct sockaddr_in
+#define _GNU_SOURCE        // accept4()
+
+#include <arpa/inet.h>     // htonl(), htons(), inet_ntop(), INADDR_ANY
+#include <errno.h>         // errno, EAGAIN, EWOULDBLOCK, EINTR
+#include <linux/errqueue.h> // struct sock_extended_err, SO_EE_ORIGIN_ZEROCOPY
+#include <netdb.h>         // getaddrinfo() para --route
+#include <netinet/in.h>    // struct sockaddr_in, IP_RECVERR
+#include <poll.h>          // POLLIN (poll multishot del backend uring)
+#include <pthread.h>       // pthread_create()
+#include <sched.h>         // sched_yield()
 #include <signal.h>        // signal(), SIGPIPE, SIG_IGN
+#include <stdatomic.h>     // atomic_int (conteo de referencias compartido entre shards)
 #include <stdio.h>         // printf(), perror()
 #include <stdlib.h>        // exit(), EXIT_FAILURE, calloc(), free(), atoi()
 #include <string.h>        // memset(), memcpy(), strcmp(), strncmp(), strncpy()
+#include <sys/epoll.h>     // epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/eventfd.h>   // eventfd() para despertar a otros shards
+#include <sys/resource.h>  // getrlimit(), setrlimit(), RLIMIT_NOFILE
 #include <sys/select.h>    // select(), fd_set y macros FD_*
-#include <sys/socket.h>    // socket(), bind(), listen(), accept(), send(), recv()
+#include <sys/socket.h>    // socket(), bind(), listen(), accept4(), sendmsg(), recv()
 #include <sys/types.h>     // tipos básicos de sockets
+#include <sys/uio.h>       // struct iovec
+#include <time.h>          // clock_gettime(), CLOCK_MONOTONIC
 #include <unistd.h>        // close()
 
+#include "common/admin.h"  // métricas y socket de administración
+#include "common/dlog.h"   // log durable de lo publicado
+#include "common/lz4.h"    // compresión de lotes
+#include "common/msgpool.h" // buffers de mensajes por clases de tamaño
+#include "common/proto_v2.h" // framing binario v2
+#include "common/qgroup.h" // grupos de cola
+#include "common/retain.h" // anillo de retención por tema
+#include "common/ring.h"   // MpscRing: cola sin locks entre shards
+#include "common/subject_index.h" // índice de temas -> suscriptores
+#include "common/subject_trie.h" // suscripciones con comodines
+#include "common/uring.h"  // io_uring con syscalls directas
+
 #define BROKER_PORT 5555 // puerto TCP por defecto para el broker
-#define MAX_CLIENTS  FD_SETSIZE // limitar la cantidad de clientes conectados al máximo que soporta select()
 #define MAX_LINE 4096 // tamaño máximo de línea de control en bytes
+#define MAX_EVENTS 256 // eventos procesados por cada llamada a epoll_wait()
+#define DEFAULT_MAX_QUEUE_BYTES (8u << 20) // límite por defecto de la cola de salida (8 MiB)
+#define FLUSH_IOV 128 // segmentos (cabecera o payload) agrupados como máximo en cada sendmsg()
+#define TEXT_HDR_MAX (V2_MAX_SUBJECT + 32) // "MESSAGE <subject> <len>\n"
+#define MAX_PUB_IDS 65536 // ids de tema que un publicador v2 puede asociar
+#define INBOX_SLOTS 65536 // capacidad de la cola entre shards (mensajes)
+#define MAX_THREADS 256 // máximo de hilos reactor
+#define MAX_BATCH_BYTES (16u << 20) // tamaño máximo del cuerpo de un PUBLISH_BATCH
+#define MAX_PAYLOAD_BYTES (64u << 20) // tamaño máximo del payload de un PUBLISH
+#define LOG_RETAIN_SLOTS 1024 // anillo por tema cuando se usa --data-dir sin --retain
+#define DEFAULT_RING_MEMORY (1ull << 30) // --ring-memory por defecto: 1 GiB entre todos los anillos
+#define LOG_SYNC_MS 20 // intervalo por defecto entre confirmaciones del log
+#define URING_ENTRIES 4096 // SQEs del anillo de cada shard (backend uring)
+#define URING_BUFS 512 // buffers provistos para las recepciones de cada shard
+#define URING_BUF_SIZE (16u << 10) // tamaño de cada buffer provisto
+#define URING_MAX_IOV 1024 // segmentos de un SENDMSG del backend uring (UIO_MAXIOV)
+#define ROUTE_ID_LEN 16 // largo del id de un broker (hex)
+#define MAX_ROUTES 64 // máximo de --route
+#define ROUTE_RETRY_MS 1000 // cada cuánto se reintenta una ruta caída
+#define ROUTE_DIAL_MS 1000 // espera máxima de cada intento de conexión de una ruta
+#define CREDIT_LINE_MAX 48 // "CREDIT <msgs> <bytes>\n"
+#define COMPRESS_MIN_BYTES 256 // lotes más chicos se reparten sin comprimir
+#define REPLAY_PAGE 256 // mensajes que reproduce FROM por tema y por iteración del bucle
+#define MISS_SLOTS 1024 // temas sin interesados que recuerda cada shard (potencia de 2)
+#define MISS_NAME 64 // largo máximo (con el terminador) de un tema que se recuerda así
+#define BACK_GEN_SHIFT 40 // back_msgs/back_bytes: credit_gen en los 24 bits altos, lo devuelto en los bajos
+#define BACK_AMOUNT ((UINT64_C(1) << BACK_GEN_SHIFT) - 1)
+
+typedef enum { ROLE_UNKNOWN = 0, ROLE_PUB = 1, ROLE_SUB = 2, ROLE_ROUTE = 3 } role_t; // roles de cliente
+
+// Códecs de compresión, en el orden de codec_names
+typedef enum { CODEC_NONE = 0, CODEC_LZ4 = 1, NCODECS } codec_t;
+static const char *const codec_names[NCODECS] = {"none", "lz4"};
+
+// Forma de un mensaje de un lote cuando hay suscriptores con compresión
+typedef enum {
+    ZM_NONE = 0, // mensaje común: va a todos
+    ZM_PART = 1, // registro de un lote que también sale comprimido: no va a los que negociaron compresión
+    ZM_BATCH = 2 // el lote comprimido (MESSAGE_BATCH): solo va a los que negociaron compresión
+} zmode_t;
+
+// Qué hacer con un suscriptor cuya cola de salida excede el límite
+typedef enum { SLOW_DROP_OLDEST = 0, SLOW_DROP_NEWEST = 1, SLOW_DISCONNECT = 2 } slow_policy_t;
+
+// Eventos de interés / listos que maneja el reactor
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_ERROR 0x4
+
+// Manejador registrado en el reactor: cada descriptor tiene su callback de readiness.
+typedef struct Handler Handler;
+typedef void (*handler_fn)(Handler *h, int events);
+struct Handler {
+    int fd; // descriptor vigilado
+    int events; // eventos de interés actuales (EV_*)
+    handler_fn on_event; // callback invocado cuando el descriptor está listo
+};
+
+// Backend del reactor (epoll, select o io_uring)
+typedef struct Backend {
+    const char *name;
+    int (*init)(void);
+    int (*add)(Handler *h, int events);
+    int (*mod)(Handler *h, int events);
+    void (*del)(Handler *h);
+    int (*wait)(void); // espera eventos y despacha los callbacks; -1 en error fatal
+    int max_fd; // descriptores >= max_fd no se pueden vigilar (0 = sin límite)
+    int completion; // 1 = el backend lee y escribe los sockets de clientes (io_uring), no hay readiness
+} Backend;
+
+typedef struct Client Client;
+typedef struct Route Route;
+typedef struct RouteTarget RouteTarget;
+
+// Miembro de un grupo de cola elegido para recibir un mensaje (lo entrega el shard del cliente)
+typedef struct GroupPick {
+    QGroup *group; // solo se compara: el grupo puede haberse eliminado desde la elección
+    Client *client;
+    int shard; // shard dueño del cliente
+} GroupPick;
+
+// Mensaje publicado: cabeceras + payload en un único bloque inmutable. Todas las colas de los
+// suscriptores apuntan al mismo bloque; se libera cuando la última referencia lo suelta. Trae la
+// cabecera de texto y la binaria, así cada suscriptor recibe el framing que negoció.
+typedef struct MsgBuf {
+    atomic_int refs; // referencias vivas (colas, shards, envíos zerocopy en vuelo y el creador)
+    const char *subject; // nombre del tema (internado en el índice del shard de origen)
+    uint64_t seq; // secuencia en el anillo de retención del tema (0 = sin retención)
+    long long created_ms; // instante de creación (para medir el retraso; 0 si no se mide)
+    int raw; // respuesta para un solo cliente: thdr se envía tal cual, sin importar el protocolo
+    unsigned char bhdr[V2_HDR_LEN + V2_SEQ_LEN]; // cabecera binaria v2 (MESSAGE con id de tema y secuencia)
+    size_t bhlen; // bytes de bhdr
+    char *thdr; // cabecera de texto ("MESSAGE <subject> <len>\n") o respuesta completa si raw
+    size_t thlen; // bytes de thdr
+    size_t plen; // bytes de payload
+    size_t ready; // bytes de payload ya recibidos (menos que plen solo en un corte directo en curso)
+    int aborted; // corte directo cuyo publicador se desconectó antes de completar el payload
+    int routed; // llegó por una ruta desde otro broker: no se reenvía a ninguna ruta
+    int group_only; // GMSG de una ruta: solo lo reciben los elegidos, no los suscriptores del tema
+    GroupPick *picks; // miembros elegidos de los grupos de cola del tema (del pool del shard de origen)
+    size_t npicks;
+    Client *origin; // publicador al que vuelve el crédito al liberarse (NULL = sin control de flujo)
+    unsigned origin_gen; // conexión del publicador (credit_gen): otra conexión en la ranura no lo recibe
+    zmode_t zmode; // ZM_*: quiénes lo reciben según la compresión negociada
+    struct MsgBuf **parts; // ZM_BATCH con control de flujo: los registros, que devuelven el crédito al
+    size_t nparts; // liberarse, viven mientras viva el lote comprimido
+    char payload[]; // payload seguido de thdr
+} MsgBuf;
+
+// Envío MSG_ZEROCOPY en vuelo: el kernel lee del buffer hasta que notifica la finalización
+typedef struct ZcPending {
+    uint32_t seq; // número de envío zerocopy asignado por el kernel
+    MsgBuf *m; // buffer que debe seguir vivo hasta la notificación
+} ZcPending;
 
-typedef enum { ROLE_UNKNOWN = 0, ROLE_PUB = 1, ROLE_SUB = 2 } role_t; // roles de cliente
+// Envío en vuelo del backend uring: el kernel lee los iovec y los mensajes hasta la finalización,
+// así que viven aquí (y no en la pila) con una referencia a cada mensaje. Un envío se lleva toda la
+// cola (hasta URING_MAX_IOV segmentos): no hay un bucle que reintente hasta EAGAIN como con readiness.
+typedef struct UrSend {
+    struct msghdr mh;
+    struct iovec *iov;
+    MsgBuf **msgs;
+    size_t cap; // segmentos reservados en iov (msgs tiene la misma cantidad)
+    size_t nmsgs; // mensajes retenidos (0 = no hay envío en vuelo)
+    size_t bytes; // bytes del envío que siguen contados en oq_bytes hasta su finalización
+} UrSend;
 
-// Lista enlazada de temas (subjects) a los que está suscrito un cliente
-typedef struct SubjectNode {
-    char name[128];
-    struct SubjectNode *next;
-} SubjectNode;
+// Tema reproducido con FROM. Mientras 'next' != 0 la reproducción sigue de a páginas desde ahí y lo
+// que llega en vivo se descarta (ya está retenido: lo entrega la reproducción). Al terminar, las
+// secuencias hasta 'upto' ya se entregaron, así que si todavía llegan desde otro shard se descartan.
+typedef struct Replayed {
+    const Subject *subject;
+    uint64_t upto;
+    uint64_t next; // próxima secuencia a reproducir (0 = terminó)
+    uint64_t log_offset; // último registro leído del log durable (dónde seguir buscando)
+} Replayed;
+
+// Id de tema de un publicador v2. El tema se interna recién cuando alguien lo pide: mientras tanto
+// queda solo el nombre y se vuelve a resolver cuando cambia interest_gen.
+typedef struct PubId {
+    char *name; // NULL = id sin asociar
+    Subject *s; // tema internado (NULL = sin interesados en 'gen')
+    unsigned gen;
+} PubId;
+
+// Tema publicado que no le interesaba a nadie cuando cambió interest_gen por última vez
+typedef struct Miss {
+    unsigned gen; // 0 = vacío
+    char name[MISS_NAME];
+} Miss;
 
 // Estructura para cada cliente conectado
-typedef struct Client {
+struct Client {
+    Handler h; // registro en el reactor (debe ser el primer campo)
     int fd; // descriptor de socket
     role_t role; // rol: PUB, SUB o UNKNOWN
-    SubjectNode *subs; // para suscriptores
+    int proto; // 1 = texto, 2 = framing binario v2
+    PubId *pub_ids; // v2: id elegido por el publicador -> tema
+    size_t pub_ids_cap; // capacidad de pub_ids
+    SubLink **subs; // enlaces a los temas suscritos (para suscriptores)
+    size_t nsubs; // cantidad de temas suscritos
+    size_t subs_cap; // capacidad de subs
+    char **wild; // patrones suscritos (viven en el trie del shard)
+    size_t nwild, wild_cap;
+    uint8_t *known; // v2: bitmap de ids de tema ya anunciados con un OK
+    size_t known_cap; // bytes de known
+    Replayed *replayed; // temas reproducidos con FROM
+    size_t nreplayed, replayed_cap;
+    int replaying; // está en la lista replay_head de su shard
+    struct Client *next_replay; // siguiente en esa lista
     char ibuf[MAX_LINE]; // buffer para líneas de control
     size_t ibuf_len; // bytes actualmente en ibuf
     size_t want_payload; // bytes de payload pendientes (cuando es PUB)
-    char current_subject[128]; // tema actual (cuando es PUB)
-} Client;
+    Subject *current_subject; // tema actual (cuando es PUB)
+    MsgBuf *pending; // PUBLISH en curso: el payload se recibe directo en su buffer
+    int cut; // pending ya se está repartiendo mientras llega (corte directo)
+    int in_batch; // el payload pendiente es el cuerpo de un PUBLISH_BATCH
+    char *batch; // cuerpo del lote en curso (se reutiliza entre lotes)
+    size_t batch_len; // bytes acumulados en batch
+    size_t batch_cap; // capacidad de batch
+    MsgBuf **oq; // cola circular de salida (referencias a mensajes compartidos)
+    size_t oq_head; // índice del primer mensaje pendiente
+    size_t oq_count; // mensajes en la cola
+    size_t oq_cap; // capacidad de oq (potencia de 2)
+    size_t oq_off; // bytes ya enviados del primer mensaje
+    size_t oq_bytes; // bytes pendientes en la cola
+    int dirty; // está en la lista de clientes con datos por vaciar
+    struct Client *next_dirty; // siguiente en la lista de pendientes
+    int zerocopy; // SO_ZEROCOPY habilitado en el socket
+    uint32_t zc_next; // próximo número de envío zerocopy
+    ZcPending *zc; // envíos zerocopy en vuelo (FIFO circular)
+    size_t zc_head, zc_count, zc_cap;
+    uint64_t msgs_in, bytes_in; // publicado por el cliente / bytes leídos de su socket
+    uint64_t msgs_out, bytes_out; // entregas encoladas / bytes escritos en su socket
+    uint64_t dropped; // entregas descartadas por la política de consumidor lento
+    UrSend *ur; // backend uring: envío en vuelo (se reserva una vez y se reutiliza)
+    int ur_ops; // backend uring: operaciones en vuelo (recepción multishot armada y envío)
+    int ur_recv; // backend uring: la recepción multishot sigue armada
+    int ur_fd; // backend uring: descriptor que se cierra cuando terminen sus operaciones (-1 = ninguno)
+    QGroup **groups; // grupos de cola a los que pertenece
+    size_t ngroups, groups_cap;
+    char gmsg[V2_MAX_SUBJECT + QGROUP_MAX_NAME + 1]; // rol ROUTE: GMSG en curso, "<tema del grupo> <grupo>" ("" = MESSAGE)
+    int shard_id; // shard dueño de la ranura
+    _Atomic size_t queued; // oq_bytes visible para otros shards (solo si está en algún grupo)
+    Route *route; // rol ROUTE: ruta registrada (NULL hasta el handshake o si se descartó)
+    RouteTarget *target; // ruta saliente: el --route que la originó
+    // Control de flujo (publicadores con --credit-msgs / --credit-bytes)
+    int credit_on; // el publicador recibe crédito
+    int paused; // crédito agotado: no se lee su socket
+    int ur_cancel; // backend uring: se pidió cancelar la recepción para pausar
+    char *held; // backend uring: lo recibido después de pausar (se procesa al reanudar)
+    size_t held_len, held_cap;
+    int64_t credit_msgs, credit_bytes; // saldo (puede quedar negativo por el último mensaje)
+    int64_t grant_msgs, grant_bytes; // devuelto al saldo pero todavía no concedido con un CREDIT
+    atomic_uint credit_gen; // cambia al cerrar: lo que se libere después ya no es de esta conexión
+    _Atomic uint64_t back_msgs, back_bytes; // liberado por cualquier shard, pendiente de sumar al saldo,
+                                            // con la conexión a la que pertenece (BACK_GEN_SHIFT)
+    atomic_int credit_queued; // está en la pila credit_head de su shard
+    Client *next_credit; // siguiente en esa pila
+    codec_t codec; // compresión negociada en la línea de rol
+    int batch_z; // el lote en curso llegó comprimido
+    char *unz; // lote descomprimido (se reutiliza entre lotes)
+    size_t unz_cap;
+};
+
+// Contadores de un shard: solo los escribe su hilo, el hilo de administración los lee sin locks
+typedef struct ShardStats {
+    Counter msgs_in, bytes_in; // publicaciones recibidas
+    Counter msgs_out, bytes_out; // entregas encoladas / bytes escritos en sockets
+    Counter dropped; // entregas descartadas por la política de consumidor lento
+    Counter slow_disconnects; // clientes desconectados por la política
+    Counter send_errors; // sendmsg() fallidos (el cliente se cierra)
+    Counter accepted; // conexiones aceptadas
+    Counter loop_iterations, loop_busy_ns; // iteraciones del bucle y tiempo despachando (sin esperar)
+    Counter loop_max_ns; // iteración más larga desde la foto anterior
+    Counter group_out; // entregas a miembros de grupos de cola
+    Counter group_lost; // elegidos que salieron del grupo antes de recibir el mensaje
+    Counter route_in; // mensajes recibidos por rutas desde otros brokers
+    Counter credit_pauses; // veces que un publicador agotó su crédito y se dejó de leer
+    Counter credit_grants; // CREDIT enviados a publicadores
+    Counter zbatches; // lotes comprimidos para los suscriptores con compresión
+    Counter zraw_bytes, zbytes; // bytes de esos lotes antes y después de comprimir
+    Counter log_errors; // mensajes retenidos que no se pudieron agregar al log durable
+    Counter rings_refused; // anillos no creados por --ring-memory (esos mensajes van sin secuencia)
+    Counter unrouted; // publicaciones descartadas sin internar el tema: no le interesaban a nadie
+} ShardStats;
+
+// Shard: un hilo reactor con su propio listener, tabla de clientes, índice de temas y estado del
+// backend. Con un solo hilo hay un único shard. Cada hilo accede solo a su shard salvo la
+// cola 'inbox', por donde otros shards le pasan mensajes publicados.
+typedef struct Shard {
+    int id; // índice del shard
+    pthread_t thread; // hilo que lo ejecuta
+    Handler listener; // socket de escucha (SO_REUSEPORT cuando hay varios shards)
+    // Tabla de clientes indexada por descriptor. Las estructuras nunca se liberan, se reutilizan
+    // cuando el kernel recicla el fd, así un evento pendiente de un cliente cerrado no apunta a
+    // memoria liberada.
+    Client **clients;
+    size_t clients_cap;
+    SubjectIndex subjects; // índice tema -> suscriptores de este shard
+    SubTrie *trie; // patrones con comodines de los clientes de este shard
+    Client *dirty_head; // clientes con mensajes encolados en esta iteración del bucle
+    Client *replay_head; // clientes con reproducciones FROM pendientes
+    Miss *misses; // temas publicados sin interesados (se descartan sin el lock global)
+    MpscRing inbox; // mensajes publicados en otros shards
+    Handler wake; // eventfd para despertar al shard cuando llega algo a inbox
+    unsigned char *wake_peer; // shards a los que se les encoló algo en esta iteración
+    int ep_fd; // estado del backend epoll
+    Handler **sel_handlers; // estado del backend select: manejador por descriptor
+    int sel_maxfd; // descriptor más alto registrado en select
+    ShardStats stats;
+    uint64_t woke_ns; // cuándo volvió la espera del backend en esta iteración (con --admin-port)
+    atomic_int snap_req; // el hilo de administración pide las filas de este shard
+    atomic_int routes_dirty; // hay líneas de interés, rutas nuevas o rutas a cerrar de este shard
+    _Atomic(Client *) credit_head; // publicadores con crédito devuelto (pila sin locks, la vacía el shard)
+    MsgPool *pool; // buffers de los mensajes creados en este shard
+    Uring ring; // estado del backend uring
+    UringBufs bufs; // buffers provistos para las recepciones multishot
+    char discard[65536]; // destino de los payloads que se descartan
+} Shard;
+
+static Shard *shards = NULL; // todos los shards
+static int nshards = 1; // cantidad de hilos reactor
+static _Thread_local Shard *shard; // shard del hilo actual
+static const Backend *backend; // backend activo del reactor
+
+// Ids de tema globales: los MESSAGE v2 llevan el id y el mismo buffer se comparte entre shards,
+// así que todos los shards deben numerar igual. Solo se consulta al internar un tema nuevo. Un tema
+// entra al suscribirse (o por la retención); publicar en uno que nadie pidió no lo interna.
+// global_patterns tiene los patrones de todos los shards (dueño: el cliente), con el mismo lock, y
+// zpatterns solo los de suscriptores con compresión (zpatterns_n copia su tamaño para no tomar el lock).
+// interest_gen cambia cada vez que aparece un interesado nuevo (tema, patrón o grupo).
+static SubjectIndex global_ids;
+static SubTrie *global_patterns;
+static SubTrie *zpatterns;
+static atomic_size_t zpatterns_n;
+static pthread_mutex_t global_ids_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint interest_gen = 1;
+
+// Configuración de la política de consumidor lento
+static slow_policy_t slow_policy = SLOW_DROP_OLDEST;
+static size_t max_queue_bytes = DEFAULT_MAX_QUEUE_BYTES; // bytes máximos encolados por cliente
+static long max_lag_ms = 0; // con SLOW_DISCONNECT: retraso máximo del mensaje más viejo (0 = sin límite)
+static size_t zerocopy_min = 0; // mensajes >= este tamaño se envían con MSG_ZEROCOPY (0 = desactivado)
+static size_t cut_through_min = 0; // payloads >= este tamaño se reparten mientras llegan (0 = desactivado)
+static uint64_t credit_msgs = 0, credit_bytes = 0; // ventana de cada publicador (0 = sin límite)
+
+// Estado de un tema compartido por todos los shards. Vive en el Subject de global_ids y cada shard
+// guarda el mismo puntero en su Subject.data. 'shards' tiene un bit por shard con suscriptores exactos
+// del tema (lo cambia solo ese shard), así un mensaje se pasa solo a los shards que lo pueden entregar.
+// Con retención (--retain N) también lleva el anillo del tema, que se crea una sola vez (con el lock
+// del tema) y no se libera: se puede leer el puntero sin lock.
+typedef struct Topic {
+    _Atomic uint64_t shards[MAX_THREADS / 64];
+    atomic_int zsubs; // suscriptores exactos con compresión, en todos los shards (0 = no se arman lotes)
+    pthread_mutex_t lock; // publicadores de varios shards y reproducciones
+    RetainRing *_Atomic ring; // NULL = sin retención (o todavía sin destinatarios)
+} Topic;
+// Un bit por shard con algún patrón (el shard recibe todo lo que publican los demás)
+static _Atomic uint64_t pattern_shards[MAX_THREADS / 64];
+static size_t retain_slots = 0; // 0 = sin retención
+static size_t retain_bytes = 0; // arena de cada anillo (0 = retain_slots * RETAIN_AVG_BYTES)
+static size_t ring_limit = DEFAULT_RING_MEMORY; // --ring-memory: bytes de todos los anillos juntos
+static atomic_size_t ring_mem, ring_count; // bytes reservados y anillos existentes
+
+// Grupos de cola (SUBSCRIBE ... GROUP): compartidos por los shards y protegidos por qgroups_lock.
+// qgroups_n copia qgroup_members() para que publicar en un broker sin grupos no tome el lock.
+static QGroupTable *qgroups;
+static pthread_mutex_t qgroups_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t qgroups_n;
+static qgroup_policy_t group_policy = QGROUP_ROUND_ROBIN;
+
+// Federación: rutas registradas, destinos de --route e interés local, todo protegido por routes_lock.
+// Una ruta solo la lee y escribe su shard, salvo 'out' (líneas de interés que encolan los demás).
+struct Route {
+    Client *c; // conexión con rol ROUTE
+    int shard; // shard dueño de la conexión
+    int outbound; // la inició este broker (--route)
+    int dead; // reemplazada por otra ruta al mismo broker: su shard la cierra
+    char peer[ROUTE_ID_LEN + 1]; // id del broker remoto
+    char *out; // líneas RS+/RS- pendientes (las envía el shard dueño en route_sync())
+    size_t out_len, out_cap;
+    Route *next;
+};
+
+// Broker de --route: un hilo lo conecta y lo vuelve a conectar cuando la ruta se cae
+struct RouteTarget {
+    const char *spec; // "HOST:PORT" tal como se configuró
+    struct sockaddr_in addr;
+    char peer[ROUTE_ID_LEN + 1]; // id aprendido en el primer handshake ("" = todavía no)
+    int busy; // hay una conexión saliente en curso o registrada
+    int self; // es este mismo broker: no se reintenta
+    int fd; // conexión lista para que el shard 0 la registre (-1 = ninguna)
+};
+
+static char server_id[ROUTE_ID_LEN + 1]; // id de este broker (pid e instante: distinto en cada arranque)
+static Route *routes;
+static RouteTarget targets[MAX_ROUTES];
+static int ntargets;
+// Interés local: suscripciones de clientes locales (no rutas) por tema o patrón; la cuenta va en
+// Subject.data. Las rutas se enteran del paso de 0 a 1 (RS+) y de 1 a 0 (RS-).
+static SubjectIndex interest;
+static size_t interest_n; // temas y patrones con interés
+// Grupos de cola con miembros locales, por "<tema> <grupo>" (la cuenta va en Subject.data): RG+ / RG-
+static SubjectIndex group_interest;
+static pthread_mutex_t routes_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static Client clients[MAX_CLIENTS]; // array de clientes
+// Log durable (--data-dir): se agrega con el lock del anillo del tema tomado, así queda en el orden de
+// las secuencias
+static DLog *dlog = NULL;
+static long log_sync_ms = LOG_SYNC_MS;
+
+// Administración (--admin-port): el hilo de administración pide a cada shard sus filas y espera
+static int admin_port = 0; // 0 = sin socket de administración
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snap_cond = PTHREAD_COND_INITIALIZER;
+static AdminReport *snap_report; // foto en curso
+static int snap_pending; // shards que todavía no aportaron sus filas
 
 // Imprimir mensaje de error y salir
 static void die(const char *msg) {
@@ -49,64 +507,1940 @@ static void die(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
-// Agregar un tema a la lista de suscripciones del cliente (evitar duplicados)
-static void add_subscription(Client *c, const char *subject) {
-    // verificar si ya está suscrito
-    for (SubjectNode *n = c->subs; n; n = n->next) {
-        if (strcmp(n->name, subject) == 0) return; // evitar duplicados
+// Indica si el último error de E/S fue "no hay datos/espacio por ahora" en un socket no bloqueante
+static int would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// Buscar o internar un tema en el shard, asignándole su id global la primera vez
+static Subject *intern_subject(const char *name) {
+    Subject *s = subject_index_find(&shard->subjects, name);
+    if (s) return s;
+    s = subject_index_intern(&shard->subjects, name);
+    if (!s) return NULL;
+    pthread_mutex_lock(&global_ids_lock);
+    size_t before = global_ids.count;
+    Subject *g = subject_index_intern(&global_ids, name);
+    if (global_ids.count != before) atomic_fetch_add_explicit(&interest_gen, 1, memory_order_release);
+    if (g) s->id = g->id;
+    if (g && !g->data) {
+        Topic *t = (Topic *) calloc(1, sizeof(Topic));
+        if (t) {
+            pthread_mutex_init(&t->lock, NULL);
+            g->data = t;
+        }
+    }
+    if (g) s->data = g->data;
+    pthread_mutex_unlock(&global_ids_lock);
+    return s;
+}
+
+// Estado compartido del tema si tiene retención; NULL si no
+static Topic *retained(const Subject *s) {
+    Topic *t = (Topic *) s->data;
+    return t && atomic_load_explicit(&t->ring, memory_order_acquire) ? t : NULL;
+}
+
+// Arena de cada anillo y lo que reserva un anillo entero (lo que cuenta para --ring-memory)
+static size_t ring_arena(void) {
+    return retain_bytes ? retain_bytes : retain_slots * RETAIN_AVG_BYTES;
+}
+
+static size_t ring_cost(void) {
+    return retain_footprint(retain_slots, ring_arena());
+}
+
+// Estado del tema con su anillo, creándolo si todavía no tiene y entra en --ring-memory (con log
+// durable, numerado desde lo guardado). NULL sin retención, si no entra o no hay memoria.
+static Topic *topic_ring(const Subject *s) {
+    Topic *t = (Topic *) s->data;
+    if (!retain_slots || !t) return NULL;
+    if (atomic_load_explicit(&t->ring, memory_order_acquire)) return t;
+    size_t cost = ring_cost();
+    pthread_mutex_lock(&t->lock);
+    if (!t->ring) {
+        RetainRing *ring = NULL;
+        if (atomic_fetch_add(&ring_mem, cost) + cost > ring_limit) counter_add(&shard->stats.rings_refused, 1);
+        else ring = retain_new(retain_slots, ring_arena());
+        if (ring) {
+            if (dlog) retain_reset(ring, dlog_next_seq(dlog, s->name)); // seguir la numeración guardada
+            atomic_store_explicit(&t->ring, ring, memory_order_release);
+            atomic_fetch_add(&ring_count, 1);
+        } else {
+            atomic_fetch_sub(&ring_mem, cost);
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    return t->ring ? t : NULL;
+}
+
+// Prender o apagar el bit del shard propio en 'bits'
+static void shard_bit(_Atomic uint64_t *bits, int on) {
+    uint64_t bit = 1ull << (shard->id % 64);
+    if (on) atomic_fetch_or_explicit(&bits[shard->id / 64], bit, memory_order_release);
+    else atomic_fetch_and_explicit(&bits[shard->id / 64], ~bit, memory_order_release);
+}
+
+// Actualizar los bits del shard después de cambiar sus suscriptores exactos de 's' o sus patrones
+static void sync_topic_shards(const Subject *s) {
+    Topic *t = (Topic *) s->data;
+    if (t) shard_bit(t->shards, s->nsubs > 0);
+}
+
+static void sync_pattern_shards(void) {
+    shard_bit(pattern_shards, sub_trie_size(shard->trie) > 0);
+}
+
+// Indica si el cliente recibe lotes comprimidos (el códec se negocia antes de suscribirse)
+static int compresses(const Client *c) {
+    return c->codec != CODEC_NONE && c->role == ROLE_SUB;
+}
+
+// Sumar o restar un suscriptor exacto con compresión del tema
+static void topic_zsubs(const Subject *s, int delta) {
+    Topic *t = (Topic *) s->data;
+    if (t) atomic_fetch_add_explicit(&t->zsubs, delta, memory_order_relaxed);
+}
+
+// Tema de un PUBLISH. Solo se interna si a alguien le puede interesar: un suscriptor exacto (en
+// cualquier shard o ruta), un patrón o un grupo que coincide, o el log durable. Si no, devuelve NULL y
+// el payload se descarta sin agregar el tema a ningún índice, así publicar en temas nuevos no hace
+// crecer la memoria. Los nombres cortos sin interesados se recuerdan por shard hasta que cambia
+// interest_gen, para no tomar los locks globales en cada mensaje.
+static Subject *publish_subject(const char *name) {
+    Subject *s = subject_index_find(&shard->subjects, name);
+    if (s || dlog) return s ? s : intern_subject(name);
+    unsigned gen = atomic_load_explicit(&interest_gen, memory_order_acquire);
+    size_t len = strlen(name);
+    Miss *miss = len < MISS_NAME ? &shard->misses[subject_hash(name) & (MISS_SLOTS - 1)] : NULL;
+    if (miss && miss->gen == gen && strcmp(miss->name, name) == 0) return NULL;
+    pthread_mutex_lock(&global_ids_lock);
+    int wanted = subject_index_find(&global_ids, name) || sub_trie_match_any(global_patterns, name);
+    pthread_mutex_unlock(&global_ids_lock);
+    if (!wanted && atomic_load_explicit(&qgroups_n, memory_order_relaxed)) {
+        size_t n;
+        pthread_mutex_lock(&qgroups_lock);
+        (void) qgroup_match(qgroups, name, &n);
+        pthread_mutex_unlock(&qgroups_lock);
+        wanted = n > 0;
+    }
+    if (wanted) return intern_subject(name);
+    if (miss) {
+        miss->gen = gen;
+        memcpy(miss->name, name, len + 1);
+    }
+    return NULL;
+}
+
+// Avisar al shard 'sh' que tiene trabajo de rutas (se revisa al final de su iteración)
+static void route_kick(Shard *sh) {
+    if (atomic_exchange(&sh->routes_dirty, 1) || sh == shard) return;
+    uint64_t one = 1;
+    (void) write(sh->wake.fd, &one, sizeof(one));
+}
+
+// Encolar "<op> <name>\n" para la ruta (con routes_lock tomado)
+static void route_queue(Route *r, const char *op, const char *name) {
+    size_t n = strlen(op) + strlen(name) + 2;
+    if (r->out_len + n > r->out_cap) {
+        size_t ncap = r->out_cap ? r->out_cap * 2 : 256;
+        while (ncap < r->out_len + n) ncap *= 2;
+        char *b = (char *) realloc(r->out, ncap);
+        if (!b) return;
+        r->out = b;
+        r->out_cap = ncap;
+    }
+    r->out_len += (size_t) sprintf(r->out + r->out_len, "%s %s\n", op, name);
+    route_kick(&shards[r->shard]);
+}
+
+// Sumar o restar una suscripción local al interés en 'name' (con routes_lock tomado). Las rutas solo
+// se enteran cuando aparece el primer interesado o se va el último.
+static void interest_change(const char *name, int delta) {
+    Subject *s = subject_index_intern(&interest, name);
+    if (!s) return;
+    uintptr_t n = (uintptr_t) s->data;
+    if (delta < 0 && n == 0) return;
+    n = delta > 0 ? n + 1 : n - 1;
+    s->data = (void *) n;
+    if (n != (delta > 0 ? 1u : 0u)) return;
+    interest_n = delta > 0 ? interest_n + 1 : interest_n - 1;
+    for (Route *r = routes; r; r = r->next) route_queue(r, delta > 0 ? "RS+" : "RS-", name);
+}
+
+// Sumar o restar un miembro local al grupo 'name' de 'subject' (con routes_lock tomado). Como con los
+// temas, las rutas se enteran del primer miembro (RG+) y del último (RG-).
+static void group_interest_change(const char *subject, const char *name, int delta) {
+    char key[V2_MAX_SUBJECT + QGROUP_MAX_NAME + 1];
+    snprintf(key, sizeof(key), "%s %s", subject, name);
+    Subject *s = subject_index_intern(&group_interest, key);
+    if (!s) return;
+    uintptr_t n = (uintptr_t) s->data;
+    if (delta < 0 && n == 0) return;
+    n = delta > 0 ? n + 1 : n - 1;
+    s->data = (void *) n;
+    if (n != (delta > 0 ? 1u : 0u)) return;
+    for (Route *r = routes; r; r = r->next) route_queue(r, delta > 0 ? "RG+" : "RG-", key);
+}
+
+static void interest_add(const char *name) {
+    pthread_mutex_lock(&routes_lock);
+    interest_change(name, 1);
+    pthread_mutex_unlock(&routes_lock);
+}
+
+// Agregar un tema a las suscripciones del cliente (evitar duplicados)
+static Subject *add_subscription(Client *c, const char *subject) {
+    Subject *s = intern_subject(subject);
+    if (!s) return NULL;
+    // verificar si ya está suscrito (comparación de punteros: el tema está internado)
+    for (size_t i = 0; i < c->nsubs; i++)
+        if (c->subs[i]->subject == s) return s; // evitar duplicados
+    if (c->nsubs == c->subs_cap) {
+        size_t ncap = c->subs_cap ? c->subs_cap * 2 : 4;
+        SubLink **n = (SubLink **) realloc(c->subs, ncap * sizeof(SubLink *));
+        if (!n) return NULL;
+        c->subs = n;
+        c->subs_cap = ncap;
+    }
+    SubLink *l = (SubLink *) calloc(1, sizeof(SubLink));
+    if (!l) return NULL;
+    if (subject_link(s, l, c) < 0) {
+        free(l);
+        return NULL;
+    }
+    c->subs[c->nsubs++] = l;
+    sync_topic_shards(s);
+    if (compresses(c)) topic_zsubs(s, 1);
+    if (c->role != ROLE_ROUTE) interest_add(subject); // lo pedido por una ruta no se anuncia a otras
+    return s;
+}
+
+// Agregar un patrón con comodines a las suscripciones del cliente; -1 si no es válido
+static int add_pattern(Client *c, const char *pattern) {
+    if (c->nwild == c->wild_cap) {
+        size_t ncap = c->wild_cap ? c->wild_cap * 2 : 4;
+        char **n = (char **) realloc(c->wild, ncap * sizeof(char *));
+        if (!n) return -1;
+        c->wild = n;
+        c->wild_cap = ncap;
+    }
+    char *p = strdup(pattern);
+    if (!p) return -1;
+    int r = sub_trie_add(shard->trie, p, c);
+    if (r != 0) {
+        free(p);
+        return r < 0 ? -1 : 0; // r == 1: ya estaba suscrito
+    }
+    pthread_mutex_lock(&global_ids_lock);
+    if (sub_trie_add(global_patterns, p, c) < 0) {
+        pthread_mutex_unlock(&global_ids_lock);
+        sub_trie_remove(shard->trie, p, c);
+        free(p);
+        return -1;
+    }
+    // sin memoria para zpatterns el suscriptor recibe los registros sueltos en vez del lote
+    if (compresses(c) && sub_trie_add(zpatterns, p, c) == 0)
+        atomic_store_explicit(&zpatterns_n, sub_trie_size(zpatterns), memory_order_relaxed);
+    pthread_mutex_unlock(&global_ids_lock);
+    atomic_fetch_add_explicit(&interest_gen, 1, memory_order_release);
+    sync_pattern_shards();
+    c->wild[c->nwild++] = p;
+    if (c->role != ROLE_ROUTE) interest_add(pattern);
+    return 0;
+}
+
+// Quitar un patrón del cliente de global_patterns
+static void drop_global_pattern(Client *c, const char *pattern) {
+    pthread_mutex_lock(&global_ids_lock);
+    sub_trie_remove(global_patterns, pattern, c);
+    if (compresses(c)) {
+        sub_trie_remove(zpatterns, pattern, c);
+        atomic_store_explicit(&zpatterns_n, sub_trie_size(zpatterns), memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&global_ids_lock);
+}
+
+// Quitar una suscripción (tema exacto o patrón) del cliente; la usan las rutas con RS-
+static void remove_subscription(Client *c, const char *subject) {
+    if (subject_is_pattern(subject)) {
+        for (size_t i = 0; i < c->nwild; i++) {
+            if (strcmp(c->wild[i], subject) != 0) continue;
+            sub_trie_remove(shard->trie, c->wild[i], c);
+            drop_global_pattern(c, c->wild[i]);
+            sync_pattern_shards();
+            free(c->wild[i]);
+            c->wild[i] = c->wild[--c->nwild];
+            return;
+        }
+        return;
+    }
+    for (size_t i = 0; i < c->nsubs; i++) {
+        if (strcmp(c->subs[i]->subject->name, subject) != 0) continue;
+        Subject *s = c->subs[i]->subject;
+        subject_unlink(c->subs[i]);
+        sync_topic_shards(s);
+        if (compresses(c)) topic_zsubs(s, -1);
+        free(c->subs[i]);
+        c->subs[i] = c->subs[--c->nsubs];
+        return;
+    }
+}
+
+// Unir al cliente al grupo de cola 'name' del tema o patrón; -1 si el patrón no es válido
+static int join_group(Client *c, const char *subject, const char *name) {
+    if (c->ngroups == c->groups_cap) {
+        size_t ncap = c->groups_cap ? c->groups_cap * 2 : 4;
+        QGroup **n = (QGroup **) realloc(c->groups, ncap * sizeof(QGroup *));
+        if (!n) return -1;
+        c->groups = n;
+        c->groups_cap = ncap;
+    }
+    QGroup *g;
+    pthread_mutex_lock(&qgroups_lock);
+    int r = qgroup_join(qgroups, subject, name, c, &g);
+    if (r == 0) c->groups[c->ngroups++] = g;
+    atomic_store_explicit(&qgroups_n, qgroup_members(qgroups), memory_order_relaxed);
+    pthread_mutex_unlock(&qgroups_lock);
+    if (r == 0) {
+        atomic_fetch_add_explicit(&interest_gen, 1, memory_order_release);
+        atomic_store_explicit(&c->queued, c->oq_bytes, memory_order_relaxed);
+        if (c->role != ROLE_ROUTE) {
+            // los demás brokers le pasan lo que elijan para el grupo (una ruta es miembro del otro lado)
+            pthread_mutex_lock(&routes_lock);
+            group_interest_change(subject, name, 1);
+            pthread_mutex_unlock(&routes_lock);
+        }
+    }
+    return r < 0 ? -1 : 0;
+}
+
+// Sacar a la ruta del grupo 'name' de 'subject' (RG-: el otro broker se quedó sin miembros)
+static void leave_group(Client *c, const char *subject, const char *name) {
+    pthread_mutex_lock(&qgroups_lock);
+    for (size_t i = 0; i < c->ngroups; i++) {
+        QGroup *g = c->groups[i];
+        if (strcmp(g->subject, subject) != 0 || strcmp(g->name, name) != 0) continue;
+        c->groups[i] = c->groups[--c->ngroups];
+        qgroup_leave(qgroups, g, c);
+        atomic_store_explicit(&qgroups_n, qgroup_members(qgroups), memory_order_relaxed);
+        break;
+    }
+    pthread_mutex_unlock(&qgroups_lock);
+}
+
+// Marcar un id de tema como conocido por el cliente v2; devuelve 1 si ya lo estaba
+static int mark_known(Client *c, uint32_t id) {
+    size_t byte = id >> 3;
+    if (byte >= c->known_cap) {
+        size_t ncap = c->known_cap ? c->known_cap : 64;
+        while (ncap <= byte) ncap *= 2;
+        uint8_t *n = (uint8_t *) realloc(c->known, ncap);
+        if (!n) return 1; // sin memoria: no se anuncia
+        memset(n + c->known_cap, 0, ncap - c->known_cap);
+        c->known = n;
+        c->known_cap = ncap;
+    }
+    uint8_t bit = (uint8_t) (1u << (id & 7));
+    if (c->known[byte] & bit) return 1;
+    c->known[byte] |= bit;
+    return 0;
+}
+
+// Quitar al cliente de todos sus temas y liberar los enlaces
+static void free_subs(Client *c) {
+    int local = c->role != ROLE_ROUTE; // lo de una ruta no es interés local
+    if (local && (c->nsubs || c->nwild)) {
+        pthread_mutex_lock(&routes_lock);
+        for (size_t i = 0; i < c->nsubs; i++) interest_change(c->subs[i]->subject->name, -1);
+        for (size_t i = 0; i < c->nwild; i++) interest_change(c->wild[i], -1);
+        pthread_mutex_unlock(&routes_lock);
+    }
+    for (size_t i = 0; i < c->nsubs; i++) {
+        Subject *s = c->subs[i]->subject;
+        subject_unlink(c->subs[i]); // O(1) en el arreglo del tema
+        sync_topic_shards(s);
+        if (compresses(c)) topic_zsubs(s, -1);
+        free(c->subs[i]);
+    }
+    c->nsubs = 0;
+    for (size_t i = 0; i < c->nwild; i++) {
+        sub_trie_remove(shard->trie, c->wild[i], c);
+        drop_global_pattern(c, c->wild[i]);
+        free(c->wild[i]);
+    }
+    if (c->nwild) sync_pattern_shards();
+    c->nwild = 0;
+    if (c->ngroups) {
+        pthread_mutex_lock(&qgroups_lock);
+        pthread_mutex_lock(&routes_lock); // orden: qgroups_lock antes que routes_lock
+        for (size_t i = 0; i < c->ngroups; i++) {
+            // antes de salir: el grupo vacío se libera
+            if (local) group_interest_change(c->groups[i]->subject, c->groups[i]->name, -1);
+            qgroup_leave(qgroups, c->groups[i], c);
+        }
+        pthread_mutex_unlock(&routes_lock);
+        atomic_store_explicit(&qgroups_n, qgroup_members(qgroups), memory_order_relaxed);
+        pthread_mutex_unlock(&qgroups_lock);
+        c->ngroups = 0;
+    }
+    if (c->known) memset(c->known, 0, c->known_cap);
+    c->nreplayed = 0;
+}
+
+// Milisegundos del reloj monótono
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Nanosegundos del reloj monótono
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// Escribir un número en decimal; devuelve el final
+static char *put_decimal(char *p, uint64_t v) {
+    char digits[24];
+    int nd = 0;
+    do {
+        digits[nd++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (nd) *p++ = digits[--nd];
+    return p;
+}
+
+// Escribir "MESSAGE <subject> <len>[ <seq>]\n" sin snprintf (va en el camino de cada publicación)
+static size_t format_text_header(char *out, const char *subject, size_t slen, size_t plen, uint64_t seq) {
+    char *p = out;
+    memcpy(p, "MESSAGE ", 8);
+    p += 8;
+    memcpy(p, subject, slen);
+    p += slen;
+    *p++ = ' ';
+    p = put_decimal(p, plen);
+    if (seq) {
+        *p++ = ' ';
+        p = put_decimal(p, seq);
+    }
+    *p++ = '\n';
+    return (size_t) (p - out);
+}
+
+// Reservar un mensaje del tema 'name' con lugar para 'plen' bytes de payload y 'hroom' de cabecera
+// de texto, todavía sin cabeceras (referencia inicial para el creador)
+static MsgBuf *msg_reserve(const char *name, size_t plen, size_t hroom) {
+    MsgBuf *m = (MsgBuf *) msgpool_alloc(shard->pool, sizeof(MsgBuf) + plen + hroom);
+    if (!m) return NULL;
+    atomic_init(&m->refs, 1);
+    m->subject = name;
+    m->seq = 0;
+    m->created_ms = max_lag_ms > 0 || admin_port ? now_ms() : 0;
+    m->raw = 0;
+    m->plen = plen;
+    m->ready = 0;
+    m->aborted = 0;
+    m->routed = 0;
+    m->group_only = 0;
+    m->picks = NULL;
+    m->npicks = 0;
+    m->origin = NULL;
+    m->zmode = ZM_NONE;
+    m->parts = NULL;
+    m->nparts = 0;
+    m->thdr = m->payload + plen;
+    m->thlen = 0;
+    m->bhlen = 0;
+    return m;
+}
+
+// Reservar un mensaje del tema con lugar para 'plen' bytes de payload. El payload se escribe en
+// m->payload y se sella con msg_seal().
+static MsgBuf *msg_alloc(const Subject *subject, size_t plen) {
+    return msg_reserve(subject->name, plen, strlen(subject->name) + 64);
+}
+
+// Escribir las cabeceras de texto y v2 del mensaje con su secuencia
+static void msg_seal(MsgBuf *m, const Subject *subject, uint64_t seq) {
+    size_t plen = m->plen;
+    m->seq = seq;
+    m->thlen = format_text_header(m->thdr, subject->name, strlen(subject->name), plen, seq);
+    if (seq) {
+        v2_encode(m->bhdr, V2_MESSAGE, V2_FLAG_SEQ, 0, subject->id, (uint32_t) (plen + V2_SEQ_LEN));
+        v2_put_u64(m->bhdr + V2_HDR_LEN, seq);
+        m->bhlen = V2_HDR_LEN + V2_SEQ_LEN;
+    } else {
+        v2_encode(m->bhdr, V2_MESSAGE, 0, 0, subject->id, (uint32_t) plen);
+        m->bhlen = V2_HDR_LEN;
+    }
+}
+
+// Crear un mensaje publicado con el payload copiado una sola vez (referencia inicial para el creador)
+static MsgBuf *msg_new(const Subject *subject, const char *payload, size_t plen, uint64_t seq) {
+    MsgBuf *m = msg_alloc(subject, plen);
+    if (!m) return NULL;
+    if (plen) memcpy(m->payload, payload, plen);
+    m->ready = plen;
+    msg_seal(m, subject, seq);
+    return m;
+}
+
+// Crear una respuesta para un solo cliente (se envía tal cual)
+static MsgBuf *msg_raw(const void *data, size_t len) {
+    MsgBuf *m = (MsgBuf *) msgpool_alloc(shard->pool, sizeof(MsgBuf) + len);
+    if (!m) return NULL;
+    atomic_init(&m->refs, 1);
+    m->subject = NULL;
+    m->seq = 0;
+    m->created_ms = max_lag_ms > 0 || admin_port ? now_ms() : 0;
+    m->raw = 1;
+    m->plen = 0;
+    m->ready = 0;
+    m->aborted = 0;
+    m->routed = 0;
+    m->group_only = 0;
+    m->picks = NULL;
+    m->npicks = 0;
+    m->origin = NULL;
+    m->zmode = ZM_NONE;
+    m->parts = NULL;
+    m->nparts = 0;
+    m->thdr = m->payload;
+    m->thlen = len;
+    memcpy(m->thdr, data, len);
+    return m;
+}
+
+// Cabecera del mensaje según el protocolo del cliente
+static const void *frame_hdr(const Client *c, const MsgBuf *m, size_t *len) {
+    if (c->proto == 2 && !m->raw) {
+        *len = m->bhlen;
+        return m->bhdr;
+    }
+    *len = m->thlen;
+    return m->thdr;
+}
+
+// Bytes que ocupa el mensaje en el stream de este cliente
+static size_t frame_len(const Client *c, const MsgBuf *m) {
+    size_t hlen;
+    (void) frame_hdr(c, m, &hlen);
+    return hlen + m->plen;
+}
+
+// Agregar a iov los segmentos del mensaje desde el byte 'off' del frame, hasta donde llegó el payload;
+// devuelve los segmentos usados
+static int frame_iov(const Client *c, const MsgBuf *m, size_t off, struct iovec *iov) {
+    size_t hlen;
+    const char *hdr = (const char *) frame_hdr(c, m, &hlen);
+    int n = 0;
+    if (off < hlen) {
+        iov[n++] = (struct iovec){(void *) (hdr + off), hlen - off};
+        off = 0;
+    } else {
+        off -= hlen;
+    }
+    if (m->ready > off) iov[n++] = (struct iovec){(void *) (m->payload + off), m->ready - off};
+    return n;
+}
+
+// Tomar una referencia adicional
+static void msg_ref(MsgBuf *m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+}
+
+// Marca de la conexión 'gen' en back_msgs / back_bytes
+static uint64_t back_tag(unsigned gen) {
+    return (uint64_t) gen << BACK_GEN_SHIFT;
+}
+
+// Sumar 'n' a lo devuelto solo si sigue siendo de la conexión 'gen': la marca y la cantidad cambian
+// juntas, así un hilo que se demoró después de mirar credit_gen no le suma a la conexión siguiente
+static int back_add(_Atomic uint64_t *w, unsigned gen, uint64_t n) {
+    uint64_t cur = atomic_load_explicit(w, memory_order_relaxed);
+    do {
+        if ((cur & ~BACK_AMOUNT) != back_tag(gen)) return -1;
+    } while (!atomic_compare_exchange_weak_explicit(w, &cur, cur + n, memory_order_relaxed, memory_order_relaxed));
+    return 0;
+}
+
+// Devolver al publicador el crédito de un mensaje que se libera (en cualquier hilo). Se acumula en el
+// cliente y el cliente entra una sola vez en la pila de su shard, que lo suma al saldo al final de su
+// iteración; si es otro shard y la pila estaba vacía se lo despierta.
+static void credit_return(MsgBuf *m) {
+    Client *c = m->origin;
+    if (back_add(&c->back_msgs, m->origin_gen, 1) < 0) return; // ya se cerró
+    (void) back_add(&c->back_bytes, m->origin_gen, m->plen);
+    if (atomic_exchange_explicit(&c->credit_queued, 1, memory_order_acq_rel)) return;
+    Shard *sh = &shards[c->shard_id];
+    Client *head = atomic_load_explicit(&sh->credit_head, memory_order_relaxed);
+    do {
+        c->next_credit = head;
+    } while (!atomic_compare_exchange_weak_explicit(&sh->credit_head, &head, c, memory_order_release,
+                                                    memory_order_relaxed));
+    if (head || sh == shard) return;
+    uint64_t one = 1;
+    (void) write(sh->wake.fd, &one, sizeof(one));
+}
+
+// Soltar una referencia; el último libera el bloque (puede ser otro shard: vuelve al pool de origen)
+static void msg_unref(MsgBuf *m) {
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1) {
+        if (m->origin) credit_return(m);
+        if (m->picks) msgpool_free(shard ? shard->pool : NULL, m->picks);
+        if (m->parts) {
+            for (size_t i = 0; i < m->nparts; i++) msg_unref(m->parts[i]);
+            msgpool_free(shard ? shard->pool : NULL, m->parts);
+        }
+        msgpool_free(shard ? shard->pool : NULL, m);
+    }
+}
+
+// El primer mensaje de la cola es un corte directo y ya se envió todo lo que llegó de su payload
+static int head_waiting(const Client *c) {
+    const MsgBuf *m = c->oq[c->oq_head];
+    if (m->ready == m->plen) return 0;
+    size_t hlen;
+    (void) frame_hdr(c, m, &hlen);
+    return c->oq_off >= hlen + m->ready;
+}
+
+// Publicar el tamaño de la cola para la elección del grupo de cola (--group-policy least-queued)
+static void publish_queued(Client *c) {
+    if (c->ngroups) atomic_store_explicit(&c->queued, c->oq_bytes, memory_order_relaxed);
+}
+
+// Vaciar la cola de salida sin enviar
+static void free_queue(Client *c) {
+    for (size_t i = 0; i < c->oq_count; i++) msg_unref(c->oq[(c->oq_head + i) & (c->oq_cap - 1)]);
+    c->oq_head = c->oq_count = 0;
+    c->oq_off = 0;
+    c->oq_bytes = 0;
+    publish_queued(c);
+    // con el socket cerrado ya no llegarán notificaciones zerocopy
+    for (size_t i = 0; i < c->zc_count; i++) msg_unref(c->zc[(c->zc_head + i) & (c->zc_cap - 1)].m);
+    c->zc_head = c->zc_count = 0;
+}
+
+static void abort_publish(Client *c);
+static void ur_release(Client *c);
+static void route_closed(Client *c);
+
+// Liberar todos los recursos del cliente y cerrar su socket
+static void close_client(Client *c) {
+    if (c->fd < 0) return; // ya cerrado
+    backend->del(&c->h); // dejar de vigilar el descriptor
+    if (backend->completion) ur_release(c); // se cierra cuando el kernel suelte sus operaciones
+    else close(c->fd); // cerrar socket
+    c->fd = -1; // marcar como cerrado
+    route_closed(c); // sacar la ruta del registro
+    // sus mensajes ya no devuelven crédito: lo pendiente se descarta junto con la marca vieja
+    unsigned gen = atomic_fetch_add_explicit(&c->credit_gen, 1, memory_order_relaxed) + 1;
+    atomic_store_explicit(&c->back_msgs, back_tag(gen), memory_order_relaxed);
+    atomic_store_explicit(&c->back_bytes, back_tag(gen), memory_order_relaxed);
+    c->credit_on = 0;
+    c->paused = 0;
+    c->held_len = 0;
+    c->ibuf_len = 0; // resetear buffer de entrada
+    abort_publish(c); // soltar el mensaje a medias
+    c->want_payload = 0; // resetear contador de payload pendiente
+    c->current_subject = NULL; // resetear tema actual
+    c->gmsg[0] = '\0';
+    c->in_batch = 0; // descartar el lote a medias
+    c->batch_len = 0;
+    c->proto = 1; // resetear protocolo
+    c->batch_z = 0;
+    for (size_t i = 0; i < c->pub_ids_cap; i++) { // olvidar ids v2
+        free(c->pub_ids[i].name);
+        c->pub_ids[i] = (PubId){NULL, NULL, 0};
+    }
+    free_subs(c); // salir del índice de temas (con el rol todavía puesto: las rutas no restan interés)
+    c->codec = CODEC_NONE; // después de free_subs, que descuenta sus suscripciones con compresión
+    c->role = ROLE_UNKNOWN; // resetear rol
+    free_queue(c); // descartar lo que no se alcanzó a enviar
+}
+
+// Agregar un mensaje al final de la cola circular; -1 si no hay memoria
+static int oq_push(Client *c, MsgBuf *m) {
+    if (c->oq_count == c->oq_cap) {
+        size_t ncap = c->oq_cap ? c->oq_cap * 2 : 16;
+        MsgBuf **n = (MsgBuf **) malloc(ncap * sizeof(MsgBuf *));
+        if (!n) return -1;
+        for (size_t i = 0; i < c->oq_count; i++) n[i] = c->oq[(c->oq_head + i) & (c->oq_cap - 1)];
+        free(c->oq);
+        c->oq = n;
+        c->oq_head = 0;
+        c->oq_cap = ncap;
+    }
+    c->oq[(c->oq_head + c->oq_count) & (c->oq_cap - 1)] = m;
+    c->oq_count++;
+    c->oq_bytes += frame_len(c, m);
+    msg_ref(m);
+    return 0;
+}
+
+// Quitar el primer mensaje de la cola (ya enviado o descartado)
+static void oq_pop(Client *c) {
+    MsgBuf *m = c->oq[c->oq_head];
+    c->oq_head = (c->oq_head + 1) & (c->oq_cap - 1);
+    c->oq_count--;
+    c->oq_bytes -= frame_len(c, m) - c->oq_off;
+    c->oq_off = 0;
+    msg_unref(m);
+}
+
+// Mensaje pendiente más viejo del cliente: el primero del envío en vuelo (backend uring) o la cabeza
+// de la cola; NULL si no hay nada pendiente
+static const MsgBuf *oldest_pending(const Client *c) {
+    if (c->ur && c->ur->nmsgs > 0) return c->ur->msgs[0];
+    return c->oq_count > 0 ? c->oq[c->oq_head] : NULL;
+}
+
+// Quitar de la cabeza de la cola los mensajes completos más viejos hasta que quepan 'need' bytes.
+// Un mensaje parcialmente enviado nunca se descarta para no romper el framing.
+static void drop_oldest(Client *c, size_t need) {
+    MsgBuf *keep = NULL; // mensaje en curso
+    size_t keep_off = c->oq_off;
+    if (keep_off > 0) {
+        keep = c->oq[c->oq_head];
+        msg_ref(keep);
+        oq_pop(c);
+    }
+    size_t keep_left = keep ? frame_len(c, keep) - keep_off : 0;
+    while (c->oq_count > 0 && c->oq_bytes + keep_left + need > max_queue_bytes) {
+        if (!c->oq[c->oq_head]->raw) {
+            c->dropped++;
+            counter_add(&shard->stats.dropped, 1);
+        }
+        oq_pop(c);
+    }
+    if (keep) {
+        // reinsertar el mensaje en curso al frente (siempre hay espacio: se acaba de sacar)
+        c->oq_head = (c->oq_head + c->oq_cap - 1) & (c->oq_cap - 1);
+        c->oq[c->oq_head] = keep;
+        c->oq_count++;
+        c->oq_off = keep_off;
+        c->oq_bytes += keep_left;
+    }
+}
+
+// Registrar un envío zerocopy en vuelo: el buffer queda retenido hasta su notificación
+static void zc_track(Client *c, MsgBuf *m) {
+    if (c->zc_count == c->zc_cap) {
+        size_t ncap = c->zc_cap ? c->zc_cap * 2 : 16;
+        ZcPending *n = (ZcPending *) malloc(ncap * sizeof(ZcPending));
+        if (!n) return; // sin memoria: se pierde el seguimiento y el buffer queda retenido
+        for (size_t i = 0; i < c->zc_count; i++) n[i] = c->zc[(c->zc_head + i) & (c->zc_cap - 1)];
+        free(c->zc);
+        c->zc = n;
+        c->zc_head = 0;
+        c->zc_cap = ncap;
+    }
+    msg_ref(m);
+    c->zc[(c->zc_head + c->zc_count) & (c->zc_cap - 1)] = (ZcPending){c->zc_next++, m};
+    c->zc_count++;
+}
+
+// Leer las notificaciones de finalización MSG_ZEROCOPY de la cola de errores del socket
+static void zc_reap(Client *c) {
+    while (1) {
+        char ctrl[128];
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = ctrl;
+        mh.msg_controllen = sizeof(ctrl);
+        if (recvmsg(c->fd, &mh, MSG_ERRQUEUE) < 0) return; // nada pendiente
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err *ee = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            // el kernel completa rangos [ee_info, ee_data] en orden
+            while (c->zc_count > 0) {
+                ZcPending *z = &c->zc[c->zc_head];
+                if ((int32_t) (z->seq - ee->ee_info) < 0 || (int32_t) (z->seq - ee->ee_data) > 0) break;
+                msg_unref(z->m);
+                c->zc_head = (c->zc_head + 1) & (c->zc_cap - 1);
+                c->zc_count--;
+            }
+        }
+    }
+}
+
+static int ur_flush(Client *c);
+
+// Interés de lectura del cliente: ninguno mientras un publicador espera crédito
+static int read_events(const Client *c) {
+    return c->paused ? 0 : EV_READ;
+}
+
+// Enviar lo posible de la cola en una sola llamada vectorizada (varios mensajes por syscall);
+// activa/desactiva el interés de escritura según quede pendiente. Un corte directo se envía hasta
+// donde llegó su payload y detiene la cola hasta que llegue más.
+// Devuelve -1 si el cliente se cerró por error.
+static int flush_queue(Client *c) {
+    if (backend->completion) return ur_flush(c); // io_uring: el envío se encola en el anillo
+    if (c->zc_count > 0) zc_reap(c);
+    while (c->oq_count > 0) {
+        MsgBuf *head = c->oq[c->oq_head];
+        if (head->aborted) {
+            // el publicador se fue a mitad del payload: si ya empezó a salir, el stream no se
+            // puede resincronizar
+            if (c->oq_off > 0) {
+                close_client(c);
+                return -1;
+            }
+            oq_pop(c);
+            continue;
+        }
+        if (head_waiting(c)) break;
+        struct iovec iov[FLUSH_IOV];
+        int niov = 0;
+        int flags = 0;
+        MsgBuf *first = c->oq[c->oq_head];
+        if (c->zerocopy && first->plen >= zerocopy_min) {
+            // mensaje grande: enviarlo solo con MSG_ZEROCOPY (el kernel no copia el payload)
+            niov = frame_iov(c, first, c->oq_off, iov);
+            flags = MSG_ZEROCOPY;
+        } else {
+            for (size_t i = 0; i < c->oq_count && niov + 2 <= FLUSH_IOV; i++) {
+                MsgBuf *m = c->oq[(c->oq_head + i) & (c->oq_cap - 1)];
+                if (i > 0 && c->zerocopy && m->plen >= zerocopy_min) break; // irá en su propio envío
+                if (i > 0 && m->aborted) break;
+                niov += frame_iov(c, m, i == 0 ? c->oq_off : 0, iov + niov);
+                if (m->ready < m->plen) break; // lo que sigue espera a que termine de llegar
+            }
+        }
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = (size_t) niov;
+        ssize_t n = sendmsg(c->fd, &mh, flags);
+        if (n < 0) {
+            if (would_block() || errno == ENOBUFS) break; // buffer lleno: esperar EV_WRITE
+            counter_add(&shard->stats.send_errors, 1);
+            close_client(c);
+            return -1;
+        }
+        c->bytes_out += (uint64_t) n;
+        counter_add(&shard->stats.bytes_out, (uint64_t) n);
+        if (flags & MSG_ZEROCOPY) zc_track(c, first);
+        // avanzar la cola según los bytes aceptados por el kernel
+        size_t left = (size_t) n;
+        while (left > 0) {
+            MsgBuf *m = c->oq[c->oq_head];
+            size_t rem = frame_len(c, m) - c->oq_off;
+            if (left < rem) {
+                c->oq_off += left;
+                c->oq_bytes -= left;
+                left = 0;
+                break;
+            }
+            left -= rem;
+            oq_pop(c);
+        }
+        if (c->oq_count > 0 && c->oq_off > 0) break; // escritura parcial: el socket está lleno
+    }
+    publish_queued(c);
+    // esperando payload de un corte directo no hace falta EV_WRITE: el publicador vuelve a marcarlo
+    (void) backend->mod(&c->h, read_events(c) | (c->oq_count > 0 && !head_waiting(c) ? EV_WRITE : 0));
+    return 0;
+}
+
+// Marcar al cliente para vaciar su cola al final de la iteración del bucle de eventos:
+// los mensajes encolados durante la iteración salen juntos en un solo sendmsg().
+static void mark_dirty(Client *c) {
+    if (c->dirty) return;
+    c->dirty = 1;
+    c->next_dirty = shard->dirty_head;
+    shard->dirty_head = c;
+}
+
+// Vaciar las colas de todos los clientes que recibieron mensajes en esta iteración
+static void flush_dirty(void) {
+    while (shard->dirty_head) {
+        Client *c = shard->dirty_head;
+        shard->dirty_head = c->next_dirty;
+        c->dirty = 0;
+        if (c->fd >= 0 && c->oq_count > 0 && !(c->h.events & EV_WRITE)) (void) flush_queue(c);
+    }
+}
+
+// Encolar un mensaje compartido para el cliente. 'force' omite la política de consumidor lento
+// (respuestas de control como OK/ERR). Devuelve -1 si el cliente fue desconectado.
+static int client_send(Client *c, MsgBuf *m, int force) {
+    const MsgBuf *oldest = oldest_pending(c);
+    if (oldest && !force) {
+        // política de consumidor lento (lo que está en vuelo cuenta, aunque ya no se pueda descartar)
+        if (slow_policy == SLOW_DISCONNECT && max_lag_ms > 0 && now_ms() - oldest->created_ms > max_lag_ms) {
+            counter_add(&shard->stats.slow_disconnects, 1);
+            close_client(c);
+            return -1;
+        }
+        size_t len = frame_len(c, m);
+        if (c->oq_bytes + len > max_queue_bytes) {
+            if (slow_policy == SLOW_DISCONNECT) {
+                counter_add(&shard->stats.slow_disconnects, 1);
+                close_client(c);
+                return -1;
+            }
+            if (slow_policy == SLOW_DROP_NEWEST) {
+                // descartar el mensaje nuevo
+                c->dropped++;
+                counter_add(&shard->stats.dropped, 1);
+                return 0;
+            }
+            drop_oldest(c, len);
+        }
+    }
+    if (oq_push(c, m) < 0) {
+        close_client(c); // sin memoria no se puede mantener el framing
+        return -1;
+    }
+    if (!m->raw) {
+        c->msgs_out++;
+        counter_add(&shard->stats.msgs_out, 1);
+    }
+    publish_queued(c);
+    mark_dirty(c);
+    return 0;
+}
+
+// Enviar una respuesta de control respetando el orden de la cola
+static void send_raw(Client *c, const void *data, size_t len) {
+    MsgBuf *m = msg_raw(data, len);
+    if (!m) return;
+    (void) client_send(c, m, 1);
+    msg_unref(m);
+}
+
+// Enviar una respuesta de texto (OK / ERR)
+static void send_reply(Client *c, const char *line) {
+    send_raw(c, line, strlen(line));
+}
+
+// Enviar un error en el framing del cliente (texto: línea "ERR ..."; v2: frame ERR con el texto)
+static void send_error(Client *c, const char *line) {
+    if (c->proto != 2) {
+        send_reply(c, line);
+        return;
+    }
+    unsigned char f[V2_HDR_LEN + 256];
+    size_t n = strlen(line);
+    if (n > 256) n = 256;
+    v2_encode(f, V2_ERR, 0, 0, 0, (uint32_t) n);
+    memcpy(f + V2_HDR_LEN, line, n);
+    send_raw(c, f, V2_HDR_LEN + n);
+}
+
+// ---------------------------------------------------------------------------
+// Control de flujo por crédito: cada cabecera de un publicador descuenta un mensaje y su largo de su
+// saldo, y lo descontado vuelve al liberarse el mensaje. El saldo solo lo toca el shard del cliente.
+// ---------------------------------------------------------------------------
+
+// Descontar del saldo lo que anuncia una cabecera
+static void credit_charge(Client *c, int64_t msgs, int64_t bytes) {
+    if (!c->credit_on) return;
+    c->credit_msgs -= msgs;
+    c->credit_bytes -= bytes;
+}
+
+// Devolver crédito al saldo; el publicador se entera con el próximo CREDIT
+static void credit_refund(Client *c, int64_t msgs, int64_t bytes) {
+    if (!c->credit_on) return;
+    c->credit_msgs += msgs;
+    c->credit_bytes += bytes;
+    c->grant_msgs += msgs;
+    c->grant_bytes += bytes;
+}
+
+// El mensaje devuelve su crédito (un mensaje y su payload) cuando se libere
+static void credit_hold(Client *c, MsgBuf *m) {
+    if (!c->credit_on) return;
+    m->origin = c;
+    m->origin_gen = atomic_load_explicit(&c->credit_gen, memory_order_relaxed);
+}
+
+// Enviar un CREDIT en el framing del cliente
+static void send_credit(Client *c, uint64_t msgs, uint64_t bytes) {
+    if (c->proto == 2) {
+        unsigned char f[V2_HDR_LEN + V2_CREDIT_LEN];
+        v2_encode(f, V2_CREDIT, 0, 0, 0, V2_CREDIT_LEN);
+        v2_put_u64(f + V2_HDR_LEN, msgs);
+        v2_put_u64(f + V2_HDR_LEN + 8, bytes);
+        send_raw(c, f, sizeof(f));
+    } else {
+        char line[CREDIT_LINE_MAX];
+        snprintf(line, sizeof(line), "CREDIT %llu %llu\n", (unsigned long long) msgs, (unsigned long long) bytes);
+        send_reply(c, line);
+    }
+    counter_add(&shard->stats.credit_grants, 1);
+}
+
+// Dar la ventana a un publicador recién identificado (sin --credit-* no hay control de flujo)
+static void credit_start(Client *c) {
+    if (!credit_msgs && !credit_bytes) return;
+    c->credit_on = 1;
+    c->credit_msgs = (int64_t) credit_msgs;
+    c->credit_bytes = (int64_t) credit_bytes;
+    c->grant_msgs = c->grant_bytes = 0;
+    send_credit(c, credit_msgs, credit_bytes);
+}
+
+// Saldo agotado en alguna dimensión con límite
+static int credit_exhausted(int64_t msgs, int64_t bytes) {
+    return (credit_msgs && msgs <= 0) || (credit_bytes && bytes <= 0);
+}
+
+static void ur_read(Client *c, int on);
+static void process_input(Client *c);
+static void client_input(Client *c, const char *data, size_t n);
+
+// Conceder lo devuelto cuando junta un cuarto de la ventana o cuando el saldo que conoce el publicador
+// está agotado (puede estar esperándolo)
+static void credit_grant(Client *c) {
+    if (!c->grant_msgs && !c->grant_bytes) return;
+    int quarter = (credit_msgs && (uint64_t) c->grant_msgs * 4 >= credit_msgs) ||
+                  (credit_bytes && (uint64_t) c->grant_bytes * 4 >= credit_bytes);
+    if (!quarter && !credit_exhausted(c->credit_msgs - c->grant_msgs, c->credit_bytes - c->grant_bytes)) return;
+    send_credit(c, (uint64_t) c->grant_msgs, (uint64_t) c->grant_bytes);
+    c->grant_msgs = c->grant_bytes = 0;
+}
+
+// Con el saldo agotado dejar de leer al publicador. Solo entre mensajes (el que está llegando tiene que
+// completarse para liberarse): lo ya leído y no procesado espera en ibuf (o en 'held' con uring) hasta
+// credit_resume(). Devuelve 1 si está pausado.
+static int credit_pause(Client *c) {
+    if (c->paused) return 1;
+    if (!c->credit_on || c->want_payload > 0 || !credit_exhausted(c->credit_msgs, c->credit_bytes)) return 0;
+    c->paused = 1;
+    counter_add(&shard->stats.credit_pauses, 1);
+    if (backend->completion) ur_read(c, 0);
+    else (void) backend->mod(&c->h, c->h.events & ~EV_READ);
+    return 1;
+}
+
+// Volvió crédito: procesar lo que quedó leído al pausar y volver a leer el socket
+static void credit_resume(Client *c) {
+    if (!c->paused || credit_exhausted(c->credit_msgs, c->credit_bytes)) return;
+    c->paused = 0;
+    if (c->ibuf_len) process_input(c); // puede volver a pausar
+    if (c->fd >= 0 && !c->paused && c->held_len) {
+        char *data = c->held; // lo que no se procese por otra pausa vuelve a quedar retenido
+        size_t n = c->held_len;
+        c->held = NULL;
+        c->held_len = c->held_cap = 0;
+        client_input(c, data, n);
+        free(data);
+    }
+    if (c->fd < 0 || c->paused) return;
+    if (backend->completion) ur_read(c, 1);
+    else (void) backend->mod(&c->h, c->h.events | EV_READ);
+}
+
+// Después de leer: conceder lo pendiente y pausar si se agotó el saldo
+static void credit_update(Client *c) {
+    credit_grant(c);
+    (void) credit_pause(c);
+}
+
+// Sumar al saldo de los publicadores de este shard lo que devolvieron los mensajes liberados (en este
+// o en otros shards) desde la iteración anterior
+static void credit_sync(void) {
+    Client *c = atomic_exchange_explicit(&shard->credit_head, NULL, memory_order_acquire);
+    while (c) {
+        Client *next = c->next_credit;
+        atomic_store_explicit(&c->credit_queued, 0, memory_order_release);
+        // tomar lo devuelto y dejar la marca de la conexión (que solo cambia en este hilo, al cerrar)
+        int64_t msgs = (int64_t) (atomic_fetch_and_explicit(&c->back_msgs, ~BACK_AMOUNT, memory_order_relaxed) &
+                                  BACK_AMOUNT);
+        int64_t bytes = (int64_t) (atomic_fetch_and_explicit(&c->back_bytes, ~BACK_AMOUNT, memory_order_relaxed) &
+                                   BACK_AMOUNT);
+        if (c->fd >= 0 && c->credit_on) {
+            credit_refund(c, msgs, bytes);
+            credit_grant(c);
+            credit_resume(c);
+        }
+        c = next;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Compresión: el códec se negocia en la línea de rol y se usa para los lotes en ambos sentidos.
+// ---------------------------------------------------------------------------
+
+// Elegir el primer códec conocido de "COMPRESS <códec>[,<códec>...]" y responder con el elegido
+// ("none" si no hay ninguno en común o la opción no se entiende)
+static void negotiate_codec(Client *c, const char *opts) {
+    c->codec = CODEC_NONE;
+    if (strncmp(opts, "COMPRESS ", 9) == 0) {
+        for (const char *p = opts + 9; *p && c->codec == CODEC_NONE;) {
+            size_t n = strcspn(p, ",");
+            for (int k = CODEC_NONE + 1; k < NCODECS; k++)
+                if (strlen(codec_names[k]) == n && strncmp(p, codec_names[k], n) == 0) c->codec = (codec_t) k;
+            p += n;
+            if (*p == ',') p++;
+        }
+    }
+    const char *name = codec_names[c->codec];
+    size_t n = strlen(name);
+    if (c->proto == 2) {
+        unsigned char f[V2_HDR_LEN + 16];
+        v2_encode(f, V2_COMPRESS, 0, 0, 0, (uint32_t) n);
+        memcpy(f + V2_HDR_LEN, name, n);
+        send_raw(c, f, V2_HDR_LEN + n);
+    } else {
+        char line[32];
+        snprintf(line, sizeof(line), "COMPRESS %s\n", name);
+        send_reply(c, line);
+    }
+}
+
+// Escribir las cabeceras de un lote comprimido: "MESSAGE_BATCH <subject> <len>\n" y MESSAGE_BATCH en v2
+static void zbatch_seal(MsgBuf *m, const Subject *subject) {
+    size_t slen = strlen(subject->name);
+    char *p = m->thdr;
+    memcpy(p, "MESSAGE_BATCH ", 14);
+    p += 14;
+    memcpy(p, subject->name, slen);
+    p += slen;
+    *p++ = ' ';
+    p = put_decimal(p, m->plen);
+    *p++ = '\n';
+    m->thlen = (size_t) (p - m->thdr);
+    v2_encode(m->bhdr, V2_MESSAGE_BATCH, 0, 0, subject->id, (uint32_t) m->plen);
+    m->bhlen = V2_HDR_LEN;
+}
+
+// Indica si algún suscriptor con compresión recibe el tema, exacto o por un patrón. Sin estado
+// compartido no se sabe: no se arma el lote y todos reciben los registros sueltos.
+static int zbatch_wanted(const Subject *subject) {
+    const Topic *t = (const Topic *) subject->data;
+    if (!t) return 0;
+    if (atomic_load_explicit(&t->zsubs, memory_order_relaxed) > 0) return 1;
+    if (atomic_load_explicit(&zpatterns_n, memory_order_relaxed) == 0) return 0;
+    pthread_mutex_lock(&global_ids_lock);
+    int r = sub_trie_match_any(zpatterns, subject->name);
+    pthread_mutex_unlock(&global_ids_lock);
+    return r;
+}
+
+// Armar el lote comprimido del PUBLISH_BATCH en curso ('body' son sus registros sin comprimir). Se
+// comprime una sola vez, o se copia el cuerpo tal como lo mandó comprimido el publicador, y el mismo
+// buffer va a todos los suscriptores con compresión. NULL si ninguno recibe el tema, el tema tiene
+// retención, el lote es chico, está mal formado o no se achica.
+static MsgBuf *zbatch_new(Client *c, const char *body, size_t blen) {
+    Subject *subject = c->current_subject;
+    if (retained(subject) || blen < COMPRESS_MIN_BYTES || !zbatch_wanted(subject)) return NULL;
+    size_t n = 0, off = 0; // registros: el lote comprimido tiene que traer exactamente los mismos
+    while (off + V2_BATCH_REC_HDR <= blen) {
+        size_t rlen = v2_get_u32((const unsigned char *) body + off);
+        off += V2_BATCH_REC_HDR;
+        if (rlen > blen - off) return NULL;
+        off += rlen;
+        n++;
+    }
+    if (off != blen) return NULL;
+    size_t cap = c->batch_z ? c->batch_len : V2_ZBATCH_HDR + lz4_bound(blen);
+    MsgBuf *z = msg_alloc(subject, cap);
+    if (!z) return NULL;
+    if (c->batch_z) {
+        memcpy(z->payload, c->batch, cap);
+    } else {
+        size_t k = lz4_compress(body, blen, z->payload + V2_ZBATCH_HDR, cap - V2_ZBATCH_HDR);
+        if (k == 0 || V2_ZBATCH_HDR + k >= blen) {
+            msg_unref(z);
+            return NULL;
+        }
+        v2_put_u32((unsigned char *) z->payload, (uint32_t) blen);
+        z->plen = V2_ZBATCH_HDR + k;
+    }
+    z->ready = z->plen;
+    z->zmode = ZM_BATCH;
+    if (c->credit_on && !(z->parts = (MsgBuf **) msgpool_alloc(shard->pool, n * sizeof(MsgBuf *)))) {
+        msg_unref(z);
+        return NULL;
+    }
+    zbatch_seal(z, subject);
+    counter_add(&shard->stats.zbatches, 1);
+    counter_add(&shard->stats.zraw_bytes, blen);
+    counter_add(&shard->stats.zbytes, z->plen);
+    return z;
+}
+
+// Anunciar a un cliente v2 el id de un tema que recibe por un patrón (OK no solicitado con el
+// nombre), antes de su primer MESSAGE
+static void announce_subject(Client *c, const Subject *subject) {
+    if (mark_known(c, subject->id)) return;
+    size_t slen = strlen(subject->name);
+    unsigned char f[V2_HDR_LEN + V2_MAX_SUBJECT];
+    if (slen > V2_MAX_SUBJECT) return;
+    v2_encode(f, V2_OK, 0, (uint16_t) slen, subject->id, 0);
+    memcpy(f + V2_HDR_LEN, subject->name, slen);
+    send_raw(c, f, V2_HDR_LEN + slen);
+}
+
+// Indica si el cliente ya recibió esta secuencia del tema al reproducirlo con FROM, o si la va a
+// recibir porque la reproducción todavía no llegó a lo vivo
+static int already_replayed(const Client *c, const Subject *subject, uint64_t seq) {
+    for (size_t i = 0; i < c->nreplayed; i++)
+        if (c->replayed[i].subject == subject) return c->replayed[i].next || (seq && seq <= c->replayed[i].upto);
+    return 0;
+}
+
+// Encolar un mensaje a los suscriptores locales del tema
+static void deliver_local(Subject *subject, MsgBuf *m) {
+    // Sin patrones se recorren directo los suscriptores del tema (de atrás hacia adelante: si la
+    // política desconecta a un cliente, su enlace se reemplaza por el último, que ya fue visitado).
+    // Con patrones se recorre el cache de coincidencias, que no cambia durante el recorrido.
+    size_t n;
+    void *const *owners = subject_matches(subject, shard->trie, &n);
+    int wild = owners != subject->owners;
+    for (size_t i = n; i-- > 0;) {
+        Client *c = (Client *) owners[i];
+        if (m->routed && c->role == ROLE_ROUTE) continue; // un salto: no vuelve a salir por una ruta
+        // de un lote con compresión, cada suscriptor recibe o el lote comprimido o los registros sueltos
+        if (m->zmode != ZM_NONE && (m->zmode == ZM_BATCH) != (c->codec != CODEC_NONE)) continue;
+        if (wild) {
+            if (c->fd < 0) continue; // desconectado durante este recorrido
+            if (c->proto == 2) announce_subject(c, subject);
+        }
+        if (c->nreplayed && already_replayed(c, subject, m->seq)) continue;
+        // encolar una referencia sin bloquear al broker
+        (void) client_send(c, m, 0);
+    }
+}
+
+// Cola de un miembro de grupo (la publica su shard; para los de otro shard es una estimación)
+static size_t member_queued(void *member) {
+    return atomic_load_explicit(&((Client *) member)->queued, memory_order_relaxed);
+}
+
+// Indica si el miembro es un cliente de este broker (no una ruta)
+static int local_member(void *member) {
+    return ((Client *) member)->role != ROLE_ROUTE;
+}
+
+// Elegir el miembro de cada grupo de cola que recibe el mensaje y anotarlo en él, antes de repartirlo:
+// uno local si hay y si no una ruta hacia un broker con miembros. Lo que llegó por una ruta ya lo
+// repartió entre los grupos el broker de origen. Devuelve la cantidad de elegidos.
+static size_t pick_members(const Subject *subject, MsgBuf *m) {
+    if (m->routed || atomic_load_explicit(&qgroups_n, memory_order_relaxed) == 0) return 0;
+    pthread_mutex_lock(&qgroups_lock);
+    size_t n;
+    QGroup *const *gs = qgroup_match(qgroups, subject->name, &n);
+    if (n > 0 && (m->picks = (GroupPick *) msgpool_alloc(shard->pool, n * sizeof(GroupPick)))) {
+        for (size_t i = 0; i < n; i++) {
+            Client *c = (Client *) qgroup_pick(gs[i], group_policy, member_queued, local_member);
+            if (!c) c = (Client *) qgroup_pick(gs[i], group_policy, member_queued, NULL);
+            if (c) m->picks[m->npicks++] = (GroupPick){gs[i], c, c->shard_id};
+        }
+    }
+    pthread_mutex_unlock(&qgroups_lock);
+    return m->npicks;
+}
+
+// Indica si el cliente sigue en el grupo
+static int in_group(const Client *c, const QGroup *g) {
+    for (size_t i = 0; i < c->ngroups; i++)
+        if (c->groups[i] == g) return 1;
+    return 0;
+}
+
+// Copia del mensaje para una ruta elegida en un grupo, con la cabecera GMSG (el grupo sigue vivo
+// mientras la ruta sea miembro); NULL si no hay memoria
+static MsgBuf *msg_group(const MsgBuf *m, const QGroup *g) {
+    MsgBuf *r = msg_reserve(m->subject, m->plen, strlen(m->subject) + strlen(g->subject) + strlen(g->name) + 32);
+    if (!r) return NULL;
+    memcpy(r->payload, m->payload, m->plen);
+    r->ready = m->plen;
+    r->routed = 1;
+    r->thlen = (size_t) sprintf(r->thdr, "GMSG %s %s %s %zu\n", m->subject, g->subject, g->name, m->plen);
+    return r;
+}
+
+// Encolar el mensaje a los elegidos de los grupos de cola que son de este shard. Un elegido que se
+// desconectó o dejó el grupo desde la elección no lo recibe (no se elige otro: a lo sumo una entrega).
+// A una ruta elegida le llega una copia GMSG cuando el payload está completo: la de un corte directo
+// se la pasa finish_publish() con 'routes_only'.
+static void deliver_picks(MsgBuf *m, int routes_only) {
+    Subject *subject = NULL;
+    for (size_t i = 0; i < m->npicks; i++) {
+        const GroupPick *p = &m->picks[i];
+        if (p->shard != shard->id || (routes_only && p->client->role != ROLE_ROUTE)) continue;
+        Client *c = p->client;
+        if (c->fd < 0 || !in_group(c, p->group)) {
+            counter_add(&shard->stats.group_lost, 1);
+            continue;
+        }
+        if (c->role == ROLE_ROUTE) {
+            if (m->ready < m->plen) continue;
+            MsgBuf *g = msg_group(m, p->group);
+            if (!g) {
+                counter_add(&shard->stats.group_lost, 1);
+                continue;
+            }
+            if (client_send(c, g, 0) == 0) counter_add(&shard->stats.group_out, 1);
+            msg_unref(g);
+            continue;
+        }
+        if (c->proto == 2) {
+            // por un patrón el cliente v2 todavía no conoce el id del tema
+            if (!subject) subject = intern_subject(m->subject);
+            if (subject) announce_subject(c, subject);
+        }
+        if (client_send(c, m, 0) == 0) counter_add(&shard->stats.group_out, 1);
+    }
+}
+
+static void drain_inbox(void);
+
+// Pasar un mensaje a otro shard. Si su cola está llena se procesa la propia mientras tanto, así
+// dos shards que se envían mutuamente no se bloquean entre sí.
+static void route_to_shard(Shard *dst, MsgBuf *m) {
+    msg_ref(m); // la referencia viaja con el mensaje
+    while (mpsc_push(&dst->inbox, m) < 0) {
+        drain_inbox();
+        sched_yield();
+    }
+    shard->wake_peer[dst->id] = 1; // despertarlo al final de la iteración
+}
+
+// Contar una publicación completa del tema
+static void count_publish(Subject *subject, size_t len) {
+    subject->msgs++;
+    subject->bytes += len;
+    counter_add(&shard->stats.msgs_in, 1);
+    counter_add(&shard->stats.bytes_in, len);
+}
+
+// Indica si el shard 'i' puede entregar un mensaje del tema: tiene suscriptores exactos, algún patrón o
+// un elegido de los grupos (un GMSG, solo esto último). Sin estado compartido (faltó memoria al
+// internarlo) se asume que sí.
+static int shard_wants(const Subject *subject, const MsgBuf *m, int i) {
+    const Topic *t = (const Topic *) subject->data;
+    uint64_t bit = 1ull << (i % 64);
+    if (!m->group_only && (!t || (atomic_load_explicit(&t->shards[i / 64], memory_order_acquire) & bit) ||
+                           (atomic_load_explicit(&pattern_shards[i / 64], memory_order_acquire) & bit)))
+        return 1;
+    for (size_t k = 0; k < m->npicks; k++)
+        if (m->picks[k].shard == i) return 1;
+    return 0;
+}
+
+// Indica si algún otro shard puede entregar un mensaje del tema
+static int peers_want(const Subject *subject, const MsgBuf *m) {
+    for (int i = 0; i < nshards; i++)
+        if (i != shard->id && shard_wants(subject, m, i)) return 1;
+    return 0;
+}
+
+// Pasar un mensaje a los demás shards que lo pueden entregar
+static void route_to_peers(const Subject *subject, MsgBuf *m) {
+    for (int i = 0; i < nshards; i++)
+        if (i != shard->id && shard_wants(subject, m, i)) route_to_shard(&shards[i], m);
+}
+
+// Enviar un mensaje con el payload completo (sin sellar) a todos los suscriptores del tema, en este y
+// en los demás shards. Consume la referencia del creador.
+static void broadcast_message(Subject *subject, MsgBuf *m) {
+    count_publish(subject, m->plen);
+    size_t npicks = pick_members(subject, m);
+    int anyone = subject->nsubs || sub_trie_size(shard->trie) || npicks || peers_want(subject, m);
+    // el anillo se crea con el primer destinatario; una vez creado se retiene aunque ya no haya
+    // nadie suscrito. Con log durable, todo lo publicado.
+    Topic *r = anyone || dlog ? topic_ring(subject) : retained(subject);
+    uint64_t seq = 0;
+    if (r) {
+        pthread_mutex_lock(&r->lock);
+        seq = retain_append(r->ring, m->payload, m->plen);
+        // sin lugar en disco el mensaje sigue en el anillo y se entrega, pero un reinicio lo pierde
+        if (dlog && dlog_append(dlog, subject->name, seq, m->payload, m->plen) < 0)
+            counter_add(&shard->stats.log_errors, 1);
+        pthread_mutex_unlock(&r->lock);
+    }
+    // nadie suscrito: ni siquiera se arma la cabecera
+    if (!anyone) {
+        msg_unref(m);
+        return;
+    }
+    msg_seal(m, subject, seq);
+    deliver_local(subject, m); // el mismo buffer, compartido por todos
+    deliver_picks(m, 0);
+    route_to_peers(subject, m);
+    msg_unref(m); // soltar la referencia del creador
+}
+
+// Enviar un lote comprimido a los suscriptores con compresión del tema, en este y en los demás shards.
+// Sus registros ya se contaron y retuvieron al repartirse sueltos. Consume la referencia del creador.
+static void broadcast_zbatch(Subject *subject, MsgBuf *z) {
+    deliver_local(subject, z);
+    route_to_peers(subject, z);
+    msg_unref(z);
+}
+
+// Marcar para vaciar a los suscriptores locales del tema (y a los elegidos de sus grupos): llegó más
+// payload del corte directo 'm' (o se abortó) y quienes lo tienen en la cola pueden seguir enviando
+static void cut_progress(Subject *subject, const MsgBuf *m) {
+    size_t n;
+    void *const *owners = subject_matches(subject, shard->trie, &n);
+    for (size_t i = 0; i < n; i++) {
+        Client *c = (Client *) owners[i];
+        if (c->fd >= 0 && c->oq_count > 0) mark_dirty(c);
+    }
+    for (size_t i = 0; i < m->npicks; i++) {
+        Client *c = m->picks[i].client;
+        if (m->picks[i].shard == shard->id && c->fd >= 0 && c->oq_count > 0) mark_dirty(c);
+    }
+}
+
+// Página de una reproducción en curso
+typedef struct ReplayTo {
+    Client *c;
+    Replayed *e;
+    size_t budget; // mensajes que todavía entran en esta página
+} ReplayTo;
+
+// La página terminó: se agotó o la cola del cliente pasó la mitad de su límite (sigue cuando el
+// socket la vacíe)
+static int replay_full(const ReplayTo *to) {
+    return to->budget == 0 || to->c->fd < 0 || to->c->oq_bytes >= max_queue_bytes / 2;
+}
+
+// Encolar un mensaje reproducido y avanzar el cursor. Pasa por la política de consumidor lento como
+// cualquier entrega; replay_full() evita llegar a ella mientras el cliente lee.
+static int replay_one(void *arg, uint64_t seq, uint64_t offset, const char *payload, size_t len) {
+    ReplayTo *to = (ReplayTo *) arg;
+    MsgBuf *m = msg_new(to->e->subject, payload, len, seq);
+    if (m) {
+        (void) client_send(to->c, m, 0);
+        msg_unref(m);
+    }
+    to->e->next = seq + 1;
+    to->e->log_offset = offset;
+    to->budget--;
+    return replay_full(to);
+}
+
+// Avanzar una página la reproducción 'e' de 'c': primero lo que ya salió del anillo (del log
+// durable, sin el lock del tema) y después el anillo. Al alcanzar lo último retenido la reproducción
+// termina y lo que siga llega en vivo.
+static void replay_page(Client *c, Replayed *e) {
+    Topic *r = retained(e->subject);
+    ReplayTo to = {c, e, REPLAY_PAGE};
+    while (!replay_full(&to)) {
+        pthread_mutex_lock(&r->lock);
+        uint64_t first = retain_first(r->ring), next = retain_next(r->ring);
+        if (e->next >= next) {
+            e->upto = next - 1;
+            e->next = 0;
+            pthread_mutex_unlock(&r->lock);
+            return;
+        }
+        if (e->next < first) {
+            pthread_mutex_unlock(&r->lock);
+            size_t budget = to.budget;
+            if (dlog) dlog_replay(dlog, e->subject->name, e->next, first, e->log_offset, replay_one, &to);
+            if (to.budget == budget) e->next = first; // lo que falta ya no está en el log
+            continue;
+        }
+        for (; e->next < next && !replay_full(&to); e->next++) {
+            size_t len;
+            const char *data = retain_get(r->ring, e->next, &len);
+            if (!data) continue;
+            MsgBuf *m = msg_new(e->subject, data, len, e->next);
+            if (m) {
+                (void) client_send(c, m, 0);
+                msg_unref(m);
+            }
+            to.budget--;
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+// Avanzar las reproducciones pendientes de los clientes del shard (una vez por iteración del bucle,
+// antes de vaciar las colas)
+static void replay_pump(void) {
+    for (Client **pc = &shard->replay_head; *pc;) {
+        Client *c = *pc;
+        int active = 0;
+        for (size_t i = 0; c->fd >= 0 && i < c->nreplayed; i++) {
+            if (!c->replayed[i].next) continue;
+            replay_page(c, &c->replayed[i]);
+            active |= c->replayed[i].next != 0;
+        }
+        if (!active || c->fd < 0) {
+            *pc = c->next_replay; // terminó (o se cerró): sale de la lista
+            c->replaying = 0;
+            continue;
+        }
+        pc = &c->next_replay;
+    }
+}
+
+// Después de vaciar las colas: si algún cliente que reproduce quedó con lugar, despertar de nuevo al
+// shard para seguir. Los demás siguen cuando su socket queda escribible.
+static void replay_kick(void) {
+    for (Client *c = shard->replay_head; c; c = c->next_replay) {
+        if (c->fd >= 0 && c->oq_bytes < max_queue_bytes / 2) {
+            uint64_t one = 1;
+            (void) write(shard->wake.fd, &one, sizeof(one));
+            return;
+        }
+    }
+}
+
+// Reproducir para el cliente lo retenido del tema desde 'spec' (SUBSCRIBE ... FROM <spec>). Se llama
+// con la suscripción ya enlazada y en el hilo del shard: solo fija el cursor y la reproducción avanza
+// de a páginas en replay_pump(), al ritmo en que el cliente vacía su cola. Hasta que alcanza lo
+// retenido, lo publicado en vivo se descarta para el cliente (se lo entrega la reproducción, en
+// orden). Sin retención (o sin lugar para el anillo) no hace nada. Con log durable, lo anterior al
+// anillo se lee del disco.
+static void replay(Client *c, Subject *subject, const char *spec) {
+    Topic *r = topic_ring(subject);
+    RetainFrom f;
+    if (!r || retain_parse_from(spec, &f) < 0) return;
+    pthread_mutex_lock(&r->lock);
+    uint64_t next = retain_next(r->ring);
+    uint64_t start = dlog ? retain_start_in(f, dlog_first_seq(dlog, subject->name), next) : retain_start(r->ring, f);
+    pthread_mutex_unlock(&r->lock);
+    Replayed *e = NULL;
+    for (size_t i = 0; i < c->nreplayed && !e; i++)
+        if (c->replayed[i].subject == subject) e = &c->replayed[i];
+    if (!e) {
+        if (c->nreplayed == c->replayed_cap) {
+            size_t ncap = c->replayed_cap ? c->replayed_cap * 2 : 4;
+            Replayed *n = (Replayed *) realloc(c->replayed, ncap * sizeof(Replayed));
+            if (!n) return;
+            c->replayed = n;
+            c->replayed_cap = ncap;
+        }
+        e = &c->replayed[c->nreplayed++];
+        e->subject = subject;
+    }
+    e->upto = start - 1;
+    e->next = start < next ? start : 0; // nada retenido desde ahí: sigue en vivo
+    e->log_offset = 0;
+    if (e->next && !c->replaying) {
+        c->replaying = 1;
+        c->next_replay = shard->replay_head;
+        shard->replay_head = c;
+    }
+}
+
+// Preparar la recepción del cuerpo de un PUBLISH_BATCH de 'len' bytes (comprimido si 'z'). Un lote
+// demasiado grande (o sin memoria) se descarta completo en lugar de repartirse por partes.
+static void start_batch(Client *c, Subject *subject, size_t len, int z) {
+    c->current_subject = subject;
+    c->want_payload = len;
+    c->in_batch = 0;
+    c->batch_len = 0;
+    c->batch_z = z;
+    // El cuerpo se descuenta ahora y cada registro al repartirse; uno descartado devuelve los bytes.
+    credit_charge(c, 0, (int64_t) len);
+    if (subject && z && (c->codec == CODEC_NONE || len < V2_ZBATCH_HDR)) {
+        send_error(c, c->codec == CODEC_NONE ? "ERR compression not negotiated\n" : "ERR malformed batch\n");
+        subject = c->current_subject = NULL;
+    }
+    if (!subject || len == 0) {
+        credit_refund(c, 0, (int64_t) len);
+        return;
+    }
+    if (len > MAX_BATCH_BYTES) {
+        send_error(c, "ERR batch too large\n");
+        credit_refund(c, 0, (int64_t) len);
+        c->current_subject = NULL;
+        return;
+    }
+    if (len > c->batch_cap) {
+        char *n = (char *) realloc(c->batch, len);
+        if (!n) {
+            credit_refund(c, 0, (int64_t) len);
+            c->current_subject = NULL;
+            return;
+        }
+        c->batch = n;
+        c->batch_cap = len;
+    }
+    c->in_batch = 1;
+}
+
+// Descomprimir el lote en curso en c->unz; devuelve su largo o -1 si está mal formado
+static long unpack_batch(Client *c) {
+    size_t raw = v2_get_u32((const unsigned char *) c->batch);
+    if (raw > MAX_BATCH_BYTES) return -1;
+    if (raw > c->unz_cap) {
+        char *n = (char *) realloc(c->unz, raw);
+        if (!n) return -1;
+        c->unz = n;
+        c->unz_cap = raw;
+    }
+    if (lz4_decompress(c->batch + V2_ZBATCH_HDR, c->batch_len - V2_ZBATCH_HDR, c->unz, raw) < 0) return -1;
+    return (long) raw;
+}
+
+// Indica si cada registro de un lote entra en un segmento del log (si no, el lote entero se rechaza
+// antes de repartir nada, igual que un PUBLISH demasiado grande)
+static int batch_fits_log(const Subject *subject, const char *body, size_t blen) {
+    const unsigned char *p = (const unsigned char *) body;
+    for (size_t off = 0; off + V2_BATCH_REC_HDR <= blen;) {
+        size_t rlen = v2_get_u32(p + off);
+        off += V2_BATCH_REC_HDR;
+        if (rlen > blen - off) break; // truncado: lo informa finish_batch()
+        if (!dlog_fits(dlog, subject->name, rlen)) return 0;
+        off += rlen;
+    }
+    return 1;
+}
+
+// Repartir los mensajes de un lote completo: un broadcast por registro y, si hay suscriptores con
+// compresión, el lote comprimido para todos ellos
+static void finish_batch(Client *c) {
+    const char *body = c->batch;
+    size_t blen = c->batch_len;
+    if (c->batch_z) {
+        long raw = unpack_batch(c);
+        if (raw < 0) {
+            credit_refund(c, 0, (int64_t) blen);
+            send_error(c, "ERR malformed batch\n");
+            c->in_batch = 0;
+            c->batch_len = 0;
+            return;
+        }
+        // el saldo cuenta los registros sin comprimir, como los descuenta el publicador
+        credit_charge(c, 0, raw - (int64_t) blen);
+        body = c->unz;
+        blen = (size_t) raw;
+    }
+    if (retained(c->current_subject) && dlog && !batch_fits_log(c->current_subject, body, blen)) {
+        credit_refund(c, 0, (int64_t) blen);
+        send_error(c, "ERR payload larger than a log segment\n");
+        c->in_batch = 0;
+        c->batch_len = 0;
+        return;
+    }
+    MsgBuf *z = zbatch_new(c, body, blen);
+    const unsigned char *p = (const unsigned char *) body;
+    size_t off = 0, held = 0; // held: bytes de payload que devuelven los mensajes al liberarse
+    while (off + V2_BATCH_REC_HDR <= blen) {
+        size_t rlen = v2_get_u32(p + off);
+        off += V2_BATCH_REC_HDR;
+        if (rlen > blen - off) break; // registro truncado
+        MsgBuf *m = msg_alloc(c->current_subject, rlen);
+        if (m) {
+            memcpy(m->payload, body + off, rlen);
+            m->ready = rlen;
+            credit_charge(c, 1, 0);
+            credit_hold(c, m);
+            held += rlen;
+            if (z) {
+                m->zmode = ZM_PART;
+                if (z->parts) {
+                    msg_ref(m); // el crédito vuelve cuando se liberen el registro y el lote
+                    z->parts[z->nparts++] = m;
+                }
+            }
+            broadcast_message(c->current_subject, m);
+        }
+        c->msgs_in++;
+        off += rlen;
+    }
+    credit_refund(c, 0, (int64_t) (blen - held)); // cabeceras de los registros y lo descartado
+    if (z) broadcast_zbatch(c->current_subject, z);
+    if (off != blen) send_error(c, "ERR malformed batch\n");
+    c->in_batch = 0;
+    c->batch_len = 0;
+}
+
+// Empezar a repartir el PUBLISH en curso antes de que llegue todo el payload: la cabecera ya lleva el
+// largo final, así cada suscriptor recibe un único frame que se completa a medida que llega. Solo los
+// suscriptores de este shard; los demás shards reciben el mensaje completo al terminar.
+static void start_cut(Client *c) {
+    msg_seal(c->pending, c->current_subject, 0);
+    c->cut = 1;
+    (void) pick_members(c->current_subject, c->pending);
+    deliver_local(c->current_subject, c->pending);
+    deliver_picks(c->pending, 0);
+}
+
+// Terminó de llegar un GMSG de una ruta: el broker de origen eligió a este para el grupo 'key' ("<tema
+// del grupo> <grupo>") y el mensaje va a uno de sus miembros locales, a nadie más
+static void finish_group_message(Subject *subject, MsgBuf *m, char *key) {
+    char *name = strchr(key, ' ');
+    Client *c = NULL;
+    if (name && atomic_load_explicit(&qgroups_n, memory_order_relaxed)) {
+        *name++ = '\0';
+        pthread_mutex_lock(&qgroups_lock);
+        QGroup *g = qgroup_find(qgroups, key, name);
+        if (g && (m->picks = (GroupPick *) msgpool_alloc(shard->pool, sizeof(GroupPick))) &&
+            (c = (Client *) qgroup_pick(g, group_policy, member_queued, local_member)))
+            m->picks[m->npicks++] = (GroupPick){g, c, c->shard_id};
+        pthread_mutex_unlock(&qgroups_lock);
+    }
+    if (!c) {
+        counter_add(&shard->stats.group_lost, 1); // el último miembro se fue mientras viajaba
+        msg_unref(m);
+        return;
+    }
+    m->group_only = 1;
+    msg_seal(m, subject, 0);
+    deliver_picks(m, 0);
+    route_to_peers(subject, m);
+    msg_unref(m);
+}
+
+// Terminó de llegar el payload del PUBLISH en curso
+static void finish_publish(Client *c) {
+    MsgBuf *m = c->pending;
+    Subject *subject = c->current_subject;
+    c->pending = NULL;
+    c->msgs_in++;
+    if (c->gmsg[0]) {
+        finish_group_message(subject, m, c->gmsg);
+        c->gmsg[0] = '\0';
+        return;
+    }
+    if (!c->cut) {
+        broadcast_message(subject, m);
+        return;
+    }
+    c->cut = 0;
+    count_publish(subject, m->plen);
+    cut_progress(subject, m);
+    deliver_picks(m, 1); // las rutas elegidas esperaban el payload completo
+    route_to_peers(subject, m);
+    msg_unref(m);
+}
+
+// Descartar el PUBLISH en curso (el publicador se desconectó). Un corte directo ya encolado se marca
+// abortado: quien no empezó a enviarlo lo salta y quien ya envió una parte se desconecta.
+static void abort_publish(Client *c) {
+    if (!c->pending) return;
+    if (c->cut) {
+        c->pending->aborted = 1;
+        cut_progress(c->current_subject, c->pending);
+        c->cut = 0;
+    }
+    msg_unref(c->pending);
+    c->pending = NULL;
+}
+
+// Preparar la recepción del payload de un PUBLISH de 'len' bytes: el mensaje se reserva completo y el
+// payload se lee directo en su buffer. Sin tema (o demasiado grande) el payload se descarta.
+static void start_publish(Client *c, Subject *subject, size_t len) {
+    c->current_subject = NULL;
+    c->want_payload = len;
+    credit_charge(c, 1, (int64_t) len);
+    if (subject && len > MAX_PAYLOAD_BYTES) {
+        send_error(c, "ERR payload too large\n");
+        subject = NULL;
+    } else if (subject && retained(subject) && dlog && !dlog_fits(dlog, subject->name, len)) {
+        send_error(c, "ERR payload larger than a log segment\n");
+        subject = NULL;
+    }
+    if (!subject || !(c->pending = msg_alloc(subject, len))) {
+        credit_refund(c, 1, (int64_t) len); // el payload se descarta: no retiene nada
+        c->gmsg[0] = '\0';
+        return;
+    }
+    credit_hold(c, c->pending);
+    c->pending->routed = c->role == ROLE_ROUTE;
+    c->current_subject = subject;
+    if (len == 0) {
+        finish_publish(c);
+        c->current_subject = NULL;
+    } else if (cut_through_min && len >= cut_through_min && !retained(subject) && !c->gmsg[0]) {
+        start_cut(c); // con retención la cabecera necesita la secuencia, que se asigna al final
+    }
+}
+
+// Dónde va el próximo trozo de payload: el cuerpo del lote, el buffer del mensaje en curso o, si se
+// descarta, el buffer del shard. '*room' = bytes que se pueden escribir ahí.
+static char *payload_dst(Client *c, size_t *room) {
+    *room = c->want_payload;
+    if (c->in_batch) return c->batch + c->batch_len;
+    if (c->pending) return c->pending->payload + c->pending->ready;
+    if (*room > sizeof(shard->discard)) *room = sizeof(shard->discard);
+    return shard->discard;
+}
+
+// Contar 'n' bytes de payload ya escritos en payload_dst(); al completarse se reparte el mensaje
+static void payload_arrived(Client *c, size_t n) {
+    if (c->in_batch) {
+        c->batch_len += n;
+    } else if (c->pending) {
+        c->pending->ready += n;
+        if (c->cut) cut_progress(c->current_subject, c->pending); // los suscriptores pueden enviar lo nuevo
+    }
+    c->want_payload -= n; // actualizar bytes pendientes
+    if (c->want_payload == 0) {
+        if (c->in_batch) finish_batch(c);
+        else if (c->pending) finish_publish(c);
+        c->current_subject = NULL; // resetear tema actual
+    }
+}
+
+// Consumir bytes de payload que llegaron en el buffer de líneas de control
+static void take_payload(Client *c, const char *data, size_t n) {
+    while (n > 0) {
+        size_t room;
+        char *dst = payload_dst(c, &room);
+        size_t k = n < room ? n : room;
+        memcpy(dst, data, k);
+        payload_arrived(c, k);
+        data += k;
+        n -= k;
     }
-    // agregar al inicio de la lista
-    SubjectNode *n = (SubjectNode *) calloc(1, sizeof(SubjectNode)); // inicializado a 0
-    strncpy(n->name, subject, sizeof(n->name)-1); // asegurar null-terminación
-    n->next = c->subs; // insertar al inicio
-    c->subs = n; // actualizar cabeza de lista
 }
 
-// Verificar si el cliente está suscrito a un tema
-static int sub_has_subject(Client *c, const char *subject) {
-    // buscar en la lista
-    for (SubjectNode *n = c->subs; n; n = n->next)
-        // strcmp devuelve 0 si son iguales (strcmp es una comparación de strings)
-        if (strcmp(n->name, subject) == 0) return 1;
+// Buscar la ruta viva hacia el broker 'peer' (con routes_lock tomado)
+static Route *route_find(const char *peer) {
+    for (Route *r = routes; r; r = r->next)
+        if (!r->dead && strcmp(r->peer, peer) == 0) return r;
+    return NULL;
+}
+
+// Registrar la conexión como ruta hacia 'peer' y encolarle todo el interés local actual. Con dos rutas
+// al mismo broker ambos lados se quedan con la misma: la que inició el de id menor (entre dos del mismo
+// iniciador, la nueva, porque la vieja quedó a medio cerrar). Devuelve -1 si se descarta esta.
+static int route_register(Client *c, const char *peer, int outbound) {
+    Route *r = (Route *) calloc(1, sizeof(Route));
+    if (!r) return -1;
+    pthread_mutex_lock(&routes_lock);
+    Route *old = route_find(peer);
+    if (old && old->outbound != outbound && outbound != (strcmp(server_id, peer) < 0)) {
+        pthread_mutex_unlock(&routes_lock);
+        free(r);
+        return -1;
+    }
+    if (old) {
+        old->dead = 1;
+        route_kick(&shards[old->shard]);
+    }
+    r->c = c;
+    r->shard = shard->id;
+    r->outbound = outbound;
+    snprintf(r->peer, sizeof(r->peer), "%.*s", ROUTE_ID_LEN, peer);
+    r->next = routes;
+    routes = r;
+    for (size_t b = 0; b < interest.nbuckets; b++)
+        for (Subject *s = interest.buckets[b]; s; s = s->next)
+            if (s->data) route_queue(r, "RS+", s->name);
+    for (size_t b = 0; b < group_interest.nbuckets; b++)
+        for (Subject *s = group_interest.buckets[b]; s; s = s->next)
+            if (s->data) route_queue(r, "RG+", s->name);
+    c->route = r;
+    pthread_mutex_unlock(&routes_lock);
+    printf("Route to %s up (%s).\n", peer, outbound ? c->target->spec : "inbound");
+    fflush(stdout);
     return 0;
 }
 
-// Liberar la lista de temas
-static void free_subs(SubjectNode *n) {
-    // recorrer y liberar cada nodo
-    while (n) {
-        SubjectNode *t = n->next; // guardar siguiente
-        free(n); // liberar nodo actual
-        n = t; // avanzar
+// Sacar la conexión del registro de rutas al cerrarla; su --route vuelve a quedar libre para reintentar
+static void route_closed(Client *c) {
+    if (!c->route && !c->target) return;
+    pthread_mutex_lock(&routes_lock);
+    if (c->route) {
+        for (Route **pp = &routes; *pp; pp = &(*pp)->next) {
+            if (*pp == c->route) {
+                *pp = c->route->next;
+                break;
+            }
+        }
+        if (!c->route->dead) printf("Route to %s down.\n", c->route->peer);
+        free(c->route->out);
+        free(c->route);
     }
+    if (c->target) c->target->busy = 0;
+    pthread_mutex_unlock(&routes_lock);
+    fflush(stdout);
+    c->route = NULL;
+    c->target = NULL;
 }
 
-// Liberar todos los recursos del cliente y cerrar su socket
-static void close_client(Client *c) {
-    if (c->fd > 0) close(c->fd); // cerrar socket si está abierto
-    c->fd = -1; // marcar como cerrado
-    c->role = ROLE_UNKNOWN; // resetear rol
-    c->ibuf_len = 0; // resetear buffer de entrada
-    c->want_payload = 0; // resetear contador de payload pendiente
-    c->current_subject[0] = '\0'; // resetear tema actual
-    free_subs(c->subs); // liberar lista de temas
-    c->subs = NULL; // resetear puntero a lista
+// Respuesta "ROUTE <id>" a una ruta saliente: ahora se conoce el broker del otro lado
+static void route_answered(Client *c, const char *peer) {
+    RouteTarget *t = c->target;
+    int self = strcmp(peer, server_id) == 0;
+    pthread_mutex_lock(&routes_lock);
+    snprintf(t->peer, sizeof(t->peer), "%.*s", ROUTE_ID_LEN, peer);
+    t->self = self;
+    pthread_mutex_unlock(&routes_lock);
+    if (self) {
+        fprintf(stderr, "route %s points to this broker, ignored\n", t->spec);
+        close_client(c);
+    } else if (route_register(c, peer, 1) < 0) {
+        close_client(c); // el otro lado se queda con la ruta que inició él
+    }
+}
+
+// Siguiente palabra de una línea de ruta, terminada en '\0'; NULL si no hay o pasa de 'max' bytes. Los
+// temas de una ruta pueden ser tan largos como en v2 (V2_MAX_SUBJECT), así que no se parsea con sscanf.
+static char *route_word(char **cur, size_t max) {
+    char *w = *cur + strspn(*cur, " ");
+    size_t n = strcspn(w, " ");
+    if (n == 0 || n > max) return NULL;
+    *cur = w[n] ? w + n + 1 : w + n;
+    w[n] = '\0';
+    return w;
+}
+
+// Largo del payload al final de un MESSAGE/GMSG de ruta; -1 si no es un número o sobra algo después
+static int route_len(char *w, const char *rest, size_t *len) {
+    char *end;
+    if (!w || *w < '0' || *w > '9' || *rest) return -1;
+    unsigned long long v = strtoull(w, &end, 10);
+    if (*end) return -1;
+    *len = (size_t) v;
+    return 0;
 }
 
-// Enviar un mensaje a todos los suscriptores del tema
-static void broadcast_message(const char *subject, const char *payload, size_t len) {
-    char header[256]; // cabecera del mensaje (string)
-    int hlen = snprintf(header, sizeof(header), "MESSAGE %s %zu\n", subject, len); // construir cabecera
-    // recorrer todos los clientes
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        Client *c = &clients[i]; // puntero al cliente actual
-        // enviar solo si es suscriptor y está suscrito al tema
-        if (c->fd > 0 && c->role == ROLE_SUB && sub_has_subject(c, subject)) {
-            // enviar cabecera y payload
-            (void) send(c->fd, header, (size_t) hlen, 0);
-            if (len > 0) (void) send(c->fd, payload, len, 0);
+// Manejar una línea de una ruta: lo publicado en el otro broker, su interés y (si la inició este) la
+// respuesta al handshake
+static void handle_route_line(Client *c, char *line) {
+    char *cur = line;
+    char *cmd = route_word(&cur, 31);
+    char *subject = route_word(&cur, V2_MAX_SUBJECT); // tema o patrón
+    if (!cmd || !subject) return;
+    if (strcmp(cmd, "MESSAGE") == 0 || strcmp(cmd, "GMSG") == 0) {
+        int gmsg = cmd[0] == 'G';
+        char *gsubject = gmsg ? route_word(&cur, V2_MAX_SUBJECT) : NULL;
+        char *group = gmsg ? route_word(&cur, QGROUP_MAX_NAME - 1) : NULL;
+        char *lenw = route_word(&cur, 20);
+        size_t len;
+        if ((gmsg && (!gsubject || !group)) || route_len(lenw, cur, &len) < 0) {
+            // sin el largo no se puede saltear el payload: seguir leería el payload como líneas
+            fprintf(stderr, "route: malformed %s header, closing the route\n", cmd);
+            close_client(c);
+            return;
         }
+        counter_add(&shard->stats.route_in, 1);
+        // un GMSG va a un miembro de un grupo de este broker, elegido por el de origen
+        if (gmsg) snprintf(c->gmsg, sizeof(c->gmsg), "%s %s", gsubject, group);
+        start_publish(c, subject_is_pattern(subject) ? NULL : publish_subject(subject), len);
+        return;
+    }
+    if (c->route && (strcmp(cmd, "RG+") == 0 || strcmp(cmd, "RG-") == 0)) {
+        // el otro broker tiene (o ya no) miembros del grupo: la ruta es un miembro más
+        char *group = route_word(&cur, QGROUP_MAX_NAME - 1);
+        if (!group) return;
+        if (cmd[2] == '+') (void) join_group(c, subject, group);
+        else leave_group(c, subject, group);
+    } else if (c->route && strcmp(cmd, "RS+") == 0) {
+        if (subject_is_pattern(subject)) (void) add_pattern(c, subject);
+        else (void) add_subscription(c, subject);
+    } else if (c->route && strcmp(cmd, "RS-") == 0) {
+        remove_subscription(c, subject);
+    } else if (c->target && !c->route && strcmp(cmd, "ROUTE") == 0) {
+        route_answered(c, subject);
     }
+    // lo demás (un ERR del otro broker) se ignora: una ruta no responde
 }
 
 // Manejar una línea de control recibida del cliente
@@ -118,18 +2452,36 @@ static void handle_control_line(Client *c, const char *line) {
     memcpy(tmp, line, L); // copiar línea
     tmp[L] = '\0'; // asegurar null-terminación
 
-    // Si el rol es desconocido, esperar "PUB" o "SUB"
+    // Si el rol es desconocido, esperar "PUB" o "SUB" (o "PUB2" / "SUB2" para el framing binario)
     if (c->role == ROLE_UNKNOWN) {
-        if (strcmp(tmp, "PUB") == 0) {
+        // después del rol puede venir la compresión ("SUB COMPRESS lz4"); en ROUTE va el id
+        char *opts = strncmp(tmp, "ROUTE ", 6) == 0 ? NULL : strchr(tmp, ' ');
+        if (opts) *opts++ = '\0';
+        if (strcmp(tmp, "PUB") == 0 || strcmp(tmp, "PUB2") == 0) {
             // rol publicador
             c->role = ROLE_PUB; // inicializar estado de publicador
-        } else if (strcmp(tmp, "SUB") == 0) {
+            c->proto = tmp[3] == '2' ? 2 : 1;
+            credit_start(c); // ventana inicial (con control de flujo)
+            if (opts) negotiate_codec(c, opts);
+        } else if (strcmp(tmp, "SUB") == 0 || strcmp(tmp, "SUB2") == 0) {
             // rol suscriptor
             c->role = ROLE_SUB; // inicializar estado de suscriptor
+            c->proto = tmp[3] == '2' ? 2 : 1;
+            if (opts) negotiate_codec(c, opts);
+        } else if (strncmp(tmp, "ROUTE ", 6) == 0 && tmp[6]) {
+            // ruta entrante desde otro broker: se responde con el id propio y se registra
+            c->role = ROLE_ROUTE;
+            char peer[ROUTE_ID_LEN + 1], reply[ROUTE_ID_LEN + 8];
+            snprintf(peer, sizeof(peer), "%.*s", ROUTE_ID_LEN, tmp + 6);
+            snprintf(reply, sizeof(reply), "ROUTE %s\n", server_id);
+            send_reply(c, reply);
+            // Hacia sí mismo no se registra: el que llamó ve su propio id y cierra. Si se descarta por
+            // duplicada, el otro lado toma la misma decisión y también la cierra.
+            if (strcmp(peer, server_id) != 0) (void) route_register(c, peer, 0);
         } else {
             // línea inválida
-            const char *err = "ERR unknown role; send PUB or SUB\n";
-            (void) send(c->fd, err, strlen(err), 0); // notificar error
+            const char *err = "ERR unknown role; send PUB, SUB, PUB2 or SUB2\n";
+            send_reply(c, err); // notificar error
         }
         return;
     }
@@ -138,65 +2490,324 @@ static void handle_control_line(Client *c, const char *line) {
         // manejar línea de suscriptor
         char cmd[32]; // comando (string)
         char subject[128]; // tema (string)
-        if (sscanf(tmp, "%31s %127s", cmd, subject) == 2 && strcmp(cmd, "SUBSCRIBE") == 0) {
+        char kw[8], spec[QGROUP_MAX_NAME]; // "FROM <spec>" o "GROUP <name>" opcional
+        int fields = sscanf(tmp, "%31s %127s %7s %63s", cmd, subject, kw, spec);
+        int is_sub = fields >= 2 && strcmp(cmd, "SUBSCRIBE") == 0;
+        int group = fields == 4 && strcmp(kw, "GROUP") == 0, from = fields == 4 && strcmp(kw, "FROM") == 0;
+        if (is_sub && group) {
+            // grupo de cola: cada mensaje del tema va a un solo miembro
+            send_reply(c, join_group(c, subject, spec) < 0 ? "ERR invalid pattern\n" : "OK\n");
+        } else if (is_sub && (fields == 2 || from)) {
             // parsear línea con sscanf
-            add_subscription(c, subject); // agregar tema a la lista
+            Subject *s = NULL;
+            if (subject_is_pattern(subject)) {
+                if (from) {
+                    // lo retenido es por tema concreto: un patrón no tiene desde dónde reproducir
+                    send_reply(c, "ERR FROM requires a subject without wildcards\n");
+                    return;
+                }
+                if (add_pattern(c, subject) < 0) {
+                    send_reply(c, "ERR invalid pattern\n");
+                    return;
+                }
+            } else {
+                s = add_subscription(c, subject); // agregar tema a la lista
+            }
             const char *ok = "OK\n"; // confirmar suscripción
-            (void) send(c->fd, ok, strlen(ok), 0); // enviar ACK
+            send_reply(c, ok); // enviar ACK
+            if (s && from) replay(c, s, spec); // lo retenido, antes de lo nuevo
         } else {
-            // línea inválida
-            const char *err = "ERR expected: SUBSCRIBE <subject>\n"; //
-            (void) send(c->fd, err, strlen(err), 0); // notificar error
+            // línea inválida (también una palabra clave desconocida o sin argumento después del tema)
+            const char *err = "ERR expected: SUBSCRIBE <subject> [FROM <seq>|GROUP <name>]\n"; //
+            send_reply(c, err); // notificar error
         }
     } else if (c->role == ROLE_PUB) {
         // manejar línea de publicador
         char cmd[32]; // comando (string)
         char subject[128]; // tema (string)
         size_t len = 0; // longitud del payload (size_t es un entero sin signo)
-        if (sscanf(tmp, "%31s %127s %zu", cmd, subject, &len) == 3 && strcmp(cmd, "PUBLISH") == 0) {
-            // parsear línea
-            strncpy(c->current_subject, subject, sizeof(c->current_subject)-1); // guardar tema actual
-            c->want_payload = len; // establecer bytes de payload pendientes
+        char codec[8]; // PUBLISH_BATCH comprimido: códec negociado
+        int fields = sscanf(tmp, "%31s %127s %zu %7s", cmd, subject, &len, codec);
+        if (fields >= 3 && subject_is_pattern(subject)) {
+            // los comodines solo valen para suscribirse; el payload se descarta
+            send_reply(c, "ERR cannot publish to a pattern\n");
+            if (strcmp(cmd, "PUBLISH") == 0) start_publish(c, NULL, len);
+            else if (strcmp(cmd, "PUBLISH_BATCH") == 0) start_batch(c, NULL, len, 0);
+        } else if (fields >= 3 && strcmp(cmd, "PUBLISH") == 0) {
+            // parsear línea: el tema se resuelve una sola vez y el payload llega a su propio buffer
+            Subject *s = publish_subject(subject);
+            if (!s) counter_add(&shard->stats.unrouted, 1);
+            start_publish(c, s, len);
+        } else if (fields >= 3 && strcmp(cmd, "PUBLISH_BATCH") == 0) {
+            // el cuerpo se reparte cuando llega completo; con un códec distinto del negociado se descarta
+            int z = fields == 4;
+            Subject *s = publish_subject(subject);
+            if (!s) counter_add(&shard->stats.unrouted, 1);
+            if (z && c->codec != CODEC_NONE && strcmp(codec, codec_names[c->codec]) != 0) {
+                send_reply(c, "ERR unknown codec\n");
+                s = NULL;
+            }
+            start_batch(c, s, len, z);
         } else {
             // línea inválida
             const char *err = "ERR expected: PUBLISH <subject> <len>\\n<payload>\n"; // mensaje de error
-            (void) send(c->fd, err, strlen(err), 0); // notificar error
+            send_reply(c, err); // notificar error
+        }
+    } else if (c->role == ROLE_ROUTE) {
+        handle_route_line(c, tmp);
+    }
+}
+
+// Asociar un id de tema elegido por un publicador v2; NULL si el id está fuera de rango o no hay memoria
+static PubId *bind_pub_id(Client *c, uint32_t id, const char *name) {
+    if (id >= MAX_PUB_IDS) return NULL;
+    if (id >= c->pub_ids_cap) {
+        size_t ncap = c->pub_ids_cap ? c->pub_ids_cap : 16;
+        while (ncap <= id) ncap *= 2;
+        PubId *n = (PubId *) realloc(c->pub_ids, ncap * sizeof(PubId));
+        if (!n) return NULL;
+        memset(n + c->pub_ids_cap, 0, (ncap - c->pub_ids_cap) * sizeof(PubId));
+        c->pub_ids = n;
+        c->pub_ids_cap = ncap;
+    }
+    PubId *p = &c->pub_ids[id];
+    if (p->name && strcmp(p->name, name) == 0) return p; // el publicador repite el nombre
+    char *copy = strdup(name);
+    if (!copy) return NULL;
+    free(p->name);
+    *p = (PubId){copy, NULL, 0};
+    return p;
+}
+
+// Tema de un id asociado; NULL mientras no le interese a nadie (se vuelve a mirar cuando aparece un
+// interesado nuevo)
+static Subject *pub_id_subject(PubId *p) {
+    if (p->s) return p->s;
+    unsigned gen = atomic_load_explicit(&interest_gen, memory_order_acquire);
+    if (p->gen == gen) return NULL;
+    p->s = publish_subject(p->name);
+    p->gen = gen;
+    return p->s;
+}
+
+// Procesar un frame v2 al inicio de [start, end). Devuelve los bytes consumidos (cabecera y nombre;
+// el payload de un PUBLISH queda en want_payload) o 0 si el frame todavía está incompleto.
+static size_t handle_frame(Client *c, const char *start, const char *end) {
+    if ((size_t) (end - start) < V2_HDR_LEN) return 0;
+    V2Header h = v2_decode((const unsigned char *) start);
+    if (h.subject_len > V2_MAX_SUBJECT) {
+        send_error(c, "ERR subject too long\n");
+        close_client(c); // no se puede resincronizar el stream
+        return 0;
+    }
+    size_t need = V2_HDR_LEN + h.subject_len;
+    if ((size_t) (end - start) < need) return 0;
+    char name[V2_MAX_SUBJECT + 1];
+    memcpy(name, start + V2_HDR_LEN, h.subject_len);
+    name[h.subject_len] = '\0';
+
+    if (c->role == ROLE_PUB && (h.opcode == V2_PUBLISH || h.opcode == V2_PUBLISH_BATCH)) {
+        Subject *s = NULL;
+        PubId *pid = NULL;
+        int deep = h.subject_len > 0 && !subject_levels_ok(name);
+        int pattern = !deep && h.subject_len > 0 && subject_is_pattern(name);
+        if (pattern || deep) {
+            // los comodines solo valen para suscribirse; el id deja de apuntar a un tema anterior
+            if (h.subject_id < c->pub_ids_cap) {
+                free(c->pub_ids[h.subject_id].name);
+                c->pub_ids[h.subject_id] = (PubId){NULL, NULL, 0};
+            }
+        } else if (h.subject_len > 0) {
+            pid = bind_pub_id(c, h.subject_id, name); // primera vez: asociar el id del publicador al tema
+        } else if (h.subject_id < c->pub_ids_cap && c->pub_ids[h.subject_id].name) {
+            pid = &c->pub_ids[h.subject_id]; // camino rápido: solo el id
+        }
+        if (pid) s = pub_id_subject(pid);
+        if (deep) send_error(c, "ERR too many subject levels\n");
+        else if (pattern) send_error(c, "ERR cannot publish to a pattern\n");
+        else if (!pid) send_error(c, "ERR unknown subject id\n");
+        else if (!s) counter_add(&shard->stats.unrouted, 1);
+        if (h.opcode == V2_PUBLISH_BATCH) start_batch(c, s, h.payload_len, (h.flags & V2_FLAG_COMP) != 0);
+        else start_publish(c, s, h.payload_len); // sin tema, el payload se descarta
+    } else if (c->role == ROLE_SUB && h.opcode == V2_SUBSCRIBE && h.subject_len > 0 && !subject_levels_ok(name)) {
+        // más niveles de los que compara el trie (el payload, FROM o grupo, se descarta)
+        send_error(c, "ERR too many subject levels\n");
+        c->want_payload = h.payload_len;
+        c->current_subject = NULL;
+    } else if (c->role == ROLE_SUB && h.opcode == V2_SUBSCRIBE && h.subject_len > 0 && (h.flags & V2_FLAG_GROUP)) {
+        // Grupo de cola: el payload es el nombre del grupo; se espera el frame completo.
+        char group[QGROUP_MAX_NAME];
+        if (h.payload_len == 0 || h.payload_len >= QGROUP_MAX_NAME) {
+            send_error(c, "ERR invalid group name\n");
+            c->want_payload = h.payload_len;
+        } else {
+            if ((size_t) (end - start) < need + h.payload_len) return 0;
+            memcpy(group, start + need, h.payload_len);
+            group[h.payload_len] = '\0';
+            need += h.payload_len;
+            // el nombre viaja en las líneas RG+ / GMSG de las rutas: una sola palabra
+            Subject *s = subject_is_pattern(name) ? NULL : intern_subject(name);
+            if (strlen(group) != h.payload_len || strpbrk(group, " \t\r\n")) {
+                send_error(c, "ERR invalid group name\n");
+            } else if (join_group(c, name, group) < 0 || (!s && !subject_is_pattern(name))) {
+                send_error(c, "ERR subscribe failed\n");
+            } else {
+                // como en un SUBSCRIBE: el id del tema (o SUBJECT_NO_ID si es un patrón)
+                if (s) mark_known(c, s->id);
+                unsigned char f[V2_HDR_LEN + V2_MAX_SUBJECT];
+                v2_encode(f, V2_OK, 0, h.subject_len, s ? s->id : SUBJECT_NO_ID, 0);
+                memcpy(f + V2_HDR_LEN, name, h.subject_len);
+                send_raw(c, f, V2_HDR_LEN + h.subject_len);
+            }
+        }
+        c->current_subject = NULL;
+    } else if (c->role == ROLE_SUB && h.opcode == V2_SUBSCRIBE && h.subject_len > 0 && subject_is_pattern(name)) {
+        // Patrón: el OK no trae id; cada tema concreto se anuncia antes de su primer MESSAGE.
+        if (add_pattern(c, name) < 0) {
+            send_error(c, "ERR invalid pattern\n");
+        } else {
+            unsigned char f[V2_HDR_LEN + V2_MAX_SUBJECT];
+            v2_encode(f, V2_OK, 0, h.subject_len, SUBJECT_NO_ID, 0);
+            memcpy(f + V2_HDR_LEN, name, h.subject_len);
+            send_raw(c, f, need);
         }
+        c->want_payload = h.payload_len;
+        c->current_subject = NULL;
+    } else if (c->role == ROLE_SUB && h.opcode == V2_SUBSCRIBE && h.subject_len > 0) {
+        // El payload, si viene, es el argumento de FROM: se espera el frame completo.
+        char spec[RETAIN_MAX_SPEC];
+        size_t slen = h.payload_len < RETAIN_MAX_SPEC ? h.payload_len : 0;
+        if ((size_t) (end - start) < need + slen) return 0;
+        memcpy(spec, start + need, slen);
+        spec[slen] = '\0';
+        Subject *s = add_subscription(c, name);
+        if (!s) {
+            send_error(c, "ERR subscribe failed\n");
+        } else {
+            // el OK devuelve el id con el que llegarán los MESSAGE de este tema
+            mark_known(c, s->id);
+            unsigned char f[V2_HDR_LEN + V2_MAX_SUBJECT];
+            v2_encode(f, V2_OK, 0, h.subject_len, s->id, 0);
+            memcpy(f + V2_HDR_LEN, name, h.subject_len);
+            send_raw(c, f, need);
+            if (slen) replay(c, s, spec);
+        }
+        c->want_payload = h.payload_len - slen; // un payload que no es un FROM válido se descarta
+        c->current_subject = NULL;
+        need += slen;
+    } else {
+        send_error(c, "ERR unexpected frame\n");
+        c->want_payload = h.payload_len;
+        c->current_subject = NULL;
     }
+    return need;
 }
 
 // Manejar datos legibles en el socket del cliente
 static void handle_readable(Client *c) {
     // Client es un puntero a la estructura del cliente
-    if (c->role == ROLE_PUB && c->want_payload > 0) {
-        // modo payload
-        static char pbuf[65536]; // buffer temporal para payload (static para no usar stack)
-        size_t toread = c->want_payload < sizeof(pbuf) ? c->want_payload : sizeof(pbuf); // bytes a leer
-        ssize_t n = recv(c->fd, pbuf, toread, 0); // leer del socket
+    if (c->want_payload > 0) {
+        // modo payload: leer directo al buffer del mensaje (o del lote), sin copia intermedia
+        size_t room;
+        char *dst = payload_dst(c, &room);
+        ssize_t n = recv(c->fd, dst, room, 0); // leer del socket
         if (n <= 0) {
-            // error o conexión cerrada
+            // error o conexión cerrada (EAGAIN solo indica que no hay datos todavía)
+            if (n < 0 && would_block()) return;
             close_client(c);
             return;
         }
-        broadcast_message(c->current_subject, pbuf, (size_t) n); // reenviar a suscriptores
-        c->want_payload -= (size_t) n; // actualizar bytes pendientes
-        if (c->want_payload == 0) c->current_subject[0] = '\0'; // resetear tema actual
+        c->bytes_in += (uint64_t) n;
+        payload_arrived(c, (size_t) n);
         return;
     }
 
     ssize_t n = recv(c->fd, c->ibuf + c->ibuf_len, sizeof(c->ibuf) - 1 - c->ibuf_len, 0); // leer línea de control
     if (n <= 0) {
         // error o conexión cerrada
+        if (n < 0 && would_block()) return;
         close_client(c);
         return;
     }
+    c->bytes_in += (uint64_t) n;
     c->ibuf_len += (size_t) n; // actualizar longitud del buffer
+    process_input(c);
+}
+
+// Guardar lo recibido por el backend uring mientras el publicador está pausado
+static void hold_input(Client *c, const char *data, size_t n) {
+    if (c->held_len + n > c->held_cap) {
+        size_t ncap = c->held_cap ? c->held_cap * 2 : URING_BUF_SIZE;
+        while (ncap < c->held_len + n) ncap *= 2;
+        char *b = (char *) realloc(c->held, ncap);
+        if (!b) {
+            close_client(c); // sin memoria no se puede seguir el stream
+            return;
+        }
+        c->held = b;
+        c->held_cap = ncap;
+    }
+    memcpy(c->held + c->held_len, data, n);
+    c->held_len += n;
+}
+
+// Procesar bytes que el backend uring ya recibió en un buffer provisto: el payload va a su destino y
+// el resto pasa por el buffer de líneas de control, igual que con recv()
+static void client_input(Client *c, const char *data, size_t n) {
+    while (n > 0 && c->fd >= 0) {
+        if (c->paused && c->want_payload == 0) {
+            hold_input(c, data, n); // sin crédito: se procesa al reanudar
+            return;
+        }
+        if (c->want_payload > 0) {
+            size_t k = n < c->want_payload ? n : c->want_payload;
+            take_payload(c, data, k);
+            data += k;
+            n -= k;
+            continue;
+        }
+        size_t room = sizeof(c->ibuf) - 1 - c->ibuf_len;
+        if (room == 0) {
+            close_client(c); // línea de control demasiado larga (como recv() con 0 bytes)
+            return;
+        }
+        size_t k = n < room ? n : room;
+        memcpy(c->ibuf + c->ibuf_len, data, k);
+        c->ibuf_len += k;
+        data += k;
+        n -= k;
+        process_input(c);
+    }
+}
+
+// Procesar lo acumulado en el buffer de líneas de control
+static void process_input(Client *c) {
     c->ibuf[c->ibuf_len] = '\0'; // asegurar null-terminación
 
     char *start = c->ibuf; // puntero al inicio del buffer
-    char *nl; // puntero al salto de línea
-    // procesar todas las líneas completas en el buffer
-    while ((nl = memchr(start, '\n', (c->ibuf + c->ibuf_len) - start))) {
+    char *end = c->ibuf + c->ibuf_len; // fin de los datos válidos
+    // procesar todas las líneas completas y los payloads que haya en el buffer
+    while (start < end) {
+        if (c->want_payload == 0 && credit_pause(c)) break; // sin crédito: el resto espera en ibuf
+        if (c->want_payload > 0) {
+            // modo payload: copiar lo que ya llegó junto con las líneas de control
+            size_t avail = (size_t) (end - start);
+            size_t take = c->want_payload < avail ? c->want_payload : avail;
+            take_payload(c, start, take);
+            start += take;
+            if (c->fd < 0) return;
+            continue;
+        }
+        if (c->proto == 2) {
+            // framing binario: sin parseo de texto
+            size_t used = handle_frame(c, start, end);
+            if (c->fd < 0) return;
+            if (used == 0) break; // frame incompleto: esperar más datos
+            start += used;
+            continue;
+        }
+        char *nl = memchr(start, '\n', (size_t) (end - start)); // puntero al salto de línea
+        if (!nl) break; // línea incompleta: esperar más datos
         size_t linelen = (size_t) (nl - start + 1); // longitud de la línea incluyendo '\n'
         char line[MAX_LINE];
         memcpy(line, start, linelen);
@@ -204,40 +2815,789 @@ static void handle_readable(Client *c) {
         handle_control_line(c, line);
         start = nl + 1;
         if (c->fd < 0) return;
-        if (c->role == ROLE_PUB && c->want_payload > 0) break; // pasa a modo payload
     }
-    size_t left = (size_t) ((c->ibuf + c->ibuf_len) - start);
+    size_t left = (size_t) (end - start);
     memmove(c->ibuf, start, left);
     c->ibuf_len = left;
+}
 
-    if (c->role == ROLE_PUB && c->want_payload > 0 && c->ibuf_len > 0) {
-        size_t take = c->want_payload < c->ibuf_len ? c->want_payload : c->ibuf_len;
-        broadcast_message(c->current_subject, c->ibuf, take);
-        memmove(c->ibuf, c->ibuf + take, c->ibuf_len - take);
-        c->ibuf_len -= take;
-        c->want_payload -= take;
-        if (c->want_payload == 0) c->current_subject[0] = '\0';
-        if (c->want_payload > 0) return;
+// ---------------------------------------------------------------------------
+// Backend epoll: solo devuelve los descriptores listos, el costo por iteración
+// es proporcional a las conexiones activas y no al tamaño de la tabla.
+// ---------------------------------------------------------------------------
+
+static uint32_t ep_mask(int events) {
+    uint32_t m = 0;
+    if (events & EV_READ) m |= EPOLLIN | EPOLLRDHUP;
+    if (events & EV_WRITE) m |= EPOLLOUT;
+    return m;
+}
+
+static int ep_init(void) {
+    shard->ep_fd = epoll_create1(EPOLL_CLOEXEC);
+    return shard->ep_fd < 0 ? -1 : 0;
+}
+
+static int ep_ctl(int op, Handler *h, int events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ep_mask(events);
+    ev.data.ptr = h; // el callback se recupera directamente del evento
+    if (epoll_ctl(shard->ep_fd, op, h->fd, &ev) < 0) return -1;
+    h->events = events;
+    return 0;
+}
+
+static int ep_add(Handler *h, int events) { return ep_ctl(EPOLL_CTL_ADD, h, events); }
+
+static int ep_mod(Handler *h, int events) {
+    if (h->events == events) return 0; // evitar syscalls innecesarias
+    return ep_ctl(EPOLL_CTL_MOD, h, events);
+}
+
+static void ep_del(Handler *h) {
+    (void) epoll_ctl(shard->ep_fd, EPOLL_CTL_DEL, h->fd, NULL);
+    h->events = 0;
+}
+
+static int ep_wait(void) {
+    struct epoll_event evs[MAX_EVENTS];
+    int n = epoll_wait(shard->ep_fd, evs, MAX_EVENTS, -1);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    if (admin_port) shard->woke_ns = now_ns();
+    for (int i = 0; i < n; i++) {
+        Handler *h = (Handler *) evs[i].data.ptr;
+        int ready = 0;
+        if (evs[i].events & (EPOLLIN | EPOLLRDHUP)) ready |= EV_READ;
+        if (evs[i].events & EPOLLOUT) ready |= EV_WRITE;
+        if (evs[i].events & (EPOLLERR | EPOLLHUP)) ready |= EV_ERROR | EV_READ;
+        h->on_event(h, ready);
     }
+    return 0;
 }
 
-int main(int argc, char **argv) {
-    // Obtiene el puerto de los argumentos de línea de comandos, o usa el puerto por defecto.
-    int port = (argc > 1) ? atoi(argv[1]) : BROKER_PORT;
+static const Backend epoll_backend = {"epoll", ep_init, ep_add, ep_mod, ep_del, ep_wait, 0, 0};
 
-    // Evita que el programa termine si un cliente cierra la conexión mientras se le envía datos.
-    signal(SIGPIPE, SIG_IGN);
+// ---------------------------------------------------------------------------
+// Backend select: reconstruye los fd_set en cada iteración, limitado a FD_SETSIZE.
+// ---------------------------------------------------------------------------
+
+static int sel_init(void) {
+    shard->sel_handlers = (Handler **) calloc(FD_SETSIZE, sizeof(Handler *));
+    shard->sel_maxfd = -1;
+    return shard->sel_handlers ? 0 : -1;
+}
+
+static int sel_add(Handler *h, int events) {
+    if (h->fd < 0 || h->fd >= FD_SETSIZE) return -1;
+    shard->sel_handlers[h->fd] = h;
+    h->events = events;
+    if (h->fd > shard->sel_maxfd) shard->sel_maxfd = h->fd;
+    return 0;
+}
+
+static int sel_mod(Handler *h, int events) {
+    h->events = events;
+    return 0;
+}
+
+static void sel_del(Handler *h) {
+    if (h->fd >= 0 && h->fd < FD_SETSIZE) shard->sel_handlers[h->fd] = NULL;
+    h->events = 0;
+}
+
+static int sel_wait(void) {
+    fd_set rset, wset;
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    int maxfd = -1;
+    for (int fd = 0; fd <= shard->sel_maxfd; fd++) {
+        Handler *h = shard->sel_handlers[fd];
+        if (!h) continue;
+        if (h->events & EV_READ) FD_SET(fd, &rset);
+        if (h->events & EV_WRITE) FD_SET(fd, &wset);
+        maxfd = fd;
+    }
+    shard->sel_maxfd = maxfd;
+    int nready = select(maxfd + 1, &rset, &wset, NULL, NULL);
+    if (nready < 0) return errno == EINTR ? 0 : -1;
+    if (admin_port) shard->woke_ns = now_ns();
+    for (int fd = 0; fd <= maxfd && nready > 0; fd++) {
+        int ready = 0;
+        if (FD_ISSET(fd, &rset)) ready |= EV_READ;
+        if (FD_ISSET(fd, &wset)) ready |= EV_WRITE;
+        if (!ready) continue;
+        nready--;
+        Handler *h = shard->sel_handlers[fd];
+        if (h) h->on_event(h, ready);
+    }
+    return 0;
+}
+
+static const Backend select_backend = {"select", sel_init, sel_add, sel_mod, sel_del, sel_wait, FD_SETSIZE, 0};
+
+// ---------------------------------------------------------------------------
+// Callbacks de conexión
+// ---------------------------------------------------------------------------
+
+// Readiness de un cliente: leer mientras siga abierto
+static void on_client_event(Handler *h, int events) {
+    Client *c = (Client *) h;
+    if (c->fd < 0) return; // evento rezagado de un cliente ya cerrado
+    if ((events & EV_ERROR) && c->zerocopy) zc_reap(c); // notificaciones MSG_ZEROCOPY
+    if ((events & EV_WRITE) && flush_queue(c) < 0) return;
+    // pausado por falta de crédito solo se lee ante un error (para cerrarlo)
+    if ((events & EV_READ) && (!c->paused || (events & EV_ERROR))) handle_readable(c);
+    if (c->credit_on && c->fd >= 0) credit_update(c);
+}
+
+// Obtener (o crear) la ranura del cliente para un descriptor, ampliando la tabla si hace falta
+static Client *client_slot(int fd) {
+    if ((size_t) fd >= shard->clients_cap) {
+        size_t ncap = shard->clients_cap ? shard->clients_cap : 1024;
+        while (ncap <= (size_t) fd) ncap *= 2;
+        Client **n = (Client **) realloc(shard->clients, ncap * sizeof(Client *));
+        if (!n) return NULL;
+        memset(n + shard->clients_cap, 0, (ncap - shard->clients_cap) * sizeof(Client *));
+        shard->clients = n;
+        shard->clients_cap = ncap;
+    }
+    if (!shard->clients[fd]) {
+        shard->clients[fd] = (Client *) calloc(1, sizeof(Client));
+        if (!shard->clients[fd]) return NULL;
+        shard->clients[fd]->fd = -1;
+        shard->clients[fd]->shard_id = shard->id;
+    }
+    return shard->clients[fd];
+}
+
+// Registrar una conexión recién aceptada (o una ruta saliente). Si el backend no puede vigilar el
+// descriptor o no hay memoria, cierra la conexión y devuelve NULL.
+static Client *setup_client(int connfd) {
+    Client *c = (backend->max_fd && connfd >= backend->max_fd) ? NULL : client_slot(connfd);
+    if (c && backend->completion && !c->ur) c->ur = (UrSend *) calloc(1, sizeof(UrSend));
+    if (!c || (backend->completion && !c->ur)) {
+        close(connfd);
+        return NULL;
+    }
+    // Inicializa la estructura del nuevo cliente.
+    c->fd = connfd;
+    c->role = ROLE_UNKNOWN;
+    c->proto = 1;
+    c->ibuf_len = 0;
+    c->want_payload = 0;
+    c->nsubs = 0;
+    c->current_subject = NULL;
+    c->in_batch = 0;
+    c->batch_len = 0;
+    c->oq_head = c->oq_count = 0;
+    c->oq_off = c->oq_bytes = 0;
+    c->zc_head = c->zc_count = 0;
+    c->zc_next = 0;
+    c->msgs_in = c->bytes_in = c->msgs_out = c->bytes_out = c->dropped = 0;
+    c->ur_ops = c->ur_recv = c->ur_cancel = 0;
+    c->ur_fd = -1;
+    c->credit_on = c->paused = 0;
+    c->codec = CODEC_NONE;
+    c->batch_z = 0;
+    // lo de la conexión anterior ya se descartó al cerrarla; esta empieza en cero con su marca
+    unsigned gen = atomic_load_explicit(&c->credit_gen, memory_order_relaxed);
+    atomic_store_explicit(&c->back_msgs, back_tag(gen), memory_order_relaxed);
+    atomic_store_explicit(&c->back_bytes, back_tag(gen), memory_order_relaxed);
+    // con io_uring el kernel hace las escrituras: MSG_ZEROCOPY (errqueue por readiness) no aplica
+    c->zerocopy = zerocopy_min > 0 && !backend->completion &&
+                  setsockopt(connfd, SOL_SOCKET, SO_ZEROCOPY, &(int){1}, sizeof(int)) == 0;
+    c->h.fd = connfd;
+    c->h.on_event = on_client_event;
+    if (backend->add(&c->h, EV_READ) < 0) {
+        close(connfd);
+        c->fd = -1;
+        return NULL;
+    }
+    counter_add(&shard->stats.accepted, 1);
+    return c;
+}
+
+// Readiness del socket de escucha: aceptar todas las conexiones pendientes
+static void on_accept(Handler *h, int events) {
+    (void) events;
+    while (1) {
+        struct sockaddr_in cli;
+        socklen_t clilen = sizeof(cli);
+        int connfd = accept4(h->fd, (struct sockaddr *) &cli, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4"); // EMFILE, ENFILE, ...
+            return; // cola de aceptación vacía
+        }
+        (void) setup_client(connfd);
+    }
+}
+
+// Entregar a los suscriptores locales los mensajes que otros shards dejaron en la cola
+static void drain_inbox(void) {
+    MsgBuf *m;
+    while ((m = (MsgBuf *) mpsc_pop(&shard->inbox)) != NULL) {
+        // con un patrón de este shard que coincide, el tema puede no tener suscriptores exactos aquí:
+        // se interna (solo entonces)
+        Subject *subject = subject_index_find(&shard->subjects, m->subject);
+        if (!subject && sub_trie_match_any(shard->trie, m->subject)) subject = intern_subject(m->subject);
+        if (subject && !m->group_only) deliver_local(subject, m);
+        if (m->npicks) deliver_picks(m, 0); // aunque el tema no tenga suscriptores en este shard
+        msg_unref(m); // referencia que viajó con el mensaje
+    }
+}
+
+static void shard_snapshot(void);
+
+// Readiness del eventfd del shard: otro shard encoló mensajes o el hilo de administración pide una foto
+static void on_wake(Handler *h, int events) {
+    (void) events;
+    uint64_t v;
+    (void) read(h->fd, &v, sizeof(v)); // reiniciar el contador del eventfd
+    if (nshards > 1) drain_inbox();
+    if (atomic_exchange(&shard->snap_req, 0)) shard_snapshot();
+}
+
+// ---------------------------------------------------------------------------
+// Federación: el hilo de --route conecta los destinos y pasa cada conexión al shard 0, que la
+// registra como cliente con rol ROUTE. Cada shard envía las líneas de interés de sus rutas y cierra
+// las que quedaron reemplazadas.
+// ---------------------------------------------------------------------------
+
+// Registrar una conexión saliente lista y presentarse con el id propio
+static void route_connected(RouteTarget *t, int fd) {
+    Client *c = setup_client(fd);
+    if (!c) {
+        pthread_mutex_lock(&routes_lock);
+        t->busy = 0;
+        pthread_mutex_unlock(&routes_lock);
+        return;
+    }
+    c->role = ROLE_ROUTE;
+    c->target = t;
+    char line[ROUTE_ID_LEN + 8];
+    snprintf(line, sizeof(line), "ROUTE %s\n", server_id);
+    send_reply(c, line);
+}
+
+// Trabajo de rutas de este shard: conexiones salientes nuevas (shard 0), líneas de interés
+// pendientes y rutas reemplazadas. Se toma una cosa por vez con el lock y se atiende sin él.
+static void route_sync(void) {
+    atomic_store(&shard->routes_dirty, 0);
+    while (1) {
+        RouteTarget *t = NULL;
+        Client *c = NULL;
+        char *out = NULL;
+        size_t len = 0;
+        int fd = -1;
+        pthread_mutex_lock(&routes_lock);
+        for (int i = 0; shard->id == 0 && i < ntargets && fd < 0; i++) {
+            if (targets[i].fd < 0) continue;
+            t = &targets[i];
+            fd = t->fd;
+            t->fd = -1;
+        }
+        for (Route *r = routes; r && fd < 0; r = r->next) {
+            if (r->shard != shard->id || (!r->dead && r->out_len == 0)) continue;
+            c = r->c;
+            if (!r->dead) {
+                out = r->out;
+                len = r->out_len;
+                r->out = NULL;
+                r->out_len = r->out_cap = 0;
+            }
+            break;
+        }
+        pthread_mutex_unlock(&routes_lock);
+        if (fd >= 0) {
+            route_connected(t, fd);
+        } else if (out) {
+            send_raw(c, out, len);
+            free(out);
+        } else if (c) {
+            close_client(c); // reemplazada: close_client la saca de la lista
+        } else {
+            return;
+        }
+    }
+}
+
+// Conectar a un destino de --route sin bloquear más de ROUTE_DIAL_MS; -1 si no responde
+static int route_dial(const struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) < 0) {
+        struct pollfd p = {fd, POLLOUT, 0};
+        int err = 0;
+        socklen_t elen = sizeof(err);
+        if (errno != EINPROGRESS || poll(&p, 1, ROUTE_DIAL_MS) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen) < 0 || err != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// Hilo de --route: intenta cada ROUTE_RETRY_MS los destinos sin ruta. No reintenta uno que ya tiene
+// ruta con el mismo broker (aunque la haya iniciado el otro) ni uno que resultó ser este broker.
+static void *route_dialer(void *arg) {
+    (void) arg;
+    struct timespec ts = {ROUTE_RETRY_MS / 1000, (ROUTE_RETRY_MS % 1000) * 1000000L};
+    while (1) {
+        for (int i = 0; i < ntargets; i++) {
+            RouteTarget *t = &targets[i];
+            pthread_mutex_lock(&routes_lock);
+            int skip = t->busy || t->self || (t->peer[0] && route_find(t->peer));
+            if (!skip) t->busy = 1;
+            pthread_mutex_unlock(&routes_lock);
+            if (skip) continue;
+            int fd = route_dial(&t->addr);
+            pthread_mutex_lock(&routes_lock);
+            if (fd >= 0) t->fd = fd;
+            else t->busy = 0;
+            pthread_mutex_unlock(&routes_lock);
+            if (fd >= 0) route_kick(&shards[0]);
+        }
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Backend io_uring: el kernel hace las operaciones en lugar de avisar readiness. El listener usa un
+// accept multishot y cada cliente una recepción multishot que toma buffers del anillo provisto del
+// shard. Los envíos de la iteración (todo el fanout) se encolan como SENDMSG y salen, junto con lo
+// demás, en una sola io_uring_enter() que también espera las finalizaciones: una syscall por vuelta
+// del bucle en lugar de un recv()/sendmsg() por socket. El eventfd usa un poll multishot y su
+// callback de readiness.
+// ---------------------------------------------------------------------------
+
+// Qué operación terminó: va en los 3 bits bajos de user_data, junto al puntero al Handler
+enum { UR_POLL = 1, UR_ACCEPT = 2, UR_RECV = 3, UR_SEND = 4 };
+#define UR_TAG_MASK 7u
+
+static struct io_uring_sqe *ur_sqe(Handler *h, int op) {
+    struct io_uring_sqe *sqe = uring_sqe(&shard->ring);
+    if (!sqe) die("io_uring_enter");
+    sqe->fd = h->fd;
+    sqe->user_data = (uint64_t) (uintptr_t) h | (uint64_t) op;
+    return sqe;
+}
+
+// Armar (o rearmar) la operación multishot del descriptor
+static void ur_arm(Handler *h, int op) {
+    struct io_uring_sqe *sqe = ur_sqe(h, op);
+    if (op == UR_ACCEPT) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC; // sockets bloqueantes: io_uring espera por su cuenta
+    } else if (op == UR_RECV) {
+        Client *c = (Client *) h;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = shard->bufs.bgid;
+        c->ur_ops++;
+        c->ur_recv = 1;
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+    }
+}
+
+static int ur_init(void) {
+    if (uring_init(&shard->ring, URING_ENTRIES) < 0) return -1;
+    return uring_bufs_init(&shard->ring, &shard->bufs, 0, URING_BUFS, URING_BUF_SIZE);
+}
+
+static int ur_add(Handler *h, int events) {
+    h->events = events;
+    if (h->on_event == on_accept) ur_arm(h, UR_ACCEPT);
+    else if (h->on_event == on_client_event) ur_arm(h, UR_RECV);
+    else ur_arm(h, UR_POLL);
+    return 0;
+}
+
+// El interés de escritura no cambia nada: flush_queue() encola el envío directamente
+static int ur_mod(Handler *h, int events) {
+    h->events = events;
+    return 0;
+}
+
+static void ur_del(Handler *h) {
+    h->events = 0;
+}
+
+// Pausar la lectura de un publicador sin crédito (cancelar su recepción multishot) o reanudarla. Los
+// trozos que el kernel ya había recibido todavía llegan y se procesan; si se reanuda antes de que
+// termine la cancelación, ur_received() vuelve a armarla.
+static void ur_read(Client *c, int on) {
+    if (on) {
+        if (!c->ur_recv) ur_arm(&c->h, UR_RECV);
+        return;
+    }
+    if (!c->ur_recv || c->ur_cancel) return;
+    struct io_uring_sqe *sqe = ur_sqe(&c->h, 0);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) (uintptr_t) &c->h | UR_RECV; // la recepción, por su user_data
+    sqe->user_data = 0; // su finalización se ignora
+    c->ur_cancel = 1;
+}
+
+// Cerrar un cliente con operaciones en vuelo: shutdown() las hace terminar y el descriptor se cierra
+// recién con la última finalización, así el número no se recicla mientras el kernel todavía lo usa
+static void ur_release(Client *c) {
+    (void) shutdown(c->fd, SHUT_RDWR);
+    if (c->ur_ops == 0) {
+        close(c->fd);
+        return;
+    }
+    struct io_uring_sqe *sqe = ur_sqe(&c->h, 0);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = 0; // su finalización se ignora
+    c->ur_fd = c->fd;
+}
+
+// Cerrar el descriptor de un cliente cerrado cuando ya no le quedan operaciones
+static void ur_done(Client *c) {
+    if (c->fd < 0 && c->ur_ops == 0 && c->ur_fd >= 0) {
+        close(c->ur_fd);
+        c->ur_fd = -1;
+    }
+}
+
+static void ur_send_submit(Client *c) {
+    struct io_uring_sqe *sqe = ur_sqe(&c->h, UR_SEND);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t) (uintptr_t) &c->ur->mh;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL; // el kernel reintenta los envíos cortos
+    c->ur_ops++;
+}
+
+// Encolar en el anillo un SENDMSG con lo que haya en la cola (un envío en vuelo por cliente). Los
+// mensajes pasan de la cola al envío con su referencia; un corte directo incompleto queda en la cola,
+// marcado como enviado hasta donde llegó. Sus bytes siguen en oq_bytes hasta que el envío termina,
+// así un consumidor trabado no suma otra cola entera por encima de --max-queue-bytes. Devuelve -1
+// si el cliente se cerró.
+static int ur_flush(Client *c) {
+    UrSend *s = c->ur;
+    if (s->nmsgs > 0) return 0; // lo que siga sale cuando termine el envío en vuelo
+    size_t want = c->oq_count * 2 < URING_MAX_IOV ? c->oq_count * 2 : URING_MAX_IOV;
+    if (want > s->cap) {
+        struct iovec *iov = (struct iovec *) realloc(s->iov, want * sizeof(struct iovec));
+        if (iov) s->iov = iov;
+        MsgBuf **msgs = (MsgBuf **) realloc(s->msgs, want * sizeof(MsgBuf *));
+        if (msgs) s->msgs = msgs;
+        if (iov && msgs) s->cap = want;
+    }
+    size_t niov = 0;
+    while (c->oq_count > 0 && niov + 2 <= s->cap) {
+        MsgBuf *m = c->oq[c->oq_head];
+        if (m->aborted) {
+            if (c->oq_off > 0) {
+                close_client(c); // el frame quedó a medias: no se puede resincronizar
+                return -1;
+            }
+            oq_pop(c);
+            continue;
+        }
+        if (head_waiting(c)) break;
+        niov += (size_t) frame_iov(c, m, c->oq_off, s->iov + niov);
+        msg_ref(m);
+        s->msgs[s->nmsgs++] = m;
+        if (m->ready < m->plen) {
+            size_t hlen;
+            (void) frame_hdr(c, m, &hlen);
+            s->bytes += hlen + m->ready - c->oq_off;
+            c->oq_bytes -= hlen + m->ready - c->oq_off;
+            c->oq_off = hlen + m->ready;
+            break;
+        }
+        s->bytes += frame_len(c, m) - c->oq_off;
+        oq_pop(c);
+    }
+    c->oq_bytes += s->bytes;
+    publish_queued(c);
+    if (niov == 0) return 0;
+    memset(&s->mh, 0, sizeof(s->mh));
+    s->mh.msg_iov = s->iov;
+    s->mh.msg_iovlen = niov;
+    ur_send_submit(c);
+    return 0;
+}
+
+// Finalizó el envío en vuelo de un cliente
+static void ur_sent(Client *c, int res) {
+    UrSend *s = c->ur;
+    c->ur_ops--;
+    if (c->fd >= 0 && res > 0) {
+        c->bytes_out += (uint64_t) res;
+        counter_add(&shard->stats.bytes_out, (uint64_t) res);
+        // avanzar los iovec; si quedó algo se reenvía antes que lo demás de la cola
+        size_t left = (size_t) res;
+        while (left > 0 && s->mh.msg_iovlen > 0) {
+            struct iovec *v = s->mh.msg_iov;
+            if (left < v->iov_len) {
+                v->iov_base = (char *) v->iov_base + left;
+                v->iov_len -= left;
+                break;
+            }
+            left -= v->iov_len;
+            s->mh.msg_iov++;
+            s->mh.msg_iovlen--;
+        }
+        if (s->mh.msg_iovlen > 0) {
+            ur_send_submit(c);
+            return;
+        }
+    } else if (c->fd >= 0) {
+        counter_add(&shard->stats.send_errors, 1);
+        close_client(c);
+    }
+    for (size_t i = 0; i < s->nmsgs; i++) msg_unref(s->msgs[i]);
+    s->nmsgs = 0;
+    if (c->fd >= 0) c->oq_bytes -= s->bytes; // al cerrarse la cola ya quedó en cero
+    s->bytes = 0;
+    if (c->fd >= 0) (void) ur_flush(c);
+    ur_done(c);
+}
+
+// Llegó un trozo de la recepción multishot de un cliente
+static void ur_received(Client *c, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        c->ur_ops--;
+        c->ur_recv = 0;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t) (flags >> IORING_CQE_BUFFER_SHIFT);
+        if (res > 0 && c->fd >= 0) {
+            c->bytes_in += (uint64_t) res;
+            client_input(c, uring_buf(&shard->bufs, bid), (size_t) res);
+        }
+        uring_bufs_put(&shard->bufs, bid);
+    }
+    if (c->fd >= 0 && c->credit_on) credit_update(c);
+    if (c->fd >= 0) {
+        int paused = res == -ECANCELED && c->ur_cancel; // cancelada por falta de crédito, no es un error
+        if (!c->ur_recv) c->ur_cancel = 0;
+        if (res == 0 || (res < 0 && res != -ENOBUFS && !paused)) {
+            close_client(c); // cerrado por el cliente o error
+        } else if (!c->ur_recv && !c->paused) {
+            ur_arm(&c->h, UR_RECV); // el kernel la desarmó (p. ej. sin buffers libres) o terminó la pausa
+        }
+    }
+    ur_done(c);
+}
+
+static int ur_wait(void) {
+    // enviar todo lo encolado en la iteración y esperar al menos una finalización
+    if (uring_submit_wait(&shard->ring, 1) < 0) return errno == EINTR || errno == EBUSY ? 0 : -1;
+    if (admin_port) shard->woke_ns = now_ns();
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek(&shard->ring)) != NULL) {
+        uint64_t ud = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_seen(&shard->ring);
+        Handler *h = (Handler *) (uintptr_t) (ud & ~(uint64_t) UR_TAG_MASK);
+        switch (ud & UR_TAG_MASK) {
+            case UR_RECV:
+                ur_received((Client *) h, res, flags);
+                break;
+            case UR_SEND:
+                ur_sent((Client *) h, res);
+                break;
+            case UR_ACCEPT:
+                if (res >= 0) {
+                    (void) setup_client(res);
+                } else if (res != -EAGAIN && res != -ECONNABORTED) {
+                    errno = -res;
+                    perror("accept"); // EMFILE, ENFILE, ...
+                }
+                if (!(flags & IORING_CQE_F_MORE)) ur_arm(h, UR_ACCEPT);
+                break;
+            case UR_POLL:
+                if (res > 0) h->on_event(h, EV_READ);
+                if (!(flags & IORING_CQE_F_MORE)) ur_arm(h, UR_POLL);
+                break;
+            default:
+                break; // cancelaciones
+        }
+    }
+    uring_bufs_publish(&shard->bufs); // devolver al kernel los buffers consumidos
+    return 0;
+}
+
+static const Backend uring_backend = {"uring", ur_init, ur_add, ur_mod, ur_del, ur_wait, 0, 1};
+
+// Despertar (una vez por iteración) a los shards a los que se les encolaron mensajes
+static void wake_peers(void) {
+    for (int i = 0; i < nshards; i++) {
+        if (!shard->wake_peer[i]) continue;
+        shard->wake_peer[i] = 0;
+        uint64_t one = 1;
+        (void) write(shards[i].wake.fd, &one, sizeof(one));
+    }
+}
+
+// Tablas de la foto de administración
+static const char *const client_labels[] = {"shard", "fd", "role", "addr"};
+static const char *const client_cols[] = {"subs", "queue_msgs", "queue_bytes", "lag_ms", "msgs_in",
+                                          "bytes_in", "msgs_out", "bytes_out", "dropped"};
+static const AdminTableDef client_table = {"client", client_labels, 4, client_cols, 9, 0x1F0, 0, 2, 6};
+static const char *const subject_labels[] = {"subject"};
+static const char *const subject_cols[] = {"msgs", "bytes", "subscribers"};
+static const AdminTableDef subject_table = {"subject", subject_labels, 1, subject_cols, 3, 0x3, 1, 0, 0};
+
+// Aportar a la foto en curso las filas de este shard (corre en su hilo, así no hace falta lock)
+static void shard_snapshot(void) {
+    static const char *const roles[] = {"unknown", "pub", "sub", "route"};
+    AdminReport *r = snap_report;
+    long long now = now_ms();
+    size_t nclients = 0, npatterns = 0;
+    for (size_t fd = 0; fd < shard->clients_cap; fd++) {
+        Client *c = shard->clients[fd];
+        if (!c || c->fd < 0) continue;
+        nclients++;
+        npatterns += c->nwild;
+        char sid[16], sfd[16], addr[INET_ADDRSTRLEN + 8] = "?";
+        snprintf(sid, sizeof(sid), "%d", shard->id);
+        snprintf(sfd, sizeof(sfd), "%d", c->fd);
+        struct sockaddr_in sa;
+        socklen_t salen = sizeof(sa);
+        if (getpeername(c->fd, (struct sockaddr *) &sa, &salen) == 0) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &sa.sin_addr, ip, sizeof(ip));
+            snprintf(addr, sizeof(addr), "%s:%u", ip, ntohs(sa.sin_port));
+        }
+        // retraso: antigüedad del mensaje más viejo que sigue pendiente (en la cola o en vuelo)
+        const MsgBuf *oldest = oldest_pending(c);
+        long long lag = 0;
+        if (oldest && oldest->created_ms) lag = now - oldest->created_ms;
+        const char *labels[] = {sid, sfd, roles[c->role], addr};
+        uint64_t vals[] = {c->nsubs + c->nwild, c->oq_count, c->oq_bytes, lag > 0 ? (uint64_t) lag : 0,
+                           c->msgs_in, c->bytes_in, c->msgs_out, c->bytes_out, c->dropped};
+        admin_row(r, &client_table, labels, vals);
+    }
+    for (size_t b = 0; b < shard->subjects.nbuckets; b++) {
+        for (Subject *s = shard->subjects.buckets[b]; s; s = s->next) {
+            const char *labels[] = {s->name};
+            uint64_t vals[] = {s->msgs, s->bytes, s->nsubs};
+            admin_row(r, &subject_table, labels, vals);
+        }
+    }
+    admin_value(r, "clients", "Connected clients", 0, nclients);
+    admin_value(r, "patterns", "Wildcard subscriptions", 0, npatterns);
+    atomic_store_explicit(&shard->stats.loop_max_ns, 0, memory_order_relaxed); // el máximo es por foto
+
+    pthread_mutex_lock(&snap_lock);
+    if (--snap_pending == 0) pthread_cond_signal(&snap_cond);
+    pthread_mutex_unlock(&snap_lock);
+}
+
+// Armar una foto (hilo de administración): suma los contadores y pide a cada shard sus filas
+static void collect(AdminReport *r, void *arg) {
+    (void) arg;
+    for (int i = 0; i < nshards; i++) {
+        ShardStats *st = &shards[i].stats;
+        admin_value(r, "messages_in_total", "Messages published", 1, counter_get(&st->msgs_in));
+        admin_value(r, "bytes_in_total", "Payload bytes published", 1, counter_get(&st->bytes_in));
+        admin_value(r, "deliveries_total", "Messages queued to subscribers", 1, counter_get(&st->msgs_out));
+        admin_value(r, "bytes_out_total", "Bytes written to client sockets", 1, counter_get(&st->bytes_out));
+        admin_value(r, "dropped_total", "Deliveries dropped by the slow consumer policy", 1,
+                    counter_get(&st->dropped));
+        admin_value(r, "slow_disconnects_total", "Clients disconnected by the slow consumer policy", 1,
+                    counter_get(&st->slow_disconnects));
+        admin_value(r, "send_errors_total", "Failed sends (client closed)", 1, counter_get(&st->send_errors));
+        admin_value(r, "connections_total", "Accepted connections", 1, counter_get(&st->accepted));
+        admin_value(r, "loop_iterations_total", "Event loop iterations", 1, counter_get(&st->loop_iterations));
+        admin_value(r, "loop_busy_ns_total", "Time spent dispatching events", 1, counter_get(&st->loop_busy_ns));
+        admin_value(r, "group_deliveries_total", "Messages queued to queue group members", 1,
+                    counter_get(&st->group_out));
+        admin_value(r, "group_lost_total", "Queue group picks that left before delivery", 1,
+                    counter_get(&st->group_lost));
+        admin_value(r, "route_messages_in_total", "Messages received from other brokers", 1,
+                    counter_get(&st->route_in));
+        admin_value(r, "credit_pauses_total", "Times a publisher ran out of credit and stopped being read", 1,
+                    counter_get(&st->credit_pauses));
+        admin_value(r, "credit_grants_total", "CREDIT grants sent to publishers", 1, counter_get(&st->credit_grants));
+        admin_value(r, "compressed_batches_total", "Batches compressed once for compressing subscribers", 1,
+                    counter_get(&st->zbatches));
+        admin_value(r, "compress_raw_bytes_total", "Bytes of those batches before compression", 1,
+                    counter_get(&st->zraw_bytes));
+        admin_value(r, "compress_bytes_total", "Bytes of those batches after compression", 1, counter_get(&st->zbytes));
+        admin_value(r, "unrouted_publishes_total", "Publishes dropped because no one was interested in the subject",
+                    1, counter_get(&st->unrouted));
+        admin_value(r, "log_append_errors_total", "Retained messages that could not be written to the durable log", 1,
+                    counter_get(&st->log_errors));
+        admin_value(r, "rings_refused_total", "Retention rings not created because of --ring-memory", 1,
+                    counter_get(&st->rings_refused));
+        MsgPoolStats ps;
+        msgpool_stats(shards[i].pool, &ps);
+        admin_value(r, "pool_allocs_total", "Message buffers taken from the pools", 1, ps.allocs);
+        admin_value(r, "pool_reused_total", "Message buffers recycled without new memory", 1, ps.reused);
+        admin_value(r, "pool_large_total", "Messages too large for the pools (malloc)", 1, ps.large);
+        admin_value(r, "pool_bytes", "Memory held by the message pools", 0, ps.slab_bytes);
+    }
+    // la iteración más larga es un máximo, no una suma
+    uint64_t loop_max = 0;
+    for (int i = 0; i < nshards; i++) {
+        uint64_t v = counter_get(&shards[i].stats.loop_max_ns);
+        if (v > loop_max) loop_max = v;
+    }
+    admin_value(r, "loop_max_ns", "Longest event loop iteration since the previous snapshot", 0, loop_max);
+    pthread_mutex_lock(&global_ids_lock);
+    admin_value(r, "subjects", "Subjects seen", 0, global_ids.count);
+    pthread_mutex_unlock(&global_ids_lock);
+    if (retain_slots) {
+        admin_value(r, "rings", "Subjects with a retention ring", 0, atomic_load(&ring_count));
+        admin_value(r, "ring_bytes", "Bytes reserved by retention rings", 0, atomic_load(&ring_mem));
+    }
+    admin_value(r, "group_members", "Queue group memberships", 0, atomic_load(&qgroups_n));
+    size_t nroutes = 0;
+    pthread_mutex_lock(&routes_lock);
+    for (Route *rt = routes; rt; rt = rt->next) nroutes += !rt->dead;
+    admin_value(r, "routes", "Routes to other brokers", 0, nroutes);
+    admin_value(r, "interest", "Subjects and patterns announced to routes", 0, interest_n);
+    pthread_mutex_unlock(&routes_lock);
+    if (dlog) {
+        DLogStats st;
+        dlog_stats(dlog, &st);
+        admin_value(r, "log_segments", "Durable log segments", 0, st.segments);
+        admin_value(r, "log_bytes", "Durable log bytes", 0, st.bytes);
+        admin_value(r, "log_first_offset", "Oldest offset in the durable log", 0, st.first_offset);
+        admin_value(r, "log_next_offset", "Next offset of the durable log", 1, st.next_offset);
+    }
 
-    // Inicializa el array de clientes, marcando todos los descriptores como -1 (no en uso).
-    for (int i = 0; i < MAX_CLIENTS; i++) { clients[i].fd = -1; }
+    // Cada shard agrega sus filas en su propio hilo; se espera a que terminen todos.
+    pthread_mutex_lock(&snap_lock);
+    snap_report = r;
+    snap_pending = nshards;
+    for (int i = 0; i < nshards; i++) {
+        atomic_store(&shards[i].snap_req, 1);
+        uint64_t one = 1;
+        (void) write(shards[i].wake.fd, &one, sizeof(one));
+    }
+    while (snap_pending > 0) pthread_cond_wait(&snap_cond, &snap_lock);
+    snap_report = NULL;
+    pthread_mutex_unlock(&snap_lock);
+}
 
-    // Crea un socket de escucha TCP.
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+// Crear el socket de escucha de un shard (con SO_REUSEPORT el kernel reparte las conexiones)
+static int open_listener(int port) {
+    // Crea un socket de escucha TCP no bloqueante.
+    int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (listenfd < 0) die("socket");
 
     // Permite reutilizar la dirección y el puerto inmediatamente después de cerrar el broker.
     int yes = 1;
     (void) setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (nshards > 1 && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0)
+        die("SO_REUSEPORT");
 
     // Configura la dirección del broker para escuchar en cualquier interfaz.
     struct sockaddr_in addr;
@@ -248,59 +3608,240 @@ int main(int argc, char **argv) {
     // Asocia el socket a la dirección y puerto.
     if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) die("bind");
     // Pone el socket en modo de escucha para aceptar nuevas conexiones.
-    if (listen(listenfd, 128) < 0) die("listen");
+    if (listen(listenfd, SOMAXCONN) < 0) die("listen");
+    return listenfd;
+}
+
+// Hilo reactor de un shard: inicializa su backend y ejecuta el bucle de eventos
+static void *shard_run(void *arg) {
+    shard = (Shard *) arg;
+    // Inicializa el reactor y registra el socket de escucha y el eventfd.
+    if (backend->init() < 0) die("reactor init");
+    if (backend->add(&shard->listener, EV_READ) < 0) die("reactor add");
+    if (shard->wake.on_event && backend->add(&shard->wake, EV_READ) < 0) die("reactor add");
+
+    // Bucle de eventos: el backend espera y despacha los callbacks de cada descriptor listo.
+    while (1) {
+        if (backend->wait() < 0) die(backend->name);
+        if (atomic_load_explicit(&shard->routes_dirty, memory_order_relaxed)) route_sync();
+        if (shard->replay_head) replay_pump(); // una página de cada FROM pendiente
+        flush_dirty(); // un sendmsg() por suscriptor con todo lo encolado en la iteración
+        if (atomic_load_explicit(&shard->credit_head, memory_order_relaxed)) {
+            credit_sync(); // lo liberado hasta aquí (también por los envíos recién hechos) vuelve como crédito
+            flush_dirty();
+        }
+        if (shard->replay_head) replay_kick();
+        if (nshards > 1) wake_peers();
+        if (admin_port) {
+            uint64_t busy = now_ns() - shard->woke_ns;
+            counter_add(&shard->stats.loop_iterations, 1);
+            counter_add(&shard->stats.loop_busy_ns, busy);
+            counter_max(&shard->stats.loop_max_ns, busy);
+        }
+    }
+    return NULL;
+}
 
-    printf("Broker TCP started on port %d.\n", port);
+// Elevar el límite suave de descriptores al máximo permitido para soportar decenas de miles de clientes
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void) setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
 
-    fd_set rset;
-    int maxfd = listenfd;
+// Hilo que confirma el log durable periódicamente (group commit)
+static void *log_flusher(void *arg) {
+    (void) arg;
+    struct timespec ts = {log_sync_ms / 1000, (log_sync_ms % 1000) * 1000000L};
     while (1) {
-        // Prepara el conjunto de descriptores de archivo para select().
-        FD_ZERO(&rset);
-        FD_SET(listenfd, &rset); // Agrega el socket de escucha.
-        // Agrega los sockets de los clientes conectados.
-        for (int i = 0; i < MAX_CLIENTS; i++)
-            if (clients[i].fd > 0)
-                FD_SET(clients[i].fd, &rset);
-        // Espera a que haya actividad en alguno de los sockets.
-        int nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
-        if (nready < 0) die("select");
-
-        // Si hay una nueva conexión entrante.
-        if (FD_ISSET(listenfd, &rset)) {
-            struct sockaddr_in cli;
-            socklen_t clilen = sizeof(cli);
-            // Acepta la nueva conexión.
-            int connfd = accept(listenfd, (struct sockaddr *) &cli, &clilen);
-            if (connfd >= 0) {
-                int placed = 0;
-                // Busca un hueco libre en el array de clientes.
-                for (int i = 0; i < MAX_CLIENTS; i++)
-                    if (clients[i].fd < 0) {
-                        // Inicializa la estructura del nuevo cliente.
-                        clients[i].fd = connfd;
-                        clients[i].role = ROLE_UNKNOWN;
-                        clients[i].ibuf_len = 0;
-                        clients[i].want_payload = 0;
-                        clients[i].subs = NULL;
-                        clients[i].current_subject[0] = '\0';
-                        placed = 1;
-                        break;
-                    }
-                // Si no hay hueco, cierra la conexión.
-                if (!placed) { close(connfd); }
-                // Actualiza el descriptor de archivo más alto.
-                if (connfd > maxfd) maxfd = connfd;
+        nanosleep(&ts, NULL);
+        dlog_commit(dlog);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    // Obtiene el puerto y las opciones de la línea de comandos, o usa los valores por defecto.
+    int port = BROKER_PORT;
+    const char *data_dir = NULL; // directorio del log durable (NULL = sin log)
+    size_t log_segment_bytes = 0; // 0 = DLOG_SEGMENT_BYTES
+    uint64_t log_max_bytes = 0; // 0 = sin límite
+    backend = &epoll_backend;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            const char *b = argv[++i];
+            if (strcmp(b, "epoll") == 0) backend = &epoll_backend;
+            else if (strcmp(b, "select") == 0) backend = &select_backend;
+            else if (strcmp(b, "uring") == 0) backend = &uring_backend;
+            else {
+                fprintf(stderr, "unknown backend '%s' (use epoll, select or uring)\n", b);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--slow-policy") == 0 && i + 1 < argc) {
+            const char *p = argv[++i];
+            if (strcmp(p, "drop-oldest") == 0) slow_policy = SLOW_DROP_OLDEST;
+            else if (strcmp(p, "drop-newest") == 0) slow_policy = SLOW_DROP_NEWEST;
+            else if (strcmp(p, "disconnect") == 0) slow_policy = SLOW_DISCONNECT;
+            else {
+                fprintf(stderr, "unknown slow policy '%s' (use drop-oldest, drop-newest or disconnect)\n", p);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--max-queue-bytes") == 0 && i + 1 < argc) {
+            max_queue_bytes = (size_t) strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-lag-ms") == 0 && i + 1 < argc) {
+            max_lag_ms = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--zerocopy-min") == 0 && i + 1 < argc) {
+            zerocopy_min = (size_t) strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cut-through") == 0 && i + 1 < argc) {
+            cut_through_min = (size_t) strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--retain") == 0 && i + 1 < argc) {
+            retain_slots = (size_t) strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--retain-bytes") == 0 && i + 1 < argc) {
+            retain_bytes = (size_t) strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ring-memory") == 0 && i + 1 < argc) {
+            ring_limit = (size_t) strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--data-dir") == 0 && i + 1 < argc) {
+            data_dir = argv[++i];
+        } else if (strcmp(argv[i], "--log-segment-bytes") == 0 && i + 1 < argc) {
+            log_segment_bytes = (size_t) strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--log-max-bytes") == 0 && i + 1 < argc) {
+            log_max_bytes = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--log-sync-ms") == 0 && i + 1 < argc) {
+            log_sync_ms = strtol(argv[++i], NULL, 10);
+            if (log_sync_ms < 1) log_sync_ms = 1;
+        } else if (strcmp(argv[i], "--admin-port") == 0 && i + 1 < argc) {
+            admin_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--group-policy") == 0 && i + 1 < argc) {
+            const char *p = argv[++i];
+            if (strcmp(p, "round-robin") == 0) group_policy = QGROUP_ROUND_ROBIN;
+            else if (strcmp(p, "least-queued") == 0) group_policy = QGROUP_LEAST_QUEUED;
+            else {
+                fprintf(stderr, "unknown group policy '%s' (use round-robin or least-queued)\n", p);
+                return EXIT_FAILURE;
             }
-            if (--nready <= 0) continue; // Si ya se han procesado todos los eventos, vuelve a esperar.
-        }
-        // Comprueba si hay datos de los clientes.
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            Client *c = &clients[i];
-            if (c->fd > 0 && FD_ISSET(c->fd, &rset)) {
-                // Maneja los datos recibidos del cliente.
-                handle_readable(c);
+        } else if (strcmp(argv[i], "--route") == 0 && i + 1 < argc) {
+            const char *spec = argv[++i];
+            const char *colon = strrchr(spec, ':');
+            if (!colon || ntargets == MAX_ROUTES) {
+                fprintf(stderr, "--route expects HOST:PORT (at most %d)\n", MAX_ROUTES);
+                return EXIT_FAILURE;
             }
+            char host[256];
+            snprintf(host, sizeof(host), "%.*s", (int) (colon - spec), spec);
+            struct addrinfo hints, *res;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            int rc = getaddrinfo(host, colon + 1, &hints, &res);
+            if (rc != 0) {
+                fprintf(stderr, "route %s: %s\n", spec, gai_strerror(rc));
+                return EXIT_FAILURE;
+            }
+            RouteTarget *t = &targets[ntargets++];
+            t->spec = spec;
+            memcpy(&t->addr, res->ai_addr, sizeof(t->addr));
+            t->fd = -1;
+            freeaddrinfo(res);
+        } else if (strcmp(argv[i], "--credit-msgs") == 0 && i + 1 < argc) {
+            credit_msgs = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--credit-bytes") == 0 && i + 1 < argc) {
+            credit_bytes = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            nshards = atoi(argv[++i]);
+            if (nshards < 1 || nshards > MAX_THREADS) {
+                fprintf(stderr, "--threads must be between 1 and %d\n", MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+        } else {
+            port = atoi(argv[i]);
         }
     }
+
+    // Sin io_uring (kernel viejo, seccomp de un contenedor) se vuelve al bucle de readiness.
+    if (backend == &uring_backend && uring_probe() < 0) {
+        fprintf(stderr, "io_uring not available (%s), falling back to epoll\n", strerror(errno));
+        backend = &epoll_backend;
+    }
+
+    // Evita que el programa termine si un cliente cierra la conexión mientras se le envía datos.
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+    if (subject_index_init(&global_ids) < 0) die("subject index");
+    if (!(global_patterns = sub_trie_new()) || !(zpatterns = sub_trie_new())) die("subject trie");
+    if (!(qgroups = qgroup_table_new())) die("queue groups");
+    if (subject_index_init(&interest) < 0 || subject_index_init(&group_interest) < 0) die("subject index");
+    snprintf(server_id, sizeof(server_id), "%08x%08x", (unsigned) getpid(), (unsigned) now_ns());
+
+    // Abre el log durable antes de aceptar clientes: las secuencias continúan desde lo guardado.
+    struct timespec t0, t1;
+    if (data_dir) {
+        if (!retain_slots) retain_slots = LOG_RETAIN_SLOTS;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (!(dlog = dlog_open(data_dir, log_segment_bytes, log_max_bytes))) die(data_dir);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    }
+
+    if (retain_slots && ring_cost() > ring_limit) {
+        fprintf(stderr, "--ring-memory %zu is smaller than one retention ring (%zu bytes)\n", ring_limit, ring_cost());
+        return EXIT_FAILURE;
+    }
+
+    // Crea los shards: cada uno con su listener, su índice de temas y su cola de entrada.
+    shards = (Shard *) calloc((size_t) nshards, sizeof(Shard));
+    if (!shards) die("calloc");
+    for (int i = 0; i < nshards; i++) {
+        Shard *sh = &shards[i];
+        sh->id = i;
+        sh->listener = (Handler){open_listener(port), 0, on_accept};
+        if (subject_index_init(&sh->subjects) < 0) die("subject index");
+        if (!(sh->trie = sub_trie_new())) die("subject trie");
+        if (!(sh->pool = msgpool_new())) die("message pool");
+        if (!(sh->misses = (Miss *) calloc(MISS_SLOTS, sizeof(Miss)))) die("calloc");
+        sh->wake_peer = (unsigned char *) calloc((size_t) nshards, 1);
+        if (!sh->wake_peer) die("calloc");
+        if (nshards > 1 && mpsc_init(&sh->inbox, INBOX_SLOTS) < 0) die("inbox");
+        // el eventfd también despierta al shard cuando hay trabajo para sus rutas (que pueden llegar
+        // en cualquier momento, aun sin --route)
+        sh->wake = (Handler){eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), 0, on_wake};
+        if (sh->wake.fd < 0) die("eventfd");
+    }
+
+    printf("Broker TCP started on port %d (%s backend, %d thread%s).\n", port, backend->name, nshards,
+           nshards == 1 ? "" : "s");
+    if (retain_slots)
+        printf("Retention: last %zu messages / %zu bytes per subject, %zu bytes in total.\n", retain_slots,
+               ring_arena(), ring_limit);
+    if (dlog) {
+        DLogStats st;
+        dlog_stats(dlog, &st);
+        printf("Log: %s, %zu segment%s, %llu bytes, %zu subjects, offsets %llu..%llu (opened in %.1f ms).\n",
+               data_dir, st.segments, st.segments == 1 ? "" : "s", (unsigned long long) st.bytes, st.subjects,
+               (unsigned long long) st.first_offset, (unsigned long long) st.next_offset,
+               (double) (t1.tv_sec - t0.tv_sec) * 1e3 + (double) (t1.tv_nsec - t0.tv_nsec) / 1e6);
+        pthread_t flusher;
+        if (pthread_create(&flusher, NULL, log_flusher, NULL) != 0) die("pthread_create");
+    }
+    if (credit_msgs || credit_bytes)
+        printf("Flow control: %llu messages / %llu bytes of credit per publisher (0 = unlimited).\n",
+               (unsigned long long) credit_msgs, (unsigned long long) credit_bytes);
+    printf("Server id %s", server_id);
+    for (int i = 0; i < ntargets; i++) printf("%s%s", i ? ", " : ", routes to ", targets[i].spec);
+    printf(".\n");
+    if (ntargets) {
+        pthread_t dialer;
+        if (pthread_create(&dialer, NULL, route_dialer, NULL) != 0) die("pthread_create");
+    }
+    if (admin_port) {
+        if (admin_start(admin_port, "broker_tcp", collect, NULL) < 0) die("admin port");
+        printf("Admin: 127.0.0.1:%d (stats, json, metrics).\n", admin_port);
+    }
+    fflush(stdout);
+
+    // El shard 0 corre en el hilo principal; el resto en hilos propios.
+    for (int i = 1; i < nshards; i++)
+        if (pthread_create(&shards[i].thread, NULL, shard_run, &shards[i]) != 0) die("pthread_create");
+    shard_run(&shards[0]);
+    return 0;
 }
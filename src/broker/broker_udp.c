@@ -3,31 +3,235 @@
 //  SUBSCRIBE <subject>\n              (suscriptor -> broker)
 //  PUBLISH   <subject> <len>\n<payload>    (publicador -> broker)
 //  MESSAGE   <subject> <len>\n<payload>    (broker -> suscriptor)
+// Un peer que envía "PUB2\n" o "SUB2\n" (o directamente un frame binario) usa el framing v2 de
+// common/proto_v2.h. En UDP cada datagrama es independiente, por eso el publicador v2 puede incluir
+// el nombre del tema en cada PUBLISH; el broker igual acepta ids ya asociados por ese peer.
+//
+// Uso: broker_udp [puerto] [--recv-batch N] [--no-gso]
+// Cada despertar drena hasta N datagramas con recvmmsg(). Las respuestas y el fanout se encolan y se
+// envían juntos con sendmmsg() al terminar el lote; varios mensajes del mismo tamaño para un mismo
+// suscriptor se agrupan en un solo envío con UDP_SEGMENT (GSO), que el kernel corta en datagramas.
+//
+// Con --multicast GRUPO[:PUERTO] cada tema se asigna a un grupo (GRUPO + id % MCAST_GROUPS) y el
+// broker responde al SUBSCRIBE con el grupo al que unirse en vez de entregar por unicast:
+//  OK MCAST <grupo> <puerto>\n          (texto)
+//  OK con payload u32 grupo | u16 puerto (v2, orden de red)
+// Cada PUBLISH sale como un único datagrama al grupo (frame v2 MESSAGE con nombre e id), así el
+// costo del fanout no depende de la cantidad de suscriptores.
+//
+// Con --reliable N cada tema numera sus mensajes (MESSAGE <tema> <len> <seq>\n en texto, V2_FLAG_SEQ
+// en v2) y guarda los últimos N. Un suscriptor que detecta huecos los pide en un solo datagrama:
+//  NACK <tema> <desde> <cantidad> [<desde> <cantidad> ...]\n   (una línea por tema)
+// y el broker los reenvía por unicast, o responde LOST <tema> <desde> <cantidad>\n si ya salieron
+// del anillo. --loss PCT descarta al azar ese porcentaje de las entregas para probarlo.
+// Un NACK reenvía como mucho NACK_MAX_MSGS mensajes, y cada peer recibe reenvíos (NACK y FROM) a no
+// más de --resend-rate B por segundo: un NACK chico con la dirección de otro no multiplica el tráfico
+// hacia ella. Lo que no entra no se informa como LOST; el suscriptor lo vuelve a pedir.
+// --retain N es lo mismo (el anillo está en common/retain.h, con --retain-bytes B de arena por tema)
+// y habilita "SUBSCRIBE <tema> FROM <seq|last|-N>\n" (en v2, el argumento va en el payload del
+// SUBSCRIBE): después del OK se reenvía por unicast lo retenido desde ahí, de a poco (pump_replays()),
+// mientras sigue en vivo.
+// Solo tienen anillo los temas que alguien recibe (suscripción exacta, patrón o grupo); todos juntos
+// reservan como mucho --ring-memory B y el de un tema que queda sin interesados se libera al rato.
+//
+// Los mensajes que no entran en un datagrama viajan fragmentados (V2_FLAG_FRAG, common/proto_v2.h):
+// el broker junta los fragmentos de cada publicador antes del fanout y fragmenta hacia cada
+// suscriptor según su tamaño de datagrama (MAX_DGRAM, o menos con --mtu N|auto para no depender de la
+// fragmentación IP). Los suscriptores de texto reciben los fragmentos como frames v2 con el nombre.
+//
+// SUBSCRIBE acepta patrones jerárquicos ("*" = un nivel, ">" al final = uno o más; common/subject_trie.h).
+// Lo que llega por un patrón sale siempre por unicast y, en v2, con el nombre del tema (el OK del
+// patrón no trae id: SUBJECT_NO_ID).
+//
+// "SUBSCRIBE <tema> GROUP <nombre>\n" (en v2, V2_FLAG_GROUP con el nombre como payload) une al peer a un
+// grupo de cola (common/qgroup.h): cada mensaje del tema va a un solo miembro, elegido en ronda (en
+// UDP no hay colas por peer para elegir al menos cargado), por unicast.
+//
+// "UNSUBSCRIBE <tema> [GROUP <nombre>]\n" (en texto también desde peers v2, como NACK) deshace una
+// suscripción exacta, un patrón o la pertenencia a un grupo; responde OK o "ERR not subscribed". Como
+// en UDP no hay desconexión, un peer del que no llega nada (un suscriptor manda "PING\n" cada 10 s)
+// durante --peer-timeout SEC (30 por defecto, 0 = nunca) se olvida con todas sus suscripciones, y así
+// un miembro que se fue deja de recibir su parte de los mensajes del grupo.
+//
+// Con --admin-port N se atiende en 127.0.0.1:N una foto de métricas en texto, JSON o formato
+// Prometheus (common/admin.h): contadores del bucle y tablas por peer y por tema. El hilo de
+// administración despierta al bucle con un datagrama vacío y este arma las tablas entre dos lotes.
+// En UDP no hay colas por peer, así que no hay profundidad de cola ni retraso que medir.
 
-#include <arpa/inet.h>     // htonl(), htons(), INADDR_ANY
-#include <netinet/in.h>    // struct sockaddr_in
+#define _GNU_SOURCE        // recvmmsg(), sendmmsg()
+
+#include <arpa/inet.h>     // htonl(), htons(), INADDR_ANY, inet_pton(), inet_ntop(), inet_ntoa()
+#include <errno.h>         // errno, EINTR, EAGAIN
+#include <pthread.h>       // pthread_mutex_t, pthread_cond_t (foto para el socket de administración)
+#include <netinet/in.h>    // struct sockaddr_in, IN_MULTICAST, IP_MULTICAST_*
+#include <netinet/udp.h>   // UDP_SEGMENT
 #include <stdio.h>         // printf(), perror()
-#include <stdlib.h>        // exit(), atoi(), calloc(), free()
-#include <string.h>        // memset(), memcpy(), strcmp(), strncpy(), memchr()
-#include <sys/select.h>    // select(), fd_set
-#include <sys/socket.h>    // socket(), bind(), recvfrom(), sendto()
+#include <stdlib.h>        // exit(), atoi(), atof(), calloc(), realloc(), free(), rand(), strtoull()
+#include <string.h>        // memset(), memcpy(), strcmp(), strncmp(), strcspn(), strchr(), memchr(), strtok_r()
+#include <sys/socket.h>    // socket(), bind(), recvmmsg(), sendmmsg(), sendto()
+#include <sys/time.h>      // struct timeval (SO_RCVTIMEO)
 #include <sys/types.h>     // tipos básicos
+#include <sys/uio.h>       // struct iovec
 #include <unistd.h>        // close()
 
+#include "common/admin.h" // métricas y socket de administración
+#include "common/frag.h" // reensamblado de mensajes fragmentados
+#include "common/latency.h" // lat_now_ns()
+#include "common/proto_v2.h" // framing binario v2
+#include "common/qgroup.h" // grupos de cola
+#include "common/retain.h" // anillo de retención por tema
+#include "common/subject_index.h" // índice de temas -> suscriptores
+#include "common/subject_trie.h" // suscripciones con comodines
+
 #define BROKER_PORT 5556 // Puerto por defecto para el broker UDP
 #define MAX_DGRAM   2048 // Tamaño máximo del datagrama UDP
 
-// Estructura para una entrada de suscripción. Almacena el tema (subject)
-// y la dirección del suscriptor.
-typedef struct SubEntry {
-    char subject[128]; // Nombre del tema
+#define PEER_BUCKETS 4096 // buckets de la tabla de peers (potencia de 2)
+#define MAX_PUB_IDS 65536 // ids de tema que un publicador v2 puede asociar
+#define DEFAULT_RECV_BATCH 64 // datagramas leídos por recvmmsg() por defecto
+#define MAX_RECV_BATCH 1024 // máximo de --recv-batch
+#define OUT_ENTRIES 256 // envíos pendientes (mmsghdr) antes de vaciar la cola
+#define OUT_SLOTS 512 // datagramas armados pendientes antes de vaciar la cola
+#define GSO_MAX_SEGS 64 // segmentos por envío con UDP_SEGMENT
+#define GSO_MAX_BYTES 65000 // bytes por envío con UDP_SEGMENT
+#define MCAST_GROUPS 1024 // grupos multicast consecutivos a partir del base
+#define MCAST_PORT 5557 // puerto multicast por defecto
+#define MAX_RING 1048576 // mensajes máximos en el anillo de retransmisión de cada tema
+#define REASM_BYTES (64u << 20) // bytes retenidos como máximo en mensajes a medio reensamblar
+#define REASM_TIMEOUT_NS 2000000000ull // descartar un mensaje incompleto después de 2 s
+#define RCVBUF_BYTES (4 << 20) // buffer de recepción pedido (los fragmentos de un mensaje llegan en ráfaga)
+#define DEFAULT_RING_MEMORY (1ull << 30) // --ring-memory por defecto: 1 GiB entre todos los anillos
+#define RING_IDLE_NS 60000000000ull // liberar el anillo de un tema después de 60 s sin interesados
+#define SWEEP_NS 1000000000ull // tareas periódicas del bucle (y espera máxima de recvmmsg) cada 1 s
+#define DEFAULT_PEER_TIMEOUT 30 // --peer-timeout por defecto, en segundos
+#define NACK_MAX_MSGS 512 // mensajes reenviados como mucho por un datagrama NACK
+#define DEFAULT_RESEND_RATE (8ull << 20) // --resend-rate por defecto: 8 MB/s de reenvíos por peer
+#define MAX_RESEND_RATE (64ull << 30) // máximo de --resend-rate (la recarga del crédito no desborda)
+#define RESEND_BURST_NS 100000000ull // crédito máximo acumulado: 100 ms de --resend-rate
+#define REPLAY_TICK_NS 10000000ull // espera máxima de recvmmsg() mientras hay reproducciones en curso
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // Linux >= 4.18
+#endif
+
+// Reproducción FROM en curso: se reenvía de a poco, según el crédito del peer
+typedef struct Replay {
+    Subject *subject;
+    uint64_t next; // próxima secuencia a reenviar
+    uint64_t upto; // retain_next() al suscribirse: lo posterior ya llega en vivo
+} Replay;
+
+// Suscriptor UDP identificado por su dirección. Guarda los enlaces a sus temas.
+typedef struct Peer {
     struct sockaddr_in addr; // Dirección del suscriptor
     socklen_t addrlen; // Longitud de la dirección
-    struct SubEntry *next; // Puntero a la siguiente entrada en la lista
-} SubEntry;
+    int proto; // 1 = texto, 2 = framing binario v2
+    size_t max_dgram; // datagrama más grande que se le envía (MAX_DGRAM o según --mtu)
+    Subject **pub_ids; // v2: id elegido por el publicador -> tema
+    size_t pub_ids_cap; // capacidad de pub_ids
+    SubLink **subs; // Enlaces a los temas suscritos
+    size_t nsubs; // Cantidad de temas suscritos
+    size_t subs_cap; // Capacidad de subs
+    unsigned out_epoch; // lote de salida en el que se le encoló algo por última vez
+    size_t out_entry; // último envío encolado para este peer (válido si out_epoch es el actual)
+    char **patterns; // patrones suscritos (copias, para darse de baja del trie)
+    size_t npatterns, patterns_cap;
+    QGroup **groups; // grupos de cola de los que es miembro
+    size_t ngroups, groups_cap;
+    unsigned fan_mark; // último fanout en el que recibió el mensaje por una suscripción exacta
+    uint64_t dgrams_out, bytes_out; // datagramas y bytes encolados hacia el peer
+    uint64_t last_seen; // hora del último lote con un datagrama del peer (ver --peer-timeout)
+    Replay *replays; // reproducciones FROM en curso
+    size_t nreplays, replays_cap;
+    uint64_t resend_tokens, resend_ns; // bytes de reenvío disponibles (--resend-rate) y cuándo se recargó
+    struct Peer *next; // Siguiente peer en el mismo bucket
+} Peer;
+
+// Envío pendiente hacia un peer: uno o más datagramas del mismo tamaño. Con más de uno se envían en
+// una sola llamada con UDP_SEGMENT y el kernel los separa.
+typedef struct OutEntry {
+    Peer *peer; // destino (los peers expiran solo con la cola vacía, ver expire_peers())
+    struct iovec iov[GSO_MAX_SEGS]; // un segmento por datagrama
+    size_t nsegs; // datagramas en el envío
+    size_t seglen; // tamaño de cada datagrama
+    size_t bytes; // total del envío
+    char ctrl[CMSG_SPACE(sizeof(uint16_t))]; // cmsg UDP_SEGMENT
+} OutEntry;
+
+static Peer *peers[PEER_BUCKETS]; // tabla hash dirección -> peer
+static SubjectIndex subjects; // índice tema -> peers suscritos
+static SubTrie *trie; // patrones con comodines -> peers
+static QGroupTable *qgroups; // grupos de cola (se sale con UNSUBSCRIBE o cuando el peer expira)
+static unsigned fan_stamp; // número del fanout actual (ver Peer.fan_mark)
+
+// Cola de salida del lote actual
+static int out_sock; // socket del broker
+static int use_gso = 1; // agrupar datagramas con UDP_SEGMENT
+static OutEntry out[OUT_ENTRIES];
+static struct mmsghdr out_msgs[OUT_ENTRIES];
+static size_t out_count; // envíos en la cola
+static unsigned out_epoch = 1; // cambia en cada vaciado (invalida Peer.out_entry)
+static char out_slots[OUT_SLOTS][MAX_DGRAM]; // datagramas armados (referenciados por los iov)
+static size_t out_nslots; // ranuras usadas
 
-// Puntero a la cabeza de la lista enlazada de suscripciones.
-static SubEntry *subs = NULL;
+// Modo multicast (--multicast)
+static int mcast = 0; // activo
+static uint32_t mcast_base; // primer grupo (orden de host)
+static uint16_t mcast_port = MCAST_PORT; // puerto de todos los grupos
+static Peer *mcast_dests[MCAST_GROUPS]; // destino por grupo (se crean al primer envío)
+
+// Entrega secuenciada (--reliable N / --retain N): cada tema numera sus mensajes y guarda los
+// últimos N en su anillo de retención (Subject.data) para reenviarlos cuando un suscriptor pide los
+// que le faltan con NACK o se suscribe con FROM.
+static size_t ring_size = 0; // 0 = sin secuencias
+static size_t ring_bytes = 0; // arena de cada anillo (0 = ring_size * RETAIN_AVG_BYTES)
+static size_t ring_limit = DEFAULT_RING_MEMORY; // --ring-memory: bytes de todos los anillos juntos
+static size_t ring_mem, ring_count; // bytes reservados y anillos existentes
+static uint64_t loop_ns; // hora del lote actual (uso de los anillos y de los peers)
+static uint64_t peer_timeout_ns = DEFAULT_PEER_TIMEOUT * 1000000000ull; // --peer-timeout (0 = nunca)
+static uint64_t resend_rate = DEFAULT_RESEND_RATE; // --resend-rate: bytes por segundo reenviados a cada peer
+static Peer **replaying; // peers con reproducciones en curso
+static size_t nreplaying, replaying_cap;
+
+// Anillo de un tema (Subject.data). Se crea con el primer mensaje que alguien recibe y sweep_rings()
+// lo libera cuando el tema pasa RING_IDLE_NS sin interesados.
+typedef struct TopicRing {
+    RetainRing *ring;
+    uint64_t used_ns; // última vez que el tema tenía interesados
+} TopicRing;
+static double loss_pct = 0; // pérdida simulada de entregas (--loss)
+
+// Contadores del bucle: los escribe solo el hilo principal, el de administración los lee sin locks
+typedef struct UdpStats {
+    Counter dgrams_in, bytes_in; // datagramas recibidos
+    Counter truncated_in; // datagramas más grandes que MAX_DGRAM (llegan cortados)
+    Counter msgs_in, msg_bytes_in; // publicaciones completas (ya reensambladas)
+    Counter dgrams_out, bytes_out; // datagramas encolados hacia peers y grupos
+    Counter send_errors; // envíos de sendmmsg() que fallaron (el datagrama se pierde)
+    Counter dropped_oversize; // entregas descartadas por no poder fragmentarse
+    Counter loss_injected; // entregas descartadas por --loss
+    Counter nacks, retransmits, lost_reported; // pedidos NACK, mensajes reenviados, LOST respondidos
+    Counter rings_refused; // anillos no creados por --ring-memory (esos mensajes van sin secuencia)
+    Counter peers_expired; // peers olvidados por --peer-timeout
+    Counter resend_throttled; // NACK cortados por NACK_MAX_MSGS o --resend-rate
+    Counter batches, busy_ns; // lotes de recvmmsg() y tiempo procesándolos
+    Counter batch_max_ns; // lote más largo desde la foto anterior
+} UdpStats;
+
+static UdpStats stats;
+
+// Administración (--admin-port): el hilo de administración pide la foto y espera al bucle
+static int admin_port = 0; // 0 = sin socket de administración
+static int broker_port; // puerto propio, para despertar a recvmmsg() con un datagrama vacío
+static atomic_int snap_req; // hay una foto pedida
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snap_cond = PTHREAD_COND_INITIALIZER;
+static AdminReport *snap_report; // foto en curso (NULL cuando ya se completó)
+
+// Fragmentación
+static int mtu = 0; // --mtu: 0 = sin límite extra, -1 = según la ruta de cada peer (auto)
+static uint32_t next_msg_id = 1; // id de los mensajes que el broker fragmenta
+static FragTable *reasm; // fragmentos recibidos de los publicadores
 
 // Compara dos direcciones de socket para ver si son iguales.
 static int addr_equal(const struct sockaddr_in *a, const struct sockaddr_in *b) {
@@ -35,58 +239,1130 @@ static int addr_equal(const struct sockaddr_in *a, const struct sockaddr_in *b)
     return a->sin_family == b->sin_family && a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
 }
 
-// Verifica si un cliente ya está suscrito a un tema.
-static int already_subscribed(const char *subject, const struct sockaddr_in *who) {
-    // Recorre la lista de suscripciones.
-    for (SubEntry *e = subs; e; e = e->next)
-        // Si encuentra una entrada con el mismo tema y la misma dirección, retorna verdadero.
-        if (strcmp(e->subject, subject) == 0 && addr_equal(&e->addr, who)) return 1;
-    // Si no encuentra ninguna coincidencia, retorna falso.
-    return 0;
+// Bucket de la tabla de peers para una dirección.
+static size_t peer_bucket(const struct sockaddr_in *a) {
+    uint32_t h = a->sin_addr.s_addr * 2654435761u ^ (uint32_t) a->sin_port * 40503u;
+    return h & (PEER_BUCKETS - 1);
 }
 
-// Agrega una nueva suscripción a la lista.
-static void add_subscription(const char *subject, const struct sockaddr_in *who, socklen_t who_len) {
+// Datagrama más grande hacia una dirección: MAX_DGRAM, acotado por la MTU si se pidió --mtu.
+static size_t dgram_limit(const struct sockaddr_in *a, socklen_t alen) {
+    int m = mtu < 0 ? udp_path_mtu((const struct sockaddr *) a, alen) : mtu;
+    if (m <= UDP_IP_OVERHEAD + V2_HDR_LEN + V2_FRAG_LEN + 256) return MAX_DGRAM; // desconocida o absurda
+    size_t d = (size_t) m - UDP_IP_OVERHEAD;
+    return d < MAX_DGRAM ? d : MAX_DGRAM;
+}
+
+// Busca el peer de una dirección (sin crearlo) y lo marca como visto en este lote.
+static Peer *find_peer(const struct sockaddr_in *who) {
+    for (Peer *p = peers[peer_bucket(who)]; p; p = p->next) {
+        if (!addr_equal(&p->addr, who)) continue;
+        p->last_seen = loop_ns;
+        return p;
+    }
+    return NULL;
+}
+
+// Busca el peer de una dirección, creándolo si no existe.
+static Peer *get_peer(const struct sockaddr_in *who, socklen_t who_len) {
+    Peer *p = find_peer(who);
+    if (p) return p;
+    size_t b = peer_bucket(who);
+    p = (Peer *) calloc(1, sizeof(Peer));
+    if (!p) return NULL;
+    p->addr = *who;
+    p->addrlen = who_len;
+    p->proto = 1;
+    p->max_dgram = dgram_limit(who, who_len);
+    p->last_seen = loop_ns;
+    p->next = peers[b];
+    peers[b] = p;
+    return p;
+}
+
+// Grupo multicast de un tema (dirección en orden de red)
+static uint32_t mcast_group_of(const Subject *s) {
+    return htonl(mcast_base + s->id % MCAST_GROUPS);
+}
+
+// Destino multicast de un tema. Es un Peer más para que la cola de salida lo trate igual (y agrupe
+// con GSO varias publicaciones del mismo tema dentro de un lote).
+static Peer *mcast_dest(const Subject *s) {
+    size_t g = s->id % MCAST_GROUPS;
+    if (!mcast_dests[g]) {
+        Peer *p = (Peer *) calloc(1, sizeof(Peer));
+        if (!p) return NULL;
+        p->addr.sin_family = AF_INET;
+        p->addr.sin_addr.s_addr = mcast_group_of(s);
+        p->addr.sin_port = htons(mcast_port);
+        p->addrlen = sizeof(p->addr);
+        p->proto = 2;
+        p->max_dgram = dgram_limit(&p->addr, p->addrlen);
+        mcast_dests[g] = p;
+    }
+    return mcast_dests[g];
+}
+
+// Agrega una nueva suscripción al índice. Devuelve el tema o NULL si no hay memoria.
+static Subject *add_subscription(Peer *p, const char *subject) {
+    Subject *s = subject_index_intern(&subjects, subject);
+    if (!s) return NULL;
     // Si el cliente ya está suscrito, no hace nada.
-    if (already_subscribed(subject, who)) return;
-    // Reserva memoria para una nueva entrada de suscripción.
-    SubEntry *e = (SubEntry *) calloc(1, sizeof(SubEntry));
-    // Copia el nombre del tema, la dirección del cliente y la longitud de la dirección.
-    strncpy(e->subject, subject, sizeof(e->subject)-1);
-    e->addr = *who;
-    e->addrlen = who_len;
-    // Inserta la nueva entrada al principio de la lista.
-    e->next = subs;
-    subs = e;
-}
-
-// Envía un mensaje a todos los suscriptores de un tema.
-static void fanout_message(int sock, const char *subject, const char *payload, size_t len) {
-    char header[256];
-    // Construye la cabecera del mensaje.
-    int hlen = snprintf(header, sizeof(header), "MESSAGE %s %zu\n", subject, len);
-    char buf[MAX_DGRAM];
-    // Verifica si el mensaje completo (cabecera + payload) cabe en el buffer.
-    if ((size_t) hlen + len > sizeof(buf)) {
-        if ((size_t) hlen >= sizeof(buf)) return; // Si ni siquiera la cabecera cabe, no se puede hacer nada.
-        len = sizeof(buf) - (size_t) hlen; // Trunca el payload si es necesario.
-    }
-    // Copia la cabecera al buffer.
-    memcpy(buf, header, (size_t)hlen);
-    // Si hay payload, lo copia después de la cabecera.
-    if (len > 0)
-        memcpy(buf+hlen, payload, len);
-
-    // Recorre la lista de suscripciones.
-    for (SubEntry *e = subs; e; e = e->next)
-        // Si la suscripción es para el tema del mensaje, envía el datagrama al suscriptor.
-        if (strcmp(e->subject, subject) == 0)
-            (void) sendto(sock, buf, (size_t) hlen + len, 0, (struct sockaddr *) &e->addr, e->addrlen);
+    for (size_t i = 0; i < p->nsubs; i++)
+        if (p->subs[i]->subject == s) return s;
+    if (p->nsubs == p->subs_cap) {
+        size_t ncap = p->subs_cap ? p->subs_cap * 2 : 4;
+        SubLink **n = (SubLink **) realloc(p->subs, ncap * sizeof(SubLink *));
+        if (!n) return NULL;
+        p->subs = n;
+        p->subs_cap = ncap;
+    }
+    SubLink *l = (SubLink *) calloc(1, sizeof(SubLink));
+    if (!l) return NULL;
+    if (subject_link(s, l, p) < 0) {
+        free(l);
+        return NULL;
+    }
+    p->subs[p->nsubs++] = l;
+    return s;
+}
+
+// Quita la suscripción exacta de 'p' a un tema; 0 si no estaba suscrito.
+static int remove_subscription(Peer *p, const char *subject) {
+    for (size_t i = 0; i < p->nsubs; i++) {
+        if (strcmp(p->subs[i]->subject->name, subject) != 0) continue;
+        for (size_t j = 0; j < p->nreplays; j++)
+            if (p->replays[j].subject == p->subs[i]->subject) p->replays[j].next = p->replays[j].upto; // terminada
+        subject_unlink(p->subs[i]);
+        free(p->subs[i]);
+        p->subs[i] = p->subs[--p->nsubs];
+        return 1;
+    }
+    return 0;
+}
+
+// Suscribe 'p' a un patrón y lo anota para poder quitarlo; -1 si no es válido o no hay memoria.
+static int add_pattern(Peer *p, const char *pattern) {
+    int r = sub_trie_add(trie, pattern, p);
+    if (r != 0) return r < 0 ? -1 : 0; // ya suscrito: nada que anotar
+    if (p->npatterns == p->patterns_cap) {
+        size_t ncap = p->patterns_cap ? p->patterns_cap * 2 : 4;
+        char **n = (char **) realloc(p->patterns, ncap * sizeof(char *));
+        if (!n) goto fail;
+        p->patterns = n;
+        p->patterns_cap = ncap;
+    }
+    if (!(p->patterns[p->npatterns] = strdup(pattern))) goto fail;
+    p->npatterns++;
+    return 0;
+fail:
+    sub_trie_remove(trie, pattern, p);
+    return -1;
+}
+
+// Quita un patrón de 'p'; 0 si no estaba suscrito.
+static int remove_pattern(Peer *p, const char *pattern) {
+    for (size_t i = 0; i < p->npatterns; i++) {
+        if (strcmp(p->patterns[i], pattern) != 0) continue;
+        sub_trie_remove(trie, pattern, p);
+        free(p->patterns[i]);
+        p->patterns[i] = p->patterns[--p->npatterns];
+        return 1;
+    }
+    return 0;
+}
+
+// Une 'p' a un grupo de cola y lo anota para poder salir; -1 si el tema no es válido o no hay memoria.
+static int join_group(Peer *p, const char *subject, const char *name) {
+    QGroup *g;
+    int r = qgroup_join(qgroups, subject, name, p, &g);
+    if (r != 0) return r < 0 ? -1 : 0; // ya era miembro
+    if (p->ngroups == p->groups_cap) {
+        size_t ncap = p->groups_cap ? p->groups_cap * 2 : 4;
+        QGroup **n = (QGroup **) realloc(p->groups, ncap * sizeof(QGroup *));
+        if (!n) {
+            qgroup_leave(qgroups, g, p);
+            return -1;
+        }
+        p->groups = n;
+        p->groups_cap = ncap;
+    }
+    p->groups[p->ngroups++] = g;
+    return 0;
+}
+
+// Saca a 'p' de un grupo de cola (el grupo se libera si queda vacío); 0 si no era miembro.
+static int leave_group(Peer *p, const char *subject, const char *name) {
+    QGroup *g = qgroup_find(qgroups, subject, name);
+    for (size_t i = 0; g && i < p->ngroups; i++) {
+        if (p->groups[i] != g) continue;
+        qgroup_leave(qgroups, g, p);
+        p->groups[i] = p->groups[--p->ngroups];
+        return 1;
+    }
+    return 0;
+}
+
+// Libera un peer con todas sus suscripciones, patrones y grupos (ya fuera de la tabla de peers).
+static void free_peer(Peer *p) {
+    for (size_t i = 0; i < p->nsubs; i++) {
+        subject_unlink(p->subs[i]);
+        free(p->subs[i]);
+    }
+    for (size_t i = 0; i < p->npatterns; i++) {
+        sub_trie_remove(trie, p->patterns[i], p);
+        free(p->patterns[i]);
+    }
+    for (size_t i = 0; i < p->ngroups; i++) qgroup_leave(qgroups, p->groups[i], p);
+    for (size_t i = 0; i < nreplaying; i++) {
+        if (replaying[i] != p) continue;
+        replaying[i] = replaying[--nreplaying];
+        break;
+    }
+    free(p->replays);
+    free(p->subs);
+    free(p->patterns);
+    free(p->groups);
+    free(p->pub_ids);
+    free(p);
+}
+
+// Olvida los peers de los que no llegó nada en --peer-timeout. Solo con la cola de salida vacía
+// (justo después de out_flush()): los envíos pendientes apuntan a sus peers.
+static void expire_peers(uint64_t now) {
+    if (!peer_timeout_ns) return;
+    for (size_t b = 0; b < PEER_BUCKETS; b++) {
+        Peer **pp = &peers[b];
+        while (*pp) {
+            Peer *p = *pp;
+            if (now - p->last_seen <= peer_timeout_ns) {
+                pp = &p->next;
+                continue;
+            }
+            *pp = p->next;
+            free_peer(p);
+            counter_add(&stats.peers_expired, 1);
+        }
+    }
+}
+
+// ¿Lo recibe algún patrón o grupo de cola? (las suscripciones exactas se ven en el índice)
+static int pattern_wants(const char *name) {
+    size_t ngroups;
+    if (sub_trie_match_any(trie, name)) return 1;
+    (void) qgroup_match(qgroups, name, &ngroups);
+    return ngroups > 0;
+}
+
+// Tema de un PUBLISH. Un tema que nadie pidió no se interna (ni tiene anillo): las suscripciones
+// exactas ya lo internaron y si no, se interna solo si lo recibe un patrón o un grupo de patrón, para
+// guardar sus coincidencias. Publicar a un patrón no es válido.
+static Subject *publish_subject(const char *name) {
+    Subject *s = subject_index_find(&subjects, name);
+    if (s || subject_is_pattern(name)) return s;
+    return pattern_wants(name) ? subject_index_intern(&subjects, name) : NULL;
+}
+
+// Asociar un id de tema elegido por un publicador v2; -1 si el id está fuera de rango
+static int bind_pub_id(Peer *p, uint32_t id, Subject *s) {
+    if (id >= MAX_PUB_IDS) return -1;
+    if (id >= p->pub_ids_cap) {
+        size_t ncap = p->pub_ids_cap ? p->pub_ids_cap : 16;
+        while (ncap <= id) ncap *= 2;
+        Subject **n = (Subject **) realloc(p->pub_ids, ncap * sizeof(Subject *));
+        if (!n) return -1;
+        memset(n + p->pub_ids_cap, 0, (ncap - p->pub_ids_cap) * sizeof(Subject *));
+        p->pub_ids = n;
+        p->pub_ids_cap = ncap;
+    }
+    p->pub_ids[id] = s;
+    return 0;
+}
+
+// Envía un envío GSO que el kernel rechazó (p. ej. segmentos mayores que la MTU) datagrama por datagrama.
+static void send_segments(const OutEntry *e) {
+    for (size_t i = 0; i < e->nsegs; i++)
+        if (sendto(out_sock, e->iov[i].iov_base, e->iov[i].iov_len, 0, (const struct sockaddr *) &e->peer->addr,
+                   e->peer->addrlen) < 0)
+            counter_add(&stats.send_errors, 1);
+}
+
+// Vaciar la cola de salida con sendmmsg()
+static void out_flush(void) {
+    for (size_t i = 0; i < out_count; i++) {
+        OutEntry *e = &out[i];
+        struct msghdr *h = &out_msgs[i].msg_hdr;
+        memset(h, 0, sizeof(*h));
+        h->msg_name = &e->peer->addr;
+        h->msg_namelen = e->peer->addrlen;
+        h->msg_iov = e->iov;
+        h->msg_iovlen = e->nsegs;
+        if (e->nsegs > 1) {
+            // Tamaño de segmento para GSO
+            h->msg_control = e->ctrl;
+            h->msg_controllen = sizeof(e->ctrl);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(h);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t seg = (uint16_t) e->seglen;
+            memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+        }
+    }
+    size_t done = 0;
+    while (done < out_count) {
+        int r = sendmmsg(out_sock, out_msgs + done, (unsigned) (out_count - done), 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            // El envío 'done' falló: si era GSO se reintenta por partes; si no, el datagrama se pierde.
+            if (out[done].nsegs > 1) send_segments(&out[done]);
+            else counter_add(&stats.send_errors, 1);
+            done++;
+            continue;
+        }
+        done += (size_t) r;
+    }
+    out_count = 0;
+    out_epoch++;
+}
+
+// Reservar 'n' ranuras para datagramas; si no alcanzan, se vacía la cola y se reutilizan todas.
+// Se llama antes de armar datagramas, nunca mientras la cola referencia ranuras que se siguen usando.
+static void out_reserve(size_t n) {
+    if (out_nslots + n > OUT_SLOTS) {
+        out_flush();
+        out_nslots = 0;
+    }
+}
+
+// Ranura para un datagrama (después de out_reserve())
+static char *out_slot(void) {
+    return out_slots[out_nslots++];
+}
+
+// Encolar un datagrama armado para un peer. Si el último envío encolado para ese peer tiene
+// datagramas del mismo tamaño, se agrega como un segmento más.
+static void out_push(Peer *p, const char *data, size_t len) {
+    p->dgrams_out++;
+    p->bytes_out += len;
+    counter_add(&stats.dgrams_out, 1);
+    counter_add(&stats.bytes_out, len);
+    if (use_gso && p->out_epoch == out_epoch) {
+        OutEntry *e = &out[p->out_entry];
+        if (e->seglen == len && e->nsegs < GSO_MAX_SEGS && e->bytes + len <= GSO_MAX_BYTES) {
+            e->iov[e->nsegs].iov_base = (void *) data;
+            e->iov[e->nsegs].iov_len = len;
+            e->nsegs++;
+            e->bytes += len;
+            return;
+        }
+    }
+    if (out_count == OUT_ENTRIES) out_flush(); // las ranuras siguen siendo válidas
+    OutEntry *e = &out[out_count];
+    e->peer = p;
+    e->iov[0].iov_base = (void *) data;
+    e->iov[0].iov_len = len;
+    e->nsegs = 1;
+    e->seglen = len;
+    e->bytes = len;
+    p->out_entry = out_count++;
+    p->out_epoch = out_epoch;
+}
+
+// Encolar una respuesta corta (se copia a una ranura propia)
+static void out_reply(Peer *p, const void *data, size_t len) {
+    out_reserve(1);
+    char *slot = out_slot();
+    memcpy(slot, data, len);
+    out_push(p, slot, len);
+}
+
+// Arma un MESSAGE de texto en 'dst' (MAX_DGRAM bytes); 'seq' 0 = sin secuencia. Devuelve el largo o
+// 0 si no entra en un datagrama (se envía fragmentado).
+static size_t encode_text(char *dst, const Subject *s, uint64_t seq, const char *payload, size_t len) {
+    int hlen = seq ? snprintf(dst, MAX_DGRAM, "MESSAGE %s %zu %llu\n", s->name, len, (unsigned long long) seq)
+                   : snprintf(dst, MAX_DGRAM, "MESSAGE %s %zu\n", s->name, len);
+    if (hlen < 0 || (size_t) hlen + len > MAX_DGRAM) return 0;
+    memcpy(dst + hlen, payload, len);
+    return (size_t) hlen + len;
+}
+
+// Arma un MESSAGE v2 en 'dst' (MAX_DGRAM bytes), con o sin el nombre del tema y la secuencia. Con
+// 'frag' el payload es ese fragmento. Devuelve 0 si no entra.
+static size_t encode_v2(char *dst, const Subject *s, int with_name, uint64_t seq, const V2Frag *frag,
+                        const char *payload, size_t len) {
+    size_t slen = with_name ? strlen(s->name) : 0;
+    size_t hdr = V2_HDR_LEN + slen + (seq ? V2_SEQ_LEN : 0) + (frag ? V2_FRAG_LEN : 0);
+    if (hdr + len > MAX_DGRAM) return 0;
+    uint8_t flags = (uint8_t) ((seq ? V2_FLAG_SEQ : 0) | (frag ? V2_FLAG_FRAG : 0));
+    v2_encode((unsigned char *) dst, V2_MESSAGE, flags, (uint16_t) slen, s->id, (uint32_t) len);
+    char *w = dst + V2_HDR_LEN;
+    memcpy(w, s->name, slen);
+    w += slen;
+    if (seq) {
+        v2_put_u64((unsigned char *) w, seq);
+        w += V2_SEQ_LEN;
+    }
+    if (frag) {
+        v2_put_frag((unsigned char *) w, frag);
+        w += V2_FRAG_LEN;
+    }
+    memcpy(w, payload, len);
+    return hdr + len;
+}
+
+// Pérdida simulada (--loss): decide si descartar un datagrama de entrega.
+static int inject_loss(void) {
+    if (loss_pct > 0 && (double) rand() < loss_pct / 100.0 * ((double) RAND_MAX + 1.0)) {
+        counter_add(&stats.loss_injected, 1);
+        return 1;
+    }
+    return 0;
+}
+
+// Arena de cada anillo y lo que reserva un anillo entero (lo que cuenta para --ring-memory)
+static size_t ring_arena(void) {
+    return ring_bytes ? ring_bytes : ring_size * RETAIN_AVG_BYTES;
+}
+
+static size_t ring_cost(void) {
+    return sizeof(TopicRing) + retain_footprint(ring_size, ring_arena());
+}
+
+// Anillo de retención de un tema; NULL si no tiene (nadie lo recibió todavía o se liberó)
+static RetainRing *ring_of(const Subject *s) {
+    return s->data ? ((TopicRing *) s->data)->ring : NULL;
+}
+
+// ¿Alguien recibe el tema? (suscripción exacta, patrón o grupo de cola)
+static int has_interest(const Subject *s) {
+    return s->nsubs || pattern_wants(s->name);
+}
+
+// Crea el anillo de un tema si entra en --ring-memory; NULL si no entra o no hay memoria.
+static TopicRing *ring_new(Subject *s) {
+    size_t cost = ring_cost();
+    if (ring_mem + cost > ring_limit) {
+        counter_add(&stats.rings_refused, 1);
+        return NULL;
+    }
+    TopicRing *t = (TopicRing *) malloc(sizeof(TopicRing));
+    if (!t) return NULL;
+    if (!(t->ring = retain_new(ring_size, ring_arena()))) {
+        free(t);
+        return NULL;
+    }
+    t->used_ns = loop_ns;
+    s->data = t;
+    ring_mem += cost;
+    ring_count++;
+    return t;
+}
+
+// Libera los anillos de los temas que pasaron RING_IDLE_NS sin interesados. Lo retenido se pierde:
+// un FROM o un NACK posterior no encuentra nada.
+static void sweep_rings(uint64_t now) {
+    for (size_t b = 0; b < subjects.nbuckets && ring_count; b++) {
+        for (Subject *s = subjects.buckets[b]; s; s = s->next) {
+            TopicRing *t = (TopicRing *) s->data;
+            if (!t) continue;
+            if (has_interest(s)) {
+                t->used_ns = now;
+            } else if (now - t->used_ns > RING_IDLE_NS) {
+                retain_free(t->ring);
+                free(t);
+                s->data = NULL;
+                ring_mem -= ring_cost();
+                ring_count--;
+            }
+        }
+    }
+}
+
+// Asigna la próxima secuencia del tema y guarda una copia del payload en su anillo. El anillo se crea
+// recién cuando el tema tiene interesados ('interested'); un tema que ya lo tiene sigue reteniendo
+// hasta que sweep_rings() lo libera. Devuelve 0 sin anillo (el mensaje se entrega sin secuencia).
+static uint64_t sequence_message(Subject *s, int interested, const char *payload, size_t len) {
+    TopicRing *t = (TopicRing *) s->data;
+    if (!t && interested) t = ring_new(s);
+    if (!t) return 0;
+    if (interested) t->used_ns = loop_ns;
+    return retain_append(t->ring, payload, len);
+}
+
+// Encola un mensaje que no entra en un datagrama de 'p' como fragmentos v2 de hasta p->max_dgram.
+static void push_fragments(Peer *p, const Subject *s, int with_name, uint64_t seq, uint32_t msg_id,
+                           const char *payload, size_t len) {
+    size_t hdr = V2_HDR_LEN + (with_name ? strlen(s->name) : 0) + (seq ? V2_SEQ_LEN : 0) + V2_FRAG_LEN;
+    if (hdr >= p->max_dgram || len > FRAG_MAX_MESSAGE) {
+        counter_add(&stats.dropped_oversize, 1);
+        return;
+    }
+    size_t chunk = p->max_dgram - hdr;
+    size_t count = (len + chunk - 1) / chunk;
+    if (count > UINT16_MAX) {
+        counter_add(&stats.dropped_oversize, 1);
+        return;
+    }
+    V2Frag fr = {msg_id, 0, (uint16_t) count, (uint32_t) len, 0};
+    for (size_t i = 0; i < count; i++) {
+        size_t off = i * chunk;
+        size_t flen = len - off < chunk ? len - off : chunk;
+        fr.index = (uint16_t) i;
+        fr.offset = (uint32_t) off;
+        if (inject_loss()) continue;
+        out_reserve(1);
+        char *f = out_slot();
+        size_t dlen = encode_v2(f, s, with_name, seq, &fr, payload + off, flen);
+        if (dlen) out_push(p, f, dlen);
+    }
+}
+
+// Encola un mensaje completo para un solo destino, en un datagrama o fragmentado. Los peers de texto
+// (y los grupos multicast) reciben el nombre del tema en los fragmentos.
+static void push_message(Peer *p, const Subject *s, int with_name, uint64_t seq, uint32_t msg_id,
+                         const char *payload, size_t len) {
+    out_reserve(1);
+    char *f = out_slot();
+    size_t flen = p->proto == 2 ? encode_v2(f, s, with_name, seq, NULL, payload, len)
+                                : encode_text(f, s, seq, payload, len);
+    if (flen && flen <= p->max_dgram) {
+        if (!inject_loss()) out_push(p, f, flen);
+        return;
+    }
+    push_fragments(p, s, with_name || p->proto != 2, seq, msg_id, payload, len);
+}
+
+// Entrega a los peers que reciben el tema solo por un patrón (los que no marcó la pasada de
+// suscripciones exactas), por unicast y en v2 con el nombre del tema.
+static void fanout_wild(const Subject *s, void *const *match, size_t n, uint64_t seq, uint32_t msg_id,
+                        const char *payload, size_t len) {
+    for (size_t i = 0; i < n; i++) {
+        Peer *p = (Peer *) match[i];
+        if (p->fan_mark == fan_stamp) continue;
+        push_message(p, s, 1, seq, msg_id, payload, len);
+    }
+}
+
+// Entrega a un miembro de cada grupo de cola del tema, por unicast (con el nombre si el grupo es de un
+// patrón, como en fanout_wild()).
+static void fanout_groups(const Subject *s, QGroup *const *groups, size_t n, uint64_t seq, uint32_t msg_id,
+                          const char *payload, size_t len) {
+    for (size_t i = 0; i < n; i++) {
+        Peer *p = (Peer *) qgroup_pick(groups[i], QGROUP_ROUND_ROBIN, NULL, NULL);
+        if (p) push_message(p, s, subject_is_pattern(groups[i]->subject), seq, msg_id, payload, len);
+    }
+}
+
+// Envía un mensaje a todos los suscriptores de un tema. Arma el datagrama de texto y el binario
+// solo si algún suscriptor lo necesita, una sola vez cada uno, y los encola para el próximo vaciado.
+// Los suscriptores a los que no les entra en un datagrama lo reciben fragmentado en una segunda pasada.
+static void fanout_message(Subject *s, const char *payload, size_t len) {
+    if (!s) return;
+    s->msgs++;
+    s->bytes += len;
+    counter_add(&stats.msgs_in, 1);
+    counter_add(&stats.msg_bytes_in, len);
+    size_t nmatch, ngroups;
+    void *const *match = subject_matches(s, trie, &nmatch);
+    QGroup *const *groups = qgroup_match(qgroups, s->name, &ngroups);
+    uint64_t seq = ring_size ? sequence_message(s, nmatch || ngroups, payload, len) : 0;
+    if (nmatch == 0 && ngroups == 0) return; // nadie suscrito al tema
+    uint32_t msg_id = next_msg_id++;
+    fan_stamp++;
+    if (mcast) {
+        // Un solo datagrama (o una sola serie de fragmentos) al grupo del tema, con el nombre para
+        // que se pueda demultiplexar aunque varios temas compartan grupo.
+        if (s->nsubs) {
+            Peer *g = mcast_dest(s);
+            if (g) push_message(g, s, 1, seq, msg_id, payload, len);
+            for (size_t i = 0; i < s->nsubs; i++) ((Peer *) s->owners[i])->fan_mark = fan_stamp;
+        }
+        fanout_wild(s, match, nmatch, seq, msg_id, payload, len);
+        fanout_groups(s, groups, ngroups, seq, msg_id, payload, len);
+        return;
+    }
+    out_reserve(2); // ranuras para la versión de texto y la binaria
+    char *tbuf = NULL, *bbuf = NULL;
+    size_t tlen = 0, blen = 0; // 0 = no entra en un datagrama
+    size_t nfrag = 0; // suscriptores que necesitan fragmentos
+    // Recorre solo los suscriptores del tema y les envía el datagrama.
+    for (size_t i = 0; i < s->nsubs; i++) {
+        Peer *p = (Peer *) s->owners[i];
+        if (p->proto == 2) {
+            if (!bbuf) {
+                bbuf = out_slot();
+                // Cabecera binaria fija: solo el id del tema.
+                blen = encode_v2(bbuf, s, 0, seq, NULL, payload, len);
+            }
+            if (!blen || blen > p->max_dgram) {
+                nfrag++;
+                continue;
+            }
+            if (!inject_loss()) out_push(p, bbuf, blen);
+        } else {
+            if (!tbuf) {
+                tbuf = out_slot();
+                tlen = encode_text(tbuf, s, seq, payload, len);
+            }
+            if (!tlen || tlen > p->max_dgram) {
+                nfrag++;
+                continue;
+            }
+            if (!inject_loss()) out_push(p, tbuf, tlen);
+        }
+        p->fan_mark = fan_stamp;
+    }
+    // Los fragmentos pueden vaciar la cola y reutilizar las ranuras, por eso van después.
+    for (size_t i = 0; nfrag && i < s->nsubs; i++) {
+        Peer *p = (Peer *) s->owners[i];
+        size_t whole = p->proto == 2 ? blen : tlen;
+        if (whole && whole <= p->max_dgram) continue;
+        push_fragments(p, s, p->proto != 2, seq, msg_id, payload, len);
+        nfrag--;
+    }
+    if (match != (void *const *) s->owners) fanout_wild(s, match, nmatch, seq, msg_id, payload, len);
+    fanout_groups(s, groups, ngroups, seq, msg_id, payload, len);
+}
+
+// Bytes que todavía se le pueden reenviar a 'p': el crédito se recarga a --resend-rate por segundo y
+// acumula como mucho RESEND_BURST_NS de envíos.
+static uint64_t resend_budget(Peer *p) {
+    uint64_t burst = resend_rate * RESEND_BURST_NS / 1000000000ull;
+    uint64_t dt = loop_ns - p->resend_ns;
+    if (dt > RESEND_BURST_NS) dt = RESEND_BURST_NS;
+    p->resend_tokens += dt * resend_rate / 1000000000ull;
+    if (p->resend_tokens > burst) p->resend_tokens = burst;
+    p->resend_ns = loop_ns;
+    return p->resend_tokens;
+}
+
+// Descontar un reenvío del crédito (un mensaje más grande que lo que queda igual sale: deja el crédito en 0)
+static void resend_charge(Peer *p, size_t len) {
+    p->resend_tokens = len < p->resend_tokens ? p->resend_tokens - len : 0;
+}
+
+// Reenvía a 'p' los mensajes [from, from + count) de un tema que sigan en el anillo, mientras queden
+// '*left' mensajes del NACK y crédito del peer. Los que ya se sobrescribieron se informan con
+// "LOST <tema> <desde> <cantidad>\n" para que el suscriptor no insista. Devuelve -1 si se cortó.
+static int retransmit(Peer *p, Subject *s, uint64_t from, uint64_t count, size_t *left) {
+    RetainRing *r = ring_of(s);
+    if (!r) return 0; // nunca tuvo anillo o ya se liberó
+    if (count > ring_size) count = ring_size;
+    uint64_t lost_from = 0, lost_n = 0;
+    int cut = 0;
+    for (uint64_t seq = from; seq - from < count && seq < retain_next(r); seq++) {
+        size_t len;
+        const char *data = retain_get(r, seq, &len);
+        if (!data) {
+            if (!lost_n) lost_from = seq;
+            lost_n++;
+            continue;
+        }
+        if (*left == 0 || resend_budget(p) == 0) {
+            cut = -1;
+            break;
+        }
+        // Por unicast en el formato del peer, aunque el original haya ido por multicast.
+        // Con el nombre: el peer puede haberlo recibido por un patrón y no conocer el id.
+        push_message(p, s, 1, seq, next_msg_id++, data, len);
+        resend_charge(p, len);
+        (*left)--;
+        counter_add(&stats.retransmits, 1);
+    }
+    if (lost_n) {
+        counter_add(&stats.lost_reported, lost_n);
+        char line[V2_MAX_SUBJECT + 64];
+        int n = snprintf(line, sizeof(line), "LOST %s %llu %llu\n", s->name, (unsigned long long) lost_from,
+                         (unsigned long long) lost_n);
+        if (n > 0 && (size_t) n < sizeof(line)) {
+            out_reply(p, line, (size_t) n);
+            resend_charge(p, (size_t) n);
+        }
+    }
+    return cut;
+}
+
+// Avanza las reproducciones de 'p' mientras tenga crédito. Lo que el anillo ya descartó se saltea.
+static void pump_peer(Peer *p) {
+    for (size_t i = 0; i < p->nreplays;) {
+        Replay *rp = &p->replays[i];
+        RetainRing *r = ring_of(rp->subject);
+        if (r && rp->next < retain_first(r)) rp->next = retain_first(r);
+        while (r && rp->next < rp->upto && rp->next < retain_next(r) && resend_budget(p) > 0) {
+            size_t len;
+            const char *data = retain_get(r, rp->next, &len);
+            if (data) {
+                push_message(p, rp->subject, 1, rp->next, next_msg_id++, data, len);
+                resend_charge(p, len);
+            }
+            rp->next++;
+        }
+        if (r && rp->next < rp->upto && rp->next < retain_next(r)) return; // sin crédito: sigue en el próximo lote
+        p->replays[i] = p->replays[--p->nreplays]; // terminada (o el anillo se liberó)
+    }
+}
+
+// Avanza todas las reproducciones en curso (una vez por vuelta del bucle, antes de vaciar la cola).
+static void pump_replays(void) {
+    for (size_t i = 0; i < nreplaying;) {
+        Peer *p = replaying[i];
+        pump_peer(p);
+        if (p->nreplays) i++;
+        else replaying[i] = replaying[--nreplaying];
+    }
+}
+
+// Reproduce para 'p' lo retenido de un tema a partir de 'spec' (SUBSCRIBE ... FROM <spec>), por
+// unicast y hasta lo último retenido al suscribirse; lo que sigue llega en vivo. Sale lo que permite
+// el crédito del peer y el resto en los lotes siguientes (pump_replays()). Sin retención se ignora.
+static void replay(Peer *p, Subject *s, const char *spec) {
+    RetainFrom f;
+    if (!ring_size || retain_parse_from(spec, &f) < 0) return;
+    RetainRing *r = ring_of(s);
+    if (!r || retain_start(r, f) == retain_next(r)) return;
+    Replay *rp = NULL;
+    for (size_t i = 0; i < p->nreplays; i++)
+        if (p->replays[i].subject == s) rp = &p->replays[i]; // un FROM nuevo reemplaza al anterior
+    if (!rp) {
+        if (p->nreplays == p->replays_cap) {
+            size_t ncap = p->replays_cap ? p->replays_cap * 2 : 4;
+            Replay *n = (Replay *) realloc(p->replays, ncap * sizeof(Replay));
+            if (!n) return;
+            p->replays = n;
+            p->replays_cap = ncap;
+        }
+        if (p->nreplays == 0) {
+            if (nreplaying == replaying_cap) {
+                size_t ncap = replaying_cap ? replaying_cap * 2 : 16;
+                Peer **n = (Peer **) realloc(replaying, ncap * sizeof(Peer *));
+                if (!n) return;
+                replaying = n;
+                replaying_cap = ncap;
+            }
+            replaying[nreplaying++] = p;
+        }
+        rp = &p->replays[p->nreplays++];
+    }
+    *rp = (Replay) {s, retain_start(r, f), retain_next(r)};
+    pump_peer(p);
+}
+
+// Procesa un datagrama de NACKs: una línea por tema con pares "<desde> <cantidad>".
+//  NACK <tema> <desde> <cantidad> [<desde> <cantidad> ...]\n
+static void handle_nack(const char *buf, size_t n, Peer *p) {
+    if (!ring_size) return;
+    size_t left = NACK_MAX_MSGS; // mensajes que todavía puede reenviar este datagrama
+    char text[MAX_DGRAM + 1];
+    memcpy(text, buf, n);
+    text[n] = '\0';
+    char *save = NULL;
+    for (char *line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        // el tema puede ser tan largo como en v2 (V2_MAX_SUBJECT)
+        if (strncmp(line, "NACK ", 5) != 0) continue;
+        char *subject = line + 5, *cur = subject + strcspn(subject, " "), *end;
+        if (cur == subject || (size_t) (cur - subject) > V2_MAX_SUBJECT) continue;
+        if (*cur) *cur++ = '\0';
+        Subject *s = subject_index_find(&subjects, subject);
+        if (!s) continue;
+        while (1) {
+            unsigned long long from = strtoull(cur, &end, 10);
+            if (end == cur) break;
+            cur = end;
+            unsigned long long count = strtoull(cur, &end, 10);
+            if (end == cur) break;
+            cur = end;
+            if (retransmit(p, s, from, count, &left) < 0) {
+                counter_add(&stats.resend_throttled, 1);
+                return;
+            }
+        }
+    }
+}
+
+// Procesa un frame binario v2.
+static void handle_frame(const unsigned char *buf, size_t n, const struct sockaddr_in *cli, socklen_t clilen) {
+    V2Header h = v2_decode(buf);
+    if (V2_HDR_LEN + (size_t) h.subject_len > n || h.subject_len > V2_MAX_SUBJECT) return; // mal formado
+    char name[V2_MAX_SUBJECT + 1];
+    memcpy(name, buf + V2_HDR_LEN, h.subject_len);
+    name[h.subject_len] = '\0';
+    const char *payload = (const char *) buf + V2_HDR_LEN + h.subject_len;
+    size_t avail = n - V2_HDR_LEN - h.subject_len;
+    Peer *p = get_peer(cli, clilen);
+    if (!p) return;
+    char *whole = NULL; // mensaje reensamblado
+    if (h.opcode == V2_PUBLISH && (h.flags & V2_FLAG_FRAG)) {
+        // Fragmento: se procesa recién cuando llegó el mensaje completo. Un publicador de texto también
+        // fragmenta en v2, así que esto no cambia el formato en que recibe el peer.
+        if (avail < V2_FRAG_LEN) return;
+        V2Frag fr = v2_get_frag((const unsigned char *) payload);
+        payload += V2_FRAG_LEN;
+        avail -= V2_FRAG_LEN;
+        size_t flen = h.payload_len < avail ? h.payload_len : avail;
+        uint64_t src = ((uint64_t) cli->sin_addr.s_addr << 16) | cli->sin_port;
+        size_t wlen = 0;
+        whole = frag_table_add(reasm, src, &fr, payload, flen, lat_now_ns(), &wlen);
+        if (!whole) return;
+        payload = whole;
+        avail = wlen;
+        h.payload_len = (uint32_t) wlen;
+    } else {
+        p->proto = 2;
+    }
+    size_t len = h.payload_len < avail ? h.payload_len : avail;
+
+    if (h.subject_len > 0 && !subject_levels_ok(name)) {
+        // más niveles de los que compara el trie: no se publica ni se suscribe (v2 no responde errores)
+        if (h.opcode == V2_PUBLISH && h.subject_id < p->pub_ids_cap) p->pub_ids[h.subject_id] = NULL;
+        free(whole);
+    } else if (h.opcode == V2_PUBLISH) {
+        Subject *s = NULL;
+        if (h.subject_len > 0) {
+            s = publish_subject(name);
+            if (s) (void) bind_pub_id(p, h.subject_id, s);
+            else if (h.subject_id < p->pub_ids_cap) p->pub_ids[h.subject_id] = NULL;
+        } else if (h.subject_id < p->pub_ids_cap) {
+            s = p->pub_ids[h.subject_id];
+        }
+        fanout_message(s, payload, len);
+        free(whole);
+    } else if (h.opcode == V2_SUBSCRIBE && h.subject_len > 0 && (h.flags & V2_FLAG_GROUP)) {
+        // Grupo de cola: el payload es el nombre. El OK trae el id del tema (SUBJECT_NO_ID si es un
+        // patrón) y nunca un grupo multicast: lo del grupo sale por unicast.
+        char group[QGROUP_MAX_NAME];
+        if (len == 0 || len >= QGROUP_MAX_NAME) return;
+        memcpy(group, payload, len);
+        group[len] = '\0';
+        Subject *s = subject_is_pattern(name) ? NULL : subject_index_intern(&subjects, name);
+        if ((!s && !subject_is_pattern(name)) || join_group(p, name, group) < 0) return;
+        unsigned char f[V2_HDR_LEN + V2_MAX_SUBJECT];
+        v2_encode(f, V2_OK, 0, h.subject_len, s ? s->id : SUBJECT_NO_ID, 0);
+        memcpy(f + V2_HDR_LEN, name, h.subject_len);
+        out_reply(p, f, V2_HDR_LEN + h.subject_len);
+    } else if (h.opcode == V2_SUBSCRIBE && h.subject_len > 0 && subject_is_pattern(name)) {
+        // Patrón: OK sin id ni grupo (lo que coincide llega por unicast con el nombre).
+        if (add_pattern(p, name) < 0) return;
+        unsigned char f[V2_HDR_LEN + V2_MAX_SUBJECT];
+        v2_encode(f, V2_OK, 0, h.subject_len, SUBJECT_NO_ID, 0);
+        memcpy(f + V2_HDR_LEN, name, h.subject_len);
+        out_reply(p, f, V2_HDR_LEN + h.subject_len);
+    } else if (h.opcode == V2_SUBSCRIBE && h.subject_len > 0) {
+        Subject *s = add_subscription(p, name);
+        if (!s) return;
+        // El OK devuelve el id con el que llegarán los MESSAGE de este tema (y en multicast, el grupo).
+        unsigned char f[V2_HDR_LEN + V2_MAX_SUBJECT + 6];
+        size_t plen = 0;
+        memcpy(f + V2_HDR_LEN, name, h.subject_len);
+        if (mcast) {
+            uint32_t grp = mcast_group_of(s);
+            uint16_t port = htons(mcast_port);
+            memcpy(f + V2_HDR_LEN + h.subject_len, &grp, 4);
+            memcpy(f + V2_HDR_LEN + h.subject_len + 4, &port, 2);
+            plen = 6;
+        }
+        v2_encode(f, V2_OK, 0, h.subject_len, s->id, (uint32_t) plen);
+        out_reply(p, f, V2_HDR_LEN + h.subject_len + plen);
+        // El payload de un SUBSCRIBE, si viene, es el argumento de FROM.
+        if (len > 0 && len < RETAIN_MAX_SPEC) {
+            char spec[RETAIN_MAX_SPEC];
+            memcpy(spec, payload, len);
+            spec[len] = '\0';
+            replay(p, s, spec);
+        }
+    }
+}
+
+// Procesa un datagrama recibido de 'cli'.
+static void handle_datagram(const char *buf, size_t n, const struct sockaddr_in *cli, socklen_t clilen) {
+    // Frame binario v2: sin parseo de texto.
+    if (v2_is_frame((const unsigned char *) buf, n)) {
+        handle_frame((const unsigned char *) buf, n, cli, clilen);
+        return;
+    }
+    // Pedido de retransmisión (en texto también desde peers v2).
+    if (n > 5 && memcmp(buf, "NACK ", 5) == 0) {
+        Peer *p = get_peer(cli, clilen);
+        counter_add(&stats.nacks, 1);
+        if (p) handle_nack(buf, n, p);
+        return;
+    }
+    // Keepalive de un suscriptor: solo cuenta como actividad (no se responde ni crea el peer).
+    if (n == 5 && memcmp(buf, "PING\n", 5) == 0) {
+        (void) find_peer(cli);
+        return;
+    }
+    // Token de negociación v2.
+    if ((n == 5 && (memcmp(buf, "PUB2\n", 5) == 0 || memcmp(buf, "SUB2\n", 5) == 0))) {
+        Peer *p = get_peer(cli, clilen);
+        if (p) p->proto = 2;
+        return;
+    }
+
+    // Busca el salto de línea para separar la cabecera del payload.
+    const char *nl = memchr(buf, '\n', n);
+    if (!nl) return; // Si no hay salto de línea, el datagrama está mal formado.
+    size_t header_len = (size_t) (nl - buf + 1);
+
+    // Copia la cabecera a un buffer separado.
+    char header[512];
+    size_t cpy = header_len < sizeof(header) - 1 ? header_len : sizeof(header) - 1;
+    memcpy(header, buf, cpy);
+    header[cpy] = '\0';
+
+    char cmd[32], subject[128];
+    size_t len = 0;
+    // Parsea la cabecera para obtener el comando, el tema y la longitud del payload.
+    if (sscanf(header, "%31s %127s %zu", cmd, subject, &len) >= 2) {
+        // Si el comando es SUBSCRIBE, agrega una nueva suscripción.
+        if (strcmp(cmd, "SUBSCRIBE") == 0) {
+            Peer *p = get_peer(cli, clilen);
+            if (!p) return;
+            // SUBSCRIBE <tema> GROUP <nombre>: grupo de cola, sin multicast
+            char kw[8], arg[QGROUP_MAX_NAME];
+            int extra = sscanf(header, "%*s %*s %7s %63s", kw, arg);
+            if (extra == 2 && strcmp(kw, "GROUP") == 0) {
+                if (join_group(p, subject, arg) < 0) out_reply(p, "ERR invalid pattern\n", 20);
+                else out_reply(p, "OK\n", 3);
+                return;
+            }
+            if (subject_is_pattern(subject)) {
+                if (add_pattern(p, subject) < 0) out_reply(p, "ERR invalid pattern\n", 20);
+                else out_reply(p, "OK\n", 3);
+                return;
+            }
+            Subject *s = add_subscription(p, subject);
+            if (!s) return;
+            // Envía una confirmación al suscriptor (en multicast, con el grupo al que debe unirse).
+            if (mcast) {
+                char ok[64];
+                struct in_addr grp = {mcast_group_of(s)};
+                int olen = snprintf(ok, sizeof(ok), "OK MCAST %s %u\n", inet_ntoa(grp), (unsigned) mcast_port);
+                out_reply(p, ok, (size_t) olen);
+            } else {
+                out_reply(p, "OK\n", 3);
+            }
+            // SUBSCRIBE <tema> FROM <seq|last|-N>: primero lo retenido, después en vivo.
+            if (extra == 2 && strcmp(kw, "FROM") == 0 && strlen(arg) < RETAIN_MAX_SPEC) replay(p, s, arg);
+        } else if (strcmp(cmd, "UNSUBSCRIBE") == 0) {
+            // UNSUBSCRIBE <tema> [GROUP <nombre>]
+            Peer *p = get_peer(cli, clilen);
+            if (!p) return;
+            char kw[8], arg[QGROUP_MAX_NAME];
+            int extra = sscanf(header, "%*s %*s %7s %63s", kw, arg);
+            int found;
+            if (extra == 2 && strcmp(kw, "GROUP") == 0) found = leave_group(p, subject, arg);
+            else if (extra > 0) found = -1;
+            else if (subject_is_pattern(subject)) found = remove_pattern(p, subject);
+            else found = remove_subscription(p, subject);
+            if (found < 0) out_reply(p, "ERR unknown keyword\n", 20);
+            else if (!found) out_reply(p, "ERR not subscribed\n", 19);
+            else out_reply(p, "OK\n", 3);
+            // Si el comando es PUBLISH, reenvía el mensaje a los suscriptores.
+        } else if (strcmp(cmd, "PUBLISH") == 0) {
+            (void) find_peer(cli); // un suscriptor que también publica sigue vivo
+            size_t payload_avail = n - header_len;
+            const char *payload = buf + header_len;
+            if (len > payload_avail) len = payload_avail;
+            // Ajusta la longitud si el payload es más corto de lo esperado.
+            fanout_message(publish_subject(subject), payload, len);
+        }
+    }
+}
+
+// Tablas de la foto de administración
+static const char *const peer_labels[] = {"addr", "proto"};
+static const char *const peer_cols[] = {"subs", "dgrams_out", "bytes_out"};
+static const AdminTableDef peer_table = {"peer", peer_labels, 2, peer_cols, 3, 0x6, 0, 2, 1};
+static const char *const subject_labels[] = {"subject"};
+static const char *const subject_cols[] = {"msgs", "bytes", "subscribers"};
+static const AdminTableDef subject_table = {"subject", subject_labels, 1, subject_cols, 3, 0x3, 0, 0, 0};
+
+// Agregar las filas de un peer (los destinos multicast figuran como un peer más, con proto "mcast")
+static void peer_row(AdminReport *r, const Peer *p, const char *proto) {
+    char addr[INET_ADDRSTRLEN + 8], ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &p->addr.sin_addr, ip, sizeof(ip));
+    snprintf(addr, sizeof(addr), "%s:%u", ip, ntohs(p->addr.sin_port));
+    const char *labels[] = {addr, proto};
+    uint64_t vals[] = {p->nsubs, p->dgrams_out, p->bytes_out};
+    admin_row(r, &peer_table, labels, vals);
+}
+
+// Espera máxima de recvmmsg() (SO_RCVTIMEO); solo llama al kernel cuando cambia.
+static void set_wait(int sock, uint64_t ns) {
+    static uint64_t cur;
+    if (ns == cur) return;
+    struct timeval tv = {(time_t) (ns / 1000000000ull), (suseconds_t) (ns % 1000000000ull / 1000)};
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0) cur = ns;
+}
+
+// Completar la foto pedida (hilo principal, entre dos lotes: nadie más toca peers ni temas)
+static void snapshot(void) {
+    pthread_mutex_lock(&snap_lock);
+    AdminReport *r = snap_report;
+    if (r) {
+        size_t npeers = 0;
+        for (size_t b = 0; b < PEER_BUCKETS; b++) {
+            for (const Peer *p = peers[b]; p; p = p->next) {
+                peer_row(r, p, p->proto == 2 ? "v2" : "text");
+                npeers++;
+            }
+        }
+        for (size_t g = 0; g < MCAST_GROUPS; g++)
+            if (mcast_dests[g]) peer_row(r, mcast_dests[g], "mcast");
+        for (size_t b = 0; b < subjects.nbuckets; b++) {
+            for (const Subject *sj = subjects.buckets[b]; sj; sj = sj->next) {
+                const char *labels[] = {sj->name};
+                uint64_t vals[] = {sj->msgs, sj->bytes, sj->nsubs};
+                admin_row(r, &subject_table, labels, vals);
+            }
+        }
+        admin_value(r, "peers", "Known peers", 0, npeers);
+        admin_value(r, "subjects", "Subjects seen", 0, subjects.count);
+        admin_value(r, "patterns", "Wildcard subscriptions", 0, sub_trie_size(trie));
+        admin_value(r, "group_members", "Queue group memberships", 0, qgroup_members(qgroups));
+        admin_value(r, "rings", "Subjects with a retention ring", 0, ring_count);
+        admin_value(r, "ring_bytes", "Bytes reserved by retention rings", 0, ring_mem);
+        // la tabla de reensamblado es del bucle: sus descartes se leen acá y no en collect()
+        uint64_t expired, evicted;
+        frag_table_stats(reasm, &expired, &evicted);
+        admin_value(r, "reassembly_expired_total", "Fragmented messages dropped incomplete after the timeout", 1,
+                    expired);
+        admin_value(r, "reassembly_evicted_total", "Fragmented messages dropped incomplete to make room", 1,
+                    evicted);
+        admin_value(r, "batch_max_ns", "Longest receive batch since the previous snapshot", 0,
+                    counter_get(&stats.batch_max_ns));
+        atomic_store_explicit(&stats.batch_max_ns, 0, memory_order_relaxed); // el máximo es por foto
+        snap_report = NULL;
+        pthread_cond_signal(&snap_cond);
+    }
+    pthread_mutex_unlock(&snap_lock);
+}
+
+// Armar una foto (hilo de administración): suma los contadores y espera las tablas del bucle
+static void collect(AdminReport *r, void *arg) {
+    (void) arg;
+    admin_value(r, "datagrams_in_total", "Datagrams received", 1, counter_get(&stats.dgrams_in));
+    admin_value(r, "bytes_in_total", "Bytes received", 1, counter_get(&stats.bytes_in));
+    admin_value(r, "truncated_in_total", "Datagrams larger than the receive buffer", 1,
+                counter_get(&stats.truncated_in));
+    admin_value(r, "messages_in_total", "Messages published (after reassembly)", 1, counter_get(&stats.msgs_in));
+    admin_value(r, "message_bytes_in_total", "Payload bytes published", 1, counter_get(&stats.msg_bytes_in));
+    admin_value(r, "datagrams_out_total", "Datagrams queued to peers and groups", 1, counter_get(&stats.dgrams_out));
+    admin_value(r, "bytes_out_total", "Bytes queued to peers and groups", 1, counter_get(&stats.bytes_out));
+    admin_value(r, "send_errors_total", "Datagrams lost to failed sends", 1, counter_get(&stats.send_errors));
+    admin_value(r, "dropped_oversize_total", "Deliveries too large to fragment", 1,
+                counter_get(&stats.dropped_oversize));
+    admin_value(r, "loss_injected_total", "Deliveries dropped by --loss", 1, counter_get(&stats.loss_injected));
+    admin_value(r, "nacks_total", "NACK datagrams received", 1, counter_get(&stats.nacks));
+    admin_value(r, "retransmits_total", "Messages retransmitted", 1, counter_get(&stats.retransmits));
+    admin_value(r, "lost_reported_total", "Messages reported LOST", 1, counter_get(&stats.lost_reported));
+    admin_value(r, "resend_throttled_total", "NACKs cut short by the per-NACK cap or --resend-rate", 1,
+                counter_get(&stats.resend_throttled));
+    admin_value(r, "peers_expired_total", "Peers dropped after --peer-timeout without traffic", 1,
+                counter_get(&stats.peers_expired));
+    admin_value(r, "rings_refused_total", "Retention rings not created because of --ring-memory", 1,
+                counter_get(&stats.rings_refused));
+    admin_value(r, "batches_total", "recvmmsg() batches", 1, counter_get(&stats.batches));
+    admin_value(r, "busy_ns_total", "Time spent processing batches", 1, counter_get(&stats.busy_ns));
+
+    // Las tablas las arma el bucle: se lo despierta con un datagrama vacío (recvmmsg lo devuelve con
+    // largo 0 y se ignora) y se espera a que complete la foto.
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return;
+    struct sockaddr_in self = {0};
+    self.sin_family = AF_INET;
+    self.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    self.sin_port = htons((uint16_t) broker_port);
+    pthread_mutex_lock(&snap_lock);
+    snap_report = r;
+    atomic_store(&snap_req, 1);
+    (void) sendto(fd, "", 0, 0, (struct sockaddr *) &self, sizeof(self));
+    while (snap_report) pthread_cond_wait(&snap_cond, &snap_lock);
+    pthread_mutex_unlock(&snap_lock);
+    close(fd);
 }
 
 int main(int argc, char **argv) {
     // Obtiene el puerto de los argumentos de la línea de comandos, o usa el puerto por defecto.
-    int port = (argc > 1) ? atoi(argv[1]) : BROKER_PORT;
+    int port = BROKER_PORT;
+    int recv_batch = DEFAULT_RECV_BATCH;
+    const char *mcast_if = NULL;
+    int mcast_ttl = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--recv-batch") == 0 && i + 1 < argc) {
+            recv_batch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-gso") == 0) {
+            use_gso = 0;
+        } else if (strcmp(argv[i], "--multicast") == 0 && i + 1 < argc) {
+            // GRUPO[:PUERTO]
+            char grp[64];
+            snprintf(grp, sizeof(grp), "%s", argv[++i]);
+            char *colon = strchr(grp, ':');
+            if (colon) {
+                *colon = '\0';
+                mcast_port = (uint16_t) atoi(colon + 1);
+            }
+            struct in_addr a;
+            if (inet_pton(AF_INET, grp, &a) != 1 || !IN_MULTICAST(ntohl(a.s_addr))) {
+                fprintf(stderr, "--multicast: %s is not an IPv4 multicast group\n", grp);
+                exit(1);
+            }
+            mcast = 1;
+            mcast_base = ntohl(a.s_addr);
+        } else if ((strcmp(argv[i], "--reliable") == 0 || strcmp(argv[i], "--retain") == 0) && i + 1 < argc) {
+            // el mismo anillo sirve para NACK y para FROM
+            long r = atol(argv[i + 1]);
+            if (r < 1 || r > MAX_RING) {
+                fprintf(stderr, "%s must be between 1 and %d\n", argv[i], MAX_RING);
+                exit(1);
+            }
+            ring_size = (size_t) r;
+            i++;
+        } else if (strcmp(argv[i], "--retain-bytes") == 0 && i + 1 < argc) {
+            ring_bytes = (size_t) atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--ring-memory") == 0 && i + 1 < argc) {
+            ring_limit = (size_t) atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--resend-rate") == 0 && i + 1 < argc) {
+            long long r = atoll(argv[++i]);
+            if (r < 1 || (unsigned long long) r > MAX_RESEND_RATE) {
+                fprintf(stderr, "--resend-rate must be between 1 and %llu\n", MAX_RESEND_RATE);
+                exit(1);
+            }
+            resend_rate = (uint64_t) r;
+        } else if (strcmp(argv[i], "--peer-timeout") == 0 && i + 1 < argc) {
+            peer_timeout_ns = (uint64_t) atoll(argv[++i]) * 1000000000ull;
+        } else if (strcmp(argv[i], "--mtu") == 0 && i + 1 < argc) {
+            i++;
+            mtu = strcmp(argv[i], "auto") == 0 ? -1 : atoi(argv[i]);
+        } else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) {
+            loss_pct = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--multicast-if") == 0 && i + 1 < argc) {
+            mcast_if = argv[++i];
+        } else if (strcmp(argv[i], "--multicast-ttl") == 0 && i + 1 < argc) {
+            mcast_ttl = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--admin-port") == 0 && i + 1 < argc) {
+            admin_port = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            port = atoi(argv[i]);
+        } else {
+            fprintf(stderr,
+                    "Uso: %s [puerto] [--recv-batch N] [--no-gso] [--multicast GRUPO[:PUERTO]] [--multicast-if IP] "
+                    "[--multicast-ttl N] [--reliable N] [--retain N] [--retain-bytes B] [--ring-memory B] "
+                    "[--resend-rate B] [--peer-timeout SEC] [--loss PCT] [--mtu N|auto] [--admin-port N]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (recv_batch < 1 || recv_batch > MAX_RECV_BATCH) {
+        fprintf(stderr, "--recv-batch must be between 1 and %d\n", MAX_RECV_BATCH);
+        exit(1);
+    }
+    if (subject_index_init(&subjects) < 0 || !(reasm = frag_table_new(REASM_BYTES, REASM_TIMEOUT_NS)) ||
+        !(trie = sub_trie_new()) || !(qgroups = qgroup_table_new())) {
+        perror("subject index");
+        exit(1);
+    }
 
     // Crea un socket UDP.
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -94,6 +1370,7 @@ int main(int argc, char **argv) {
         perror("socket");
         exit(1);
     }
+    out_sock = sock;
 
     // Configura la dirección del broker para escuchar en cualquier interfaz.
     struct sockaddr_in addr;
@@ -106,59 +1383,112 @@ int main(int argc, char **argv) {
         perror("bind");
         exit(1);
     }
+    // Un mensaje de cientos de KB llega como una ráfaga de fragmentos; el kernel acota esto a rmem_max.
+    int rcvbuf = RCVBUF_BYTES;
+    (void) setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    // recvmmsg() espera como mucho SWEEP_NS para que las tareas periódicas corran aunque no llegue nada.
+    set_wait(sock, SWEEP_NS);
+    // Con --mtu auto los datagramas salen con DF: el kernel sigue la MTU de la ruta en vez de fragmentar.
+    if (mtu < 0) {
+        int pmtu = IP_PMTUDISC_DO;
+        (void) setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+    }
+    // Sin soporte de UDP_SEGMENT en el kernel, cada datagrama va en su propio mmsghdr.
+    int probe = 0;
+    if (use_gso && setsockopt(sock, SOL_UDP, UDP_SEGMENT, &probe, sizeof(probe)) < 0) use_gso = 0;
 
-    printf("Broker UDP started on port %d.\n", port);
+    if (mcast) {
+        // Interfaz de salida de los grupos (p. ej. 127.0.0.1 para probar en una sola máquina) y alcance.
+        if (mcast_if) {
+            struct in_addr ifa;
+            if (inet_pton(AF_INET, mcast_if, &ifa) != 1 ||
+                setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &ifa, sizeof(ifa)) < 0) {
+                perror("IP_MULTICAST_IF");
+                exit(1);
+            }
+        }
+        unsigned char ttl = (unsigned char) mcast_ttl, loop = 1;
+        (void) setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        (void) setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        struct in_addr base = {htonl(mcast_base)};
+        printf("Multicast fanout: groups from %s, port %u.\n", inet_ntoa(base), (unsigned) mcast_port);
+    }
 
-    fd_set rset;
-    char buf[MAX_DGRAM];
-    while (1) {
-        // Prepara el conjunto de descriptores de archivo para select().
-        FD_ZERO(&rset);
-        FD_SET(sock, &rset);
-        // Espera a que lleguen datos al socket.
-        if (select(sock + 1, &rset, NULL, NULL, NULL) < 0) {
-            perror("select");
-            break;
+    if (ring_size && ring_cost() > ring_limit) {
+        fprintf(stderr, "--ring-memory %zu is smaller than one retention ring (%zu bytes)\n", ring_limit, ring_cost());
+        exit(1);
+    }
+    if (ring_size)
+        printf("Sequenced delivery: retention ring of %zu messages / %zu bytes per subject, %zu bytes in total.\n",
+               ring_size, ring_arena(), ring_limit);
+    if (loss_pct > 0) {
+        printf("Injecting %.2f%% loss on deliveries.\n", loss_pct);
+        srand((unsigned) lat_now_ns());
+    }
+
+    printf("Broker UDP started on port %d (recv batch %d, GSO %s).\n", port, recv_batch, use_gso ? "on" : "off");
+    if (admin_port) {
+        broker_port = port;
+        if (admin_start(admin_port, "broker_udp", collect, NULL) < 0) {
+            perror("admin port");
+            exit(1);
         }
-        // Si no hay datos en el socket, continúa el bucle.
-        if (!FD_ISSET(sock, &rset)) continue;
-
-        // Recibe un datagrama.
-        struct sockaddr_in cli;
-        socklen_t clilen = sizeof(cli);
-        ssize_t n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *) &cli, &clilen);
-        if (n <= 0) continue;
-
-        // Busca el salto de línea para separar la cabecera del payload.
-        char *nl = memchr(buf, '\n', (size_t) n);
-        if (!nl) continue; // Si no hay salto de línea, el datagrama está mal formado.
-        size_t header_len = (size_t) (nl - buf + 1);
-
-        // Copia la cabecera a un buffer separado.
-        char header[512];
-        size_t cpy = header_len < sizeof(header) - 1 ? header_len : sizeof(header) - 1;
-        memcpy(header, buf, cpy);
-        header[cpy] = '\0';
-
-        char cmd[32], subject[128];
-        size_t len = 0;
-        // Parsea la cabecera para obtener el comando, el tema y la longitud del payload.
-        if (sscanf(header, "%31s %127s %zu", cmd, subject, &len) >= 2) {
-            // Si el comando es SUBSCRIBE, agrega una nueva suscripción.
-            if (strcmp(cmd, "SUBSCRIBE") == 0) {
-                add_subscription(subject, &cli, clilen);
-                const char *ok = "OK\n";
-                // Envía una confirmación al suscriptor.
-                (void) sendto(sock, ok, strlen(ok), 0, (struct sockaddr *) &cli, clilen);
-                // Si el comando es PUBLISH, reenvía el mensaje a los suscriptores.
-            } else if (strcmp(cmd, "PUBLISH") == 0) {
-                size_t payload_avail = (size_t) n - header_len;
-                const char *payload = (const char *) (buf + header_len);
-                if (len > payload_avail) len = payload_avail;
-                // Ajusta la longitud si el payload es más corto de lo esperado.
-                fanout_message(sock, subject, payload, len);
+        printf("Admin: 127.0.0.1:%d (stats, json, metrics).\n", admin_port);
+    }
+
+    // Buffers de recepción: un datagrama y una dirección por entrada de recvmmsg().
+    static char rbuf[MAX_RECV_BATCH][MAX_DGRAM];
+    static struct sockaddr_in raddr[MAX_RECV_BATCH];
+    static struct iovec riov[MAX_RECV_BATCH];
+    static struct mmsghdr rmsgs[MAX_RECV_BATCH];
+    for (int i = 0; i < recv_batch; i++) {
+        riov[i].iov_base = rbuf[i];
+        riov[i].iov_len = MAX_DGRAM;
+        rmsgs[i].msg_hdr.msg_iov = &riov[i];
+        rmsgs[i].msg_hdr.msg_iovlen = 1;
+        rmsgs[i].msg_hdr.msg_name = &raddr[i];
+    }
+    uint64_t last_sweep = lat_now_ns();
+    while (1) {
+        for (int i = 0; i < recv_batch; i++) rmsgs[i].msg_hdr.msg_namelen = sizeof(raddr[i]);
+        // Bloquea hasta el primer datagrama (o SO_RCVTIMEO) y después toma, sin esperar, los que ya estén en cola.
+        int n = recvmmsg(sock, rmsgs, (unsigned) recv_batch, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvmmsg");
+                break;
             }
+            n = 0; // nada en SWEEP_NS: solo las tareas periódicas
+        }
+        uint64_t woke = lat_now_ns();
+        loop_ns = woke;
+        for (int i = 0; i < n; i++) {
+            if (rmsgs[i].msg_len == 0) continue;
+            counter_add(&stats.dgrams_in, 1);
+            counter_add(&stats.bytes_in, rmsgs[i].msg_len);
+            if (rmsgs[i].msg_hdr.msg_flags & MSG_TRUNC) counter_add(&stats.truncated_in, 1);
+            handle_datagram(rbuf[i], rmsgs[i].msg_len, &raddr[i], rmsgs[i].msg_hdr.msg_namelen);
+        }
+        // Las reproducciones FROM avanzan según el crédito de cada peer; mientras haya, se espera poco.
+        pump_replays();
+        set_wait(sock, nreplaying ? REPLAY_TICK_NS : SWEEP_NS);
+        // Todas las respuestas y entregas del lote salen juntas.
+        out_flush();
+        out_nslots = 0;
+        uint64_t now = lat_now_ns();
+        frag_table_expire(reasm, now);
+        if (now - last_sweep >= SWEEP_NS) {
+            expire_peers(now); // la cola de salida está vacía
+            sweep_rings(now);
+            last_sweep = now;
+        }
+        if (n > 0) {
+            counter_add(&stats.batches, 1);
+            counter_add(&stats.busy_ns, now - woke);
+            counter_max(&stats.batch_max_ns, now - woke);
         }
+        if (atomic_exchange(&snap_req, 0)) snapshot();
     }
 
     // Cierra el socket.
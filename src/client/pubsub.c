@@ -0,0 +1,703 @@
+// pubsub.c — libpubsub: conexión, framing y parseo compartidos por los clientes (ver pubsub.h)
+
+#define _GNU_SOURCE        // strndup()
+
+#include "client/pubsub.h"
+
+#include <errno.h>         // errno, EINTR, EAGAIN, EINVAL
+#include <netinet/in.h>    // IPPROTO_TCP
+#include <netinet/tcp.h>   // TCP_NODELAY
+#include <stdio.h>         // fprintf()
+#include <stdlib.h>        // malloc(), realloc(), free()
+#include <string.h>        // memcpy(), memmove(), memchr(), memcmp(), strlen(), strcmp(), strdup()
+#include <sys/socket.h>    // socket(), connect(), setsockopt(), sendmsg(), recv()
+#include <sys/uio.h>       // struct iovec
+#include <time.h>          // clock_gettime(), nanosleep()
+#include <unistd.h>        // close()
+
+#include "common/lz4.h"    // compresión de lotes
+
+struct addrinfo *ps_resolve(const char *host, const char *port, int socktype) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET; // IPv4
+    hints.ai_socktype = socktype;
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        return NULL;
+    }
+    return res;
+}
+
+int ps_dial_tcp(const char *host, const char *port) {
+    struct addrinfo *res = ps_resolve(host, port, SOCK_STREAM);
+    if (!res) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    // Prueba las direcciones resueltas hasta que una acepte la conexión.
+    int fd = -1;
+    for (struct addrinfo *rp = res; rp; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) break;
+        int e = errno;
+        close(fd);
+        errno = e;
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Tabla de ids
+
+const char *ps_ids_get(const PsIds *ids, uint32_t id) {
+    return id < ids->cap ? ids->names[id] : NULL;
+}
+
+// Además del OK de cada SUBSCRIBE, con comodines el broker anuncia con un OK no solicitado cada tema
+// concreto antes de su primer MESSAGE. Los patrones vuelven con SUBJECT_NO_ID, que no se registra.
+void ps_ids_learn(PsIds *ids, uint32_t id, const char *name, size_t len) {
+    if (id >= PS_MAX_IDS || ps_ids_get(ids, id)) return;
+    if (id >= ids->cap) {
+        size_t ncap = ids->cap ? ids->cap : 64;
+        while (ncap <= id) ncap *= 2;
+        char **n = (char **) realloc(ids->names, ncap * sizeof(char *));
+        if (!n) return;
+        memset(n + ids->cap, 0, (ncap - ids->cap) * sizeof(char *));
+        ids->names = n;
+        ids->cap = ncap;
+    }
+    ids->names[id] = strndup(name, len);
+}
+
+void ps_ids_free(PsIds *ids) {
+    for (size_t i = 0; i < ids->cap; i++) free(ids->names[i]);
+    free(ids->names);
+    ids->names = NULL;
+    ids->cap = 0;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Cabeceras
+
+// Escribir un entero en decimal; devuelve el final
+static char *put_decimal(char *p, uint64_t v) {
+    char digits[20];
+    int nd = 0;
+    do {
+        digits[nd++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (nd) *p++ = digits[--nd];
+    return p;
+}
+
+size_t ps_publish_header(char *dst, size_t cap, int v2, int batch, const char *subject, int with_name, uint32_t id,
+                         size_t len) {
+    size_t slen = strlen(subject);
+    if (v2) {
+        // Con el nombre se asocia el id; después basta con el id.
+        size_t nlen = with_name ? slen : 0;
+        if (slen > V2_MAX_SUBJECT || len > UINT32_MAX || V2_HDR_LEN + nlen > cap) return 0;
+        v2_encode((unsigned char *) dst, batch ? V2_PUBLISH_BATCH : V2_PUBLISH, 0, (uint16_t) nlen, id,
+                  (uint32_t) len);
+        memcpy(dst + V2_HDR_LEN, subject, nlen);
+        return V2_HDR_LEN + nlen;
+    }
+    // "PUBLISH <tema> <len>\n" sin snprintf (va en el camino de cada mensaje)
+    const char *cmd = batch ? "PUBLISH_BATCH " : "PUBLISH ";
+    size_t clen = strlen(cmd);
+    if (clen + slen + 22 > cap) return 0;
+    char *p = dst;
+    memcpy(p, cmd, clen);
+    p += clen;
+    memcpy(p, subject, slen);
+    p += slen;
+    *p++ = ' ';
+    p = put_decimal(p, len);
+    *p++ = '\n';
+    return (size_t) (p - dst);
+}
+
+size_t ps_subscribe_frame(char *dst, size_t cap, int v2, const char *subject, const char *from, const char *group) {
+    size_t slen = strlen(subject);
+    if (group && from) return 0; // un grupo de cola no reproduce lo retenido (los brokers no lo aceptan)
+    const char *arg = group ? group : from; // argumento opcional: nombre del grupo o FROM
+    size_t flen = arg ? strlen(arg) : 0;
+    if (flen >= (group ? PS_MAX_GROUP : PS_MAX_FROM) || (group && flen == 0)) return 0;
+    if (v2) {
+        if (slen > V2_MAX_SUBJECT || V2_HDR_LEN + slen + flen > cap) return 0;
+        v2_encode((unsigned char *) dst, V2_SUBSCRIBE, group ? V2_FLAG_GROUP : 0, (uint16_t) slen, 0, (uint32_t) flen);
+        memcpy(dst + V2_HDR_LEN, subject, slen);
+        memcpy(dst + V2_HDR_LEN + slen, arg ? arg : "", flen); // el argumento va como payload
+        return V2_HDR_LEN + slen + flen;
+    }
+    if (slen + flen + 19 > cap) return 0;
+    char *p = dst;
+    memcpy(p, "SUBSCRIBE ", 10);
+    p += 10;
+    memcpy(p, subject, slen);
+    p += slen;
+    if (arg) {
+        memcpy(p, group ? " GROUP " : " FROM ", group ? 7 : 6);
+        p += group ? 7 : 6;
+        memcpy(p, arg, flen);
+        p += flen;
+    }
+    *p++ = '\n';
+    return (size_t) (p - dst);
+}
+
+// ---------------------------------------------------------------------------------------------
+// Parseo
+
+// Próxima palabra de la línea [*p, end); NULL si no quedan
+static const char *next_word(const char **p, const char *end, size_t *len) {
+    const char *s = *p;
+    while (s < end && *s == ' ') s++;
+    const char *w = s;
+    while (s < end && *s != ' ' && *s != '\r' && *s != '\n') s++;
+    *p = s;
+    *len = (size_t) (s - w);
+    return *len ? w : NULL;
+}
+
+static int parse_u64(const char *w, size_t len, uint64_t *v) {
+    if (!w || len == 0 || len > 19) return -1;
+    uint64_t x = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (w[i] < '0' || w[i] > '9') return -1;
+        x = x * 10 + (uint64_t) (w[i] - '0');
+    }
+    *v = x;
+    return 0;
+}
+
+static int word_is(const char *w, size_t len, const char *lit) {
+    return w && len == strlen(lit) && memcmp(w, lit, len) == 0;
+}
+
+// Interpretar una línea de texto (y su payload) al inicio de buf. En un stream, si falta el payload
+// devuelve 0 y el total en *need; en un datagrama lo que falta se recorta. Devuelve los bytes usados.
+static size_t parse_text(const char *buf, size_t n, int dgram, PsMsg *m, size_t *need) {
+    memset(m, 0, sizeof(*m));
+    size_t scan = n < PS_MAX_LINE ? n : PS_MAX_LINE;
+    const char *nl = (const char *) memchr(buf, '\n', scan);
+    if (!nl) {
+        if (dgram || n >= PS_MAX_LINE) return n; // línea sin fin o demasiado larga: descartar
+        *need = 0;
+        return 0;
+    }
+    size_t hlen = (size_t) (nl - buf) + 1;
+    const char *p = buf, *end = nl;
+    size_t tlen, slen, len;
+    const char *tag = next_word(&p, end, &tlen);
+    if (word_is(tag, tlen, "MESSAGE") || word_is(tag, tlen, "MESSAGE_BATCH") || word_is(tag, tlen, "LOST")) {
+        // MESSAGE <tema> <len>[ <seq>]  /  MESSAGE_BATCH <tema> <len>  /  LOST <tema> <desde> <cantidad>
+        const char *subject = next_word(&p, end, &slen);
+        const char *w = next_word(&p, end, &len);
+        uint64_t a, b = 0;
+        if (subject && parse_u64(w, len, &a) == 0) {
+            w = next_word(&p, end, &len);
+            if (w && parse_u64(w, len, &b) < 0) b = 0;
+            m->subject = subject;
+            m->subject_len = slen;
+            if (tag[0] == 'L') {
+                m->kind = PS_LOST;
+                m->seq = a;
+                m->count = b;
+                return hlen;
+            }
+            size_t plen = (size_t) a;
+            if (n - hlen < plen) {
+                if (!dgram) {
+                    *need = hlen + plen; // esperar el payload completo
+                    return 0;
+                }
+                plen = n - hlen;
+            }
+            m->kind = tlen == 7 ? PS_MESSAGE : PS_BATCH;
+            m->seq = b;
+            m->payload = buf + hlen;
+            m->len = plen;
+            return hlen + plen;
+        }
+    }
+    m->payload = buf;
+    m->len = hlen;
+    if (word_is(tag, tlen, "CREDIT")) {
+        // CREDIT <mensajes> <bytes>
+        const char *w = next_word(&p, end, &len);
+        uint64_t a, b;
+        if (parse_u64(w, len, &a) == 0) {
+            w = next_word(&p, end, &len);
+            if (parse_u64(w, len, &b) == 0) {
+                m->kind = PS_CREDIT;
+                m->count = a;
+                m->seq = b;
+                return hlen;
+            }
+        }
+    }
+    if (word_is(tag, tlen, "COMPRESS")) {
+        // COMPRESS <códec>: el payload es el códec
+        const char *w = next_word(&p, end, &len);
+        if (w) {
+            m->kind = PS_COMPRESS;
+            m->payload = w;
+            m->len = len;
+            return hlen;
+        }
+    }
+    if (word_is(tag, tlen, "OK")) {
+        // "OK\n" o, en multicast, "OK MCAST <grupo> <puerto>\n": el resto de la línea va en el payload
+        m->kind = PS_OK;
+        while (p < end && *p == ' ') p++;
+        m->payload = p;
+        m->len = (size_t) (end - p);
+    } else if (word_is(tag, tlen, "ERR")) {
+        m->kind = PS_ERR;
+    } else {
+        m->kind = PS_OTHER;
+    }
+    return hlen;
+}
+
+// Completar un frame v2 ya delimitado: 'body' y 'blen' son lo que sigue al nombre
+static void fill_v2(const V2Header *h, const char *name, const char *body, size_t blen, PsIds *ids, PsMsg *m) {
+    m->subject_id = h->subject_id;
+    m->payload = body;
+    m->len = blen;
+    if (h->opcode == V2_MESSAGE || h->opcode == V2_MESSAGE_BATCH) {
+        m->kind = h->opcode == V2_MESSAGE ? PS_MESSAGE : PS_BATCH;
+        if (h->subject_len > 0) {
+            // por un patrón el broker puede mandar el nombre
+            m->subject = name;
+            m->subject_len = h->subject_len;
+        } else {
+            m->subject = ps_ids_get(ids, h->subject_id);
+            m->subject_len = m->subject ? strlen(m->subject) : 0;
+        }
+    } else if (h->opcode == V2_OK) {
+        // El OK de un SUBSCRIBE trae el nombre y el id que usará el broker.
+        m->kind = PS_OK;
+        m->subject = name;
+        m->subject_len = h->subject_len;
+        if (h->subject_len > 0) ps_ids_learn(ids, h->subject_id, name, h->subject_len);
+    } else if (h->opcode == V2_ERR) {
+        m->kind = PS_ERR;
+    } else if (h->opcode == V2_CREDIT && blen >= V2_CREDIT_LEN) {
+        m->kind = PS_CREDIT;
+        m->count = v2_get_u64((const unsigned char *) body);
+        m->seq = v2_get_u64((const unsigned char *) body + 8);
+    } else if (h->opcode == V2_COMPRESS) {
+        m->kind = PS_COMPRESS;
+    }
+}
+
+// Frame v2 de un stream TCP: ahí la secuencia (V2_FLAG_SEQ) cuenta dentro de payload_len
+static size_t parse_v2_stream(const char *buf, size_t n, PsIds *ids, PsMsg *m, size_t *need) {
+    memset(m, 0, sizeof(*m));
+    if (n < V2_HDR_LEN) {
+        *need = V2_HDR_LEN;
+        return 0;
+    }
+    V2Header h = v2_decode((const unsigned char *) buf);
+    size_t total = V2_HDR_LEN + (size_t) h.subject_len + h.payload_len;
+    if (n < total) {
+        *need = total;
+        return 0;
+    }
+    const char *name = buf + V2_HDR_LEN;
+    const char *body = name + h.subject_len;
+    size_t blen = h.payload_len;
+    if (h.opcode == V2_MESSAGE && (h.flags & V2_FLAG_SEQ) && blen >= V2_SEQ_LEN) {
+        // con retención el broker numera los mensajes; la secuencia va antes del payload
+        m->seq = v2_get_u64((const unsigned char *) body);
+        body += V2_SEQ_LEN;
+        blen -= V2_SEQ_LEN;
+    }
+    fill_v2(&h, name, body, blen, ids, m);
+    return total;
+}
+
+int ps_parse_dgram(const char *buf, size_t n, PsIds *ids, PsMsg *m) {
+    size_t need;
+    if (!v2_is_frame((const unsigned char *) buf, n)) {
+        parse_text(buf, n, 1, m, &need);
+        return m->kind == PS_NONE ? -1 : 0;
+    }
+    // En UDP la secuencia y la cabecera de fragmento no cuentan en payload_len.
+    memset(m, 0, sizeof(*m));
+    V2Header h = v2_decode((const unsigned char *) buf);
+    if (V2_HDR_LEN + (size_t) h.subject_len > n) return -1;
+    const char *name = buf + V2_HDR_LEN;
+    const char *body = name + h.subject_len;
+    size_t avail = n - V2_HDR_LEN - h.subject_len;
+    if (h.opcode == V2_MESSAGE && (h.flags & V2_FLAG_SEQ)) {
+        if (avail < V2_SEQ_LEN) return -1;
+        m->seq = v2_get_u64((const unsigned char *) body);
+        body += V2_SEQ_LEN;
+        avail -= V2_SEQ_LEN;
+    }
+    if (h.opcode == V2_MESSAGE && (h.flags & V2_FLAG_FRAG)) {
+        if (avail < V2_FRAG_LEN) return -1;
+        m->frag = 1;
+        m->fr = v2_get_frag((const unsigned char *) body);
+        body += V2_FRAG_LEN;
+        avail -= V2_FRAG_LEN;
+    }
+    uint64_t seq = m->seq;
+    int frag = m->frag;
+    V2Frag fr = m->fr;
+    fill_v2(&h, name, body, h.payload_len < avail ? h.payload_len : avail, ids, m);
+    m->seq = seq;
+    m->frag = frag;
+    m->fr = fr;
+    return m->kind == PS_NONE ? -1 : 0;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Conexión TCP
+
+// Enviar iovecs completos (salvo escrituras parciales, una sola llamada). -1 si falla.
+static int send_iov(int fd, struct iovec *iov, size_t n) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    while (msg.msg_iovlen > 0) {
+        ssize_t k = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (k < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // Avanza sobre lo ya enviado.
+        while (msg.msg_iovlen > 0 && (size_t) k >= msg.msg_iov->iov_len) {
+            k -= (ssize_t) msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + k;
+            msg.msg_iov->iov_len -= (size_t) k;
+        }
+    }
+    return 0;
+}
+
+int ps_open(PsClient *c, const char *host, const char *port, int role, int opts) {
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    c->v2 = (opts & PS_OPT_V2) != 0;
+    c->in = (char *) malloc(PS_RECV_BUF);
+    c->out = (char *) malloc(PS_SEND_BUF);
+    if (!c->in || !c->out) {
+        ps_close(c);
+        errno = ENOMEM;
+        return -1;
+    }
+    c->in_cap = PS_RECV_BUF;
+    c->out_cap = PS_SEND_BUF;
+    c->opened_ms = ps_now_ms();
+    c->fd = ps_dial_tcp(host, port);
+    if (c->fd < 0) {
+        int e = errno;
+        ps_close(c);
+        errno = e;
+        return -1;
+    }
+    // Las escrituras ya se juntan en 'out': sin Nagle un lote chico (comprimido) no espera el ACK
+    // retrasado del broker mientras el publicador aguarda crédito.
+    int one = 1;
+    (void) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // El rol va primero en el buffer: sale junto con las primeras suscripciones o publicaciones.
+    const char *tok = role == PS_PUB ? (c->v2 ? "PUB2" : "PUB") : (c->v2 ? "SUB2" : "SUB");
+    c->zoffer = (opts & PS_OPT_COMPRESS) != 0;
+    c->out_len = (size_t) snprintf(c->out, c->out_cap, "%s%s\n", tok, c->zoffer ? " COMPRESS lz4" : "");
+    return 0;
+}
+
+void ps_close(PsClient *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    ps_ids_free(&c->ids);
+    for (size_t i = 0; i < c->npub; i++) free(c->pub_names[i]);
+    free(c->pub_names);
+    free(c->in);
+    free(c->out);
+    free(c->zbuf);
+    c->pub_names = NULL;
+    c->in = c->out = c->zbuf = NULL;
+    c->zbuf_cap = 0;
+    c->npub = c->pub_cap = 0;
+}
+
+int ps_flush(PsClient *c) {
+    if (c->out_len == 0) return 0;
+    struct iovec iov = {c->out, c->out_len};
+    c->out_len = 0;
+    return send_iov(c->fd, &iov, 1);
+}
+
+int ps_subscribe(PsClient *c, const char *subject, const char *from, const char *group) {
+    size_t n = ps_subscribe_frame(c->out + c->out_len, c->out_cap - c->out_len, c->v2, subject, from, group);
+    if (n == 0 && c->out_len > 0) {
+        if (ps_flush(c) < 0) return -1;
+        n = ps_subscribe_frame(c->out, c->out_cap, c->v2, subject, from, group);
+    }
+    if (n == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    c->out_len += n;
+    return 0;
+}
+
+// Id de publicación de un tema en v2 (el publicador los elige: 1, 2, ...). *with_name = 1 si es
+// la primera vez y el frame debe llevar el nombre. 0 si no hay memoria.
+static uint32_t pub_id(PsClient *c, const char *subject, int *with_name) {
+    *with_name = 0;
+    if (c->npub && strcmp(c->pub_names[c->pub_last], subject) == 0) return (uint32_t) c->pub_last + 1;
+    for (size_t i = 0; i < c->npub; i++) {
+        if (strcmp(c->pub_names[i], subject) == 0) {
+            c->pub_last = i;
+            return (uint32_t) i + 1;
+        }
+    }
+    if (c->npub == c->pub_cap) {
+        size_t ncap = c->pub_cap ? c->pub_cap * 2 : 8;
+        char **n = (char **) realloc(c->pub_names, ncap * sizeof(char *));
+        if (!n) return 0;
+        c->pub_names = n;
+        c->pub_cap = ncap;
+    }
+    if (!(c->pub_names[c->npub] = strdup(subject))) return 0;
+    c->pub_last = c->npub++;
+    *with_name = 1;
+    return (uint32_t) c->pub_last + 1;
+}
+
+// Armar la cabecera de un PUBLISH / PUBLISH_BATCH de la conexión en 'dst'
+static size_t conn_header(PsClient *c, char *dst, size_t cap, int batch, const char *subject, size_t len) {
+    int with_name = 0;
+    uint32_t id = 0;
+    if (c->v2 && !(id = pub_id(c, subject, &with_name))) return 0;
+    return ps_publish_header(dst, cap, c->v2, batch, subject, with_name, id, len);
+}
+
+// Descontar del saldo de crédito lo que se envía
+static void credit_spend(PsClient *c, uint64_t msgs, size_t bytes) {
+    c->credit_msgs -= (int64_t) msgs;
+    c->credit_bytes -= (int64_t) bytes;
+}
+
+int ps_publish(PsClient *c, const char *subject, const void *payload, size_t len) {
+    credit_spend(c, 1, len);
+    size_t hmax = V2_HDR_LEN + strlen(subject) + 40; // cabecera más larga posible
+    if (c->out_len + hmax + len > c->out_cap) {
+        if (hmax + len > c->out_cap) {
+            // No entra en el buffer: lo pendiente, la cabecera y el payload en una sola escritura.
+            char hdr[V2_HDR_LEN + V2_MAX_SUBJECT + 40];
+            size_t hlen = conn_header(c, hdr, sizeof(hdr), 0, subject, len);
+            if (!hlen) {
+                errno = EINVAL;
+                return -1;
+            }
+            struct iovec iov[3] = {{c->out, c->out_len}, {hdr, hlen}, {(void *) payload, len}};
+            c->out_len = 0;
+            return send_iov(c->fd, iov, 3);
+        }
+        if (ps_flush(c) < 0) return -1;
+    }
+    size_t hlen = conn_header(c, c->out + c->out_len, c->out_cap - c->out_len, 0, subject, len);
+    if (!hlen) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(c->out + c->out_len + hlen, payload, len);
+    c->out_len += hlen + len;
+    return 0;
+}
+
+// Reservar al menos 'n' bytes en zbuf; -1 si no hay memoria
+static int zbuf_reserve(PsClient *c, size_t n) {
+    if (n <= c->zbuf_cap) return 0;
+    char *b = (char *) realloc(c->zbuf, n);
+    if (!b) return -1;
+    c->zbuf = b;
+    c->zbuf_cap = n;
+    return 0;
+}
+
+// Comprimir un lote en zbuf ("u32 raw_len | bloque"); devuelve el largo, 0 si no conviene
+static size_t compress_batch(PsClient *c, const void *records, size_t len) {
+    if (!c->compress || len < PS_COMPRESS_MIN || len > UINT32_MAX ||
+        zbuf_reserve(c, V2_ZBATCH_HDR + lz4_bound(len)) < 0)
+        return 0;
+    size_t k = lz4_compress(records, len, c->zbuf + V2_ZBATCH_HDR, c->zbuf_cap - V2_ZBATCH_HDR);
+    if (k == 0 || V2_ZBATCH_HDR + k >= len) return 0;
+    v2_put_u32((unsigned char *) c->zbuf, (uint32_t) len);
+    return V2_ZBATCH_HDR + k;
+}
+
+int ps_publish_batch(PsClient *c, const char *subject, const void *records, size_t len) {
+    // el broker descuenta un mensaje por registro (y los bytes sin comprimir)
+    uint64_t n = 0;
+    for (size_t off = 0; off + V2_BATCH_REC_HDR <= len; n++)
+        off += V2_BATCH_REC_HDR + v2_get_u32((const unsigned char *) records + off);
+    credit_spend(c, n, len);
+    size_t zlen = compress_batch(c, records, len);
+    const void *body = zlen ? c->zbuf : records;
+    size_t blen = zlen ? zlen : len;
+    char hdr[V2_HDR_LEN + V2_MAX_SUBJECT + 40];
+    size_t hlen = conn_header(c, hdr, sizeof(hdr), 1, subject, blen);
+    if (!hlen) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (zlen && c->v2) {
+        hdr[1] |= V2_FLAG_COMP;
+    } else if (zlen) {
+        memcpy(hdr + hlen - 1, " lz4\n", 5); // "PUBLISH_BATCH <tema> <bytes> lz4\n"
+        hlen += 4;
+    }
+    struct iovec iov[3] = {{c->out, c->out_len}, {hdr, hlen}, {(void *) body, blen}};
+    c->out_len = 0;
+    return send_iov(c->fd, iov, 3);
+}
+
+// Sumar un CREDIT al saldo; el primero trae la ventana
+static void credit_add(PsClient *c, const PsMsg *m) {
+    if (!c->credit) {
+        c->credit = 1;
+        c->credit_win_msgs = m->count;
+        c->credit_win_bytes = m->seq; // lo enviado antes ya se descontó del saldo (queda negativo)
+    }
+    c->credit_msgs += (int64_t) m->count;
+    c->credit_bytes += (int64_t) m->seq;
+}
+
+// Saldo agotado en alguna dimensión con límite
+static int credit_empty(const PsClient *c) {
+    return (c->credit_win_msgs && c->credit_msgs <= 0) || (c->credit_win_bytes && c->credit_bytes <= 0);
+}
+
+// Saldo por debajo de la mitad de la ventana: conviene leer los CREDIT que ya llegaron
+static int credit_low(const PsClient *c) {
+    return (c->credit_win_msgs && c->credit_msgs * 2 < (int64_t) c->credit_win_msgs) ||
+           (c->credit_win_bytes && c->credit_bytes * 2 < (int64_t) c->credit_win_bytes);
+}
+
+// Entregar los registros de un lote comprimido como PS_MESSAGE del mismo tema; uno mal formado se
+// entrega como PS_ERR
+static void deliver_batch(PsClient *c, const PsMsg *b, PsHandler h, void *arg) {
+    PsMsg m = *b;
+    size_t raw = b->len >= V2_ZBATCH_HDR ? v2_get_u32((const unsigned char *) b->payload) : 0;
+    if (b->len < V2_ZBATCH_HDR || zbuf_reserve(c, raw) < 0 ||
+        lz4_decompress(b->payload + V2_ZBATCH_HDR, b->len - V2_ZBATCH_HDR, c->zbuf, raw) < 0) {
+        m.kind = PS_ERR;
+        m.payload = "ERR malformed compressed batch\n";
+        m.len = strlen(m.payload);
+        h(arg, &m);
+        return;
+    }
+    m.kind = PS_MESSAGE;
+    for (size_t off = 0; off + V2_BATCH_REC_HDR <= raw;) {
+        size_t rlen = v2_get_u32((const unsigned char *) c->zbuf + off);
+        off += V2_BATCH_REC_HDR;
+        if (rlen > raw - off) break;
+        m.payload = c->zbuf + off;
+        m.len = rlen;
+        h(arg, &m);
+        off += rlen;
+    }
+}
+
+// ps_poll() con flags de recv() (MSG_DONTWAIT para no bloquear)
+static int poll_flags(PsClient *c, PsHandler h, void *arg, int flags) {
+    ssize_t k = recv(c->fd, c->in + c->in_end, c->in_cap - c->in_end, flags);
+    if (k == 0) return 0; // Conexión cerrada.
+    if (k < 0) return (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) ? -1 : 0;
+    c->in_end += (size_t) k;
+
+    // Entregar todos los frames completos directamente desde el buffer.
+    size_t need = 0;
+    while (c->in_start < c->in_end) {
+        PsMsg m;
+        const char *p = c->in + c->in_start;
+        size_t n = c->in_end - c->in_start;
+        size_t used = c->v2 ? parse_v2_stream(p, n, &c->ids, &m, &need) : parse_text(p, n, 0, &m, &need);
+        if (used == 0) break;
+        c->in_start += used;
+        if (m.kind == PS_CREDIT) credit_add(c, &m);
+        if (m.kind == PS_COMPRESS) {
+            c->zoffer = 0;
+            c->compress = m.len == 3 && memcmp(m.payload, "lz4", 3) == 0;
+        }
+        if (m.kind == PS_BATCH) {
+            if (h) deliver_batch(c, &m, h, arg);
+        } else if (m.kind != PS_NONE && h) {
+            h(arg, &m);
+        }
+    }
+    if (c->in_start == c->in_end) {
+        c->in_start = c->in_end = 0;
+        return 1;
+    }
+    // Queda un frame incompleto: dejar lugar para él (compactar y, si hace falta, agrandar).
+    size_t have = c->in_end - c->in_start;
+    size_t want = need > have ? need : have + 1;
+    if (c->in_start + want > c->in_cap || c->in_end == c->in_cap) {
+        memmove(c->in, c->in + c->in_start, have);
+        c->in_start = 0;
+        c->in_end = have;
+    }
+    if (want > c->in_cap) {
+        char *nb = (char *) realloc(c->in, want);
+        if (!nb) return 0;
+        c->in = nb;
+        c->in_cap = want;
+    }
+    return 1;
+}
+
+int ps_poll(PsClient *c, PsHandler h, void *arg) {
+    return poll_flags(c, h, arg, 0);
+}
+
+int ps_credit_wait(PsClient *c, PsHandler h, void *arg) {
+    // El primer CREDIT llega con la primera respuesta del broker; si no llega, no hay control de flujo.
+    int probe = c->credit ? credit_low(c)
+                          : c->probes < PS_CREDIT_PROBES || ps_now_ms() - c->opened_ms < PS_CREDIT_PROBE_MS;
+    probe |= c->zoffer; // hasta que el broker diga si acepta la compresión los lotes salen sin comprimir
+    if (probe) {
+        if (!c->credit) c->probes++;
+        if (poll_flags(c, h, arg, MSG_DONTWAIT) == 0) return -1;
+    }
+    while (c->credit && credit_empty(c)) {
+        // lo encolado ya está descontado: tiene que llegar al broker para que vuelva como crédito
+        if (ps_flush(c) < 0 || poll_flags(c, h, arg, 0) == 0) return -1;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Tiempo
+
+long long ps_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void ps_sleep_ms(long ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
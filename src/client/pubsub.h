@@ -0,0 +1,169 @@
+// pubsub.h — libpubsub: biblioteca de cliente compartida por los publishers y subscribers
+// Reúne lo que cada cliente repetía: resolver y conectar, armar las cabeceras PUBLISH / SUBSCRIBE en
+// texto o v2, parsear lo que manda el broker y la tabla id -> tema del framing v2.
+//
+// Para TCP, PsClient lee con un buffer grande (PS_RECV_BUF): cada recv() trae todos los frames que
+// haya en el socket y ps_poll() los entrega uno por uno a un callback, sin copiar: el PsMsg apunta al
+// buffer de lectura. Lo que se publica o suscribe se arma en un buffer de escritura y sale con una
+// sola llamada en ps_flush(). Ni la lectura ni la escritura reservan memoria por mensaje.
+//
+// Con el control de flujo de broker_tcp (--credit-msgs / --credit-bytes), PsClient lleva el saldo de
+// crédito del publicador: ps_poll() suma los CREDIT que llegan, ps_publish() y ps_publish_batch()
+// descuentan lo que envían y ps_credit_wait() bloquea mientras el saldo esté agotado.
+//
+// Con PS_OPT_COMPRESS la línea de rol ofrece el códec lz4 (common/lz4.h). Si broker_tcp lo acepta,
+// ps_publish_batch() comprime los lotes y ps_poll() descomprime los MESSAGE_BATCH y entrega cada
+// registro como un PS_MESSAGE más, así el callback no se entera de la compresión.
+//
+// Para UDP, ps_parse_dgram() interpreta un datagrama (texto o v2, con secuencia y fragmentos) con la
+// misma estructura PsMsg, y los encabezados se arman con las mismas funciones.
+
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include <netdb.h>         // struct addrinfo
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint32_t, uint64_t
+
+#include "common/proto_v2.h" // V2Frag
+
+#define PS_RECV_BUF (256u << 10) // buffer de lectura inicial de una conexión TCP
+#define PS_SEND_BUF (64u << 10) // buffer de escritura de una conexión TCP
+#define PS_MAX_LINE 4096 // largo máximo de una línea de control de texto
+#define PS_MAX_IDS (1u << 24) // ids de tema que se aceptan del broker
+#define PS_MAX_FROM 32 // largo máximo del argumento de FROM
+#define PS_MAX_GROUP 64 // largo máximo del nombre de un grupo de cola, con el terminador (QGROUP_MAX_NAME)
+#define PS_CREDIT_PROBE_MS 1000 // sin CREDIT en este tiempo (y PS_CREDIT_PROBES envíos) no hay control de flujo
+#define PS_CREDIT_PROBES 4
+#define PS_COMPRESS_MIN 256 // lotes más chicos se envían sin comprimir
+
+// Opciones de ps_open()
+#define PS_OPT_V2 0x1 // framing binario v2
+#define PS_OPT_COMPRESS 0x2 // ofrecer compresión (solo broker_tcp)
+
+// Roles de una conexión TCP
+#define PS_PUB 1
+#define PS_SUB 2
+
+// Qué trae un frame recibido
+typedef enum PsKind {
+    PS_NONE = 0, // nada que entregar (línea descartada, frame desconocido)
+    PS_MESSAGE, // mensaje publicado
+    PS_OK, // confirmación (en v2 trae el id del tema; en multicast, el grupo en el payload)
+    PS_ERR, // error del broker (payload = texto)
+    PS_LOST, // UDP: el broker ya no tiene [seq, seq + count)
+    PS_OTHER, // cualquier otra línea de texto (payload = la línea)
+    PS_CREDIT, // crédito del broker para el publicador (count = mensajes, seq = bytes)
+    PS_COMPRESS, // respuesta a la compresión ofrecida (payload = códec elegido, "none" si ninguno)
+    PS_BATCH // lote comprimido (payload = "u32 raw_len | bloque"); ps_poll() entrega sus registros
+} PsKind;
+
+// Frame recibido. Todos los punteros apuntan al buffer de lectura o al datagrama: valen hasta que
+// vuelve el callback (o hasta el próximo datagrama); lo que haga falta conservar se copia.
+typedef struct PsMsg {
+    PsKind kind;
+    const char *subject; // tema (no termina en '\0'); NULL si llegó un id que no se conoce
+    size_t subject_len;
+    uint32_t subject_id; // v2: id del tema (0 en texto)
+    uint64_t seq; // secuencia del broker con retención (0 = sin secuencia); PS_LOST: desde
+    uint64_t count; // PS_LOST: cantidad
+    const char *payload;
+    size_t len;
+    int frag; // UDP: es un fragmento (V2_FLAG_FRAG) descrito por 'fr'; el payload es el trozo
+    V2Frag fr;
+} PsMsg;
+
+// Tabla id -> tema de los OK de v2
+typedef struct PsIds {
+    char **names; // names[id] = tema (NULL si no se conoce)
+    size_t cap;
+} PsIds;
+
+// Conexión TCP con el broker
+typedef struct PsClient {
+    int fd;
+    int v2; // framing binario
+    PsIds ids; // suscriptor v2: id -> tema
+    char **pub_names; // publicador v2: tema del id i + 1 (el primer PUBLISH lleva el nombre)
+    size_t npub, pub_cap, pub_last; // pub_last: índice usado por última vez
+    char *in; // buffer de lectura: [in_start, in_end) sin procesar
+    size_t in_start, in_end, in_cap;
+    char *out; // buffer de escritura
+    size_t out_len, out_cap;
+    // Control de flujo: el primer CREDIT trae la ventana (0 = sin límite) y los siguientes la reponen
+    int credit; // el broker controla el flujo (llegó el primer CREDIT)
+    uint64_t credit_win_msgs, credit_win_bytes; // ventana
+    int64_t credit_msgs, credit_bytes; // saldo (negativo si el último envío lo excedió)
+    long long opened_ms; // cuándo se abrió (para dejar de esperar el primer CREDIT)
+    unsigned probes; // lecturas sin bloqueo hechas esperando el primer CREDIT
+    // Compresión: se ofrece en la línea de rol y se usa cuando el broker responde con el códec
+    int zoffer; // se ofreció y todavía no llegó la respuesta
+    int compress; // el broker aceptó lz4
+    char *zbuf; // lote comprimido (publicador) o descomprimido (suscriptor); se reutiliza
+    size_t zbuf_cap;
+} PsClient;
+
+// Se llama por cada frame que entrega ps_poll()
+typedef void (*PsHandler)(void *arg, const PsMsg *m);
+
+// Resolver host:puerto para 'socktype' (SOCK_STREAM / SOCK_DGRAM). Imprime el error y devuelve NULL
+// si no se pudo; el resultado se libera con freeaddrinfo().
+struct addrinfo *ps_resolve(const char *host, const char *port, int socktype);
+
+// Conectar por TCP a la primera dirección que responda; -1 con errno si no se pudo
+int ps_dial_tcp(const char *host, const char *port);
+
+// Conectar y anunciar el rol (PS_PUB / PS_SUB) con las opciones PS_OPT_*. -1 con errno.
+int ps_open(PsClient *c, const char *host, const char *port, int role, int opts);
+void ps_close(PsClient *c);
+
+// Encolar una suscripción; 'from' (o NULL) pide lo retenido desde ahí ("SUBSCRIBE <tema> FROM ...") y
+// 'group' (o NULL) une a un grupo de cola ("SUBSCRIBE <tema> GROUP ..."). Un grupo no reproduce lo
+// retenido: pasar ambos devuelve -1 con EINVAL, igual que un tema, FROM o grupo demasiado largos.
+int ps_subscribe(PsClient *c, const char *subject, const char *from, const char *group);
+
+// Encolar un PUBLISH (sale con el próximo ps_flush(), o antes si el buffer se llena). Un mensaje que
+// no entra en el buffer se envía directo, junto con lo pendiente.
+int ps_publish(PsClient *c, const char *subject, const void *payload, size_t len);
+
+// Enviar un PUBLISH_BATCH cuyo cuerpo son registros "u32 len | bytes" (proto_v2.h): la cabecera y el
+// cuerpo salen con una sola escritura, sin copiar el cuerpo (salvo al comprimirlo, si se negoció y el
+// lote se achica). Vacía antes lo pendiente.
+int ps_publish_batch(PsClient *c, const char *subject, const void *records, size_t len);
+
+// Enviar todo lo encolado. -1 si la conexión falló.
+int ps_flush(PsClient *c);
+
+// Leer del socket una vez y entregar a 'h' todos los frames completos. 1 = se leyó algo,
+// 0 = conexión cerrada, -1 = timeout o señal (nada perdido: lo incompleto queda en el buffer).
+int ps_poll(PsClient *c, PsHandler h, void *arg);
+
+// Antes de publicar: lee sin bloquear los CREDIT que ya llegaron (mientras no se conoce la ventana o
+// el saldo baja de la mitad) y la respuesta a la compresión ofrecida y, si el saldo está agotado,
+// vacía lo encolado y espera el próximo CREDIT.
+// Lo demás que llegue va a 'h' (puede ser NULL). Sin control de flujo vuelve enseguida. -1 si la
+// conexión falló o se cerró.
+int ps_credit_wait(PsClient *c, PsHandler h, void *arg);
+
+// Armar la cabecera de un PUBLISH (o PUBLISH_BATCH con batch = 1) de 'len' bytes en 'dst'. En v2 lleva
+// el nombre si 'with_name' (asocia 'id' al tema) y si no solo el id. Devuelve el largo, 0 si no entra.
+size_t ps_publish_header(char *dst, size_t cap, int v2, int batch, const char *subject, int with_name, uint32_t id,
+                         size_t len);
+
+// Armar un SUBSCRIBE completo en 'dst'; 0 si no entra, si el tema / FROM / grupo son demasiado largos
+// o si vienen a la vez 'from' y 'group'
+size_t ps_subscribe_frame(char *dst, size_t cap, int v2, const char *subject, const char *from, const char *group);
+
+// Interpretar un datagrama completo (texto o v2 según su primer byte). Un payload más corto que lo
+// anunciado se recorta. Los OK de v2 se registran en 'ids'. Devuelve -1 si está mal formado.
+int ps_parse_dgram(const char *buf, size_t n, PsIds *ids, PsMsg *m);
+
+const char *ps_ids_get(const PsIds *ids, uint32_t id);
+void ps_ids_learn(PsIds *ids, uint32_t id, const char *name, size_t len);
+void ps_ids_free(PsIds *ids);
+
+// Relojes y pausas de los clientes
+long long ps_now_ms(void);
+void ps_sleep_ms(long ms);
+
+#endif // PUBSUB_H
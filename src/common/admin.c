@@ -0,0 +1,471 @@
+// admin.c — Implementación del socket de administración y de las fotos de métricas
+
+#include "common/admin.h"
+
+#include <arpa/inet.h>     // htonl(), htons(), INADDR_LOOPBACK
+#include <netinet/in.h>    // struct sockaddr_in
+#include <pthread.h>       // pthread_create(), pthread_detach()
+#include <stdarg.h>        // va_list
+#include <stdio.h>         // vsnprintf(), perror()
+#include <stdlib.h>        // malloc(), realloc(), free(), qsort()
+#include <string.h>        // memcpy(), memset(), strcmp(), strlen(), strncmp(), strstr()
+#include <sys/socket.h>    // socket(), bind(), listen(), accept(), recv(), send(), shutdown()
+#include <sys/time.h>      // struct timeval (SO_RCVTIMEO)
+#include <time.h>          // clock_gettime()
+#include <unistd.h>        // close()
+
+#define REQ_MAX 1024 // bytes leídos del pedido
+#define KEY_SEP '\x1f' // separador de etiquetas en la clave de una fila
+
+typedef enum { FMT_TEXT, FMT_JSON, FMT_PROM } Format;
+
+// Valores de la foto anterior de una tabla con tasa, ordenados por clave
+typedef struct Prev {
+    const AdminTableDef *def;
+    char **keys;
+    uint64_t *v;
+    size_t n;
+    uint64_t ns; // instante de la foto
+} Prev;
+
+typedef struct Server {
+    int fd;
+    const char *prefix;
+    AdminCollect collect;
+    void *arg;
+    uint64_t start_ns;
+    Prev prev[ADMIN_MAX_TABLES];
+    size_t nprev;
+} Server;
+
+// Texto de salida que crece a medida que se escribe
+typedef struct Out {
+    char *p;
+    size_t len, cap;
+} Out;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void put(Out *o, const char *fmt, ...) {
+    va_list ap;
+    while (1) {
+        va_start(ap, fmt);
+        int n = vsnprintf(o->p ? o->p + o->len : NULL, o->p ? o->cap - o->len : 0, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if (o->p && o->len + (size_t) n < o->cap) {
+            o->len += (size_t) n;
+            return;
+        }
+        size_t ncap = o->cap ? o->cap * 2 : 4096;
+        while (ncap <= o->len + (size_t) n) ncap *= 2;
+        char *p = (char *) realloc(o->p, ncap);
+        if (!p) return;
+        o->p = p;
+        o->cap = ncap;
+    }
+}
+
+// Cadena entre comillas con los escapes de JSON (o de una etiqueta de Prometheus)
+static void put_quoted(Out *o, const char *s, int json) {
+    put(o, "\"");
+    for (; *s; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') put(o, "\\%c", c);
+        else if (c == '\n') put(o, "\\n");
+        else if (c < 0x20) {
+            if (json) put(o, "\\u%04x", c);
+        } else put(o, "%c", c);
+    }
+    put(o, "\"");
+}
+
+void admin_value(AdminReport *r, const char *name, const char *help, int counter, uint64_t v) {
+    for (size_t i = 0; i < r->nvalues; i++) {
+        if (strcmp(r->values[i].name, name) == 0) {
+            r->values[i].v += v;
+            return;
+        }
+    }
+    if (r->nvalues == ADMIN_MAX_VALUES) return;
+    r->values[r->nvalues++] = (AdminValue){name, help, counter, v};
+}
+
+static char *dup_str(const char *s) {
+    size_t n = strlen(s) + 1;
+    char *d = (char *) malloc(n);
+    if (d) memcpy(d, s, n);
+    return d;
+}
+
+void admin_row(AdminReport *r, const AdminTableDef *def, const char *const *labels, const uint64_t *vals) {
+    AdminTable *t = NULL;
+    for (size_t i = 0; i < r->ntables && !t; i++)
+        if (r->tables[i].def == def) t = &r->tables[i];
+    if (!t) {
+        if (r->ntables == ADMIN_MAX_TABLES) return;
+        t = &r->tables[r->ntables++];
+        memset(t, 0, sizeof(*t));
+        t->def = def;
+    }
+    if (t->nrows == t->cap) {
+        size_t ncap = t->cap ? t->cap * 2 : 64;
+        char **lv = (char **) realloc(t->lv, ncap * def->nlabels * sizeof(char *));
+        if (!lv) return;
+        t->lv = lv;
+        uint64_t *v = (uint64_t *) realloc(t->v, ncap * def->ncols * sizeof(uint64_t));
+        if (!v) return;
+        t->v = v;
+        t->cap = ncap;
+    }
+    for (size_t i = 0; i < def->nlabels; i++) t->lv[t->nrows * def->nlabels + i] = dup_str(labels[i]);
+    memcpy(t->v + t->nrows * def->ncols, vals, def->ncols * sizeof(uint64_t));
+    t->nrows++;
+}
+
+static void report_free(AdminReport *r) {
+    for (size_t i = 0; i < r->ntables; i++) {
+        AdminTable *t = &r->tables[i];
+        for (size_t j = 0; j < t->nrows * t->def->nlabels; j++) free(t->lv[j]);
+        free(t->lv);
+        free(t->v);
+        free(t->rate);
+    }
+}
+
+// Clave de una fila: sus etiquetas separadas por KEY_SEP
+static char *row_key(const AdminTable *t, size_t row) {
+    size_t n = 1;
+    for (size_t i = 0; i < t->def->nlabels; i++) n += strlen(t->lv[row * t->def->nlabels + i]) + 1;
+    char *k = (char *) malloc(n);
+    if (!k) return NULL;
+    size_t p = 0;
+    for (size_t i = 0; i < t->def->nlabels; i++) {
+        const char *l = t->lv[row * t->def->nlabels + i];
+        size_t len = strlen(l);
+        memcpy(k + p, l, len);
+        p += len;
+        k[p++] = KEY_SEP;
+    }
+    k[p] = '\0';
+    return k;
+}
+
+// Orden de filas para qsort: por clave o por una columna de mayor a menor
+typedef struct RowRef {
+    size_t row;
+    char *key;
+    uint64_t sort;
+} RowRef;
+
+static int cmp_key(const void *a, const void *b) {
+    const RowRef *x = (const RowRef *) a, *y = (const RowRef *) b;
+    int c = strcmp(x->key ? x->key : "", y->key ? y->key : "");
+    return c ? c : (x->row < y->row ? -1 : x->row > y->row);
+}
+
+static int cmp_sort(const void *a, const void *b) {
+    const RowRef *x = (const RowRef *) a, *y = (const RowRef *) b;
+    if (x->sort != y->sort) return x->sort > y->sort ? -1 : 1;
+    return cmp_key(a, b);
+}
+
+// Reordenar las filas de la tabla según 'refs'
+static void permute(AdminTable *t, const RowRef *refs, size_t n) {
+    size_t nl = t->def->nlabels, nc = t->def->ncols;
+    char **lv = (char **) malloc((n ? n : 1) * nl * sizeof(char *));
+    uint64_t *v = (uint64_t *) malloc((n ? n : 1) * nc * sizeof(uint64_t));
+    double *rate = t->rate ? (double *) malloc((n ? n : 1) * sizeof(double)) : NULL;
+    if (!lv || !v || (t->rate && !rate)) {
+        free(lv);
+        free(v);
+        free(rate);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        memcpy(lv + i * nl, t->lv + refs[i].row * nl, nl * sizeof(char *));
+        memcpy(v + i * nc, t->v + refs[i].row * nc, nc * sizeof(uint64_t));
+        if (rate) rate[i] = t->rate[refs[i].row];
+    }
+    free(t->lv);
+    free(t->v);
+    free(t->rate);
+    t->lv = lv;
+    t->v = v;
+    t->rate = rate;
+    t->nrows = t->cap = n;
+}
+
+static Prev *prev_of(Server *s, const AdminTableDef *def) {
+    for (size_t i = 0; i < s->nprev; i++)
+        if (s->prev[i].def == def) return &s->prev[i];
+    if (s->nprev == ADMIN_MAX_TABLES) return NULL;
+    Prev *p = &s->prev[s->nprev++];
+    memset(p, 0, sizeof(*p));
+    p->def = def;
+    p->ns = s->start_ns;
+    return p;
+}
+
+// Unir filas repetidas, calcular la tasa contra la foto anterior y ordenar para mostrar
+static void prepare(Server *s, AdminTable *t, uint64_t now) {
+    const AdminTableDef *def = t->def;
+    size_t n = t->nrows, nc = def->ncols;
+    RowRef *refs = (RowRef *) calloc(n ? n : 1, sizeof(RowRef));
+    if (!refs) return;
+    for (size_t i = 0; i < n; i++) refs[i] = (RowRef){i, row_key(t, i), 0};
+    qsort(refs, n, sizeof(RowRef), cmp_key);
+    size_t u = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (def->merge && u && refs[i].key && refs[u - 1].key && strcmp(refs[i].key, refs[u - 1].key) == 0) {
+            for (size_t c = 0; c < nc; c++) t->v[refs[u - 1].row * nc + c] += t->v[refs[i].row * nc + c];
+            for (size_t l = 0; l < def->nlabels; l++) {
+                free(t->lv[refs[i].row * def->nlabels + l]);
+                t->lv[refs[i].row * def->nlabels + l] = NULL;
+            }
+            free(refs[i].key);
+            continue;
+        }
+        refs[u++] = refs[i];
+    }
+    n = u;
+    if (def->rate_col >= 0 && (t->rate = (double *) calloc(t->nrows ? t->nrows : 1, sizeof(double)))) {
+        Prev *p = prev_of(s, def);
+        double dt = p ? (double) (now - p->ns) / 1e9 : 0;
+        uint64_t *pv = (uint64_t *) malloc((n ? n : 1) * sizeof(uint64_t));
+        char **pk = (char **) malloc((n ? n : 1) * sizeof(char *));
+        for (size_t i = 0; i < n; i++) {
+            uint64_t cur = t->v[refs[i].row * nc + (size_t) def->rate_col], old = 0;
+            size_t lo = 0, hi = p ? p->n : 0;
+            while (lo < hi) { // búsqueda binaria en la foto anterior (ordenada por clave)
+                size_t mid = (lo + hi) / 2;
+                int c = strcmp(p->keys[mid], refs[i].key ? refs[i].key : "");
+                if (c == 0) {
+                    old = p->v[mid];
+                    break;
+                }
+                if (c < 0) lo = mid + 1;
+                else hi = mid;
+            }
+            t->rate[refs[i].row] = dt > 0 && cur >= old ? (double) (cur - old) / dt : 0;
+            if (pv && pk) {
+                pv[i] = cur;
+                pk[i] = refs[i].key ? dup_str(refs[i].key) : NULL;
+            }
+        }
+        if (p && pv && pk) {
+            for (size_t i = 0; i < p->n; i++) free(p->keys[i]);
+            free(p->keys);
+            free(p->v);
+            size_t m = 0; // sin las claves que no se pudieron copiar (se sigue ordenado)
+            for (size_t i = 0; i < n; i++) {
+                if (!pk[i]) continue;
+                pk[m] = pk[i];
+                pv[m++] = pv[i];
+            }
+            p->keys = pk;
+            p->v = pv;
+            p->n = m;
+            p->ns = now;
+        } else {
+            free(pv);
+            free(pk);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        refs[i].sort = t->v[refs[i].row * nc + (size_t) def->sort_col];
+        // con tasa se ordena por la tasa (lo que más consume ahora, no desde el arranque)
+        if (t->rate && def->sort_col == def->rate_col) refs[i].sort = (uint64_t) (t->rate[refs[i].row] * 1000);
+    }
+    qsort(refs, n, sizeof(RowRef), cmp_sort);
+    permute(t, refs, n);
+    for (size_t i = 0; i < n; i++) free(refs[i].key);
+    free(refs);
+}
+
+static void render_text(Out *o, const AdminReport *r, double uptime) {
+    put(o, "uptime_seconds %.1f\n", uptime);
+    for (size_t i = 0; i < r->nvalues; i++) put(o, "%s %llu\n", r->values[i].name, (unsigned long long) r->values[i].v);
+    for (size_t i = 0; i < r->ntables; i++) {
+        const AdminTable *t = &r->tables[i];
+        const AdminTableDef *def = t->def;
+        size_t nl = def->nlabels;
+        size_t *w = (size_t *) calloc(nl ? nl : 1, sizeof(size_t));
+        if (!w) continue;
+        for (size_t l = 0; l < nl; l++) {
+            w[l] = strlen(def->labels[l]);
+            for (size_t row = 0; row < t->nrows; row++) {
+                size_t len = strlen(t->lv[row * nl + l]);
+                if (len > w[l]) w[l] = len;
+            }
+        }
+        put(o, "\n%s (%zu)\n", def->name, t->nrows);
+        for (size_t l = 0; l < nl; l++) put(o, "%-*s  ", (int) w[l], def->labels[l]);
+        char rh[64];
+        snprintf(rh, sizeof rh, "%s_per_s", t->rate ? def->cols[def->rate_col] : "");
+        if (t->rate) put(o, "%14s", rh);
+        for (size_t c = 0; c < def->ncols; c++) put(o, "%14s", def->cols[c]);
+        put(o, "\n");
+        for (size_t row = 0; row < t->nrows; row++) {
+            for (size_t l = 0; l < nl; l++) put(o, "%-*s  ", (int) w[l], t->lv[row * nl + l]);
+            if (t->rate) put(o, "%14.1f", t->rate[row]);
+            for (size_t c = 0; c < def->ncols; c++) put(o, "%14llu", (unsigned long long) t->v[row * def->ncols + c]);
+            put(o, "\n");
+        }
+        free(w);
+    }
+}
+
+static void render_json(Out *o, const AdminReport *r, double uptime) {
+    put(o, "{\"uptime_seconds\":%.1f", uptime);
+    for (size_t i = 0; i < r->nvalues; i++) put(o, ",\"%s\":%llu", r->values[i].name, (unsigned long long) r->values[i].v);
+    // las tablas van aparte para que sus nombres no choquen con los valores ("clients")
+    put(o, ",\"tables\":{");
+    for (size_t i = 0; i < r->ntables; i++) {
+        const AdminTable *t = &r->tables[i];
+        const AdminTableDef *def = t->def;
+        put(o, "%s\"%s\":[", i ? "," : "", def->name);
+        for (size_t row = 0; row < t->nrows; row++) {
+            put(o, row ? ",{" : "{");
+            for (size_t l = 0; l < def->nlabels; l++) {
+                put(o, "%s\"%s\":", l ? "," : "", def->labels[l]);
+                put_quoted(o, t->lv[row * def->nlabels + l], 1);
+            }
+            if (t->rate) put(o, ",\"%s_per_s\":%.1f", def->cols[def->rate_col], t->rate[row]);
+            for (size_t c = 0; c < def->ncols; c++)
+                put(o, ",\"%s\":%llu", def->cols[c], (unsigned long long) t->v[row * def->ncols + c]);
+            put(o, "}");
+        }
+        put(o, "]");
+    }
+    put(o, "}}\n");
+}
+
+static void render_prom(Out *o, const AdminReport *r, const char *prefix, double uptime) {
+    put(o, "# TYPE %s_uptime_seconds gauge\n%s_uptime_seconds %.1f\n", prefix, prefix, uptime);
+    for (size_t i = 0; i < r->nvalues; i++) {
+        const AdminValue *v = &r->values[i];
+        const char *type = v->counter ? "counter" : "gauge";
+        if (v->help) put(o, "# HELP %s_%s %s\n", prefix, v->name, v->help);
+        put(o, "# TYPE %s_%s %s\n%s_%s %llu\n", prefix, v->name, type, prefix, v->name, (unsigned long long) v->v);
+    }
+    // Una familia por columna, con todas sus filas juntas
+    for (size_t i = 0; i < r->ntables; i++) {
+        const AdminTable *t = &r->tables[i];
+        const AdminTableDef *def = t->def;
+        for (size_t c = 0; c < def->ncols; c++) {
+            const char *type = (def->counters >> c) & 1 ? "counter" : "gauge";
+            put(o, "# TYPE %s_%s_%s %s\n", prefix, def->name, def->cols[c], type);
+            for (size_t row = 0; row < t->nrows; row++) {
+                put(o, "%s_%s_%s{", prefix, def->name, def->cols[c]);
+                for (size_t l = 0; l < def->nlabels; l++) {
+                    put(o, "%s%s=", l ? "," : "", def->labels[l]);
+                    put_quoted(o, t->lv[row * def->nlabels + l], 0);
+                }
+                put(o, "} %llu\n", (unsigned long long) t->v[row * def->ncols + c]);
+            }
+        }
+    }
+}
+
+static void send_all(int fd, const char *p, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        p += n;
+        len -= (size_t) n;
+    }
+}
+
+// Atender una conexión: leer el pedido, armar la foto y responder
+static void serve(Server *s, int fd) {
+    char req[REQ_MAX + 1];
+    size_t len = 0;
+    struct timeval tv = {1, 0}; // un cliente que no manda nada no traba al hilo
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (len < REQ_MAX) {
+        ssize_t n = recv(fd, req + len, REQ_MAX - len, 0);
+        if (n <= 0) break;
+        len += (size_t) n;
+        req[len] = '\0';
+        // texto: alcanza con la primera línea; HTTP: hasta el final de las cabeceras
+        if (strncmp(req, "GET ", 4) == 0 ? strstr(req, "\r\n\r\n") != NULL : memchr(req, '\n', len) != NULL) break;
+    }
+    req[len] = '\0';
+    int http = strncmp(req, "GET ", 4) == 0;
+    const char *what = http ? req + 4 : req;
+    if (http && *what == '/') what++;
+    Format fmt = FMT_TEXT;
+    if (strncmp(what, "json", 4) == 0) fmt = FMT_JSON;
+    else if (strncmp(what, "metrics", 7) == 0) fmt = FMT_PROM;
+
+    AdminReport *r = (AdminReport *) calloc(1, sizeof(AdminReport));
+    if (!r) return;
+    s->collect(r, s->arg);
+    uint64_t now = now_ns();
+    for (size_t i = 0; i < r->ntables; i++) prepare(s, &r->tables[i], now);
+    double uptime = (double) (now - s->start_ns) / 1e9;
+    Out body = {0};
+    if (fmt == FMT_JSON) render_json(&body, r, uptime);
+    else if (fmt == FMT_PROM) render_prom(&body, r, s->prefix, uptime);
+    else render_text(&body, r, uptime);
+    report_free(r);
+    free(r);
+    if (http) {
+        const char *type = fmt == FMT_JSON ? "application/json" : fmt == FMT_PROM ? "text/plain; version=0.0.4" : "text/plain";
+        Out h = {0};
+        put(&h, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", type,
+            body.len);
+        if (h.p) send_all(fd, h.p, h.len);
+        free(h.p);
+    }
+    if (body.p) send_all(fd, body.p, body.len);
+    free(body.p);
+    shutdown(fd, SHUT_WR);
+}
+
+static void *admin_thread(void *arg) {
+    Server *s = (Server *) arg;
+    while (1) {
+        int fd = accept(s->fd, NULL, NULL);
+        if (fd < 0) continue;
+        serve(s, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int admin_start(int port, const char *prefix, AdminCollect collect, void *arg) {
+    Server *s = (Server *) calloc(1, sizeof(Server));
+    if (!s) return -1;
+    s->prefix = prefix;
+    s->collect = collect;
+    s->arg = arg;
+    s->start_ns = now_ns();
+    s->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s->fd < 0) {
+        free(s);
+        return -1;
+    }
+    int yes = 1;
+    (void) setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    // Solo local: las fotos muestran temas y direcciones de los clientes
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t) port);
+    pthread_t th;
+    if (bind(s->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(s->fd, 16) < 0 ||
+        pthread_create(&th, NULL, admin_thread, s) != 0) {
+        close(s->fd);
+        free(s);
+        return -1;
+    }
+    pthread_detach(th);
+    return 0;
+}
@@ -0,0 +1,86 @@
+// admin.h — Métricas de los brokers y socket de administración
+// Los brokers cuentan lo que pasa con contadores de un solo escritor: el hilo dueño los suma con
+// atómicos relajados (sin instrucciones con lock) y cualquier otro hilo los lee sin tomar locks.
+// admin_start() abre un socket TCP en 127.0.0.1 atendido por un hilo propio. Cada conexión envía una
+// línea y recibe una foto del broker, después se cierra:
+//   stats    texto legible (tablas ordenadas: lo que más consume primero)
+//   json     la misma foto en JSON
+//   metrics  formato de exposición de Prometheus
+// También acepta "GET /stats", "GET /json" y "GET /metrics" (HTTP/1.x), para curl o un scraper.
+// La foto la arma el broker en un AdminReport: valores sueltos y tablas con etiquetas (por tema, por
+// cliente). En texto y JSON se agrega la tasa por segundo de una columna desde la foto anterior.
+
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stdatomic.h>     // _Atomic, atomic_load_explicit(), atomic_store_explicit()
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint64_t
+
+#define ADMIN_MAX_VALUES 64 // valores sueltos por foto
+#define ADMIN_MAX_TABLES 4 // tablas por foto
+
+// Contador de un solo escritor
+typedef _Atomic uint64_t Counter;
+
+static inline void counter_add(Counter *c, uint64_t n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void counter_max(Counter *c, uint64_t v) {
+    if (v > atomic_load_explicit(c, memory_order_relaxed)) atomic_store_explicit(c, v, memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(Counter *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+// Forma de una tabla (la define el broker una vez, estática)
+typedef struct AdminTableDef {
+    const char *name; // "subject", "client": nombre de la tabla y prefijo de sus métricas
+    const char *const *labels; // columnas de texto que identifican la fila
+    size_t nlabels;
+    const char *const *cols; // columnas numéricas
+    size_t ncols;
+    uint64_t counters; // bit i: la columna i es un contador (si no, un valor instantáneo)
+    int merge; // sumar las filas con las mismas etiquetas (un tema visto desde varios hilos)
+    int sort_col; // columna por la que se ordena de mayor a menor en texto y JSON
+    int rate_col; // columna de la que se calcula "<col>_per_s" en texto y JSON (-1 = ninguna)
+} AdminTableDef;
+
+typedef struct AdminTable {
+    const AdminTableDef *def;
+    char **lv; // nrows * nlabels etiquetas
+    uint64_t *v; // nrows * ncols valores
+    double *rate; // tasa de rate_col por fila (la calcula el hilo de administración)
+    size_t nrows, cap;
+} AdminTable;
+
+typedef struct AdminValue {
+    const char *name;
+    const char *help;
+    int counter; // 1 = contador, 0 = valor instantáneo
+    uint64_t v;
+} AdminValue;
+
+typedef struct AdminReport {
+    AdminValue values[ADMIN_MAX_VALUES];
+    size_t nvalues;
+    AdminTable tables[ADMIN_MAX_TABLES];
+    size_t ntables;
+} AdminReport;
+
+// Arma una foto: la llama el hilo de administración con un AdminReport vacío
+typedef void (*AdminCollect)(AdminReport *r, void *arg);
+
+// Abrir el socket de administración en 127.0.0.1:'port' y atenderlo en un hilo propio. 'prefix'
+// antecede a los nombres en Prometheus ("broker_tcp"). -1 si no se pudo abrir.
+int admin_start(int port, const char *prefix, AdminCollect collect, void *arg);
+
+// Agregar un valor suelto (se suma si ya existe, así cada hilo puede aportar su parte)
+void admin_value(AdminReport *r, const char *name, const char *help, int counter, uint64_t v);
+
+// Agregar una fila a la tabla 'def' (se crea la primera vez). Copia las etiquetas.
+void admin_row(AdminReport *r, const AdminTableDef *def, const char *const *labels, const uint64_t *vals);
+
+#endif // ADMIN_H
@@ -0,0 +1,701 @@
+// dlog.c — Implementación del log durable
+
+#define _GNU_SOURCE        // posix_fallocate(), strdup()
+
+#include "common/dlog.h"
+
+#include <dirent.h>        // opendir(), readdir(), closedir()
+#include <errno.h>         // errno, EINVAL
+#include <fcntl.h>         // open(), posix_fallocate(), O_*
+#include <pthread.h>       // pthread_mutex_t
+#include <stdio.h>         // snprintf(), fopen(), fread(), fclose(), rename()
+#include <stdlib.h>        // calloc(), malloc(), realloc(), free(), qsort(), strtoull()
+#include <string.h>        // memcpy(), memcmp(), memmove(), memset(), strlen(), strcmp()
+#include <sys/mman.h>      // mmap(), munmap(), msync()
+#include <sys/stat.h>      // fstat(), mkdir()
+#include <unistd.h>        // close(), ftruncate(), fsync(), write(), unlink(), access()
+
+#include "common/subject_index.h" // tema -> tramos del log
+
+#define DLOG_MAGIC 0x31474f4c42555350ull // "PSUBLOG1"
+#define DLOG_MAX_SUBJECT 1024 // largo máximo de un tema en el log
+#define DLOG_PATH 4096
+
+// Cabecera de cada registro; le siguen el tema y el payload, con relleno hasta múltiplo de 8.
+// Un registro con len == 0 marca el final del segmento.
+typedef struct RecHdr {
+    uint32_t len; // registro completo
+    uint32_t sum; // suma de verificación de lo que sigue a este campo
+    uint64_t offset; // posición global en el log
+    uint64_t seq; // secuencia en el tema
+    uint32_t plen;
+    uint16_t slen;
+    uint16_t pad;
+} RecHdr;
+
+// Archivo .idx: cabecera y entradas offset -> posición, en orden
+typedef struct IdxHdr {
+    uint64_t magic;
+    uint64_t committed; // bytes del segmento que ya están en disco (no hace falta verificarlos)
+    uint64_t count; // entradas válidas
+    uint64_t pad;
+} IdxHdr;
+
+typedef struct IdxEntry {
+    uint32_t rel; // offset - base del segmento
+    uint32_t pos; // posición del registro en el segmento
+} IdxEntry;
+
+// Archivo .sum: cabecera y, por tema, SumEntry seguido del nombre
+typedef struct SumHdr {
+    uint64_t magic;
+    uint64_t next; // offset siguiente al último registro
+    uint64_t end; // bytes usados del segmento
+    uint64_t nsubjects;
+} SumHdr;
+
+typedef struct SumEntry {
+    uint64_t first_seq, last_seq, first_offset;
+    uint32_t slen;
+    uint32_t pad;
+} SumEntry;
+
+typedef struct Segment {
+    uint64_t base; // offset del primer registro
+    uint64_t next; // offset siguiente al último
+    size_t end; // bytes usados
+    size_t size; // bytes mapeados
+    char *map;
+    int fd;
+    IdxHdr *idx; // .idx mapeado
+    IdxEntry *ent;
+    size_t idx_size, idx_cap;
+    int ifd;
+    size_t indexed; // posición de la última entrada del índice
+    size_t synced; // bytes ya llevados a disco
+    int sealed; // ya no recibe registros
+    int summarized; // tiene su .sum en disco
+    Subject **touched; // temas con registros en el segmento (para su .sum y para descartarlo)
+    size_t ntouched, tcap;
+    int pins; // dlog_replay() leyendo el segmento sin el lock
+    int retired; // ya salió del log: lo libera el último dlog_replay() que lo tenga
+} Segment;
+
+// Tramo de un tema dentro de un segmento
+typedef struct Span {
+    Segment *seg;
+    uint64_t first_seq, last_seq;
+    uint64_t first_offset;
+} Span;
+
+// Estado de un tema (en Subject.data del índice del log)
+typedef struct Spans {
+    Span *v; // del segmento más viejo al más nuevo
+    size_t n, cap;
+    uint64_t next_seq;
+} Spans;
+
+struct DLog {
+    pthread_mutex_t lock; // todo el estado salvo el disco
+    pthread_mutex_t commit_lock; // un solo dlog_commit() a la vez
+    char *dir;
+    size_t segment_bytes;
+    uint64_t max_bytes;
+    Segment **segs; // del más viejo al activo (el último)
+    size_t nsegs, segs_cap;
+    uint64_t bytes;
+    SubjectIndex subjects;
+};
+
+// Suma de verificación de un registro, de a 8 bytes (el registro está rellenado a múltiplo de 8)
+static uint32_t rec_sum(const char *p, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull ^ len;
+    for (size_t i = 8; i < len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x100000001b3ull;
+        h ^= h >> 29;
+    }
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+static size_t rec_len(size_t slen, size_t plen) {
+    return (sizeof(RecHdr) + slen + plen + 7) & ~(size_t) 7;
+}
+
+static void seg_path(const DLog *log, uint64_t base, const char *ext, char *out) {
+    snprintf(out, DLOG_PATH, "%s/%020llu.%s", log->dir, (unsigned long long) base, ext);
+}
+
+// Reservar espacio en disco de una vez (evita SIGBUS al escribir por el mapa con el disco lleno);
+// en sistemas de archivos sin fallocate alcanza con el tamaño
+static int reserve(int fd, size_t size) {
+    if (posix_fallocate(fd, 0, (off_t) size) == 0) return 0;
+    return ftruncate(fd, (off_t) size);
+}
+
+static size_t idx_bytes(size_t size) {
+    return sizeof(IdxHdr) + (size / DLOG_INDEX_EVERY + 1) * sizeof(IdxEntry);
+}
+
+static void seg_free(DLog *log, Segment *s, int remove) {
+    if (s->map) munmap(s->map, s->size);
+    if (s->idx) munmap(s->idx, s->idx_size);
+    if (s->fd >= 0) close(s->fd);
+    if (s->ifd >= 0) close(s->ifd);
+    if (remove) {
+        char path[DLOG_PATH];
+        seg_path(log, s->base, "log", path);
+        unlink(path);
+        seg_path(log, s->base, "idx", path);
+        unlink(path);
+        seg_path(log, s->base, "sum", path);
+        unlink(path);
+    }
+    free(s->touched);
+    free(s);
+}
+
+// Abrir un segmento y su índice. Si el archivo tiene menos de 'want' bytes se agranda; 'fresh'
+// descarta lo que hubiera (segmento nuevo).
+static Segment *seg_open(DLog *log, uint64_t base, size_t want, int fresh) {
+    Segment *s = (Segment *) calloc(1, sizeof(Segment));
+    if (!s) return NULL;
+    s->base = s->next = base;
+    s->fd = s->ifd = -1;
+    char path[DLOG_PATH];
+    int flags = O_RDWR | O_CREAT | (fresh ? O_TRUNC : 0);
+    struct stat st;
+    seg_path(log, base, "log", path);
+    s->fd = open(path, flags, 0644);
+    if (s->fd < 0 || fstat(s->fd, &st) < 0) goto fail;
+    s->size = (size_t) st.st_size;
+    if (s->size < want) {
+        if (reserve(s->fd, want) < 0) goto fail;
+        s->size = want;
+    }
+    if (s->size) {
+        s->map = (char *) mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+        if (s->map == MAP_FAILED) {
+            s->map = NULL;
+            goto fail;
+        }
+    }
+    seg_path(log, base, "idx", path);
+    s->ifd = open(path, flags, 0644);
+    if (s->ifd < 0 || fstat(s->ifd, &st) < 0) goto fail;
+    s->idx_size = (size_t) st.st_size;
+    if (s->idx_size < idx_bytes(s->size)) {
+        if (reserve(s->ifd, idx_bytes(s->size)) < 0) goto fail;
+        s->idx_size = idx_bytes(s->size);
+    }
+    s->idx = (IdxHdr *) mmap(NULL, s->idx_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->ifd, 0);
+    if (s->idx == MAP_FAILED) {
+        s->idx = NULL;
+        goto fail;
+    }
+    s->ent = (IdxEntry *) (s->idx + 1);
+    s->idx_cap = (s->idx_size - sizeof(IdxHdr)) / sizeof(IdxEntry);
+    if (s->idx->magic != DLOG_MAGIC) {
+        s->idx->magic = DLOG_MAGIC;
+        s->idx->committed = 0;
+        s->idx->count = 0;
+    }
+    if (s->idx->count > s->idx_cap) s->idx->count = 0;
+    return s;
+fail:
+    seg_free(log, s, 0);
+    return NULL;
+}
+
+// Agregar al tema las secuencias [first_seq, last_seq] del segmento 's' (extiende su último tramo)
+static void add_span(DLog *log, Segment *s, const char *subject, uint64_t first_seq, uint64_t last_seq,
+                     uint64_t first_offset) {
+    // sin memoria: el tema no se puede reproducir desde el log, pero los registros quedan escritos
+    Subject *subj = subject_index_intern(&log->subjects, subject);
+    if (!subj) return;
+    Spans *sp = (Spans *) subj->data;
+    if (!sp) {
+        sp = (Spans *) calloc(1, sizeof(Spans));
+        if (!sp) return;
+        subj->data = sp;
+    }
+    sp->next_seq = last_seq + 1;
+    if (sp->n && sp->v[sp->n - 1].seg == s) {
+        sp->v[sp->n - 1].last_seq = last_seq;
+        return;
+    }
+    if (sp->n == sp->cap) {
+        size_t ncap = sp->cap ? sp->cap * 2 : 2;
+        Span *v = (Span *) realloc(sp->v, ncap * sizeof(Span));
+        if (!v) return;
+        sp->v = v;
+        sp->cap = ncap;
+    }
+    if (s->ntouched == s->tcap) {
+        size_t ncap = s->tcap ? s->tcap * 2 : 64;
+        Subject **t = (Subject **) realloc(s->touched, ncap * sizeof(Subject *));
+        if (!t) return;
+        s->touched = t;
+        s->tcap = ncap;
+    }
+    sp->v[sp->n++] = (Span){s, first_seq, last_seq, first_offset};
+    s->touched[s->ntouched++] = subj;
+}
+
+// Registrar un registro ya escrito en la posición 'pos': índice disperso y tramo del tema
+static void track(DLog *log, Segment *s, size_t pos, const RecHdr *h, const char *subject) {
+    if (s->idx->count == 0 || pos >= s->indexed + DLOG_INDEX_EVERY) {
+        if (s->idx->count < s->idx_cap) {
+            s->ent[s->idx->count++] = (IdxEntry){(uint32_t) (h->offset - s->base), (uint32_t) pos};
+            s->indexed = pos;
+        }
+    }
+    s->end = pos + h->len;
+    s->next = h->offset + 1;
+    log->bytes += h->len;
+    add_span(log, s, subject, h->seq, h->seq, h->offset);
+}
+
+// Reconstruir un segmento recorriendo las cabeceras de sus registros. Lo confirmado en disco se da
+// por bueno; después de eso se verifica cada registro y se corta en el primero roto (escritura a
+// medias antes de una caída).
+static void seg_scan(DLog *log, Segment *s) {
+    size_t committed = (size_t) s->idx->committed;
+    char name[DLOG_MAX_SUBJECT + 1];
+    size_t pos = 0;
+    s->idx->count = 0;
+    while (pos + sizeof(RecHdr) <= s->size) {
+        const RecHdr *h = (const RecHdr *) (s->map + pos);
+        if (h->len == 0 || h->len % 8 || h->len > s->size - pos || h->offset != s->next) break;
+        if (h->slen == 0 || h->slen > DLOG_MAX_SUBJECT || h->len < rec_len(h->slen, h->plen)) break;
+        if (pos + h->len > committed && rec_sum(s->map + pos, h->len) != h->sum) break;
+        memcpy(name, h + 1, h->slen);
+        name[h->slen] = '\0';
+        track(log, s, pos, h, name);
+        pos += h->len;
+    }
+    s->end = pos;
+    if (pos + sizeof(RecHdr) <= s->size) ((RecHdr *) (s->map + pos))->len = 0; // lo que siga es basura
+    s->synced = pos < committed ? pos : committed;
+}
+
+// Cargar un segmento cerrado desde su .sum; -1 si no existe o no es válido
+static int seg_load_sum(DLog *log, Segment *s) {
+    char path[DLOG_PATH];
+    seg_path(log, s->base, "sum", path);
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    SumHdr h;
+    int ok = fread(&h, sizeof h, 1, f) == 1 && h.magic == DLOG_MAGIC && h.end <= s->size && h.next >= s->base;
+    char name[DLOG_MAX_SUBJECT + 1];
+    for (uint64_t i = 0; ok && i < h.nsubjects; i++) {
+        SumEntry e;
+        ok = fread(&e, sizeof e, 1, f) == 1 && e.slen && e.slen <= DLOG_MAX_SUBJECT &&
+             fread(name, 1, e.slen, f) == e.slen;
+        if (!ok) break;
+        name[e.slen] = '\0';
+        add_span(log, s, name, e.first_seq, e.last_seq, e.first_offset);
+    }
+    fclose(f);
+    if (!ok) {
+        // deshacer lo cargado: el segmento se va a recorrer desde cero
+        for (size_t i = 0; i < s->ntouched; i++) {
+            Spans *sp = (Spans *) s->touched[i]->data;
+            if (sp && sp->n && sp->v[sp->n - 1].seg == s) sp->n--;
+        }
+        s->ntouched = 0;
+        return -1;
+    }
+    s->end = (size_t) h.end;
+    s->next = h.next;
+    s->sealed = s->summarized = 1;
+    s->synced = s->end;
+    log->bytes += s->end;
+    return 0;
+}
+
+// Armar el .sum de un segmento cerrado (con el lock tomado)
+static char *build_sum(const Segment *s, size_t *len) {
+    size_t n = sizeof(SumHdr);
+    for (size_t i = 0; i < s->ntouched; i++) n += sizeof(SumEntry) + strlen(s->touched[i]->name);
+    char *buf = (char *) malloc(n);
+    if (!buf) return NULL;
+    SumHdr h = {DLOG_MAGIC, s->next, s->end, s->ntouched};
+    memcpy(buf, &h, sizeof h);
+    size_t p = sizeof h;
+    for (size_t i = 0; i < s->ntouched; i++) {
+        const Subject *subj = s->touched[i];
+        const Spans *sp = (const Spans *) subj->data;
+        const Span *sn = NULL;
+        for (size_t j = 0; j < sp->n && !sn; j++)
+            if (sp->v[j].seg == s) sn = &sp->v[j];
+        size_t slen = strlen(subj->name);
+        SumEntry e = {sn->first_seq, sn->last_seq, sn->first_offset, (uint32_t) slen, 0};
+        memcpy(buf + p, &e, sizeof e);
+        memcpy(buf + p + sizeof e, subj->name, slen);
+        p += sizeof e + slen;
+    }
+    *len = p;
+    return buf;
+}
+
+// Escribir el .sum (archivo temporal + rename, para no dejar uno a medias)
+static int write_sum(DLog *log, const Segment *s, const char *buf, size_t len) {
+    char path[DLOG_PATH], tmp[DLOG_PATH + 4];
+    seg_path(log, s->base, "sum", path);
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    size_t off = 0;
+    while (off < len) {
+        ssize_t w = write(fd, buf + off, len - off);
+        if (w <= 0) break;
+        off += (size_t) w;
+    }
+    int ok = off == len && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int push_segment(DLog *log, Segment *s) {
+    if (log->nsegs == log->segs_cap) {
+        size_t ncap = log->segs_cap ? log->segs_cap * 2 : 16;
+        Segment **v = (Segment **) realloc(log->segs, ncap * sizeof(Segment *));
+        if (!v) return -1;
+        log->segs = v;
+        log->segs_cap = ncap;
+    }
+    log->segs[log->nsegs++] = s;
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Offsets base de los segmentos del directorio, ordenados; -1 si no se pudo listar
+static int list_segments(const char *dir, uint64_t **out, size_t *n) {
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    uint64_t *v = NULL;
+    size_t cap = 0;
+    *n = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        char *end;
+        uint64_t base = strtoull(e->d_name, &end, 10);
+        if (end != e->d_name + 20 || strcmp(end, ".log") != 0) continue;
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *nv = (uint64_t *) realloc(v, cap * sizeof(uint64_t));
+            if (!nv) break;
+            v = nv;
+        }
+        v[(*n)++] = base;
+    }
+    closedir(d);
+    if (*n) qsort(v, *n, sizeof(uint64_t), cmp_u64);
+    *out = v;
+    return 0;
+}
+
+DLog *dlog_open(const char *dir, size_t segment_bytes, uint64_t max_bytes) {
+    if (!segment_bytes) segment_bytes = DLOG_SEGMENT_BYTES;
+    if (segment_bytes < DLOG_INDEX_EVERY || segment_bytes > DLOG_MAX_SEGMENT_BYTES) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return NULL;
+    DLog *log = (DLog *) calloc(1, sizeof(DLog));
+    if (!log) return NULL;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_mutex_init(&log->commit_lock, NULL);
+    log->dir = strdup(dir);
+    log->segment_bytes = segment_bytes & ~(size_t) 7;
+    log->max_bytes = max_bytes;
+    uint64_t *bases = NULL;
+    size_t nb = 0;
+    if (!log->dir || subject_index_init(&log->subjects) < 0 || list_segments(dir, &bases, &nb) < 0) goto fail;
+    for (size_t i = 0; i < nb; i++) {
+        char path[DLOG_PATH];
+        seg_path(log, bases[i], "sum", path);
+        // el último segmento sin .sum es el activo: se agranda y se recorre
+        int active = i + 1 == nb && access(path, F_OK) < 0;
+        Segment *s = seg_open(log, bases[i], active ? log->segment_bytes : 0, 0);
+        if (!s || push_segment(log, s) < 0) {
+            if (s) seg_free(log, s, 0);
+            goto fail;
+        }
+        if (active) {
+            seg_scan(log, s);
+        } else if (seg_load_sum(log, s) < 0) {
+            seg_scan(log, s); // cerrado sin .sum: se escribe en el próximo dlog_commit()
+            s->sealed = 1;
+        }
+    }
+    if (log->nsegs == 0 || log->segs[log->nsegs - 1]->sealed) {
+        uint64_t base = log->nsegs ? log->segs[log->nsegs - 1]->next : 0;
+        Segment *s = seg_open(log, base, log->segment_bytes, 1);
+        if (!s || push_segment(log, s) < 0) {
+            if (s) seg_free(log, s, 0);
+            goto fail;
+        }
+    }
+    free(bases);
+    return log;
+fail:
+    free(bases);
+    dlog_close(log);
+    return NULL;
+}
+
+void dlog_close(DLog *log) {
+    if (!log) return;
+    if (log->nsegs) dlog_commit(log);
+    for (size_t i = 0; i < log->nsegs; i++) seg_free(log, log->segs[i], 0);
+    free(log->segs);
+    if (log->subjects.buckets) {
+        for (size_t i = 0; i < log->subjects.nbuckets; i++) {
+            for (Subject *s = log->subjects.buckets[i]; s; s = s->next) {
+                Spans *sp = (Spans *) s->data;
+                if (sp) free(sp->v);
+                free(sp);
+            }
+        }
+        subject_index_free(&log->subjects);
+    }
+    pthread_mutex_destroy(&log->lock);
+    pthread_mutex_destroy(&log->commit_lock);
+    free(log->dir);
+    free(log);
+}
+
+// Cerrar el segmento activo y abrir uno nuevo a continuación (con el lock tomado)
+static Segment *roll(DLog *log) {
+    Segment *cur = log->segs[log->nsegs - 1];
+    Segment *s = seg_open(log, cur->next, log->segment_bytes, 1);
+    if (!s) return NULL;
+    if (push_segment(log, s) < 0) {
+        seg_free(log, s, 1);
+        return NULL;
+    }
+    cur->sealed = 1;
+    return s;
+}
+
+int dlog_fits(const DLog *log, const char *subject, size_t len) {
+    size_t slen = strlen(subject);
+    // segment_bytes no cambia después de abrir: no hace falta el lock
+    return slen > 0 && slen <= DLOG_MAX_SUBJECT && len <= UINT32_MAX &&
+           rec_len(slen, len) + sizeof(RecHdr) <= log->segment_bytes;
+}
+
+int dlog_append(DLog *log, const char *subject, uint64_t seq, const char *payload, size_t len) {
+    if (!dlog_fits(log, subject, len)) return -1;
+    size_t slen = strlen(subject);
+    size_t rlen = rec_len(slen, len);
+    pthread_mutex_lock(&log->lock);
+    Segment *s = log->segs[log->nsegs - 1];
+    if (s->end + rlen + sizeof(RecHdr) > s->size && !(s = roll(log))) {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+    size_t pos = s->end;
+    char *p = s->map + pos;
+    RecHdr h = {(uint32_t) rlen, 0, s->next, seq, (uint32_t) len, (uint16_t) slen, 0};
+    memcpy(p, &h, sizeof h);
+    memcpy(p + sizeof h, subject, slen);
+    if (len) memcpy(p + sizeof h + slen, payload, len);
+    memset(p + sizeof h + slen + len, 0, rlen - sizeof h - slen - len);
+    ((RecHdr *) p)->sum = rec_sum(p, rlen);
+    ((RecHdr *) (p + rlen))->len = 0; // fin del segmento (siempre queda lugar para una cabecera)
+    track(log, s, pos, &h, subject);
+    pthread_mutex_unlock(&log->lock);
+    return 0;
+}
+
+// Lo que un dlog_commit() lleva a disco de un segmento
+typedef struct Pending {
+    Segment *s;
+    size_t from, to; // bytes sin confirmar
+    char *sum; // .sum a escribir (segmento cerrado)
+    size_t sum_len;
+} Pending;
+
+// Llevar a disco [from, to) de un mapa (msync trabaja con páginas enteras)
+static void sync_range(char *map, size_t from, size_t to) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = from & ~(page - 1);
+    if (to > start) msync(map + start, to - start, MS_SYNC);
+}
+
+void dlog_commit(DLog *log) {
+    pthread_mutex_lock(&log->commit_lock);
+    pthread_mutex_lock(&log->lock);
+    Pending *p = (Pending *) calloc(log->nsegs, sizeof(Pending));
+    size_t np = 0;
+    for (size_t i = 0; p && i < log->nsegs; i++) {
+        Segment *s = log->segs[i];
+        int need_sum = s->sealed && !s->summarized;
+        if (s->synced == s->end && !need_sum) continue;
+        p[np] = (Pending){s, s->synced, s->end, NULL, 0};
+        if (need_sum) p[np].sum = build_sum(s, &p[np].sum_len);
+        np++;
+    }
+    // Descartar segmentos viejos ya resumidos mientras se supere el límite (nunca el activo). Uno que
+    // se está reproduciendo queda fuera del log pero mapeado hasta que termine esa lectura.
+    Segment *dead[64];
+    size_t ndead = 0;
+    while (log->max_bytes && log->bytes > log->max_bytes && log->nsegs > 1 && ndead < 64 &&
+           log->segs[0]->summarized) {
+        Segment *s = log->segs[0];
+        for (size_t i = 0; i < s->ntouched; i++) {
+            Spans *sp = (Spans *) s->touched[i]->data;
+            if (sp && sp->n && sp->v[0].seg == s) memmove(sp->v, sp->v + 1, --sp->n * sizeof(Span));
+        }
+        log->bytes -= s->end;
+        memmove(log->segs, log->segs + 1, --log->nsegs * sizeof(Segment *));
+        if (s->pins) s->retired = 1;
+        else dead[ndead++] = s;
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    // Sin el lock: los publicadores siguen agregando mientras se espera al disco
+    for (size_t i = 0; i < np; i++) {
+        Segment *s = p[i].s;
+        if (p[i].to > p[i].from) {
+            sync_range(s->map, p[i].from, p[i].to);
+            msync(s->idx, s->idx_size, MS_SYNC); // entradas del índice
+            s->idx->committed = p[i].to;
+            msync(s->idx, sizeof(IdxHdr), MS_SYNC);
+        }
+        if (p[i].sum && write_sum(log, s, p[i].sum, p[i].sum_len) == 0) {
+            // el mapa sigue siendo del tamaño original, pero nunca se lee más allá de 'end'
+            if (ftruncate(s->fd, (off_t) s->end) < 0) {
+                // se queda con el tamaño reservado
+            }
+        } else {
+            free(p[i].sum);
+            p[i].sum = NULL;
+        }
+    }
+    pthread_mutex_lock(&log->lock);
+    for (size_t i = 0; i < np; i++) {
+        if (p[i].s->synced < p[i].to) p[i].s->synced = p[i].to;
+        if (p[i].sum) p[i].s->summarized = 1;
+        free(p[i].sum);
+    }
+    pthread_mutex_unlock(&log->lock);
+    free(p);
+    for (size_t i = 0; i < ndead; i++) seg_free(log, dead[i], 1);
+    pthread_mutex_unlock(&log->commit_lock);
+}
+
+static Spans *find_spans(DLog *log, const char *subject) {
+    Subject *s = subject_index_find(&log->subjects, subject);
+    return s ? (Spans *) s->data : NULL;
+}
+
+uint64_t dlog_next_seq(DLog *log, const char *subject) {
+    pthread_mutex_lock(&log->lock);
+    Spans *sp = find_spans(log, subject);
+    uint64_t next = sp ? sp->next_seq : 1;
+    pthread_mutex_unlock(&log->lock);
+    return next;
+}
+
+uint64_t dlog_first_seq(DLog *log, const char *subject) {
+    pthread_mutex_lock(&log->lock);
+    Spans *sp = find_spans(log, subject);
+    uint64_t first = !sp ? 1 : sp->n ? sp->v[0].first_seq : sp->next_seq;
+    pthread_mutex_unlock(&log->lock);
+    return first;
+}
+
+// Posición desde la que buscar 'offset' en un segmento: la última entrada del índice que no lo pasa
+static size_t seg_find(const Segment *s, uint64_t offset) {
+    uint64_t rel = offset - s->base;
+    size_t lo = 0, hi = (size_t) s->idx->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (s->ent[mid].rel <= rel) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? s->ent[lo - 1].pos : 0;
+}
+
+// Tramo de un segmento que dlog_replay() lee sin el lock
+typedef struct Pin {
+    Segment *s;
+    size_t pos, end; // desde la entrada del índice hasta lo escrito al tomar el tramo
+    uint64_t first_offset, last_seq; // primer registro del tema a mirar (el tramo o 'hint')
+} Pin;
+
+size_t dlog_replay(DLog *log, const char *subject, uint64_t from, uint64_t upto, uint64_t hint, DLogVisit visit,
+                   void *arg) {
+    size_t slen = strlen(subject), n = 0, npins = 0;
+    // Con el lock solo se copian los tramos y se fijan sus segmentos: el recorrido y 'visit' van sin
+    // él, así dlog_append() no espera a una reproducción larga. Lo agregado después no se ve.
+    pthread_mutex_lock(&log->lock);
+    Spans *sp = find_spans(log, subject);
+    Pin *pins = sp && sp->n ? (Pin *) malloc(sp->n * sizeof(Pin)) : NULL;
+    for (size_t i = 0; pins && i < sp->n; i++) {
+        const Span *sn = &sp->v[i];
+        if (sn->last_seq < from) continue;
+        if (sn->first_seq >= upto) break;
+        uint64_t start = hint > sn->first_offset && hint < sn->seg->next ? hint : sn->first_offset;
+        sn->seg->pins++;
+        pins[npins++] = (Pin){sn->seg, seg_find(sn->seg, start), sn->seg->end, start, sn->last_seq};
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    int stop = 0;
+    for (size_t i = 0; i < npins && !stop; i++) {
+        const Pin *pn = &pins[i];
+        for (size_t pos = pn->pos; pos < pn->end;) {
+            const RecHdr *h = (const RecHdr *) (pn->s->map + pos);
+            pos += h->len;
+            if (h->offset < pn->first_offset || h->slen != slen || memcmp(h + 1, subject, slen) != 0) continue;
+            if (h->seq >= upto) {
+                stop = 1;
+                break;
+            }
+            if (h->seq >= from) {
+                n++;
+                if (visit(arg, h->seq, h->offset, (const char *) (h + 1) + slen, h->plen)) {
+                    stop = 1;
+                    break;
+                }
+            }
+            if (h->seq >= pn->last_seq) break;
+        }
+    }
+
+    // Soltar los segmentos; los que dlog_commit() descartó mientras tanto se liberan acá
+    size_t ndead = 0;
+    pthread_mutex_lock(&log->lock);
+    for (size_t i = 0; i < npins; i++) {
+        Segment *s = pins[i].s;
+        if (--s->pins == 0 && s->retired) pins[ndead++].s = s;
+    }
+    pthread_mutex_unlock(&log->lock);
+    for (size_t i = 0; i < ndead; i++) seg_free(log, pins[i].s, 1);
+    free(pins);
+    return n;
+}
+
+void dlog_stats(DLog *log, DLogStats *st) {
+    pthread_mutex_lock(&log->lock);
+    st->segments = log->nsegs;
+    st->bytes = log->bytes;
+    st->first_offset = log->nsegs ? log->segs[0]->base : 0;
+    st->next_offset = log->nsegs ? log->segs[log->nsegs - 1]->next : 0;
+    st->subjects = log->subjects.count;
+    pthread_mutex_unlock(&log->lock);
+}
@@ -0,0 +1,77 @@
+// dlog.h — Log durable de lo publicado, para broker_tcp
+// Los mensajes se agregan a segmentos de tamaño fijo mapeados en memoria ("<offset base>.log" en el
+// directorio de datos): agregar es un memcpy al mapa, sin write() ni fsync por mensaje. Cada registro
+// lleva un offset global (posición en el log), el tema, su secuencia en el tema y el payload.
+// Junto a cada segmento hay un índice disperso ("<base>.idx": una entrada offset -> posición cada
+// DLOG_INDEX_EVERY bytes) y, cuando se cierra, un resumen por tema ("<base>.sum": primera y última
+// secuencia y primer offset). dlog_commit() hace un solo msync para todo lo agregado desde el anterior
+// (group commit) y anota hasta dónde quedó en disco.
+// Al abrir, los segmentos cerrados se cargan desde su resumen y solo se recorren las cabeceras del
+// segmento activo (la suma de verificación se mira únicamente después de lo confirmado en disco), así
+// el arranque no lee payloads y no depende de cuántos datos haya retenidos.
+// Todas las funciones son seguras entre hilos.
+
+#ifndef DLOG_H
+#define DLOG_H
+
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint64_t
+
+#define DLOG_SEGMENT_BYTES (64u << 20) // tamaño de segmento por defecto (64 MiB)
+#define DLOG_MAX_SEGMENT_BYTES (1u << 30) // las posiciones dentro de un segmento son de 32 bits
+#define DLOG_INDEX_EVERY 4096 // bytes de log entre entradas del índice disperso
+
+typedef struct DLog DLog;
+
+// Estado del log (para mostrar al arrancar y en métricas)
+typedef struct DLogStats {
+    size_t segments;
+    uint64_t bytes; // bytes de registros en todos los segmentos
+    uint64_t first_offset; // offset del registro más viejo
+    uint64_t next_offset; // offset que recibirá el próximo registro
+    size_t subjects;
+} DLogStats;
+
+// Se llama por cada mensaje reproducido con dlog_replay(), con su offset en el log; devolver
+// distinto de 0 corta el recorrido
+typedef int (*DLogVisit)(void *arg, uint64_t seq, uint64_t offset, const char *payload, size_t len);
+
+// Abrir (o crear) el log en 'dir' con segmentos de 'segment_bytes' (0 = DLOG_SEGMENT_BYTES).
+// 'max_bytes' limita el total retenido descartando segmentos enteros, los más viejos primero
+// (0 = sin límite). NULL con errno si no se pudo abrir.
+DLog *dlog_open(const char *dir, size_t segment_bytes, uint64_t max_bytes);
+
+// Confirmar lo pendiente y liberar todo
+void dlog_close(DLog *log);
+
+// Indica si un mensaje de 'len' bytes de 'subject' entra en un segmento (si no, dlog_append() lo
+// rechaza siempre)
+int dlog_fits(const DLog *log, const char *subject, size_t len);
+
+// Agregar un mensaje de 'subject' con secuencia 'seq' (creciente por tema). -1 si no entra en un
+// segmento o no se pudo crear uno nuevo.
+int dlog_append(DLog *log, const char *subject, uint64_t seq, const char *payload, size_t len);
+
+// Llevar a disco todo lo agregado hasta ahora (un msync por segmento modificado), escribir los
+// resúmenes de los segmentos cerrados y aplicar el límite de bytes. Pensado para un hilo que la
+// llame periódicamente; no bloquea a dlog_append() mientras espera al disco.
+void dlog_commit(DLog *log);
+
+// Próxima secuencia de un tema (1 si nunca publicó) y la más vieja que todavía está en el log
+// (== dlog_next_seq si no queda ninguna)
+uint64_t dlog_next_seq(DLog *log, const char *subject);
+uint64_t dlog_first_seq(DLog *log, const char *subject);
+
+// Recorrer en orden los mensajes del tema con secuencia en [from, upto). Solo se leen los payloads
+// de ese tema. El lock del log se toma solo para copiar los tramos: el recorrido no bloquea a
+// dlog_append() y los segmentos leídos no se liberan hasta que termina, aunque el límite de bytes
+// los descarte. Lo agregado después de empezar no se visita. 'hint' (o 0) es el offset de un registro
+// del tema anterior a 'from', p. ej. el último visitado por una llamada previa: la búsqueda empieza
+// ahí en lugar de al principio del tramo, así leer un tema de a páginas no recorre lo ya leído.
+// Devuelve cuántos visitó.
+size_t dlog_replay(DLog *log, const char *subject, uint64_t from, uint64_t upto, uint64_t hint, DLogVisit visit,
+                   void *arg);
+
+void dlog_stats(DLog *log, DLogStats *st);
+
+#endif // DLOG_H
@@ -0,0 +1,174 @@
+// frag.c — Implementación del reensamblado de mensajes fragmentados
+
+#include "common/frag.h"
+
+#include <netinet/in.h>    // IPPROTO_IP, IP_MTU
+#include <stdlib.h>        // calloc(), malloc(), free()
+#include <string.h>        // memcpy()
+#include <unistd.h>        // close()
+
+// Mensaje en reensamblado
+typedef struct Pending {
+    int used;
+    uint64_t src; // emisor
+    uint32_t msg_id;
+    uint32_t total; // largo total
+    uint16_t count; // fragmentos esperados
+    uint16_t received; // fragmentos distintos recibidos
+    uint32_t chunk; // largo de todos los fragmentos salvo el último (0 = todavía no se sabe)
+    uint64_t first_ns; // llegada del primer fragmento
+    char *buf; // mensaje (total bytes)
+    uint8_t *seen; // un bit por fragmento
+} Pending;
+
+struct FragTable {
+    Pending pending[FRAG_PENDING];
+    size_t bytes; // suma de 'total' de los pendientes
+    size_t max_bytes;
+    uint64_t timeout_ns;
+    uint64_t expired; // descartados por timeout
+    uint64_t evicted; // descartados para hacer lugar
+};
+
+FragTable *frag_table_new(size_t max_bytes, uint64_t timeout_ns) {
+    FragTable *t = (FragTable *) calloc(1, sizeof(FragTable));
+    if (!t) return NULL;
+    t->max_bytes = max_bytes;
+    t->timeout_ns = timeout_ns;
+    return t;
+}
+
+static void release(FragTable *t, Pending *p, int keep_buf) {
+    if (!keep_buf) free(p->buf);
+    free(p->seen);
+    t->bytes -= p->total;
+    p->used = 0;
+    p->buf = NULL;
+    p->seen = NULL;
+}
+
+void frag_table_free(FragTable *t) {
+    if (!t) return;
+    for (size_t i = 0; i < FRAG_PENDING; i++)
+        if (t->pending[i].used) release(t, &t->pending[i], 0);
+    free(t);
+}
+
+// Pendiente más viejo (para desalojar)
+static Pending *oldest(FragTable *t) {
+    Pending *o = NULL;
+    for (size_t i = 0; i < FRAG_PENDING; i++) {
+        Pending *p = &t->pending[i];
+        if (p->used && (!o || p->first_ns < o->first_ns)) o = p;
+    }
+    return o;
+}
+
+// Reservar un pendiente nuevo, desalojando los más viejos si no hay lugar
+static Pending *start(FragTable *t, uint64_t src, const V2Frag *f, uint64_t now_ns) {
+    if (f->total_len > t->max_bytes) return NULL;
+    Pending *slot = NULL;
+    while (1) {
+        for (size_t i = 0; i < FRAG_PENDING && !slot; i++)
+            if (!t->pending[i].used) slot = &t->pending[i];
+        if (slot && t->bytes + f->total_len <= t->max_bytes) break;
+        Pending *o = oldest(t);
+        if (!o) return NULL;
+        release(t, o, 0);
+        t->evicted++;
+        if (!slot) slot = o;
+    }
+    slot->buf = (char *) malloc(f->total_len ? f->total_len : 1);
+    slot->seen = (uint8_t *) calloc((f->count + 7u) / 8u, 1);
+    if (!slot->buf || !slot->seen) {
+        free(slot->buf);
+        free(slot->seen);
+        slot->buf = NULL;
+        slot->seen = NULL;
+        return NULL;
+    }
+    slot->used = 1;
+    slot->src = src;
+    slot->msg_id = f->msg_id;
+    slot->total = f->total_len;
+    slot->count = f->count;
+    slot->received = 0;
+    slot->chunk = 0;
+    slot->first_ns = now_ns;
+    t->bytes += f->total_len;
+    return slot;
+}
+
+// Largo de fragmento que implica 'f' si es consistente con su índice: los emisores cortan el mensaje
+// en trozos iguales y el último lleva el resto (entre 1 byte y un trozo). 0 si el fragmento no dice
+// nada del trozo (mensaje de un solo fragmento); -1 si es inconsistente.
+static int64_t implied_chunk(const V2Frag *f, size_t len) {
+    if (f->index + 1u < f->count)
+        return len > 0 && (uint64_t) f->offset == (uint64_t) f->index * len ? (int64_t) len : -1;
+    if ((size_t) f->offset + len != f->total_len) return -1; // el último termina justo en el final
+    if (f->count == 1) return f->offset == 0 ? 0 : -1;
+    uint32_t chunk = f->offset / (f->count - 1u);
+    if (f->offset % (f->count - 1u) != 0 || len == 0 || len > chunk) return -1;
+    return chunk;
+}
+
+char *frag_table_add(FragTable *t, uint64_t src, const V2Frag *f, const char *data, size_t len, uint64_t now_ns,
+                     size_t *out_len) {
+    // Fragmento inconsistente: se ignora.
+    if (f->count == 0 || f->index >= f->count || f->total_len > FRAG_MAX_MESSAGE ||
+        (size_t) f->offset + len > f->total_len)
+        return NULL;
+    // Cada fragmento tiene que caer en su lugar: así los 'count' índices distintos cubren exactamente
+    // [0, total_len) sin solaparse y no queda nada del buffer sin escribir.
+    int64_t chunk = implied_chunk(f, len);
+    if (chunk < 0) return NULL;
+    Pending *p = NULL;
+    for (size_t i = 0; i < FRAG_PENDING; i++) {
+        Pending *c = &t->pending[i];
+        if (c->used && c->src == src && c->msg_id == f->msg_id) {
+            p = c;
+            break;
+        }
+    }
+    if (p && (p->total != f->total_len || p->count != f->count || (chunk && p->chunk && p->chunk != chunk)))
+        return NULL;
+    if (!p && !(p = start(t, src, f, now_ns))) return NULL;
+    uint8_t bit = (uint8_t) (1u << (f->index & 7));
+    if (p->seen[f->index >> 3] & bit) return NULL; // duplicado
+    p->seen[f->index >> 3] |= bit;
+    if (chunk) p->chunk = (uint32_t) chunk;
+    memcpy(p->buf + f->offset, data, len);
+    if (++p->received < p->count) return NULL;
+    // Completo: el buffer pasa al llamador.
+    char *msg = p->buf;
+    *out_len = p->total;
+    release(t, p, 1);
+    return msg;
+}
+
+void frag_table_expire(FragTable *t, uint64_t now_ns) {
+    if (t->bytes == 0) return;
+    for (size_t i = 0; i < FRAG_PENDING; i++) {
+        Pending *p = &t->pending[i];
+        if (p->used && now_ns - p->first_ns > t->timeout_ns) {
+            release(t, p, 0);
+            t->expired++;
+        }
+    }
+}
+
+void frag_table_stats(const FragTable *t, uint64_t *expired, uint64_t *evicted) {
+    *expired = t->expired;
+    *evicted = t->evicted;
+}
+
+int udp_path_mtu(const struct sockaddr *addr, socklen_t len) {
+    // connect() en UDP no envía nada: solo resuelve la ruta, que es de donde sale IP_MTU.
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    int mtu = -1;
+    socklen_t ml = sizeof(mtu);
+    if (connect(fd, addr, len) < 0 || getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &ml) < 0) mtu = -1;
+    close(fd);
+    return mtu;
+}
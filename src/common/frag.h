@@ -0,0 +1,41 @@
+// frag.h — Reensamblado de mensajes UDP fragmentados (broker_udp y subscriber_udp)
+// Los fragmentos (V2_FLAG_FRAG en common/proto_v2.h) de un mismo mensaje se juntan en un buffer del
+// largo total. La tabla está acotada en mensajes pendientes y en bytes, y descarta los mensajes
+// incompletos más viejos que el timeout: un fragmento perdido no retiene memoria para siempre.
+// Un fragmento que no cae en el lugar que le toca según su índice (todos del mismo largo salvo el
+// último, que termina en el largo total) se ignora: un mensaje completo siempre está escrito entero.
+
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint32_t, uint64_t
+#include <sys/socket.h>    // struct sockaddr, socklen_t
+
+#include "common/proto_v2.h" // V2Frag
+
+#define FRAG_MAX_MESSAGE (4u << 20) // largo máximo de un mensaje fragmentado
+#define FRAG_PENDING 128 // mensajes incompletos a la vez
+#define UDP_IP_OVERHEAD 28 // cabeceras IPv4 + UDP sin opciones
+
+typedef struct FragTable FragTable;
+
+// Crear una tabla que retiene como mucho 'max_bytes' y descarta incompletos después de 'timeout_ns'
+FragTable *frag_table_new(size_t max_bytes, uint64_t timeout_ns);
+void frag_table_free(FragTable *t);
+
+// Agregar un fragmento de 'src' (identifica al emisor). Cuando el mensaje queda completo devuelve un
+// buffer con el mensaje (el llamador lo libera con free()) y su largo en *out_len; si no, NULL.
+char *frag_table_add(FragTable *t, uint64_t src, const V2Frag *f, const char *data, size_t len, uint64_t now_ns,
+                     size_t *out_len);
+
+// Descartar los mensajes incompletos vencidos
+void frag_table_expire(FragTable *t, uint64_t now_ns);
+
+// Mensajes descartados por timeout y por falta de lugar
+void frag_table_stats(const FragTable *t, uint64_t *expired, uint64_t *evicted);
+
+// MTU de la ruta hacia 'addr' según el kernel (IP_MTU); -1 si no se puede saber
+int udp_path_mtu(const struct sockaddr *addr, socklen_t len);
+
+#endif // FRAG_H
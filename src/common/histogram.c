@@ -0,0 +1,74 @@
+// histogram.c — Implementación del histograma de latencias
+
+#include "common/histogram.h"
+
+#include <string.h>        // memset()
+
+#define HALF (HIST_SUB_BUCKETS / 2)
+
+// Índice del bit más alto encendido (v > 0)
+static unsigned msb(uint64_t v) {
+    return 63u - (unsigned) __builtin_clzll(v);
+}
+
+// Bucket de un valor: los menores a HIST_SUB_BUCKETS tienen uno propio; el resto se agrupa
+// conservando los HIST_SUB_BITS bits más significativos.
+static unsigned bucket_of(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) return (unsigned) v;
+    unsigned shift = msb(v) - (HIST_SUB_BITS - 1);
+    if (shift > HIST_MAX_BITS - HIST_SUB_BITS) return HIST_BUCKETS - 1; // fuera de rango
+    return shift * HALF + (unsigned) (v >> shift);
+}
+
+// Mayor valor que cae en un bucket
+static uint64_t bucket_high(unsigned idx) {
+    if (idx < HIST_SUB_BUCKETS) return idx;
+    unsigned shift = idx / HALF - 1;
+    uint64_t top = idx - shift * HALF;
+    return ((top + 1) << shift) - 1;
+}
+
+void histogram_reset(Histogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void histogram_record(Histogram *h, uint64_t value) {
+    h->counts[bucket_of(value)]++;
+    if (h->total == 0 || value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+    h->total++;
+    h->sum += (double) value;
+}
+
+void histogram_merge(Histogram *dst, const Histogram *src) {
+    if (src->total == 0) return;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+    if (dst->total == 0 || src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->total += src->total;
+    dst->sum += src->sum;
+}
+
+uint64_t histogram_percentile(const Histogram *h, double p) {
+    if (h->total == 0) return 0;
+    if (p <= 0) return h->min;
+    // rango de la muestra buscada (1..total)
+    uint64_t rank = (uint64_t) (p / 100.0 * (double) h->total + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > h->total) rank = h->total;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_high(i);
+            if (v > h->max) v = h->max;
+            if (v < h->min) v = h->min;
+            return v;
+        }
+    }
+    return h->max;
+}
+
+double histogram_mean(const Histogram *h) {
+    return h->total ? h->sum / (double) h->total : 0.0;
+}
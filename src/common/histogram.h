@@ -0,0 +1,40 @@
+// histogram.h — Histograma de latencias estilo HDR compartido por el benchmark y los clientes
+// Buckets log-lineales: cada potencia de 2 se divide en HIST_SUB_BUCKETS / 2 sub-buckets, así el
+// error relativo de cualquier percentil es menor a 2 / HIST_SUB_BUCKETS (~1.6%) con memoria fija,
+// sin importar cuántas muestras se registren. Registrar una muestra es O(1) y sin reservas.
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>        // uint64_t
+
+#define HIST_SUB_BITS 7 // bits de precisión por potencia de 2
+#define HIST_SUB_BUCKETS (1u << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40 // valores >= 2^40 (~18 minutos en ns) caen en el último bucket
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * (HIST_SUB_BUCKETS / 2))
+
+typedef struct Histogram {
+    uint64_t counts[HIST_BUCKETS]; // muestras por bucket
+    uint64_t total; // muestras registradas
+    uint64_t min; // menor valor registrado
+    uint64_t max; // mayor valor registrado
+    double sum; // suma de los valores (para el promedio)
+} Histogram;
+
+// Dejar el histograma vacío
+void histogram_reset(Histogram *h);
+
+// Registrar un valor (p. ej. una latencia en nanosegundos)
+void histogram_record(Histogram *h, uint64_t value);
+
+// Sumar las muestras de 'src' a 'dst'
+void histogram_merge(Histogram *dst, const Histogram *src);
+
+// Valor en el percentil p (0..100); 0 si no hay muestras. Devuelve el mayor valor equivalente del
+// bucket, acotado por el máximo registrado.
+uint64_t histogram_percentile(const Histogram *h, double p);
+
+// Promedio de los valores registrados; 0 si no hay muestras
+double histogram_mean(const Histogram *h);
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,218 @@
+// latency.c — Implementación de la medición de latencia
+
+#include "common/latency.h"
+
+#include <stdlib.h>        // calloc(), realloc(), free()
+#include <string.h>        // memcpy(), memcmp()
+#include <time.h>          // clock_gettime(), CLOCK_MONOTONIC
+
+#include "common/histogram.h" // histograma de latencias
+
+// Secuencia esperada del próximo mensaje de un publicador
+typedef struct PubSeq {
+    uint32_t pub;
+    uint64_t next;
+} PubSeq;
+
+// Contadores de un período (intervalo o corrida completa)
+typedef struct LatPeriod {
+    Histogram hist; // latencias en ns
+    uint64_t msgs; // mensajes recibidos
+    uint64_t bytes; // bytes de payload recibidos
+    uint64_t gaps; // secuencias saltadas (posible pérdida)
+    uint64_t reorders; // mensajes que llegaron después de uno posterior
+    uint64_t unstamped; // mensajes sin sello
+} LatPeriod;
+
+typedef struct LatSubject {
+    char *name;
+    size_t nlen;
+    LatPeriod interval; // desde el último reporte
+    LatPeriod total; // toda la corrida
+    PubSeq *pubs; // publicadores vistos en el tema
+    size_t npubs, pubs_cap;
+} LatSubject;
+
+struct LatTracker {
+    LatSubject **subjects;
+    size_t n, cap;
+    size_t last; // último tema usado (los mensajes seguidos suelen ser del mismo tema)
+    uint64_t start_ns; // inicio de la corrida
+    uint64_t interval_ns; // inicio del intervalo actual
+};
+
+static const char hexdig[] = "0123456789abcdef";
+
+uint64_t lat_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// Escribir 'digits' dígitos hexadecimales de v
+static void put_hex(char *out, uint64_t v, int digits) {
+    for (int i = digits - 1; i >= 0; i--) {
+        out[i] = hexdig[v & 0xf];
+        v >>= 4;
+    }
+}
+
+// Leer 'digits' dígitos hexadecimales; -1 si alguno no es válido
+static int get_hex(const char *in, int digits, uint64_t *v) {
+    uint64_t r = 0;
+    for (int i = 0; i < digits; i++) {
+        char c = in[i];
+        unsigned d;
+        if (c >= '0' && c <= '9') d = (unsigned) (c - '0');
+        else if (c >= 'a' && c <= 'f') d = (unsigned) (c - 'a' + 10);
+        else return -1;
+        r = (r << 4) | d;
+    }
+    *v = r;
+    return 0;
+}
+
+void lat_stamp(char *out, uint32_t pub, uint64_t seq, uint64_t sent_ns) {
+    memcpy(out, "LAT1 ", 5);
+    put_hex(out + 5, pub, 8);
+    out[13] = ' ';
+    put_hex(out + 14, seq, 16);
+    out[30] = ' ';
+    put_hex(out + 31, sent_ns, 16);
+    out[47] = ' ';
+}
+
+int lat_parse(const char *payload, size_t len, LatStamp *st) {
+    uint64_t pub;
+    if (len < LAT_HDR_LEN || memcmp(payload, "LAT1 ", 5) != 0) return -1;
+    if (get_hex(payload + 5, 8, &pub) < 0 || get_hex(payload + 14, 16, &st->seq) < 0 ||
+        get_hex(payload + 31, 16, &st->sent_ns) < 0)
+        return -1;
+    st->pub = (uint32_t) pub;
+    return 0;
+}
+
+LatTracker *lat_tracker_new(void) {
+    LatTracker *t = (LatTracker *) calloc(1, sizeof(LatTracker));
+    if (!t) return NULL;
+    t->start_ns = t->interval_ns = lat_now_ns();
+    return t;
+}
+
+void lat_tracker_free(LatTracker *t) {
+    if (!t) return;
+    for (size_t i = 0; i < t->n; i++) {
+        free(t->subjects[i]->name);
+        free(t->subjects[i]->pubs);
+        free(t->subjects[i]);
+    }
+    free(t->subjects);
+    free(t);
+}
+
+// Buscar o crear las estadísticas de un tema
+static LatSubject *find_subject(LatTracker *t, const char *name, size_t nlen) {
+    if (t->last < t->n) {
+        LatSubject *s = t->subjects[t->last];
+        if (s->nlen == nlen && memcmp(s->name, name, nlen) == 0) return s;
+    }
+    for (size_t i = 0; i < t->n; i++) {
+        LatSubject *s = t->subjects[i];
+        if (s->nlen == nlen && memcmp(s->name, name, nlen) == 0) {
+            t->last = i;
+            return s;
+        }
+    }
+    if (t->n == t->cap) {
+        size_t ncap = t->cap ? t->cap * 2 : 8;
+        LatSubject **n = (LatSubject **) realloc(t->subjects, ncap * sizeof(LatSubject *));
+        if (!n) return NULL;
+        t->subjects = n;
+        t->cap = ncap;
+    }
+    LatSubject *s = (LatSubject *) calloc(1, sizeof(LatSubject));
+    if (!s) return NULL;
+    s->name = (char *) malloc(nlen + 1);
+    if (!s->name) {
+        free(s);
+        return NULL;
+    }
+    memcpy(s->name, name, nlen);
+    s->name[nlen] = '\0';
+    s->nlen = nlen;
+    t->last = t->n;
+    t->subjects[t->n++] = s;
+    return s;
+}
+
+// Secuencia esperada de un publicador en el tema (se crea al verlo por primera vez)
+static PubSeq *find_pub(LatSubject *s, uint32_t pub, uint64_t seq) {
+    for (size_t i = 0; i < s->npubs; i++)
+        if (s->pubs[i].pub == pub) return &s->pubs[i];
+    if (s->npubs == s->pubs_cap) {
+        size_t ncap = s->pubs_cap ? s->pubs_cap * 2 : 4;
+        PubSeq *n = (PubSeq *) realloc(s->pubs, ncap * sizeof(PubSeq));
+        if (!n) return NULL;
+        s->pubs = n;
+        s->pubs_cap = ncap;
+    }
+    PubSeq *p = &s->pubs[s->npubs++];
+    p->pub = pub;
+    p->next = seq; // el primer mensaje visto marca el inicio (el suscriptor pudo llegar tarde)
+    return p;
+}
+
+void lat_tracker_record(LatTracker *t, const char *subject, size_t slen, const char *payload, size_t len,
+                        uint64_t now_ns) {
+    LatSubject *s = find_subject(t, subject, slen);
+    if (!s) return;
+    LatPeriod *per[2] = {&s->interval, &s->total};
+    LatStamp st;
+    if (lat_parse(payload, len, &st) < 0) {
+        for (int i = 0; i < 2; i++) per[i]->unstamped++;
+        return;
+    }
+    uint64_t lat = now_ns > st.sent_ns ? now_ns - st.sent_ns : 0;
+    uint64_t gaps = 0, reorders = 0;
+    PubSeq *p = find_pub(s, st.pub, st.seq);
+    if (p) {
+        if (st.seq >= p->next) {
+            gaps = st.seq - p->next;
+            p->next = st.seq + 1;
+        } else {
+            reorders = 1; // llegó tarde (o duplicado)
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        histogram_record(&per[i]->hist, lat);
+        per[i]->msgs++;
+        per[i]->bytes += len;
+        per[i]->gaps += gaps;
+        per[i]->reorders += reorders;
+    }
+}
+
+void lat_tracker_report(LatTracker *t, FILE *out, int final) {
+    uint64_t now = lat_now_ns();
+    double secs = (double) (now - (final ? t->start_ns : t->interval_ns)) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+    for (size_t i = 0; i < t->n; i++) {
+        LatSubject *s = t->subjects[i];
+        LatPeriod *p = final ? &s->total : &s->interval;
+        const Histogram *h = &p->hist;
+        fprintf(out,
+                "%s[%s] msgs=%llu rate=%.0f/s %.2fMB/s lat_us p50=%.1f p99=%.1f p99.9=%.1f max=%.1f "
+                "gaps=%llu reorder=%llu unstamped=%llu\n",
+                final ? "total " : "", s->name, (unsigned long long) p->msgs, (double) p->msgs / secs,
+                (double) p->bytes / secs / 1e6, (double) histogram_percentile(h, 50) / 1e3,
+                (double) histogram_percentile(h, 99) / 1e3, (double) histogram_percentile(h, 99.9) / 1e3,
+                (double) h->max / 1e3, (unsigned long long) p->gaps, (unsigned long long) p->reorders,
+                (unsigned long long) p->unstamped);
+        if (!final) {
+            histogram_reset(&p->hist);
+            p->msgs = p->bytes = p->gaps = p->reorders = p->unstamped = 0;
+        }
+    }
+    fflush(out);
+    if (!final) t->interval_ns = now;
+}
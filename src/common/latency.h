@@ -0,0 +1,48 @@
+// latency.h — Medición de latencia de extremo a extremo para publicadores y suscriptores
+// En modo latencia el publicador antepone al payload un sello de texto de largo fijo:
+//
+//   "LAT1 <publicador:8 hex> <secuencia:16 hex> <envío_ns:16 hex> "   (LAT_HDR_LEN bytes)
+//
+// con el instante de envío en CLOCK_MONOTONIC (publicador y suscriptor en el mismo host). Al ser
+// texto, un suscriptor sin modo latencia lo sigue mostrando legible. El suscriptor lleva por tema
+// un histograma de latencias, los huecos y reordenamientos de secuencia por publicador y la tasa.
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint32_t, uint64_t
+#include <stdio.h>         // FILE
+
+#define LAT_HDR_LEN 48 // bytes del sello al inicio del payload
+
+typedef struct LatStamp {
+    uint32_t pub; // identificador del publicador
+    uint64_t seq; // secuencia del publicador (empieza en 0)
+    uint64_t sent_ns; // instante de envío (CLOCK_MONOTONIC)
+} LatStamp;
+
+typedef struct LatTracker LatTracker;
+
+// Instante actual de CLOCK_MONOTONIC en nanosegundos
+uint64_t lat_now_ns(void);
+
+// Escribir el sello en 'out' (LAT_HDR_LEN bytes, sin terminador)
+void lat_stamp(char *out, uint32_t pub, uint64_t seq, uint64_t sent_ns);
+
+// Leer el sello al inicio de un payload; -1 si no lo tiene
+int lat_parse(const char *payload, size_t len, LatStamp *st);
+
+// Crear / liberar el registro de estadísticas por tema
+LatTracker *lat_tracker_new(void);
+void lat_tracker_free(LatTracker *t);
+
+// Registrar un mensaje recibido del tema (subject, slen) a las 'now_ns'
+void lat_tracker_record(LatTracker *t, const char *subject, size_t slen, const char *payload, size_t len,
+                        uint64_t now_ns);
+
+// Imprimir una línea por tema. Con final = 0 muestra lo ocurrido desde el reporte anterior y reinicia
+// el intervalo; con final = 1 muestra los acumulados de toda la corrida.
+void lat_tracker_report(LatTracker *t, FILE *out, int final);
+
+#endif // LATENCY_H
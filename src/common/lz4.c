@@ -0,0 +1,138 @@
+// lz4.c — Implementación del formato de bloque LZ4
+// Cada secuencia es: token (4 bits de largo de literales | 4 bits de largo de coincidencia - 4), los
+// bytes extra de los largos que llegan a 15 (de a 255), los literales, la distancia en 2 bytes
+// little-endian y los bytes extra de la coincidencia. La última secuencia solo tiene literales.
+
+#include "common/lz4.h"
+
+#include <stdint.h>        // uint32_t
+#include <string.h>        // memcpy(), memset()
+
+#define HASH_LOG 12 // tabla de 4096 posiciones (16 KiB en la pila)
+#define MIN_MATCH 4 // coincidencia más corta que se codifica
+#define MAX_OFFSET 65535 // distancia máxima de una coincidencia
+#define LAST_LITERALS 5 // el formato exige que los últimos 5 bytes sean literales
+#define MF_LIMIT 12 // y que la última coincidencia empiece al menos 12 bytes antes del final
+#define SKIP_TRIGGER 6 // cada 2^6 intentos fallidos el paso de búsqueda crece en 1
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Escribir los bytes extra de un largo (ya sin los 15 del token)
+static unsigned char *put_len(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+// Escribir una secuencia de 'lit' literales desde 'anchor' y (si mlen > 0) una coincidencia de mlen
+// bytes a distancia 'off'. NULL si no entra en [op, oend).
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend, const unsigned char *anchor, size_t lit,
+                                   size_t off, size_t mlen) {
+    if ((size_t) (oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return NULL;
+    unsigned char *token = op++;
+    *token = (unsigned char) ((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    if (mlen == 0) return op; // última secuencia
+    *op++ = (unsigned char) off;
+    *op++ = (unsigned char) (off >> 8);
+    mlen -= MIN_MATCH;
+    *token |= (unsigned char) (mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15) op = put_len(op, mlen - 15);
+    return op;
+}
+
+size_t lz4_compress(const void *src, size_t n, void *dst, size_t cap) {
+    const unsigned char *in = (const unsigned char *) src, *ip = in, *anchor = in, *end = in + n;
+    unsigned char *op = (unsigned char *) dst, *oend = op + cap;
+    if (n > LZ4_MAX_INPUT) return 0;
+    if (n > MF_LIMIT) {
+        uint32_t table[1u << HASH_LOG]; // posición (desde 'in') del último lugar con cada hash
+        memset(table, 0, sizeof(table));
+        const unsigned char *mf_limit = end - MF_LIMIT, *match_limit = end - LAST_LITERALS;
+        unsigned misses = 0;
+        ip++;
+        while (ip < mf_limit) {
+            uint32_t seq = read32(ip), h = hash4(seq);
+            const unsigned char *ref = in + table[h];
+            table[h] = (uint32_t) (ip - in);
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+            // extender hacia atrás sobre los literales pendientes y hacia adelante hasta el límite
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *mp = ip + MIN_MATCH, *rp = ref + MIN_MATCH;
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            op = put_sequence(op, oend, anchor, (size_t) (ip - anchor), (size_t) (ip - ref), (size_t) (mp - ip));
+            if (!op) return 0;
+            ip = anchor = mp;
+            // registrar una posición dentro de la coincidencia mejora la siguiente búsqueda
+            if (ip < mf_limit) table[hash4(read32(ip - 2))] = (uint32_t) (ip - 2 - in);
+        }
+    }
+    op = put_sequence(op, oend, anchor, (size_t) (end - anchor), 0, 0);
+    return op ? (size_t) (op - (unsigned char *) dst) : 0;
+}
+
+// Leer los bytes extra de un largo; -1 si el bloque se termina antes
+static int get_len(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz4_decompress(const void *src, size_t n, void *dst, size_t len) {
+    const unsigned char *ip = (const unsigned char *) src, *iend = ip + n;
+    unsigned char *out = (unsigned char *) dst, *op = out, *oend = out + len;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_len(&ip, iend, &lit) < 0) return -1;
+        if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break; // última secuencia: solo literales
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t) ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t) (op - out)) return -1;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_len(&ip, iend, &mlen) < 0) return -1;
+        mlen += MIN_MATCH;
+        if (mlen > (size_t) (oend - op)) return -1;
+        const unsigned char *ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            // se solapa con lo que escribe (repeticiones): byte a byte
+            while (mlen--) *op++ = *ref++;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
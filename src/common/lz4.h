@@ -0,0 +1,30 @@
+// lz4.h — Compresión LZ4 (formato de bloque) sin dependencias externas
+// Implementación propia del formato de bloque de LZ4: lo que comprime se puede leer con cualquier
+// decodificador LZ4 (LZ4_decompress_safe) y al revés. Es el códec "lz4" que negocian broker_tcp y
+// libpubsub para los lotes (ver "COMPRESS" en broker_tcp.c).
+// El compresor busca coincidencias de 4 bytes con una tabla hash de posiciones (sin cadenas) y avanza
+// más rápido cuanto más tiempo pasa sin encontrar ninguna, así un bloque que no se comprime cuesta
+// poco. El descompresor valida cada longitud y distancia: un bloque corrupto no escribe fuera del
+// destino.
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>        // size_t
+
+#define LZ4_MAX_INPUT 0x7E000000u // bloque más grande que admite el formato
+
+// Peor caso de lo que ocupa comprimir 'n' bytes (datos que no se pueden comprimir)
+static inline size_t lz4_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+// Comprimir 'n' bytes de 'src' en 'dst' (capacidad 'cap'). Devuelve el largo comprimido, o 0 si no
+// entra en 'cap' (con cap >= lz4_bound(n) siempre entra) o la entrada es demasiado grande.
+size_t lz4_compress(const void *src, size_t n, void *dst, size_t cap);
+
+// Descomprimir el bloque 'src' de 'n' bytes, que debe producir exactamente 'len' bytes en 'dst'.
+// 0 si es así; -1 si el bloque está mal formado o no coincide con 'len'.
+int lz4_decompress(const void *src, size_t n, void *dst, size_t len);
+
+#endif // LZ4_H
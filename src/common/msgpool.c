@@ -0,0 +1,111 @@
+// msgpool.c — Implementación del pool de buffers por clases de tamaño
+
+#include "common/msgpool.h"
+
+#include <stdatomic.h>     // _Atomic, atomic_exchange_explicit(), atomic_compare_exchange_weak_explicit()
+#include <stdlib.h>        // malloc(), calloc(), free()
+
+#define POOL_MIN_SHIFT 8 // log2(POOL_MIN_BYTES)
+#define POOL_CLASSES 9 // 256 B, 512 B, ..., 64 KiB
+
+// Cabecera de cada bloque, justo antes de lo que ve el usuario (32 bytes: mantiene la alineación a 16)
+typedef struct PoolBlock {
+    MsgPool *owner; // pool de origen (NULL: reservado con malloc() por ser grande)
+    struct PoolBlock *next; // siguiente en una lista libre
+    size_t cls; // clase de tamaño
+    size_t pad;
+} PoolBlock;
+
+struct MsgPool {
+    PoolBlock *free[POOL_CLASSES]; // listas libres locales (solo el hilo dueño)
+    char *slab; // slab en curso: se corta de a un bloque
+    size_t slab_left; // bytes sin cortar en el slab en curso
+    _Atomic uint64_t allocs, reused, large, slab_bytes;
+    // bloques liberados por otros hilos, en su propia línea de caché para no competir con lo local
+    _Alignas(64) _Atomic(PoolBlock *) remote[POOL_CLASSES];
+};
+
+// Sumar a un contador de un solo escritor sin instrucciones con lock
+static void bump(_Atomic uint64_t *c, uint64_t n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Clase del tamaño pedido; POOL_CLASSES si no entra en ninguna
+static size_t class_of(size_t size) {
+    size_t cls = 0;
+    while (cls < POOL_CLASSES && ((size_t) POOL_MIN_BYTES << cls) < size) cls++;
+    return cls;
+}
+
+MsgPool *msgpool_new(void) {
+    MsgPool *p = (MsgPool *) calloc(1, sizeof(MsgPool));
+    if (!p) return NULL;
+    for (size_t i = 0; i < POOL_CLASSES; i++) atomic_init(&p->remote[i], NULL);
+    return p;
+}
+
+void *msgpool_alloc(MsgPool *p, size_t size) {
+    size_t cls = class_of(size);
+    if (cls == POOL_CLASSES) {
+        PoolBlock *b = (PoolBlock *) malloc(sizeof(PoolBlock) + size);
+        if (!b) return NULL;
+        b->owner = NULL;
+        bump(&p->large, 1);
+        return b + 1;
+    }
+    bump(&p->allocs, 1);
+    PoolBlock *b = p->free[cls];
+    if (!b && atomic_load_explicit(&p->remote[cls], memory_order_relaxed)) {
+        // la lista local se vació: tomar de una vez todo lo que devolvieron otros hilos
+        b = atomic_exchange_explicit(&p->remote[cls], NULL, memory_order_acquire);
+    }
+    if (b) {
+        p->free[cls] = b->next;
+        bump(&p->reused, 1);
+        return b + 1;
+    }
+    // cortar un bloque nuevo del slab en curso (lo que sobra de un slab agotado no se usa)
+    size_t need = sizeof(PoolBlock) + ((size_t) POOL_MIN_BYTES << cls);
+    if (p->slab_left < need) {
+        char *s = (char *) malloc(POOL_SLAB_BYTES);
+        if (!s) return NULL;
+        p->slab = s;
+        p->slab_left = POOL_SLAB_BYTES;
+        bump(&p->slab_bytes, POOL_SLAB_BYTES);
+    }
+    b = (PoolBlock *) p->slab;
+    p->slab += need;
+    p->slab_left -= need;
+    b->owner = p;
+    b->cls = cls;
+    return b + 1;
+}
+
+void msgpool_free(MsgPool *self, void *block) {
+    PoolBlock *b = (PoolBlock *) block - 1;
+    MsgPool *p = b->owner;
+    if (!p) {
+        free(b);
+        return;
+    }
+    if (p == self) {
+        b->next = p->free[b->cls];
+        p->free[b->cls] = b;
+        return;
+    }
+    // Pila de Treiber: solo se apila aquí y el dueño retira la pila entera con un intercambio,
+    // así que no hay problema ABA.
+    PoolBlock *head = atomic_load_explicit(&p->remote[b->cls], memory_order_relaxed);
+    do {
+        b->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&p->remote[b->cls], &head, b, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+void msgpool_stats(const MsgPool *p, MsgPoolStats *st) {
+    MsgPool *q = (MsgPool *) p; // las lecturas atómicas no modifican el pool
+    st->allocs = atomic_load_explicit(&q->allocs, memory_order_relaxed);
+    st->reused = atomic_load_explicit(&q->reused, memory_order_relaxed);
+    st->large = atomic_load_explicit(&q->large, memory_order_relaxed);
+    st->slab_bytes = atomic_load_explicit(&q->slab_bytes, memory_order_relaxed);
+}
@@ -0,0 +1,41 @@
+// msgpool.h — Pool de buffers de mensajes por clases de tamaño
+// Cada hilo reactor tiene su pool. Los bloques se cortan de slabs grandes (POOL_SLAB_BYTES) y se
+// agrupan en clases potencia de 2, de POOL_MIN_BYTES a POOL_MAX_BYTES; un pedido mayor va directo a
+// malloc(). Reservar y liberar desde el hilo dueño es sacar y poner en una lista, sin atómicos.
+// Un bloque que se libera en otro hilo (el último shard que soltó el mensaje) se devuelve a una pila
+// sin locks de su pool de origen, que el dueño recupera entera cuando se le vacía la lista local.
+// La memoria de los slabs no se devuelve al sistema: el pool crece hasta el pico de mensajes vivos.
+
+#ifndef MSGPOOL_H
+#define MSGPOOL_H
+
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint64_t
+
+#define POOL_MIN_BYTES 256 // clase más chica
+#define POOL_MAX_BYTES (64u << 10) // clase más grande; lo que no entra usa malloc() directo
+#define POOL_SLAB_BYTES (256u << 10) // bloque que se pide al sistema para cortar buffers
+
+typedef struct MsgPool MsgPool;
+
+// Uso del pool (los lee cualquier hilo; los escribe solo el dueño)
+typedef struct MsgPoolStats {
+    uint64_t allocs; // reservas atendidas por el pool
+    uint64_t reused; // de ellas, con un bloque liberado antes (sin cortar memoria nueva)
+    uint64_t large; // reservas mayores que POOL_MAX_BYTES (malloc directo)
+    uint64_t slab_bytes; // memoria pedida al sistema para slabs
+} MsgPoolStats;
+
+// Crear un pool vacío; NULL si no hay memoria
+MsgPool *msgpool_new(void);
+
+// Reservar 'size' bytes (alineados a 16) desde el hilo dueño del pool; NULL si no hay memoria
+void *msgpool_alloc(MsgPool *p, size_t size);
+
+// Liberar un bloque desde cualquier hilo. 'self' es el pool del hilo que libera (NULL si no tiene):
+// si es el de origen vuelve a su lista local, si no a la pila remota del pool de origen.
+void msgpool_free(MsgPool *self, void *block);
+
+void msgpool_stats(const MsgPool *p, MsgPoolStats *st);
+
+#endif // MSGPOOL_H
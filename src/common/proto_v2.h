@@ -0,0 +1,165 @@
+// proto_v2.h — Framing binario (protocolo v2) compartido por brokers y clientes
+// Se negocia con el token "PUB2" / "SUB2" en lugar de "PUB" / "SUB". Cada frame tiene una cabecera
+// fija de 12 bytes (orden de red) seguida del nombre del tema (si subject_len > 0) y del payload:
+//
+//   u8 opcode | u8 flags | u16 subject_len | u32 subject_id | u32 payload_len
+//
+// El nombre del tema viaja solo la primera vez: PUBLISH con nombre asocia subject_id (elegido por el
+// publicador) a ese tema para el resto de la conexión; el OK de un SUBSCRIBE devuelve el id con el
+// que el broker marcará los MESSAGE de ese tema. Así no hay parseo ni formateo de texto por mensaje.
+//
+// PUBLISH_BATCH lleva varios mensajes del mismo tema en un solo frame: el payload es una secuencia de
+// registros "u32 len | bytes" (orden de red). El equivalente de texto es
+// "PUBLISH_BATCH <subject> <bytes>\n" seguido del mismo cuerpo.
+//
+// CREDIT es el control de flujo de broker_tcp: concede al publicador mensajes y bytes que puede enviar
+// (ver el equivalente de texto "CREDIT <mensajes> <bytes>\n" en broker_tcp.c).
+//
+// Compresión (broker_tcp): el cliente la ofrece en la línea de rol ("PUB2 COMPRESS lz4\n") y el broker
+// responde con un frame COMPRESS cuyo payload es el códec elegido ("none" si no hay uno en común).
+// Desde ahí el publicador puede enviar PUBLISH_BATCH con V2_FLAG_COMP y el suscriptor recibe, además
+// de MESSAGE, frames MESSAGE_BATCH. En ambos el cuerpo comprimido es
+//
+//   u32 raw_len | bloque comprimido
+//
+// y raw_len es el largo de los registros "u32 len | bytes" que resultan al descomprimirlo.
+//
+// Un MESSAGE con V2_FLAG_SEQ (entrega secuenciada de broker_udp) lleva la secuencia del tema como
+// u64 entre el nombre y el payload; esos 8 bytes no cuentan en payload_len.
+//
+// En UDP, un PUBLISH o MESSAGE que no entra en un datagrama viaja en fragmentos con V2_FLAG_FRAG:
+// después del nombre (y de la secuencia) va la cabecera de fragmento
+//
+//   u32 msg_id | u16 index | u16 count | u32 total_len | u32 offset
+//
+// y payload_len es el largo de ese fragmento. El receptor junta los fragmentos de msg_id (ver
+// common/frag.h) y procesa el mensaje completo como si hubiera llegado en un solo frame.
+
+#ifndef PROTO_V2_H
+#define PROTO_V2_H
+
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint8_t, uint16_t, uint32_t, uint64_t
+#include <string.h>        // memcpy()
+
+#define V2_HDR_LEN 12 // bytes de la cabecera fija
+#define V2_MAX_SUBJECT 1024 // largo máximo del nombre de un tema en v2
+
+// Códigos de operación
+enum {
+    V2_PUBLISH = 1, // publicador -> broker
+    V2_SUBSCRIBE = 2, // suscriptor -> broker (con nombre)
+    V2_MESSAGE = 3, // broker -> suscriptor (solo id)
+    V2_OK = 4, // broker -> cliente (id + nombre del tema suscrito)
+    V2_ERR = 5, // broker -> cliente (payload = texto del error)
+    V2_PUBLISH_BATCH = 6, // publicador -> broker (payload = registros "u32 len | bytes")
+    V2_CREDIT = 7, // broker -> publicador (payload = u64 mensajes | u64 bytes de crédito)
+    V2_COMPRESS = 8, // broker -> cliente (payload = códec negociado)
+    V2_MESSAGE_BATCH = 9 // broker -> suscriptor (solo id; payload = lote comprimido)
+};
+
+#define V2_BATCH_REC_HDR 4 // bytes del largo que precede a cada mensaje de un lote
+
+// Flags
+#define V2_FLAG_SEQ 0x01 // MESSAGE: u64 secuencia antes del payload
+#define V2_FLAG_FRAG 0x02 // PUBLISH/MESSAGE: fragmento de un mensaje mayor que un datagrama
+#define V2_FLAG_GROUP 0x04 // SUBSCRIBE: el payload es el nombre de un grupo de cola (common/qgroup.h)
+#define V2_FLAG_COMP 0x08 // PUBLISH_BATCH: el cuerpo está comprimido con el códec negociado
+#define V2_SEQ_LEN 8 // bytes de la secuencia
+#define V2_CREDIT_LEN 16 // bytes del payload de un CREDIT
+#define V2_ZBATCH_HDR 4 // bytes del largo sin comprimir que precede a un lote comprimido
+#define V2_FRAG_LEN 16 // bytes de la cabecera de fragmento
+
+typedef struct V2Frag {
+    uint32_t msg_id; // identifica el mensaje entre los fragmentos del mismo emisor
+    uint16_t index; // número de fragmento (0..count-1)
+    uint16_t count; // fragmentos del mensaje
+    uint32_t total_len; // largo del mensaje completo
+    uint32_t offset; // posición del fragmento dentro del mensaje
+} V2Frag;
+
+typedef struct V2Header {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t subject_len;
+    uint32_t subject_id;
+    uint32_t payload_len;
+} V2Header;
+
+// Escribir una cabecera en 'out' (V2_HDR_LEN bytes)
+static inline void v2_encode(unsigned char *out, uint8_t opcode, uint8_t flags, uint16_t subject_len,
+                             uint32_t subject_id, uint32_t payload_len) {
+    out[0] = opcode;
+    out[1] = flags;
+    out[2] = (unsigned char) (subject_len >> 8);
+    out[3] = (unsigned char) subject_len;
+    out[4] = (unsigned char) (subject_id >> 24);
+    out[5] = (unsigned char) (subject_id >> 16);
+    out[6] = (unsigned char) (subject_id >> 8);
+    out[7] = (unsigned char) subject_id;
+    out[8] = (unsigned char) (payload_len >> 24);
+    out[9] = (unsigned char) (payload_len >> 16);
+    out[10] = (unsigned char) (payload_len >> 8);
+    out[11] = (unsigned char) payload_len;
+}
+
+// Leer una cabecera de 'in' (al menos V2_HDR_LEN bytes)
+static inline V2Header v2_decode(const unsigned char *in) {
+    V2Header h;
+    h.opcode = in[0];
+    h.flags = in[1];
+    h.subject_len = (uint16_t) ((in[2] << 8) | in[3]);
+    h.subject_id = ((uint32_t) in[4] << 24) | ((uint32_t) in[5] << 16) | ((uint32_t) in[6] << 8) | in[7];
+    h.payload_len = ((uint32_t) in[8] << 24) | ((uint32_t) in[9] << 16) | ((uint32_t) in[10] << 8) | in[11];
+    return h;
+}
+
+// Escribir / leer un entero de 32 bits en orden de red (largo de los registros de un lote)
+static inline void v2_put_u32(unsigned char *out, uint32_t v) {
+    out[0] = (unsigned char) (v >> 24);
+    out[1] = (unsigned char) (v >> 16);
+    out[2] = (unsigned char) (v >> 8);
+    out[3] = (unsigned char) v;
+}
+
+static inline uint32_t v2_get_u32(const unsigned char *in) {
+    return ((uint32_t) in[0] << 24) | ((uint32_t) in[1] << 16) | ((uint32_t) in[2] << 8) | in[3];
+}
+
+// Escribir / leer un entero de 64 bits en orden de red (secuencia de un MESSAGE)
+static inline void v2_put_u64(unsigned char *out, uint64_t v) {
+    v2_put_u32(out, (uint32_t) (v >> 32));
+    v2_put_u32(out + 4, (uint32_t) v);
+}
+
+static inline uint64_t v2_get_u64(const unsigned char *in) {
+    return ((uint64_t) v2_get_u32(in) << 32) | v2_get_u32(in + 4);
+}
+
+// Escribir / leer la cabecera de fragmento (V2_FRAG_LEN bytes)
+static inline void v2_put_frag(unsigned char *out, const V2Frag *f) {
+    v2_put_u32(out, f->msg_id);
+    out[4] = (unsigned char) (f->index >> 8);
+    out[5] = (unsigned char) f->index;
+    out[6] = (unsigned char) (f->count >> 8);
+    out[7] = (unsigned char) f->count;
+    v2_put_u32(out + 8, f->total_len);
+    v2_put_u32(out + 12, f->offset);
+}
+
+static inline V2Frag v2_get_frag(const unsigned char *in) {
+    V2Frag f;
+    f.msg_id = v2_get_u32(in);
+    f.index = (uint16_t) ((in[4] << 8) | in[5]);
+    f.count = (uint16_t) ((in[6] << 8) | in[7]);
+    f.total_len = v2_get_u32(in + 8);
+    f.offset = v2_get_u32(in + 12);
+    return f;
+}
+
+// Indica si un datagrama/buffer empieza con un frame binario (los comandos de texto empiezan con letra)
+static inline int v2_is_frame(const unsigned char *in, size_t len) {
+    return len >= V2_HDR_LEN && in[0] >= V2_PUBLISH && in[0] <= V2_MESSAGE_BATCH;
+}
+
+#endif // PROTO_V2_H
@@ -0,0 +1,166 @@
+// qgroup.c — Implementación de los grupos de cola
+
+#include "common/qgroup.h"
+
+#include <stdio.h>         // snprintf()
+#include <stdlib.h>        // calloc(), realloc(), free()
+#include <string.h>        // strdup(), strlen()
+
+#include "common/subject_trie.h" // SubTrie, subject_matches()
+
+struct QGroupTable {
+    SubjectIndex subjects; // tema exacto -> grupos (los dueños del tema son QGroup*)
+    SubTrie *trie; // patrón -> grupos
+    SubjectIndex keys; // "<nombre> <tema>" -> grupo (en Subject.data; NULL si se eliminó)
+    size_t members; // miembros en todos los grupos
+};
+
+QGroupTable *qgroup_table_new(void) {
+    QGroupTable *t = (QGroupTable *) calloc(1, sizeof(QGroupTable));
+    if (!t) return NULL;
+    if (subject_index_init(&t->subjects) < 0 || subject_index_init(&t->keys) < 0 || !(t->trie = sub_trie_new())) {
+        qgroup_table_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static void group_free(QGroup *g) {
+    free(g->subject);
+    free(g->name);
+    free(g->members);
+    free(g);
+}
+
+void qgroup_table_free(QGroupTable *t) {
+    if (!t) return;
+    if (t->keys.buckets) {
+        for (size_t b = 0; b < t->keys.nbuckets; b++)
+            for (Subject *k = t->keys.buckets[b]; k; k = k->next)
+                if (k->data) group_free((QGroup *) k->data);
+        subject_index_free(&t->keys);
+    }
+    if (t->subjects.buckets) subject_index_free(&t->subjects);
+    sub_trie_free(t->trie);
+    free(t);
+}
+
+// Clave "<nombre> <tema>" del grupo en t->keys (malloc); NULL si no hay memoria
+static char *group_key(const char *subject, const char *name) {
+    size_t klen = strlen(name) + strlen(subject) + 2;
+    char *key = (char *) malloc(klen);
+    if (key) snprintf(key, klen, "%s %s", name, subject);
+    return key;
+}
+
+// Buscar o crear el grupo 'name' de 'subject'; NULL si no hay memoria o el patrón no es válido
+static QGroup *group_get(QGroupTable *t, const char *subject, const char *name) {
+    char *key = group_key(subject, name);
+    if (!key) return NULL;
+    Subject *k = subject_index_intern(&t->keys, key);
+    free(key);
+    if (!k) return NULL;
+    if (k->data) return (QGroup *) k->data;
+
+    int wild = subject_is_pattern(subject);
+    if (wild && !subject_pattern_valid(subject)) return NULL;
+    QGroup *g = (QGroup *) calloc(1, sizeof(QGroup));
+    if (!g || !(g->subject = strdup(subject)) || !(g->name = strdup(name))) goto fail;
+    if (wild) {
+        if (sub_trie_add(t->trie, subject, g) < 0) goto fail;
+    } else {
+        Subject *s = subject_index_intern(&t->subjects, subject);
+        if (!s || subject_link(s, &g->link, g) < 0) goto fail;
+    }
+    g->key = k;
+    k->data = g;
+    return g;
+
+fail:
+    if (g) group_free(g);
+    return NULL;
+}
+
+int qgroup_join(QGroupTable *t, const char *subject, const char *name, void *member, QGroup **out) {
+    QGroup *g = group_get(t, subject, name);
+    if (!g) return -1;
+    *out = g;
+    for (size_t i = 0; i < g->nmembers; i++)
+        if (g->members[i] == member) return 1;
+    if (g->nmembers == g->cap) {
+        size_t ncap = g->cap ? g->cap * 2 : 4;
+        void **n = (void **) realloc(g->members, ncap * sizeof(void *));
+        if (!n) return -1;
+        g->members = n;
+        g->cap = ncap;
+    }
+    g->members[g->nmembers++] = member;
+    t->members++;
+    return 0;
+}
+
+void qgroup_leave(QGroupTable *t, QGroup *g, void *member) {
+    for (size_t i = 0; i < g->nmembers; i++) {
+        if (g->members[i] != member) continue;
+        // conservar el orden: la ronda sigue con el que venía después
+        memmove(&g->members[i], &g->members[i + 1], (g->nmembers - i - 1) * sizeof(void *));
+        g->nmembers--;
+        if (g->next > i) g->next--;
+        t->members--;
+        break;
+    }
+    if (g->nmembers > 0) return;
+    // grupo vacío: sacarlo del índice o del trie (la clave queda, sin grupo)
+    if (subject_is_pattern(g->subject)) sub_trie_remove(t->trie, g->subject, g);
+    else subject_unlink(&g->link);
+    g->key->data = NULL;
+    group_free(g);
+}
+
+QGroup *const *qgroup_match(QGroupTable *t, const char *subject, size_t *n) {
+    *n = 0;
+    if (t->members == 0) return NULL;
+    // Un tema sin grupos exactos solo entra al índice si lo recibe algún grupo de patrón: publicar en
+    // temas que nadie pidió no hace crecer la tabla.
+    Subject *s = subject_index_find(&t->subjects, subject);
+    if (!s && !sub_trie_match_any(t->trie, subject)) return NULL;
+    if (!s && !(s = subject_index_intern(&t->subjects, subject))) return NULL;
+    return (QGroup *const *) subject_matches(s, t->trie, n);
+}
+
+size_t qgroup_members(const QGroupTable *t) {
+    return t->members;
+}
+
+QGroup *qgroup_find(QGroupTable *t, const char *subject, const char *name) {
+    char *key = group_key(subject, name);
+    if (!key) return NULL;
+    Subject *k = subject_index_find(&t->keys, key);
+    free(key);
+    return k ? (QGroup *) k->data : NULL;
+}
+
+void *qgroup_pick(QGroup *g, qgroup_policy_t policy, size_t (*queued)(void *member), int (*eligible)(void *member)) {
+    if (g->nmembers == 0) return NULL;
+    size_t start = g->next % g->nmembers, best = g->nmembers;
+    // se recorre desde el turno de la ronda, así los empates (colas vacías) se reparten igual
+    size_t low = 0;
+    for (size_t k = 0; k < g->nmembers; k++) {
+        size_t i = (start + k) % g->nmembers;
+        if (eligible && !eligible(g->members[i])) continue;
+        if (best == g->nmembers) {
+            best = i;
+            if (policy != QGROUP_LEAST_QUEUED || !queued || (low = queued(g->members[i])) == 0) break;
+            continue;
+        }
+        size_t q = queued(g->members[i]);
+        if (q < low) {
+            low = q;
+            best = i;
+            if (low == 0) break;
+        }
+    }
+    if (best == g->nmembers) return NULL;
+    g->next = best + 1;
+    return g->members[best];
+}
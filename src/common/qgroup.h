@@ -0,0 +1,64 @@
+// qgroup.h — Grupos de cola (queue groups) para broker_tcp y broker_udp
+// "SUBSCRIBE <tema> GROUP <nombre>" une al suscriptor al grupo <nombre> de ese tema (o patrón): cada
+// mensaje del tema llega a un solo miembro de cada grupo que coincide, además de a los suscriptores
+// normales. Así varios procesos se reparten el trabajo de un tema en lugar de repetirlo.
+// Los grupos se indexan igual que las suscripciones: los de tema exacto son los dueños de un Subject
+// en un SubjectIndex propio y los de patrón viven en un SubTrie, así buscar los grupos de un tema
+// cuesta lo mismo que buscar sus suscriptores y el resultado queda en cache hasta que cambian.
+// La tabla no usa locks: broker_tcp, que la comparte entre shards, la protege con un mutex.
+
+#ifndef QGROUP_H
+#define QGROUP_H
+
+#include <stddef.h>        // size_t
+
+#include "common/subject_index.h" // Subject, SubLink
+
+#define QGROUP_MAX_NAME 64 // largo máximo del nombre de un grupo, con el terminador
+
+// Cómo se elige el miembro que recibe cada mensaje
+typedef enum {
+    QGROUP_ROUND_ROBIN = 0, // en ronda
+    QGROUP_LEAST_QUEUED = 1 // el que tiene menos pendiente (empate: sigue la ronda)
+} qgroup_policy_t;
+
+typedef struct QGroup {
+    char *subject; // tema o patrón
+    char *name; // nombre del grupo
+    void **members; // suscriptores del grupo (Client*, Peer*, ...)
+    size_t nmembers, cap;
+    size_t next; // próximo turno de la ronda
+    SubLink link; // enlace al tema exacto (sin uso si es un patrón)
+    Subject *key; // entrada "<nombre> <tema>" en el índice de grupos
+} QGroup;
+
+typedef struct QGroupTable QGroupTable;
+
+// Crear / liberar una tabla vacía; qgroup_table_new devuelve NULL si no hay memoria
+QGroupTable *qgroup_table_new(void);
+void qgroup_table_free(QGroupTable *t);
+
+// Unir 'member' al grupo 'name' del tema o patrón 'subject'; en *g queda el grupo. Devuelve 0 si se
+// agregó, 1 si ya era miembro y -1 si el patrón no es válido o no hay memoria.
+int qgroup_join(QGroupTable *t, const char *subject, const char *name, void *member, QGroup **g);
+
+// Sacar a 'member' del grupo. El grupo que queda vacío se elimina (el puntero deja de ser válido).
+void qgroup_leave(QGroupTable *t, QGroup *g, void *member);
+
+// Grupos que reciben un mensaje publicado en 'subject' (un tema, no un patrón). El arreglo es válido
+// hasta el próximo cambio de la tabla. *n = 0 si no hay ninguno; un tema sin grupos no se agrega a
+// la tabla.
+QGroup *const *qgroup_match(QGroupTable *t, const char *subject, size_t *n);
+
+// Miembros en todos los grupos (0 = no hay grupos y se puede omitir qgroup_match)
+size_t qgroup_members(const QGroupTable *t);
+
+// Grupo 'name' del tema o patrón 'subject'; NULL si no existe
+QGroup *qgroup_find(QGroupTable *t, const char *subject, const char *name);
+
+// Elegir el miembro que recibe el próximo mensaje del grupo; NULL si está vacío. Con
+// QGROUP_LEAST_QUEUED, 'queued' devuelve lo pendiente de cada miembro (sin ella es en ronda). Si se
+// pasa 'eligible', solo se eligen los miembros para los que devuelve distinto de 0 (NULL si ninguno).
+void *qgroup_pick(QGroup *g, qgroup_policy_t policy, size_t (*queued)(void *member), int (*eligible)(void *member));
+
+#endif // QGROUP_H
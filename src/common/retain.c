@@ -0,0 +1,132 @@
+// retain.c — Implementación del anillo de retención
+
+#include "common/retain.h"
+
+#include <stdlib.h>        // malloc(), free(), strtoull()
+#include <string.h>        // memcpy(), strcmp()
+
+// Mensaje retenido: posición de su payload en la arena
+typedef struct RetainEntry {
+    size_t off;
+    size_t len;
+} RetainEntry;
+
+// Todo vive en un solo bloque: la cabecera, el índice y la arena.
+struct RetainRing {
+    size_t slots; // entradas del índice
+    size_t bytes; // tamaño de la arena
+    uint64_t first; // secuencia más vieja retenida
+    uint64_t next; // próxima secuencia
+    size_t head; // dónde termina el payload más nuevo en la arena
+    RetainEntry *index; // entrada de la secuencia s en index[s % slots]
+    char *arena;
+};
+
+RetainRing *retain_new(size_t slots, size_t bytes) {
+    if (slots == 0 || bytes == 0) return NULL;
+    // Sin calloc: el índice solo se lee en [first, next) y las páginas de la arena que nunca se
+    // usan no ocupan memoria física.
+    RetainRing *r = (RetainRing *) malloc(retain_footprint(slots, bytes));
+    if (!r) return NULL;
+    r->slots = slots;
+    r->bytes = bytes;
+    r->first = r->next = 1;
+    r->head = 0;
+    r->index = (RetainEntry *) (r + 1);
+    r->arena = (char *) (r->index + slots);
+    return r;
+}
+
+size_t retain_footprint(size_t slots, size_t bytes) {
+    return sizeof(RetainRing) + slots * sizeof(RetainEntry) + bytes;
+}
+
+void retain_free(RetainRing *r) {
+    free(r);
+}
+
+void retain_reset(RetainRing *r, uint64_t next) {
+    r->first = r->next = next;
+    r->head = 0;
+}
+
+// Lugar en la arena para 'len' bytes, descartando los mensajes más viejos hasta que entre
+static size_t make_room(RetainRing *r, size_t len) {
+    while (r->next - r->first >= r->slots) r->first++;
+    while (1) {
+        if (r->first == r->next) return 0; // vacío: empezar desde el principio
+        size_t tail = r->index[r->first % r->slots].off; // inicio del más viejo
+        if (r->head > tail) {
+            // ocupado [tail, head): hay lugar al final o, dando la vuelta, antes de tail
+            if (r->head + len <= r->bytes) return r->head;
+            if (len <= tail) return 0;
+        } else if (r->head < tail && r->head + len <= tail) {
+            return r->head; // ocupado [tail, fin) + [0, head)
+        }
+        r->first++;
+    }
+}
+
+uint64_t retain_append(RetainRing *r, const char *payload, size_t len) {
+    uint64_t seq = r->next++;
+    if (len > r->bytes) {
+        // no entra: se pierde lo retenido para que lo que quede siga siendo contiguo
+        r->first = r->next;
+        r->head = 0;
+        return seq;
+    }
+    r->next = seq; // make_room() no debe ver la secuencia nueva como retenida
+    size_t off = make_room(r, len);
+    r->next = seq + 1;
+    if (len) memcpy(r->arena + off, payload, len);
+    r->index[seq % r->slots] = (RetainEntry){off, len};
+    r->head = off + len;
+    return seq;
+}
+
+uint64_t retain_first(const RetainRing *r) {
+    return r->first;
+}
+
+uint64_t retain_next(const RetainRing *r) {
+    return r->next;
+}
+
+const char *retain_get(const RetainRing *r, uint64_t seq, size_t *len) {
+    if (seq < r->first || seq >= r->next) return NULL;
+    const RetainEntry *e = &r->index[seq % r->slots];
+    *len = e->len;
+    return r->arena + e->off;
+}
+
+int retain_parse_from(const char *spec, RetainFrom *f) {
+    char *end;
+    if (strcmp(spec, "last") == 0) {
+        *f = (RetainFrom){1, 1};
+        return 0;
+    }
+    if (spec[0] == '-') {
+        unsigned long long n = strtoull(spec + 1, &end, 10);
+        if (end == spec + 1 || *end) return -1;
+        *f = (RetainFrom){1, n};
+        return 0;
+    }
+    if (spec[0] < '0' || spec[0] > '9') return -1;
+    unsigned long long n = strtoull(spec, &end, 10);
+    if (*end) return -1;
+    *f = (RetainFrom){0, n};
+    return 0;
+}
+
+uint64_t retain_start(const RetainRing *r, RetainFrom f) {
+    return retain_start_in(f, r->first, r->next);
+}
+
+uint64_t retain_start_in(RetainFrom f, uint64_t first, uint64_t next) {
+    uint64_t start;
+    if (f.relative) start = f.n >= next - first ? first : next - f.n;
+    else start = f.n;
+    if (start < first) start = first;
+    if (start > next) start = next;
+    return start;
+}
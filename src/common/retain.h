@@ -0,0 +1,55 @@
+// retain.h — Anillo de retención por tema para broker_tcp y broker_udp
+// Cada tema numera sus mensajes (la primera secuencia es 1) y guarda los últimos en un bloque reservado
+// una sola vez: un índice de 'slots' entradas y una arena circular de 'bytes' bytes. Guardar un
+// mensaje no hace malloc; los más viejos se descartan cuando falta lugar en cualquiera de los dos.
+// Lo retenido es siempre un rango contiguo de secuencias [first, next), así una reproducción nunca
+// tiene huecos. Un mensaje más grande que la arena vacía el anillo (la reproducción empieza después).
+// Sirve para "SUBSCRIBE <tema> FROM <seq|last|-N>" y, en broker_udp, para reenviar ante un NACK.
+
+#ifndef RETAIN_H
+#define RETAIN_H
+
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint64_t
+
+#define RETAIN_MAX_SPEC 32 // largo máximo del argumento de FROM
+#define RETAIN_AVG_BYTES 256 // bytes por mensaje con los que se dimensiona la arena si no se indica otra cosa
+
+typedef struct RetainRing RetainRing;
+
+// Desde dónde reproducir: una secuencia absoluta o los últimos N ("last" = los últimos 1)
+typedef struct RetainFrom {
+    int relative; // 1 = los últimos 'n'; 0 = desde la secuencia 'n'
+    uint64_t n;
+} RetainFrom;
+
+// Crear un anillo de 'slots' mensajes y 'bytes' bytes de payload; NULL si no hay memoria
+RetainRing *retain_new(size_t slots, size_t bytes);
+void retain_free(RetainRing *r);
+
+// Bytes que reserva retain_new(slots, bytes), para acotar la memoria de todos los anillos juntos
+size_t retain_footprint(size_t slots, size_t bytes);
+
+// Vaciar el anillo y seguir numerando desde 'next' (al continuar una numeración guardada en disco)
+void retain_reset(RetainRing *r, uint64_t next);
+
+// Numerar un mensaje y guardar una copia. Devuelve su secuencia.
+uint64_t retain_append(RetainRing *r, const char *payload, size_t len);
+
+// Secuencia más vieja retenida y la próxima a asignar (first == next: vacío)
+uint64_t retain_first(const RetainRing *r);
+uint64_t retain_next(const RetainRing *r);
+
+// Payload de una secuencia; NULL si ya se descartó o todavía no existe
+const char *retain_get(const RetainRing *r, uint64_t seq, size_t *len);
+
+// Parsear "<seq>", "last" o "-N"; -1 si no es válido
+int retain_parse_from(const char *spec, RetainFrom *f);
+
+// Primera secuencia a reproducir para 'f' (acotada a lo retenido; retain_next() si no hay nada)
+uint64_t retain_start(const RetainRing *r, RetainFrom f);
+
+// Lo mismo para un rango retenido [first, next) cualquiera (por ejemplo, anillo + log en disco)
+uint64_t retain_start_in(RetainFrom f, uint64_t first, uint64_t next);
+
+#endif // RETAIN_H
@@ -0,0 +1,136 @@
+// ring.h — Colas circulares acotadas y sin locks para pasar punteros entre hilos
+// MpscRing: varios productores, un consumidor (algoritmo de D. Vyukov con número de secuencia por
+// ranura). Conserva el orden FIFO de cada productor.
+// SpscRing: un productor, un consumidor (Lamport). Cada lado escribe solo su índice y guarda una copia
+// del índice del otro, que relee únicamente cuando la copia dice que la cola está llena o vacía.
+// Implementación en el header (static inline).
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>     // atomic_size_t, atomic_load_explicit(), ...
+#include <stddef.h>        // size_t
+#include <stdlib.h>        // calloc(), free()
+
+typedef struct MpscSlot {
+    atomic_size_t seq; // número de secuencia de la ranura (indica si está libre u ocupada)
+    void *data; // puntero transportado
+} MpscSlot;
+
+typedef struct MpscRing {
+    MpscSlot *slots; // ranuras (capacidad potencia de 2)
+    size_t mask; // capacidad - 1
+    _Alignas(64) atomic_size_t tail; // próxima posición a escribir (compartida por productores)
+    _Alignas(64) size_t head; // próxima posición a leer (solo el consumidor)
+} MpscRing;
+
+// Inicializar con capacidad 'cap' (se redondea a potencia de 2); -1 si no hay memoria
+static inline int mpsc_init(MpscRing *r, size_t cap) {
+    size_t n = 2;
+    while (n < cap) n <<= 1;
+    r->slots = (MpscSlot *) calloc(n, sizeof(MpscSlot));
+    if (!r->slots) return -1;
+    for (size_t i = 0; i < n; i++) atomic_init(&r->slots[i].seq, i);
+    r->mask = n - 1;
+    atomic_init(&r->tail, 0);
+    r->head = 0;
+    return 0;
+}
+
+static inline void mpsc_free(MpscRing *r) {
+    free(r->slots);
+    r->slots = NULL;
+}
+
+// Encolar (cualquier hilo); -1 si la cola está llena
+static inline int mpsc_push(MpscRing *r, void *data) {
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    while (1) {
+        MpscSlot *s = &r->slots[pos & r->mask];
+        size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        ptrdiff_t dif = (ptrdiff_t) seq - (ptrdiff_t) pos;
+        if (dif == 0) {
+            // ranura libre: reservarla avanzando tail
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                s->data = data;
+                atomic_store_explicit(&s->seq, pos + 1, memory_order_release); // publicar
+                return 0;
+            }
+        } else if (dif < 0) {
+            return -1; // llena: el consumidor no ha liberado la ranura
+        } else {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed); // otro productor avanzó
+        }
+    }
+}
+
+// Desencolar (solo el hilo consumidor); NULL si está vacía
+static inline void *mpsc_pop(MpscRing *r) {
+    MpscSlot *s = &r->slots[r->head & r->mask];
+    size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+    if (seq != r->head + 1) return NULL;
+    void *data = s->data;
+    atomic_store_explicit(&s->seq, r->head + r->mask + 1, memory_order_release); // liberar la ranura
+    r->head++;
+    return data;
+}
+
+typedef struct SpscRing {
+    void **slots; // ranuras (capacidad potencia de 2)
+    size_t mask; // capacidad - 1
+    _Alignas(64) atomic_size_t tail; // próxima posición a escribir (la escribe el productor)
+    size_t head_cache; // última head vista por el productor
+    _Alignas(64) atomic_size_t head; // próxima posición a leer (la escribe el consumidor)
+    size_t tail_cache; // última tail vista por el consumidor
+} SpscRing;
+
+// Inicializar con capacidad 'cap' (se redondea a potencia de 2); -1 si no hay memoria
+static inline int spsc_init(SpscRing *r, size_t cap) {
+    size_t n = 2;
+    while (n < cap) n <<= 1;
+    r->slots = (void **) calloc(n, sizeof(void *));
+    if (!r->slots) return -1;
+    r->mask = n - 1;
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->head, 0);
+    r->head_cache = r->tail_cache = 0;
+    return 0;
+}
+
+static inline void spsc_free(SpscRing *r) {
+    free(r->slots);
+    r->slots = NULL;
+}
+
+// Encolar (solo el productor); -1 si la cola está llena
+static inline int spsc_push(SpscRing *r, void *data) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail - r->head_cache > r->mask) {
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail - r->head_cache > r->mask) return -1;
+    }
+    r->slots[tail & r->mask] = data;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release); // publicar
+    return 0;
+}
+
+// Desencolar (solo el consumidor); NULL si está vacía
+static inline void *spsc_pop(SpscRing *r) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head == r->tail_cache) {
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head == r->tail_cache) return NULL;
+    }
+    void *data = r->slots[head & r->mask];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release); // liberar la ranura
+    return data;
+}
+
+// ¿Está vacía? (solo el consumidor; no consume nada)
+static inline int spsc_empty(SpscRing *r) {
+    return atomic_load_explicit(&r->head, memory_order_relaxed) ==
+           atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+#endif // RING_H
@@ -0,0 +1,125 @@
+// subject_index.c — Implementación del índice de temas
+
+#include "common/subject_index.h"
+
+#include <stdlib.h>        // calloc(), realloc(), free()
+#include <string.h>        // strcmp(), strlen(), memcpy()
+
+#define INITIAL_BUCKETS 256 // buckets iniciales (potencia de 2)
+
+uint32_t subject_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int subject_index_init(SubjectIndex *idx) {
+    idx->buckets = (Subject **) calloc(INITIAL_BUCKETS, sizeof(Subject *));
+    idx->nbuckets = INITIAL_BUCKETS;
+    idx->count = 0;
+    return idx->buckets ? 0 : -1;
+}
+
+void subject_index_free(SubjectIndex *idx) {
+    for (size_t i = 0; i < idx->nbuckets; i++) {
+        Subject *s = idx->buckets[i];
+        while (s) {
+            Subject *t = s->next;
+            free(s->name);
+            free(s->owners);
+            free(s->links);
+            free(s->match);
+            free(s);
+            s = t;
+        }
+    }
+    free(idx->buckets);
+    idx->buckets = NULL;
+    idx->nbuckets = idx->count = 0;
+}
+
+Subject *subject_index_find(const SubjectIndex *idx, const char *name) {
+    uint32_t h = subject_hash(name);
+    for (Subject *s = idx->buckets[h & (idx->nbuckets - 1)]; s; s = s->next)
+        if (s->hash == h && strcmp(s->name, name) == 0) return s;
+    return NULL;
+}
+
+// Duplicar la tabla cuando el factor de carga llega a 1
+static void grow(SubjectIndex *idx) {
+    size_t nb = idx->nbuckets * 2;
+    Subject **b = (Subject **) calloc(nb, sizeof(Subject *));
+    if (!b) return; // seguir con la tabla actual, solo se degrada el rendimiento
+    for (size_t i = 0; i < idx->nbuckets; i++) {
+        Subject *s = idx->buckets[i];
+        while (s) {
+            Subject *t = s->next;
+            s->next = b[s->hash & (nb - 1)];
+            b[s->hash & (nb - 1)] = s;
+            s = t;
+        }
+    }
+    free(idx->buckets);
+    idx->buckets = b;
+    idx->nbuckets = nb;
+}
+
+Subject *subject_index_intern(SubjectIndex *idx, const char *name) {
+    Subject *s = subject_index_find(idx, name);
+    if (s) return s;
+    if (idx->count >= idx->nbuckets) grow(idx);
+    s = (Subject *) calloc(1, sizeof(Subject));
+    if (!s) return NULL;
+    size_t n = strlen(name);
+    s->name = (char *) malloc(n + 1);
+    if (!s->name) {
+        free(s);
+        return NULL;
+    }
+    memcpy(s->name, name, n + 1);
+    s->hash = subject_hash(name);
+    s->id = (uint32_t) idx->count;
+    s->next = idx->buckets[s->hash & (idx->nbuckets - 1)];
+    idx->buckets[s->hash & (idx->nbuckets - 1)] = s;
+    idx->count++;
+    return s;
+}
+
+int subject_link(Subject *s, SubLink *link, void *owner) {
+    if (s->nsubs == s->cap) {
+        size_t ncap = s->cap ? s->cap * 2 : 4;
+        void **o = (void **) realloc(s->owners, ncap * sizeof(void *));
+        if (!o) return -1;
+        s->owners = o;
+        SubLink **l = (SubLink **) realloc(s->links, ncap * sizeof(SubLink *));
+        if (!l) return -1;
+        s->links = l;
+        s->cap = ncap;
+    }
+    link->subject = s;
+    link->owner = owner;
+    link->pos = s->nsubs;
+    s->owners[s->nsubs] = owner;
+    s->links[s->nsubs] = link;
+    s->nsubs++;
+    s->version++;
+    return 0;
+}
+
+void subject_unlink(SubLink *link) {
+    Subject *s = link->subject;
+    if (!s) return;
+    size_t last = s->nsubs - 1;
+    if (link->pos != last) {
+        // mover el último a la posición liberada
+        s->owners[link->pos] = s->owners[last];
+        s->links[link->pos] = s->links[last];
+        s->links[link->pos]->pos = link->pos;
+    }
+    s->nsubs--;
+    s->version++;
+    link->subject = NULL;
+}
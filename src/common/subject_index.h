@@ -0,0 +1,67 @@
+// subject_index.h — Índice de temas (subjects) compartido por broker_tcp y broker_udp
+// Tabla hash de temas internados; cada tema guarda un arreglo compacto con sus suscriptores,
+// de modo que publicar cuesta O(suscriptores del tema) y no O(clientes x suscripciones).
+
+#ifndef SUBJECT_INDEX_H
+#define SUBJECT_INDEX_H
+
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint32_t
+
+struct Subject;
+
+// Enlace entre un suscriptor y un tema. Lo guarda el dueño (cliente o peer) para poder
+// darse de baja en O(1) sin buscar en el arreglo del tema.
+typedef struct SubLink {
+    struct Subject *subject; // tema al que está enlazado
+    void *owner; // suscriptor (Client*, Peer*, ...)
+    size_t pos; // posición actual dentro de subject->owners
+} SubLink;
+
+// Tema internado
+typedef struct Subject {
+    char *name; // nombre (propiedad del índice)
+    uint32_t hash; // hash FNV-1a del nombre
+    uint32_t id; // identificador estable asignado al internar
+    void **owners; // suscriptores del tema (arreglo compacto para recorrer en el fanout)
+    SubLink **links; // enlaces paralelos a owners (para actualizar pos al compactar)
+    size_t nsubs; // cantidad de suscriptores
+    size_t cap; // capacidad de owners/links
+    uint32_t version; // cambia con cada alta o baja de un suscriptor exacto
+    void **match; // cache de subject_matches() (common/subject_trie.h)
+    size_t nmatch, match_cap;
+    uint64_t match_gen; // generación del trie con la que se armó el cache (0 = nunca)
+    uint32_t match_version; // 'version' con la que se armó el cache
+    uint64_t msgs, bytes; // publicado en el tema (lo cuenta el broker que lo internó, para métricas)
+    void *data; // estado del broker asociado al tema (anillo de retención); no lo libera el índice
+    struct Subject *next; // siguiente tema en el mismo bucket
+} Subject;
+
+typedef struct SubjectIndex {
+    Subject **buckets; // tabla hash con encadenamiento
+    size_t nbuckets; // potencia de 2
+    size_t count; // temas internados
+} SubjectIndex;
+
+// Inicializar un índice vacío; devuelve -1 si no hay memoria
+int subject_index_init(SubjectIndex *idx);
+
+// Liberar todos los temas (los SubLink pertenecen a sus dueños y no se liberan aquí)
+void subject_index_free(SubjectIndex *idx);
+
+// Hash FNV-1a de 32 bits de un nombre (el mismo que usa el índice)
+uint32_t subject_hash(const char *name);
+
+// Buscar un tema; NULL si nunca fue internado
+Subject *subject_index_find(const SubjectIndex *idx, const char *name);
+
+// Buscar o crear un tema; NULL si no hay memoria
+Subject *subject_index_intern(SubjectIndex *idx, const char *name);
+
+// Enlazar un suscriptor a un tema (el llamador evita duplicados); -1 si no hay memoria
+int subject_link(Subject *s, SubLink *link, void *owner);
+
+// Quitar un enlace en O(1) (intercambia con el último)
+void subject_unlink(SubLink *link);
+
+#endif // SUBJECT_INDEX_H
@@ -0,0 +1,407 @@
+// subject_trie.c — Implementación del trie de patrones
+
+#include "common/subject_trie.h"
+
+#include <stdlib.h>        // calloc(), malloc(), realloc(), free(), qsort()
+#include <string.h>        // memchr(), memcmp(), memcpy(), strlen(), strchr(), strdup()
+
+#define KIDS_INITIAL 4 // buckets iniciales de hijos de un nodo (potencia de 2)
+#define CHANGE_LOG 64 // últimos cambios de patrones que se recuerdan para validar los caches (potencia de 2)
+
+// Dueños de un patrón que termina en un nodo
+typedef struct Owners {
+    void **v;
+    size_t n, cap;
+} Owners;
+
+// Nodo del trie: un nivel de un patrón
+typedef struct Node {
+    char *tok; // nivel (sin terminador en el patrón original)
+    size_t len;
+    uint32_t hash;
+    struct Node *parent;
+    struct Node *sibling; // siguiente en el mismo bucket del padre
+    struct Node **kids; // hijos literales (tabla hash con encadenamiento)
+    size_t nkids, kcap;
+    struct Node *star; // hijo "*"
+    Owners exact; // patrones que terminan en este nodo
+    Owners rest; // patrones "<este nodo>.>"
+} Node;
+
+// Cada alta o baja avanza 'gen' y anota el patrón en 'log'. Un tema cuyo cache es de una generación
+// anterior solo lo recalcula si alguno de los patrones que cambiaron desde entonces lo cubre (o si ya
+// no están todos en el log): agregar un patrón no invalida los caches de los temas que no coinciden.
+struct SubTrie {
+    Node root;
+    size_t size; // pares patrón/dueño
+    uint64_t gen; // cambia con cada alta o baja
+    char *log[CHANGE_LOG]; // patrón del cambio que llevó a la generación g, en log[g % CHANGE_LOG]
+};
+
+// Hash FNV-1a de un nivel
+static uint32_t tok_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Largo del nivel que empieza en 's' (hasta el próximo punto o el final)
+static size_t tok_len(const char *s) {
+    const char *d = strchr(s, '.');
+    return d ? (size_t) (d - s) : strlen(s);
+}
+
+static int is_tok(const char *s, size_t len, char c) {
+    return len == 1 && s[0] == c;
+}
+
+int subject_is_pattern(const char *name) {
+    for (const char *p = name;;) {
+        size_t len = tok_len(p);
+        if (is_tok(p, len, '*') || is_tok(p, len, '>')) return 1;
+        if (!p[len]) return 0;
+        p += len + 1;
+    }
+}
+
+int subject_pattern_valid(const char *pattern) {
+    if (!subject_levels_ok(pattern)) return 0;
+    for (const char *p = pattern;;) {
+        size_t len = tok_len(p);
+        if (len == 0) return 0; // nivel vacío
+        int last = p[len] == '\0';
+        if (is_tok(p, len, '>') && !last) return 0;
+        if (len > 1 && (memchr(p, '*', len) || memchr(p, '>', len))) return 0; // comodín a medias
+        if (last) return 1;
+        p += len + 1;
+    }
+}
+
+int subject_levels_ok(const char *name) {
+    size_t levels = 1;
+    for (const char *p = name; (p = strchr(p, '.')) != NULL; p++)
+        if (++levels > SUBJECT_MAX_LEVELS) return 0;
+    return 1;
+}
+
+int subject_pattern_match(const char *pattern, const char *name, size_t len) {
+    const char *p = pattern, *q = name, *end = name + len;
+    for (;;) {
+        size_t pl = tok_len(p);
+        const char *d = (const char *) memchr(q, '.', (size_t) (end - q));
+        size_t ql = d ? (size_t) (d - q) : (size_t) (end - q);
+        if (is_tok(p, pl, '>')) return 1; // uno o más niveles: q todavía tiene al menos uno
+        if (!is_tok(p, pl, '*') && (pl != ql || memcmp(p, q, pl) != 0)) return 0;
+        int plast = p[pl] == '\0', qlast = d == NULL;
+        if (plast || qlast) return plast && qlast;
+        p += pl + 1;
+        q = d + 1;
+    }
+}
+
+SubTrie *sub_trie_new(void) {
+    SubTrie *t = (SubTrie *) calloc(1, sizeof(SubTrie));
+    if (t) t->gen = 1;
+    return t;
+}
+
+static void free_node(Node *n) {
+    for (size_t i = 0; i < n->kcap; i++) {
+        Node *k = n->kids[i];
+        while (k) {
+            Node *next = k->sibling;
+            free_node(k);
+            free(k);
+            k = next;
+        }
+    }
+    if (n->star) {
+        free_node(n->star);
+        free(n->star);
+    }
+    free(n->kids);
+    free(n->tok);
+    free(n->exact.v);
+    free(n->rest.v);
+}
+
+void sub_trie_free(SubTrie *t) {
+    if (!t) return;
+    free_node(&t->root);
+    for (size_t i = 0; i < CHANGE_LOG; i++) free(t->log[i]);
+    free(t);
+}
+
+// Avanzar la generación anotando el patrón que cambió (sin memoria queda NULL: invalida todo)
+static void changed(SubTrie *t, const char *pattern) {
+    t->gen++;
+    char **slot = &t->log[t->gen & (CHANGE_LOG - 1)];
+    free(*slot);
+    *slot = strdup(pattern);
+}
+
+// Indica si ningún patrón que cambió desde la generación 'gen' cubre el tema 'name'
+static int unaffected(const SubTrie *t, uint64_t gen, const char *name) {
+    if (gen == 0 || t->gen - gen > CHANGE_LOG) return 0;
+    size_t len = strlen(name);
+    for (uint64_t g = gen + 1; g <= t->gen; g++) {
+        const char *p = t->log[g & (CHANGE_LOG - 1)];
+        if (!p || subject_pattern_match(p, name, len)) return 0;
+    }
+    return 1;
+}
+
+size_t sub_trie_size(const SubTrie *t) {
+    return t->size;
+}
+
+// Hijo literal de un nodo; NULL si no existe
+static Node *find_kid(const Node *n, const char *tok, size_t len, uint32_t h) {
+    if (!n->kcap) return NULL;
+    for (Node *k = n->kids[h & (n->kcap - 1)]; k; k = k->sibling)
+        if (k->hash == h && k->len == len && memcmp(k->tok, tok, len) == 0) return k;
+    return NULL;
+}
+
+// Duplicar la tabla de hijos cuando el factor de carga llega a 1
+static void grow_kids(Node *n) {
+    size_t nc = n->kcap ? n->kcap * 2 : KIDS_INITIAL;
+    Node **b = (Node **) calloc(nc, sizeof(Node *));
+    if (!b) return; // seguir con la tabla actual
+    for (size_t i = 0; i < n->kcap; i++) {
+        Node *k = n->kids[i];
+        while (k) {
+            Node *next = k->sibling;
+            k->sibling = b[k->hash & (nc - 1)];
+            b[k->hash & (nc - 1)] = k;
+            k = next;
+        }
+    }
+    free(n->kids);
+    n->kids = b;
+    n->kcap = nc;
+}
+
+static Node *new_node(Node *parent, const char *tok, size_t len, uint32_t h) {
+    Node *k = (Node *) calloc(1, sizeof(Node));
+    if (!k) return NULL;
+    k->tok = (char *) malloc(len + 1);
+    if (!k->tok) {
+        free(k);
+        return NULL;
+    }
+    memcpy(k->tok, tok, len);
+    k->tok[len] = '\0';
+    k->len = len;
+    k->hash = h;
+    k->parent = parent;
+    return k;
+}
+
+// Hijo de un nodo para un nivel ("*" o literal), creándolo si hace falta
+static Node *get_kid(Node *n, const char *tok, size_t len) {
+    if (is_tok(tok, len, '*')) {
+        if (!n->star) n->star = new_node(n, tok, len, 0);
+        return n->star;
+    }
+    uint32_t h = tok_hash(tok, len);
+    Node *k = find_kid(n, tok, len, h);
+    if (k) return k;
+    if (n->nkids >= n->kcap) grow_kids(n);
+    if (!n->kcap) return NULL;
+    k = new_node(n, tok, len, h);
+    if (!k) return NULL;
+    k->sibling = n->kids[h & (n->kcap - 1)];
+    n->kids[h & (n->kcap - 1)] = k;
+    n->nkids++;
+    return k;
+}
+
+static int owners_add(Owners *o, void *owner) {
+    for (size_t i = 0; i < o->n; i++)
+        if (o->v[i] == owner) return 1;
+    if (o->n == o->cap) {
+        size_t nc = o->cap ? o->cap * 2 : 2;
+        void **v = (void **) realloc(o->v, nc * sizeof(void *));
+        if (!v) return -1;
+        o->v = v;
+        o->cap = nc;
+    }
+    o->v[o->n++] = owner;
+    return 0;
+}
+
+static int owners_remove(Owners *o, void *owner) {
+    for (size_t i = 0; i < o->n; i++) {
+        if (o->v[i] == owner) {
+            o->v[i] = o->v[--o->n];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Nodo donde termina un patrón y la lista que corresponde (exact, o rest si termina en ">")
+static Owners *walk(SubTrie *t, const char *pattern, int create, Node **end) {
+    Node *n = &t->root;
+    for (const char *p = pattern;;) {
+        size_t len = tok_len(p);
+        if (is_tok(p, len, '>')) {
+            *end = n;
+            return &n->rest;
+        }
+        Node *k;
+        if (create) k = get_kid(n, p, len);
+        else k = is_tok(p, len, '*') ? n->star : find_kid(n, p, len, tok_hash(p, len));
+        if (!k) return NULL;
+        n = k;
+        if (!p[len]) break;
+        p += len + 1;
+    }
+    *end = n;
+    return &n->exact;
+}
+
+int sub_trie_add(SubTrie *t, const char *pattern, void *owner) {
+    if (!subject_pattern_valid(pattern)) return -1;
+    Node *end;
+    Owners *o = walk(t, pattern, 1, &end);
+    if (!o) return -1;
+    int r = owners_add(o, owner);
+    if (r == 0) {
+        t->size++;
+        changed(t, pattern);
+    }
+    return r;
+}
+
+// Quitar del padre un nodo que quedó sin patrones ni hijos, y seguir hacia la raíz
+static void prune(Node *n) {
+    while (n->parent && n->exact.n == 0 && n->rest.n == 0 && n->nkids == 0 && !n->star) {
+        Node *parent = n->parent;
+        if (parent->star == n) {
+            parent->star = NULL;
+        } else {
+            Node **pp = &parent->kids[n->hash & (parent->kcap - 1)];
+            while (*pp != n) pp = &(*pp)->sibling;
+            *pp = n->sibling;
+            parent->nkids--;
+        }
+        free_node(n);
+        free(n);
+        n = parent;
+    }
+}
+
+void sub_trie_remove(SubTrie *t, const char *pattern, void *owner) {
+    Node *end;
+    Owners *o = walk(t, pattern, 0, &end);
+    if (!o || !owners_remove(o, owner)) return;
+    t->size--;
+    changed(t, pattern);
+    prune(end);
+}
+
+// Acumulador de coincidencias
+typedef struct Acc {
+    void **v;
+    size_t n, cap;
+} Acc;
+
+static void acc_add(Acc *a, void *const *v, size_t n) {
+    if (n == 0) return; // un tema sin suscriptores exactos tiene v == NULL
+    if (a->n + n > a->cap) {
+        size_t nc = a->cap ? a->cap : 8;
+        while (nc < a->n + n) nc *= 2;
+        void **nv = (void **) realloc(a->v, nc * sizeof(void *));
+        if (!nv) return; // sin memoria: se entrega a menos suscriptores
+        a->v = nv;
+        a->cap = nc;
+    }
+    memcpy(a->v + a->n, v, n * sizeof(void *));
+    a->n += n;
+}
+
+// Recorrer los caminos del trie que coinciden con los niveles [i, ntok) del tema
+static void match(const Node *n, const char *const *tok, const size_t *len, size_t i, size_t ntok, Acc *a) {
+    if (i == ntok) {
+        acc_add(a, n->exact.v, n->exact.n);
+        return;
+    }
+    if (n->rest.n) acc_add(a, n->rest.v, n->rest.n); // ">" cubre uno o más niveles restantes
+    const Node *k = find_kid(n, tok[i], len[i], tok_hash(tok[i], len[i]));
+    if (k) match(k, tok, len, i + 1, ntok, a);
+    if (n->star) match(n->star, tok, len, i + 1, ntok, a);
+}
+
+static int cmp_ptr(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) *(void *const *) a, y = (uintptr_t) *(void *const *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Separar un tema en niveles (sin copiar); devuelve cuántos, o 0 si tiene más de SUBJECT_MAX_LEVELS
+// (ningún patrón lo cubre: cortarlo haría coincidir patrones más cortos que el tema)
+static size_t split(const char *name, const char **tok, size_t *len) {
+    size_t ntok = 0;
+    for (const char *p = name;;) {
+        if (ntok == SUBJECT_MAX_LEVELS) return 0;
+        tok[ntok] = p;
+        len[ntok] = tok_len(p);
+        ntok++;
+        if (!p[len[ntok - 1]]) return ntok;
+        p += len[ntok - 1] + 1;
+    }
+}
+
+// Como match(), pero solo dice si algún patrón coincide
+static int match_any(const Node *n, const char *const *tok, const size_t *len, size_t i, size_t ntok) {
+    if (i == ntok) return n->exact.n > 0;
+    if (n->rest.n) return 1;
+    const Node *k = find_kid(n, tok[i], len[i], tok_hash(tok[i], len[i]));
+    if (k && match_any(k, tok, len, i + 1, ntok)) return 1;
+    return n->star && match_any(n->star, tok, len, i + 1, ntok);
+}
+
+int sub_trie_match_any(const SubTrie *t, const char *name) {
+    if (!t || t->size == 0) return 0;
+    const char *tok[SUBJECT_MAX_LEVELS];
+    size_t len[SUBJECT_MAX_LEVELS];
+    size_t ntok = split(name, tok, len);
+    return ntok && match_any(&t->root, tok, len, 0, ntok);
+}
+
+void *const *subject_matches(Subject *s, const SubTrie *t, size_t *n) {
+    if (!t || t->size == 0) {
+        *n = s->nsubs;
+        return s->owners;
+    }
+    if (s->match_version == s->version && (s->match_gen == t->gen || unaffected(t, s->match_gen, s->name))) {
+        s->match_gen = t->gen;
+        *n = s->nmatch;
+        return s->match;
+    }
+    const char *tok[SUBJECT_MAX_LEVELS];
+    size_t len[SUBJECT_MAX_LEVELS];
+    size_t ntok = split(s->name, tok, len);
+    Acc a = {s->match, 0, s->match_cap};
+    acc_add(&a, s->owners, s->nsubs);
+    if (ntok) match(&t->root, tok, len, 0, ntok, &a);
+    // Un suscriptor con varios patrones que coinciden (o patrón + exacto) recibe una sola copia.
+    if (a.n > 1) {
+        qsort(a.v, a.n, sizeof(void *), cmp_ptr);
+        size_t u = 1;
+        for (size_t i = 1; i < a.n; i++)
+            if (a.v[i] != a.v[u - 1]) a.v[u++] = a.v[i];
+        a.n = u;
+    }
+    s->match = a.v;
+    s->match_cap = a.cap;
+    s->nmatch = a.n;
+    s->match_gen = t->gen;
+    s->match_version = s->version;
+    *n = s->nmatch;
+    return s->match;
+}
@@ -0,0 +1,61 @@
+// subject_trie.h — Suscripciones con comodines para broker_tcp y broker_udp
+// Los temas son jerárquicos, separados por puntos ("sensors.kitchen.temp"). Un patrón puede usar
+// "*" para exactamente un nivel ("sensors.*.temp") y ">" como último nivel para uno o más niveles
+// ("sensors.>"). Las suscripciones exactas siguen en el SubjectIndex; los patrones viven en un trie
+// por nivel, así publicar cuesta O(niveles del tema) más los caminos con comodines, sin importar
+// cuántos patrones haya instalados. El resultado (exactos + comodines, sin repetir) se guarda en el
+// Subject y se recalcula solo cuando cambian sus suscriptores exactos o un patrón que lo cubre.
+
+#ifndef SUBJECT_TRIE_H
+#define SUBJECT_TRIE_H
+
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint64_t
+
+#include "common/subject_index.h" // Subject
+
+#define SUBJECT_NO_ID 0xffffffffu // id del OK de un patrón (los MESSAGE llegan con el id del tema concreto)
+#define SUBJECT_MAX_LEVELS 64 // niveles máximos de un tema o patrón
+
+typedef struct SubTrie SubTrie;
+
+// Indica si un nombre es un patrón (algún nivel es "*" o ">")
+int subject_is_pattern(const char *name);
+
+// Valida un patrón: niveles no vacíos, comodines como nivel completo, ">" solo al final y a lo sumo
+// SUBJECT_MAX_LEVELS niveles
+int subject_pattern_valid(const char *pattern);
+
+// Indica si un tema o patrón tiene a lo sumo SUBJECT_MAX_LEVELS niveles. Los brokers rechazan los más
+// profundos al suscribir y al publicar: el trie no los puede comparar completos.
+int subject_levels_ok(const char *name);
+
+// Indica si el tema 'name' (de 'len' bytes, sin terminador) coincide con una suscripción, exacta o
+// con comodines. Sirve a los clientes que comparten un canal entre temas (los grupos multicast).
+int subject_pattern_match(const char *pattern, const char *name, size_t len);
+
+// Crear / liberar un trie vacío; sub_trie_new devuelve NULL si no hay memoria
+SubTrie *sub_trie_new(void);
+void sub_trie_free(SubTrie *t);
+
+// Instalar un patrón para 'owner'. Devuelve 0 si se agregó, 1 si ya estaba y -1 si el patrón no es
+// válido o no hay memoria.
+int sub_trie_add(SubTrie *t, const char *pattern, void *owner);
+
+// Quitar un patrón de 'owner' (si no estaba no hace nada)
+void sub_trie_remove(SubTrie *t, const char *pattern, void *owner);
+
+// Patrones instalados (pares patrón/dueño)
+size_t sub_trie_size(const SubTrie *t);
+
+// Indica si algún patrón instalado coincide con el tema 'name', sin necesitar su Subject (para no
+// internar temas que nadie pidió)
+int sub_trie_match_any(const SubTrie *t, const char *name);
+
+// Suscriptores de un tema: los exactos y los de cada patrón que coincide, sin repetir. Sin patrones
+// instalados devuelve directamente s->owners. El arreglo es válido hasta la próxima llamada para ese
+// tema; cambiar suscripciones mientras se recorre no lo modifica. Un tema con más de
+// SUBJECT_MAX_LEVELS niveles solo recibe a sus suscriptores exactos.
+void *const *subject_matches(Subject *s, const SubTrie *t, size_t *n);
+
+#endif // SUBJECT_TRIE_H
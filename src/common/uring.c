@@ -0,0 +1,188 @@
+// uring.c — Implementación del acceso mínimo a io_uring
+
+#include "common/uring.h"
+
+#include <errno.h>         // errno, EINVAL
+#include <stdlib.h>        // posix_memalign(), free()
+#include <string.h>        // memset()
+#include <sys/mman.h>      // mmap(), munmap()
+#include <sys/socket.h>    // socketpair()
+#include <sys/syscall.h>   // __NR_io_uring_setup, __NR_io_uring_enter, __NR_io_uring_register
+#include <unistd.h>        // syscall(), close(), write()
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait_nr, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, submit, wait_nr, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nargs) {
+    return (int) syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+int uring_init(Uring *u, unsigned entries) {
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+    // Con un solo hilo por anillo, el kernel puede diferir el trabajo de finalización hasta que se
+    // piden eventos (menos interrupciones). Los kernels viejos rechazan esos flags: se prueba sin ellos.
+    static const unsigned tries[] = {IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+                                     IORING_SETUP_COOP_TASKRUN, 0};
+    struct io_uring_params p;
+    for (size_t i = 0; i < sizeof(tries) / sizeof(tries[0]); i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = tries[i] | IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4; // las recepciones multishot generan muchos CQE por SQE
+        u->fd = sys_setup(entries, &p);
+        if (u->fd >= 0 || errno != EINVAL) break;
+    }
+    if (u->fd < 0) return -1;
+    u->flags = p.flags;
+
+    u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && u->cq_map_len > u->sq_map_len) u->sq_map_len = u->cq_map_len;
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                     IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) goto fail;
+    if (single) {
+        u->cq_map = u->sq_map;
+    } else {
+        u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                         IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED) goto fail;
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *) mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto fail;
+
+    char *sq = (char *) u->sq_map, *cq = (char *) u->cq_map;
+    u->sq_head = (unsigned *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    u->sq_array = (unsigned *) (sq + p.sq_off.array);
+    u->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_local = *u->sq_tail;
+    u->cq_head = (unsigned *) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    // la ranura i del arreglo apunta siempre a la SQE i
+    for (unsigned i = 0; i < p.sq_entries; i++) u->sq_array[i] = i;
+    return 0;
+
+fail:
+    {
+        int e = errno;
+        uring_free(u);
+        errno = e;
+    }
+    return -1;
+}
+
+void uring_free(Uring *u) {
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_len);
+    if (u->cq_map && u->cq_map != MAP_FAILED && u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_len);
+    if (u->sq_map && u->sq_map != MAP_FAILED) munmap(u->sq_map, u->sq_map_len);
+    if (u->fd >= 0) close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(Uring *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local - head >= u->sq_entries) {
+        // cola llena: enviar lo acumulado sin esperar
+        if (uring_submit_wait(u, 0) < 0) return NULL;
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sq_local - head >= u->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local & u->sq_mask];
+    u->sq_local++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_wait(Uring *u, unsigned wait_nr) {
+    unsigned submit = u->sq_local - *u->sq_tail;
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+    if (submit == 0 && wait_nr == 0) return 0;
+    return sys_enter(u->fd, submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0) < 0 ? -1 : 0;
+}
+
+int uring_bufs_init(Uring *u, UringBufs *b, uint16_t bgid, unsigned count, size_t size) {
+    memset(b, 0, sizeof(*b));
+    size_t rlen = count * sizeof(struct io_uring_buf);
+    b->ring = (struct io_uring_buf_ring *) mmap(NULL, rlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                                -1, 0);
+    if (b->ring == MAP_FAILED) {
+        b->ring = NULL;
+        return -1;
+    }
+    void *base;
+    if (posix_memalign(&base, 4096, count * size) != 0) {
+        munmap(b->ring, rlen);
+        b->ring = NULL;
+        return -1;
+    }
+    b->base = (char *) base;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) b->ring;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int e = errno;
+        free(b->base);
+        munmap(b->ring, rlen);
+        b->ring = NULL;
+        errno = e;
+        return -1;
+    }
+    b->count = count;
+    b->mask = count - 1;
+    b->size = size;
+    b->bgid = bgid;
+    for (unsigned i = 0; i < count; i++) uring_bufs_put(b, (uint16_t) i);
+    uring_bufs_publish(b);
+    return 0;
+}
+
+int uring_probe(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+    Uring u;
+    UringBufs b;
+    int ok = -1;
+    if (uring_init(&u, 8) == 0) {
+        if (uring_bufs_init(&u, &b, 0, 4, 64) == 0) {
+            struct io_uring_sqe *sqe = uring_sqe(&u);
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = sv[0];
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            sqe->user_data = 1;
+            if (write(sv[1], "x", 1) == 1 && uring_submit_wait(&u, 1) == 0) {
+                struct io_uring_cqe *cqe = uring_peek(&u);
+                // un kernel sin recepción multishot responde -EINVAL o no deja la operación armada
+                if (cqe && cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE))
+                    ok = 0;
+                else errno = cqe && cqe->res < 0 ? -cqe->res : EINVAL;
+            }
+            close(sv[0]);
+            close(sv[1]);
+            uring_free(&u); // cierra el anillo antes de liberar los buffers que tiene registrados
+            free(b.base);
+            munmap(b.ring, b.count * sizeof(struct io_uring_buf));
+            return ok;
+        }
+        uring_free(&u);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return ok;
+}
@@ -0,0 +1,87 @@
+// uring.h — Acceso mínimo a io_uring con las syscalls directas (sin liburing)
+// Mapea las colas de envío (SQ) y de finalización (CQ) de un anillo, entrega SQEs para llenar y
+// recorre los CQE. Las SQEs se acumulan y salen todas juntas en la próxima uring_submit_wait(): una
+// sola llamada al kernel envía lo pedido en la iteración y espera lo que haya terminado.
+// También administra un anillo de buffers provistos (IORING_REGISTER_PBUF_RING): las recepciones
+// multishot toman un buffer del anillo por cada trozo recibido y el usuario lo devuelve al terminar.
+// Pensado para un solo hilo por anillo (cada shard de broker_tcp tiene el suyo).
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h> // struct io_uring_sqe, struct io_uring_cqe, IORING_*
+#include <stddef.h>        // size_t
+#include <stdint.h>        // uint16_t
+
+typedef struct Uring {
+    int fd;
+    // cola de envío
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    unsigned sq_local; // cola local: hasta aquí hay SQEs entregadas (se publica al enviar)
+    struct io_uring_sqe *sqes;
+    // cola de finalización
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned flags; // IORING_SETUP_* con que se creó
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+} Uring;
+
+// Anillo de buffers provistos: 'count' buffers de 'size' bytes en un bloque, del grupo 'bgid'
+typedef struct UringBufs {
+    struct io_uring_buf_ring *ring;
+    char *base;
+    unsigned count, mask;
+    size_t size;
+    uint16_t bgid;
+    uint16_t tail; // cola local: se publica con uring_bufs_publish()
+} UringBufs;
+
+// Crear un anillo de 'entries' SQEs (CQ de 4x); -1 con errno si el kernel no lo permite
+int uring_init(Uring *u, unsigned entries);
+void uring_free(Uring *u);
+
+// Próxima SQE libre, en cero. Si la cola está llena, envía primero lo acumulado. NULL si ni así.
+struct io_uring_sqe *uring_sqe(Uring *u);
+
+// Enviar lo acumulado y esperar al menos 'wait_nr' finalizaciones. -1 con errno.
+int uring_submit_wait(Uring *u, unsigned wait_nr);
+
+// Primer CQE sin consumir (NULL si no hay) y consumirlo
+static inline struct io_uring_cqe *uring_peek(Uring *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+static inline void uring_seen(Uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Registrar un anillo de 'count' (potencia de 2) buffers de 'size' bytes como grupo 'bgid'
+int uring_bufs_init(Uring *u, UringBufs *b, uint16_t bgid, unsigned count, size_t size);
+
+static inline char *uring_buf(const UringBufs *b, uint16_t bid) {
+    return b->base + (size_t) bid * b->size;
+}
+
+// Devolver un buffer al anillo (visible para el kernel tras uring_bufs_publish())
+static inline void uring_bufs_put(UringBufs *b, uint16_t bid) {
+    struct io_uring_buf *e = &b->ring->bufs[b->tail & b->mask];
+    e->addr = (uint64_t) (uintptr_t) uring_buf(b, bid);
+    e->len = (uint32_t) b->size;
+    e->bid = bid;
+    b->tail++;
+}
+
+static inline void uring_bufs_publish(UringBufs *b) {
+    __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+// Comprobar que el kernel soporta lo que usa broker_tcp (anillo de buffers provistos y recepción
+// multishot) con un par de sockets de prueba. 0 = disponible; -1 con errno.
+int uring_probe(void);
+
+#endif // URING_H
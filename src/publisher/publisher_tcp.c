@@ -1,90 +1,181 @@
 // publisher_tcp.c
+// Uso: publisher_tcp [host] [puerto] [tema] [intervalo_ms] [--v2] [--batch N] [--linger-ms MS] [--quiet]
+//                      [--latency] [--rate MSGS] [--rate-bytes BYTES] [--compress]
+// Con --v2 negocia el framing binario (common/proto_v2.h): el primer PUBLISH lleva el nombre del tema
+// y asocia el id 1; los siguientes solo llevan el id.
+// Con --batch N se juntan hasta N mensajes en un único PUBLISH_BATCH (una sola escritura); --linger-ms
+// limita cuánto puede esperar un lote incompleto. Con intervalo 0 se publica sin pausas y --quiet
+// reemplaza el log por mensaje con un resumen por segundo.
+// Con --latency cada payload empieza con un sello (common/latency.h) con el id del publicador, la
+// secuencia y el instante de envío en nanosegundos, para que el suscriptor mida la latencia.
+// Si broker_tcp controla el flujo (--credit-msgs / --credit-bytes) el publicador respeta su crédito:
+// con el saldo agotado espera el próximo CREDIT antes de enviar. --rate y --rate-bytes limitan además
+// los mensajes y bytes por segundo con una cubeta de fichas (ráfaga de hasta 100 ms de tasa).
+// Con --compress (y --batch) ofrece compresión lz4 a broker_tcp: si la acepta, cada lote de al menos
+// PS_COMPRESS_MIN bytes sale comprimido cuando así ocupa menos.
 
-#include <netdb.h>          // getaddrinfo(), freeaddrinfo()
-#include <stdio.h>          // printf(), perror()
-#include <stdlib.h>         // exit(), strtol()
-#include <string.h>         // memset(), strlen(), snprintf()
-#include <sys/socket.h>     // socket(), connect(), send()
-#include <sys/types.h>      // tipos de socket
-#include <time.h>           // time(), nanosleep(), struct timespec
-#include <unistd.h>         // close()
+#include <stdio.h>           // printf(), perror()
+#include <stdlib.h>          // strtol(), malloc(), free()
+#include <string.h>          // strlen(), strcmp(), snprintf()
+#include <time.h>            // time(), nanosleep()
+#include <unistd.h>          // getpid()
 
-// Función para conectar a un servidor TCP.
-static int connect_tcp(const char *host, const char *port) {
-    struct addrinfo hints, *res, *rp; // punteros para recorrer resultados
-    int fd = -1; // descriptor de socket
-    memset(&hints, 0, sizeof(hints)); // inicializar a 0
-    hints.ai_family = AF_INET; // IPv4
-    hints.ai_socktype = SOCK_STREAM; // TCP
-    // Resuelve el nombre de host y el puerto.
-    if (getaddrinfo(host, port, &hints, &res) != 0) {
-        perror("getaddrinfo");
-        exit(1);
-    }
-    // Itera sobre las direcciones resueltas e intenta conectar.
-    for (rp = res; rp; rp = rp->ai_next) {
-        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (fd < 0) continue; // Si falla la creación del socket, prueba con la siguiente dirección.
-        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) break; // Si la conexión es exitosa, sale del bucle.
-        close(fd); // Si la conexión falla, cierra el socket.
-        fd = -1;
-    }
-    freeaddrinfo(res); // Libera la memoria de las direcciones resueltas.
-    if (fd < 0) {
-        // Si no se pudo conectar a ninguna dirección.
-        perror("connect");
-        exit(1);
-    }
-    return fd; // Devuelve el descriptor del socket conectado.
+#include "client/pubsub.h"   // conexión y framing (libpubsub)
+#include "common/latency.h"  // sello de latencia
+#include "common/proto_v2.h" // registros de PUBLISH_BATCH
+
+#define MAX_PAYLOAD 1024 // tamaño máximo del payload generado
+#define MAX_BATCH 65536 // mensajes por lote como máximo
+#define BURST_DIV 10 // la cubeta acumula a lo sumo 1/BURST_DIV segundos de tasa
+
+// Límite de tasa: cubeta de fichas que se rellena a 'rate' por segundo hasta 'burst'. Un envío puede
+// dejarla en deuda; se duerme lo que tarda en saldarse, así la tasa media es exacta aunque los lotes
+// sean más grandes que la ráfaga.
+typedef struct Bucket {
+    double rate; // fichas por segundo (0 = sin límite)
+    double burst; // fichas acumuladas como máximo
+    double tokens;
+    uint64_t last_ns;
+} Bucket;
+
+static void bucket_init(Bucket *b, double rate) {
+    b->rate = rate;
+    b->burst = rate / BURST_DIV < 1 ? 1 : rate / BURST_DIV;
+    b->tokens = b->burst;
+    b->last_ns = lat_now_ns();
 }
 
-// Función para pausar la ejecución durante un número de milisegundos.
-static void msleep(long ms) {
-    struct timespec ts;
-    ts.tv_sec = ms / 1000;
-    ts.tv_nsec = (ms % 1000) * 1000000L;
+// Tomar 'n' fichas, esperando si la cubeta queda en deuda
+static void bucket_take(Bucket *b, double n) {
+    if (b->rate <= 0) return;
+    uint64_t now = lat_now_ns();
+    b->tokens += (double) (now - b->last_ns) * b->rate / 1e9;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last_ns = now;
+    b->tokens -= n;
+    if (b->tokens >= 0) return;
+    double wait_ns = -b->tokens * 1e9 / b->rate;
+    struct timespec ts = {(time_t) (wait_ns / 1e9), (long) ((uint64_t) wait_ns % 1000000000u)};
     nanosleep(&ts, NULL);
 }
 
+// Respuestas del broker leídas mientras se espera crédito: solo se muestran los errores
+static void on_reply(void *arg, const PsMsg *m) {
+    (void) arg;
+    if (m->kind == PS_ERR) fprintf(stderr, "%.*s", (int) m->len, m->payload);
+}
+
 int main(int argc, char **argv) {
     // Obtiene los parámetros de la línea de comandos o usa valores por defecto.
-    const char *host = (argc > 1) ? argv[1] : "127.0.0.1";
-    const char *port = (argc > 2) ? argv[2] : "5555";
-    const char *subject = (argc > 3) ? argv[3] : "test";
-    long interval_ms = (argc > 4) ? strtol(argv[4], NULL, 10) : 1000;
-
-    // Conecta al broker TCP.
-    int fd = connect_tcp(host, port);
-    printf("Publisher connected to %s:%s, subject='%s', every %ld ms.\n", host, port, subject, interval_ms);
+    // Las opciones "--..." pueden ir en cualquier posición; el resto son argumentos posicionales.
+    const char *pos[4] = {NULL, NULL, NULL, NULL};
+    int npos = 0, v2 = 0, quiet = 0, latency = 0, compress = 0;
+    long batch = 1, linger_ms = 0;
+    double rate = 0, rate_bytes = 0; // 0 = sin límite
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--v2") == 0) v2 = 1;
+        else if (strcmp(argv[i], "--quiet") == 0) quiet = 1;
+        else if (strcmp(argv[i], "--latency") == 0) latency = 1;
+        else if (strcmp(argv[i], "--compress") == 0) compress = 1;
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) batch = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--linger-ms") == 0 && i + 1 < argc) linger_ms = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) rate = strtod(argv[++i], NULL);
+        else if (strcmp(argv[i], "--rate-bytes") == 0 && i + 1 < argc) rate_bytes = strtod(argv[++i], NULL);
+        else if (npos < 4) pos[npos++] = argv[i];
+    }
+    const char *host = pos[0] ? pos[0] : "127.0.0.1";
+    const char *port = pos[1] ? pos[1] : "5555";
+    const char *subject = pos[2] ? pos[2] : "test";
+    long interval_ms = pos[3] ? strtol(pos[3], NULL, 10) : 1000;
+    size_t slen = strlen(subject);
+    if (v2 && slen > V2_MAX_SUBJECT) {
+        fprintf(stderr, "subject too long\n");
+        return 1;
+    }
+    if (batch < 1 || batch > MAX_BATCH || linger_ms < 0 || interval_ms < 0 || rate < 0 || rate_bytes < 0) {
+        fprintf(stderr, "invalid --batch, --linger-ms, --rate, --rate-bytes or interval\n");
+        return 1;
+    }
 
-    // Envía el rol "PUB" al broker.
-    const char *role = "PUB\n";
-    (void) send(fd, role, strlen(role), 0);
+    // Conecta al broker TCP; el rol "PUB" (o "PUB2" para el framing binario) sale con el primer envío.
+    PsClient c;
+    if (ps_open(&c, host, port, PS_PUB, (v2 ? PS_OPT_V2 : 0) | (compress ? PS_OPT_COMPRESS : 0)) < 0) {
+        perror("connect");
+        return 1;
+    }
+    printf("Publisher connected to %s:%s, subject='%s', every %ld ms, batch %ld.\n", host, port, subject,
+           interval_ms, batch);
 
+    // Cuerpo del lote: con batch 1 es el payload de un PUBLISH; si no, registros "u32 len | payload".
+    size_t rec_hdr = batch > 1 ? V2_BATCH_REC_HDR : 0;
+    char *body = (char *) malloc((size_t) batch * (rec_hdr + MAX_PAYLOAD));
+    if (!body) {
+        perror("malloc");
+        return 1;
+    }
+    size_t blen = 0; // bytes acumulados en el cuerpo
+    long pending = 0; // mensajes en el lote actual
+    long long first_ms = 0; // cuándo entró el primer mensaje del lote
     unsigned long counter = 0;
-    char header[256];
-    char payload[1024];
+    uint32_t pub_id = (uint32_t) getpid() ^ (uint32_t) lat_now_ns(); // distingue publicadores en el suscriptor
+    unsigned long reported = 0; // mensajes ya contados en el último resumen
+    Bucket msg_bucket, byte_bucket;
+    bucket_init(&msg_bucket, rate);
+    bucket_init(&byte_bucket, rate_bytes);
+    long long report_ms = ps_now_ms(); // último resumen (--quiet)
     while (1) {
-        // Crea el payload del mensaje.
+        // Crea el payload del mensaje directamente en el cuerpo del lote.
+        if (pending == 0) first_ms = ps_now_ms();
         time_t now = time(NULL);
-        int plen = snprintf(payload, sizeof(payload), "msg %lu at %ld", counter++, (long)now);
-        // Crea la cabecera del mensaje.
-        int hlen = snprintf(header, sizeof(header), "PUBLISH %s %d\n", subject, plen);
-        // Envía la cabecera.
-        if (send(fd, header, (size_t) hlen, 0) < 0) {
-            perror("send header");
-            break;
+        char *rec = body + blen;
+        char *pl = rec + rec_hdr;
+        int plen = 0;
+        if (latency) {
+            // Sello de latencia; el instante se toma lo más cerca posible del envío.
+            lat_stamp(pl, pub_id, counter, lat_now_ns());
+            plen = LAT_HDR_LEN;
+        }
+        plen += snprintf(pl + plen, MAX_PAYLOAD - (size_t) plen, "msg %lu at %ld", counter++, (long) now);
+        if (rec_hdr) v2_put_u32((unsigned char *) rec, (uint32_t) plen);
+        blen += rec_hdr + (size_t) plen;
+        pending++;
+        if (!quiet) printf("Sent message number %lu to subject '%s'\n", counter - 1, subject);
+
+        long long t = ps_now_ms();
+        long long wake = t + interval_ms;
+        // Con un intervalo mayor que el linger, el lote incompleto se envía sin esperar al próximo mensaje.
+        if (pending < batch && linger_ms > 0 && interval_ms > 0 && first_ms + linger_ms < wake) {
+            if (first_ms + linger_ms > t) ps_sleep_ms((long) (first_ms + linger_ms - t));
+            t = ps_now_ms();
+        }
+        if (pending >= batch || (linger_ms > 0 && t - first_ms >= linger_ms)) {
+            // Respeta la tasa y el crédito del broker; después envía cabecera y cuerpo juntos (en v2 solo
+            // el primer frame lleva el nombre del tema).
+            bucket_take(&msg_bucket, (double) pending);
+            bucket_take(&byte_bucket, (double) blen);
+            int rc = ps_credit_wait(&c, on_reply, NULL);
+            if (rc == 0)
+                rc = batch > 1 ? ps_publish_batch(&c, subject, body, blen)
+                               : (ps_publish(&c, subject, body, blen) < 0 ? -1 : ps_flush(&c));
+            if (rc < 0) {
+                perror("send");
+                break;
+            }
+            blen = 0;
+            pending = 0;
         }
-        // Envía el payload.
-        if (send(fd, payload, (size_t) plen, 0) < 0) {
-            perror("send payload");
-            break;
+        if (quiet && t - report_ms >= 1000) {
+            printf("Sent %lu messages (%.0f msg/s)\n", counter,
+                   (double) (counter - reported) * 1000.0 / (double) (t - report_ms));
+            fflush(stdout);
+            reported = counter;
+            report_ms = t;
         }
-        printf("Sent message number %lu to subject '%s'\n", counter - 1, subject);
-        // Espera el intervalo de tiempo especificado.
-        msleep(interval_ms);
+        // Espera el intervalo de tiempo especificado (0 = sin pausa).
+        if (interval_ms > 0 && wake > t) ps_sleep_ms((long) (wake - t));
     }
     // Cierra la conexión.
-    close(fd);
+    free(body);
+    ps_close(&c);
     return 0;
 }
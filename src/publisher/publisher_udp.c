@@ -1,40 +1,122 @@
 // publisher_udp.c
+// Uso: publisher_udp [host] [puerto] [tema] [intervalo_ms] [--v2] [--batch N] [--linger-ms MS] [--quiet]
+//                      [--latency] [--size BYTES] [--mtu N|auto]
+// Con --v2 envía frames binarios (common/proto_v2.h). Como UDP puede perder o reordenar datagramas,
+// cada PUBLISH lleva el nombre del tema y no depende de una asociación de id previa.
+// Con --batch N los datagramas se acumulan y se envían de a N con una sola llamada a sendmmsg();
+// cada mensaje sigue siendo un datagrama independiente. --linger-ms, intervalo 0 y --quiet funcionan
+// igual que en publisher_tcp, y --latency agrega el mismo sello de latencia al payload.
+// --size rellena cada payload hasta BYTES. Un mensaje que no entra en un datagrama (FRAME_MAX, o la
+// MTU con --mtu N|auto) se envía en fragmentos v2 (V2_FLAG_FRAG) que el broker vuelve a juntar.
 
-#include <netdb.h>          // getaddrinfo(), freeaddrinfo(), gai_strerror()
+#define _GNU_SOURCE         // sendmmsg()
+
+#include <errno.h>          // errno, EINTR
+#include <netdb.h>          // freeaddrinfo()
+#include <netinet/in.h>     // IPPROTO_IP, IP_MTU_DISCOVER
 #include <stdio.h>          // printf(), fprintf(), perror()
-#include <stdlib.h>         // strtol()
+#include <stdlib.h>         // strtol(), malloc(), calloc(), free()
 #include <string.h>         // memset(), strlen(), snprintf(), memcpy()
-#include <sys/socket.h>     // socket(), sendto()
+#include <sys/socket.h>     // socket(), sendto(), sendmmsg()
 #include <sys/types.h>      // tipos de socket
-#include <time.h>           // time(), nanosleep(), struct timespec
+#include <sys/uio.h>        // struct iovec
+#include <time.h>           // time()
 #include <unistd.h>         // close()
 
-// Función para pausar la ejecución durante un número de milisegundos.
-static void msleep(long ms) {
-    struct timespec ts;
-    ts.tv_sec = ms / 1000;
-    ts.tv_nsec = (ms % 1000) * 1000000L;
-    nanosleep(&ts,NULL);
+#include "client/pubsub.h" // resolución y cabeceras (libpubsub)
+#include "common/frag.h" // FRAG_MAX_MESSAGE, udp_path_mtu()
+#include "common/latency.h" // sello de latencia
+#include "common/proto_v2.h" // framing binario v2
+
+#define FRAME_MAX 1600 // tamaño máximo de cada datagrama
+#define MAX_BATCH 1024 // datagramas por sendmmsg() como máximo (UIO_MAXIOV)
+
+// Envía 'n' datagramas ya preparados. sendmmsg() puede enviar menos de los pedidos; un datagrama que
+// falla (p. ej. ECONNREFUSED si el broker no está) se da por perdido, como con sendto().
+static void send_batch(int sock, struct mmsghdr *msgs, unsigned int n) {
+    unsigned int done = 0;
+    while (done < n) {
+        int r = sendmmsg(sock, msgs + done, n - done, 0);
+        if (r < 0) {
+            if (errno != EINTR) done++;
+            continue;
+        }
+        done += (unsigned int) r;
+    }
+}
+
+// Envía un mensaje en fragmentos v2 de hasta 'dgram' bytes, de a MAX_BATCH por sendmmsg().
+static void send_fragments(int sock, const struct addrinfo *res, const char *subject, size_t slen, uint32_t msg_id,
+                           const char *payload, size_t len, size_t dgram) {
+    static char frames[MAX_BATCH][FRAME_MAX];
+    static struct mmsghdr msgs[MAX_BATCH];
+    static struct iovec iovs[MAX_BATCH];
+    size_t hdr = V2_HDR_LEN + slen + V2_FRAG_LEN;
+    if (hdr >= dgram) return;
+    size_t chunk = dgram - hdr;
+    size_t count = (len + chunk - 1) / chunk;
+    V2Frag fr = {msg_id, 0, (uint16_t) count, (uint32_t) len, 0};
+    unsigned int n = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t off = i * chunk;
+        size_t flen = len - off < chunk ? len - off : chunk;
+        fr.index = (uint16_t) i;
+        fr.offset = (uint32_t) off;
+        unsigned char *f = (unsigned char *) frames[n];
+        v2_encode(f, V2_PUBLISH, V2_FLAG_FRAG, (uint16_t) slen, 1, (uint32_t) flen);
+        memcpy(f + V2_HDR_LEN, subject, slen);
+        v2_put_frag(f + V2_HDR_LEN + slen, &fr);
+        memcpy(f + hdr, payload + off, flen);
+        iovs[n].iov_base = f;
+        iovs[n].iov_len = hdr + flen;
+        msgs[n].msg_hdr.msg_name = res->ai_addr;
+        msgs[n].msg_hdr.msg_namelen = res->ai_addrlen;
+        msgs[n].msg_hdr.msg_iov = &iovs[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+        if (++n == MAX_BATCH) {
+            send_batch(sock, msgs, n);
+            n = 0;
+        }
+    }
+    if (n) send_batch(sock, msgs, n);
 }
 
 int main(int argc, char **argv) {
     // Obtiene los parámetros de la línea de comandos o usa valores por defecto.
-    const char *host = (argc > 1) ? argv[1] : "127.0.0.1";
-    const char *port = (argc > 2) ? argv[2] : "5556"; // puerto UDP
-    const char *subject = (argc > 3) ? argv[3] : "test";
-    long interval_ms = (argc > 4) ? strtol(argv[4], NULL, 10) : 1000;
-
-    struct addrinfo hints, *res;
-    int rc;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET; // IPv4
-    hints.ai_socktype = SOCK_DGRAM; // UDP
-    // Resuelve la dirección del broker.
-    if ((rc = getaddrinfo(host, port, &hints, &res)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+    // Las opciones "--..." pueden ir en cualquier posición; el resto son argumentos posicionales.
+    const char *pos[4] = {NULL, NULL, NULL, NULL};
+    int npos = 0, v2 = 0, quiet = 0, latency = 0;
+    long batch = 1, linger_ms = 0, size = 0;
+    const char *mtu_opt = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--v2") == 0) v2 = 1;
+        else if (strcmp(argv[i], "--quiet") == 0) quiet = 1;
+        else if (strcmp(argv[i], "--latency") == 0) latency = 1;
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) batch = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--linger-ms") == 0 && i + 1 < argc) linger_ms = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) size = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--mtu") == 0 && i + 1 < argc) mtu_opt = argv[++i];
+        else if (npos < 4) pos[npos++] = argv[i];
+    }
+    const char *host = pos[0] ? pos[0] : "127.0.0.1";
+    const char *port = pos[1] ? pos[1] : "5556"; // puerto UDP
+    const char *subject = pos[2] ? pos[2] : "test";
+    long interval_ms = pos[3] ? strtol(pos[3], NULL, 10) : 1000;
+    size_t slen = strlen(subject);
+    if (slen > 256) {
+        fprintf(stderr, "subject too long\n");
+        return 1;
+    }
+    if (batch < 1 || batch > MAX_BATCH || linger_ms < 0 || interval_ms < 0 || size < 0 ||
+        size > (long) FRAG_MAX_MESSAGE) {
+        fprintf(stderr, "invalid --batch, --linger-ms, --size or interval\n");
         return 1;
     }
 
+    // Resuelve la dirección del broker.
+    struct addrinfo *res = ps_resolve(host, port, SOCK_DGRAM);
+    if (!res) return 1;
+
     // Crea un socket UDP.
     int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     if (sock < 0) {
@@ -43,33 +125,118 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    printf("Publisher UDP connected to %s:%s, subject='%s', every %ld ms.\n", host, port, subject, interval_ms);
+    // Tamaño de datagrama: FRAME_MAX, o menos si la MTU (fija o la de la ruta) no lo permite.
+    size_t dgram = FRAME_MAX;
+    if (mtu_opt) {
+        int m = strcmp(mtu_opt, "auto") == 0 ? udp_path_mtu(res->ai_addr, res->ai_addrlen) : atoi(mtu_opt);
+        if (m > UDP_IP_OVERHEAD + V2_HDR_LEN + V2_FRAG_LEN + 256 && (size_t) m - UDP_IP_OVERHEAD < dgram)
+            dgram = (size_t) m - UDP_IP_OVERHEAD;
+        // Con la MTU de la ruta, DF evita que el kernel fragmente si la ruta cambia.
+        int pmtu = IP_PMTUDISC_DO;
+        if (strcmp(mtu_opt, "auto") == 0) (void) setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+    }
+
+    // Anuncia el framing v2 (informativo: el broker también lo detecta en el primer frame).
+    if (v2) (void) sendto(sock, "PUB2\n", 5, 0, res->ai_addr, res->ai_addrlen);
 
+    printf("Publisher UDP connected to %s:%s, subject='%s', every %ld ms, batch %ld, datagram %zu bytes.\n", host,
+           port, subject, interval_ms, batch, dgram);
+
+    // Un datagrama por ranura; las cabeceras de sendmmsg() apuntan a ranuras fijas.
+    char (*frames)[FRAME_MAX] = malloc((size_t) batch * FRAME_MAX);
+    struct mmsghdr *msgs = calloc((size_t) batch, sizeof(struct mmsghdr));
+    struct iovec *iovs = calloc((size_t) batch, sizeof(struct iovec));
+    if (!frames || !msgs || !iovs) {
+        perror("malloc");
+        return 1;
+    }
+    for (long i = 0; i < batch; i++) {
+        iovs[i].iov_base = frames[i];
+        msgs[i].msg_hdr.msg_name = res->ai_addr;
+        msgs[i].msg_hdr.msg_namelen = res->ai_addrlen;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    long pending = 0; // datagramas en el lote actual
+    long long first_ms = 0; // cuándo entró el primer mensaje del lote
     unsigned long counter = 0;
-    char header[256];
-    char payload[1200];
-    char frame[1600];
+    uint32_t pub_id = (uint32_t) getpid() ^ (uint32_t) lat_now_ns(); // distingue publicadores en el suscriptor
+    unsigned long reported = 0; // mensajes ya contados en el último resumen
+    long long report_ms = ps_now_ms(); // último resumen (--quiet)
+    char header[V2_HDR_LEN + 256 + 32];
+    size_t payload_cap = (size_t) size > 1200 ? (size_t) size : 1200;
+    char *payload = malloc(payload_cap);
+    if (!payload) {
+        perror("malloc");
+        return 1;
+    }
 
     while (1) {
         // Crea el payload del mensaje.
+        if (pending == 0) first_ms = ps_now_ms();
         time_t now = time(NULL);
-        int plen = snprintf(payload, sizeof(payload), "msg %lu at %ld", counter++, (long)now);
+        char *pl = payload;
+        int plen = 0;
+        if (latency) {
+            // Sello de latencia; el instante se toma lo más cerca posible del envío.
+            lat_stamp(pl, pub_id, counter, lat_now_ns());
+            plen = LAT_HDR_LEN;
+        }
+        plen += snprintf(pl + plen, payload_cap - (size_t) plen, "msg %lu at %ld", counter++, (long) now);
+        if (plen < size) {
+            // Relleno hasta --size.
+            memset(pl + plen, '.', (size_t) (size - plen));
+            plen = (int) size;
+        }
         // Crea la cabecera del mensaje.
-        int hlen = snprintf(header, sizeof(header), "PUBLISH %s %d\n", subject, plen);
+        // En v2 cada PUBLISH lleva el nombre: UDP no garantiza que llegue el que asoció el id.
+        int hlen = (int) ps_publish_header(header, sizeof(header), v2, 0, subject, 1, 1, (size_t) plen);
         // Calcula el tamaño total del datagrama.
         size_t total = (size_t) hlen + (size_t) plen;
-        if (total > sizeof(frame)) total = sizeof(frame);
-        // Copia la cabecera y el payload al buffer del datagrama.
-        memcpy(frame, header, (size_t)hlen);
-        memcpy(frame+hlen, payload, (size_t)(total - (size_t)hlen));
-        // Envía el datagrama al broker.
-        (void) sendto(sock, frame, total, 0, res->ai_addr, res->ai_addrlen);
-        printf("Sent message number %lu to subject '%s'\n", counter - 1, subject);
-        // Espera el intervalo de tiempo especificado.
-        msleep(interval_ms);
+        if (total > dgram) {
+            // No entra: se envía lo pendiente (para conservar el orden) y después los fragmentos.
+            if (pending) send_batch(sock, msgs, (unsigned int) pending);
+            pending = 0;
+            send_fragments(sock, res, subject, slen, (uint32_t) counter, payload, (size_t) plen, dgram);
+        } else {
+            // Copia la cabecera y el payload a la ranura del datagrama.
+            char *frame = frames[pending];
+            memcpy(frame, header, (size_t) hlen);
+            memcpy(frame + hlen, payload, (size_t) plen);
+            iovs[pending].iov_len = total;
+            pending++;
+        }
+        if (!quiet) printf("Sent message number %lu to subject '%s'\n", counter - 1, subject);
+
+        long long t = ps_now_ms();
+        long long wake = t + interval_ms;
+        // Con un intervalo mayor que el linger, el lote incompleto se envía sin esperar al próximo mensaje.
+        if (pending > 0 && pending < batch && linger_ms > 0 && interval_ms > 0 && first_ms + linger_ms < wake) {
+            if (first_ms + linger_ms > t) ps_sleep_ms((long) (first_ms + linger_ms - t));
+            t = ps_now_ms();
+        }
+        if (pending >= batch || (linger_ms > 0 && t - first_ms >= linger_ms)) {
+            // Envía los datagramas al broker.
+            send_batch(sock, msgs, (unsigned int) pending);
+            pending = 0;
+        }
+        if (quiet && t - report_ms >= 1000) {
+            printf("Sent %lu messages (%.0f msg/s)\n", counter,
+                   (double) (counter - reported) * 1000.0 / (double) (t - report_ms));
+            fflush(stdout);
+            reported = counter;
+            report_ms = t;
+        }
+        // Espera el intervalo de tiempo especificado (0 = sin pausa).
+        if (interval_ms > 0 && wake > t) ps_sleep_ms((long) (wake - t));
     }
 
     // Cierra el socket.
+    free(payload);
+    free(frames);
+    free(msgs);
+    free(iovs);
     close(sock);
     freeaddrinfo(res);
     return 0;
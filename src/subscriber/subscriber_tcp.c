@@ -1,125 +1,356 @@
 // subscriber_tcp.c
+// Uso: subscriber_tcp [host] [puerto] [tema...] [--v2] [--latency] [--report-ms N] [--from SEQ|last|-N]
+//                     [--workers N] [--ring-depth N] [--work-us N] [--group NOMBRE] [--compress]
+// Con --v2 negocia el framing binario (common/proto_v2.h): el broker responde a cada SUBSCRIBE con un
+// OK que trae el id del tema, y los MESSAGE llegan solo con ese id.
+// Con --latency no imprime cada mensaje: lee el sello que agrega "publisher_* --latency" y cada
+// --report-ms (1000 por defecto) muestra por tema la tasa, los percentiles de latencia y los huecos y
+// reordenamientos de secuencia. Al terminar (Ctrl+C) muestra los acumulados.
+// Con --from cada SUBSCRIBE pide además lo que el broker retuvo del tema (broker con --retain N) desde
+// esa secuencia, el último mensaje (last) o los últimos N (-N), antes de lo que llegue en vivo.
+// Con --group se suscribe como miembro de ese grupo de cola: el broker entrega cada mensaje del tema a
+// un solo miembro del grupo, así varios procesos con el mismo --group se reparten el trabajo. No se
+// combina con --from.
+// Con --workers N el hilo principal solo lee el socket: copia cada mensaje y lo pasa por una cola SPSC
+// (de --ring-depth ranuras) al trabajador que le toca a su tema según un hash, así que los mensajes de
+// un mismo tema se procesan en orden y temas distintos en paralelo. Los trabajadores devuelven los
+// buffers por una cola MPSC para reusarlos. Si la cola de un trabajador se llena, el lector espera (y
+// deja de leer: el broker ve un consumidor lento); esas esperas se cuentan y se muestran al terminar.
+// --work-us simula un procesamiento de N microsegundos de CPU por mensaje.
+// Con --compress ofrece compresión lz4 a broker_tcp: los lotes publicados llegan como un solo
+// MESSAGE_BATCH comprimido y libpubsub entrega sus mensajes uno por uno, igual que sin compresión.
 
-#include <netdb.h>          // getaddrinfo(), freeaddrinfo(), gai_strerror()
-#include <stdio.h>          // printf(), perror(), fputs()
-#include <stdlib.h>         // exit(), malloc(), free()
-#include <string.h>         // memset(), strncmp(), strcmp(), sscanf(), snprintf()
-#include <sys/socket.h>     // socket(), connect(), send(), recv()
-#include <sys/types.h>      // tipos de socket
-#include <unistd.h>         // close()
-
-// Función para conectar a un servidor TCP.
-static int connect_tcp(const char *host, const char *port) {
-    struct addrinfo hints, *res, *rp;
-    int fd = -1;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    if (getaddrinfo(host, port, &hints, &res) != 0) {
-        perror("getaddrinfo");
-        exit(1);
-    }
-    for (rp = res; rp; rp = rp->ai_next) {
-        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (fd < 0) continue;
-        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) break;
-        close(fd);
-        fd = -1;
-    }
-    freeaddrinfo(res);
-    if (fd < 0) {
-        perror("connect");
-        exit(1);
+#include <pthread.h>         // pthread_create(), pthread_join(), pthread_mutex_t, pthread_cond_t
+#include <sched.h>           // sched_yield()
+#include <signal.h>          // sigaction(), SIGINT, SIGTERM
+#include <stdatomic.h>       // atomic_int, atomic_thread_fence()
+#include <stdio.h>           // printf(), perror(), fwrite()
+#include <stdlib.h>          // strtol(), malloc(), calloc(), free()
+#include <string.h>          // memset(), memcpy(), strcmp()
+#include <sys/socket.h>      // setsockopt()
+#include <sys/time.h>        // struct timeval (SO_RCVTIMEO)
+#include <time.h>            // clock_gettime(), struct timespec
+
+#include "client/pubsub.h"   // conexión, framing y lectura con buffer (libpubsub)
+#include "common/latency.h"  // estadísticas de latencia por tema
+#include "common/ring.h"     // SpscRing (lector -> trabajador), MpscRing (trabajadores -> lector)
+
+#define MAX_SUBJECTS 256 // temas por línea de comandos
+#define MAX_WORKERS 64 // límite de --workers
+#define WORKER_SPIN 256 // vueltas sin mensajes antes de que un trabajador se duerma
+#define WORKER_NAP_MS 100 // un trabajador dormido despierta igual para reportar (--latency)
+
+// Registro de latencias por tema (solo con --latency y sin trabajadores).
+static LatTracker *tracker = NULL;
+static long work_us = 0; // --work-us
+static long report_ms = 1000; // --report-ms
+
+// Copia de un mensaje para un trabajador: tema y payload en un solo bloque
+typedef struct SubMsg {
+    size_t cap; // bytes disponibles en data
+    size_t slen, len;
+    char data[]; // tema seguido del payload
+} SubMsg;
+
+typedef struct Worker {
+    SpscRing ring; // mensajes del lector (productor único: el hilo principal)
+    pthread_t thread;
+    LatTracker *tracker; // temas de este trabajador (solo con --latency)
+    pthread_mutex_t lock; // para dormir sin mensajes
+    pthread_cond_t wake;
+    atomic_int sleeping; // el trabajador está (o va a estar) esperando en 'wake'
+    atomic_int done; // el lector terminó: vaciar la cola y salir
+    _Atomic uint64_t msgs; // mensajes procesados (solo los escribe el trabajador)
+    // del lector
+    uint64_t full; // veces que encontró la cola llena
+    uint64_t stall_ns; // tiempo esperando que se liberara
+    int pushed; // encoló algo desde la última vez que lo despertó
+} Worker;
+
+static Worker *workers = NULL;
+static int nworkers = 0;
+static MpscRing recycle; // buffers ya procesados, de vuelta al lector
+
+// Simula trabajo de CPU por mensaje (--work-us)
+static void busy_work(void) {
+    if (work_us <= 0) return;
+    uint64_t until = lat_now_ns() + (uint64_t) work_us * 1000;
+    while (lat_now_ns() < until) {
+    }
+}
+
+// Procesa un mensaje: en modo latencia se registra, si no se imprime
+static void handle_message(LatTracker *t, const char *subject, size_t slen, const char *payload, size_t len) {
+    busy_work();
+    if (t) lat_tracker_record(t, subject, slen, payload, len, lat_now_ns());
+    else printf("[%.*s] %.*s\n", (int) slen, subject, (int) len, payload);
+}
+
+// FNV-1a del tema: decide qué trabajador procesa sus mensajes
+static uint32_t subject_hash(const char *s, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) h = (h ^ (unsigned char) s[i]) * 16777619u;
+    return h;
+}
+
+// Despierta al trabajador si se durmió. La barrera ordena lo encolado antes de leer 'sleeping' (el
+// trabajador hace lo simétrico), así que o él ve el mensaje o aquí se ve que duerme.
+static void worker_wake(Worker *w) {
+    w->pushed = 0;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&w->sleeping, memory_order_relaxed)) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+// Espera hasta que llegue algo, termine el lector o pasen WORKER_NAP_MS
+static void worker_park(Worker *w) {
+    pthread_mutex_lock(&w->lock);
+    atomic_store_explicit(&w->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (spsc_empty(&w->ring) && !atomic_load_explicit(&w->done, memory_order_relaxed)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += WORKER_NAP_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&w->wake, &w->lock, &ts);
+    }
+    atomic_store_explicit(&w->sleeping, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void worker_deliver(Worker *w, SubMsg *m) {
+    handle_message(w->tracker, m->data, m->slen, m->data + m->slen, m->len);
+    atomic_store_explicit(&w->msgs, atomic_load_explicit(&w->msgs, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    if (mpsc_push(&recycle, m) < 0) free(m); // sobran buffers
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = (Worker *) arg;
+    uint64_t next_report = lat_now_ns() + (uint64_t) report_ms * 1000000ull;
+    int idle = 0;
+    while (1) {
+        SubMsg *m = (SubMsg *) spsc_pop(&w->ring);
+        if (m) {
+            worker_deliver(w, m);
+            idle = 0;
+        } else if (atomic_load_explicit(&w->done, memory_order_acquire)) {
+            // el lector marcó 'done' después de su último push: lo que quede ya es visible
+            while ((m = (SubMsg *) spsc_pop(&w->ring))) worker_deliver(w, m);
+            break;
+        } else if (++idle >= WORKER_SPIN) {
+            worker_park(w);
+            idle = 0;
+        }
+        if (w->tracker && idle == 0 && lat_now_ns() >= next_report) {
+            flockfile(stdout); // que las líneas de un reporte no se mezclen con las de otro trabajador
+            lat_tracker_report(w->tracker, stdout, 0);
+            funlockfile(stdout);
+            next_report = lat_now_ns() + (uint64_t) report_ms * 1000000ull;
+        }
     }
-    return fd;
+    return NULL;
 }
 
-// Función para leer una línea del socket.
-static int read_line(int fd, char *buf, size_t max) {
-    size_t n = 0;
-    while (n + 1 < max) {
-        char c;
-        ssize_t r = recv(fd, &c, 1, 0); // Lee un byte a la vez.
-        if (r == 0) return 0; // Conexión cerrada.
-        if (r < 0) return -1; // Error.
-        buf[n++] = c;
-        if (c == '\n') {
-            // Si encuentra un salto de línea, termina la línea.
-            buf[n] = '\0';
-            return (int) n;
+// Copia el mensaje (la vista de libpubsub solo vale durante la llamada) y lo encola al trabajador de
+// su tema. Con la cola llena espera: así la presión llega al socket y de ahí al broker.
+static void dispatch(const char *subject, size_t slen, const char *payload, size_t len) {
+    Worker *w = &workers[subject_hash(subject, slen) % (uint32_t) nworkers];
+    size_t need = slen + len;
+    SubMsg *m = (SubMsg *) mpsc_pop(&recycle);
+    if (m && m->cap < need) {
+        free(m);
+        m = NULL;
+    }
+    if (!m) {
+        size_t cap = need < 256 ? 256 : need;
+        m = (SubMsg *) malloc(sizeof(SubMsg) + cap);
+        if (!m) {
+            perror("malloc");
+            return;
         }
+        m->cap = cap;
+    }
+    m->slen = slen;
+    m->len = len;
+    memcpy(m->data, subject, slen);
+    memcpy(m->data + slen, payload, len);
+    if (spsc_push(&w->ring, m) < 0) {
+        w->full++;
+        uint64_t t0 = lat_now_ns();
+        worker_wake(w);
+        while (spsc_push(&w->ring, m) < 0) sched_yield();
+        w->stall_ns += lat_now_ns() - t0;
+    }
+    w->pushed = 1;
+}
+
+// Entrega cada frame del broker. El mensaje apunta al buffer de lectura de la conexión, sin copias:
+// sin trabajadores se procesa aquí mismo; con trabajadores se copia y se despacha.
+static void on_frame(void *arg, const PsMsg *m) {
+    (void) arg;
+    if (m->kind == PS_MESSAGE) {
+        const char *subject = m->subject ? m->subject : "?";
+        size_t slen = m->subject ? m->subject_len : 1;
+        if (nworkers > 0) dispatch(subject, slen, m->payload, m->len);
+        else handle_message(tracker, subject, slen, m->payload, m->len);
+    } else if (m->kind == PS_ERR || m->kind == PS_OTHER) {
+        // Imprime los errores del broker y cualquier otro mensaje para depuración (los OK se ignoran).
+        fwrite(m->payload, 1, m->len, stdout);
+        if (m->len == 0 || m->payload[m->len - 1] != '\n') putchar('\n');
+    }
+}
+
+// Crea los trabajadores con su cola y su registro de latencias; -1 si falla
+static int workers_start(int n, long depth, int latency) {
+    workers = (Worker *) calloc((size_t) n, sizeof(Worker));
+    if (!workers || mpsc_init(&recycle, (size_t) n * (size_t) depth) < 0) return -1;
+    for (int i = 0; i < n; i++) {
+        Worker *w = &workers[i];
+        if (spsc_init(&w->ring, (size_t) depth) < 0) return -1;
+        if (latency && !(w->tracker = lat_tracker_new())) return -1;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, NULL);
+        atomic_init(&w->sleeping, 0);
+        atomic_init(&w->done, 0);
+        atomic_init(&w->msgs, 0);
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) return -1;
+        nworkers++;
     }
-    buf[n] = '\0';
-    return (int) n;
+    return 0;
+}
+
+// Avisa a los trabajadores que no llegan más mensajes, espera que vacíen sus colas y muestra los
+// contadores (y los acumulados de latencia de cada uno).
+static void workers_stop(void) {
+    for (int i = 0; i < nworkers; i++) {
+        atomic_store_explicit(&workers[i].done, 1, memory_order_release);
+        worker_wake(&workers[i]);
+    }
+    for (int i = 0; i < nworkers; i++) pthread_join(workers[i].thread, NULL);
+    for (int i = 0; i < nworkers; i++) {
+        Worker *w = &workers[i];
+        if (w->tracker) {
+            lat_tracker_report(w->tracker, stdout, 1);
+            lat_tracker_free(w->tracker);
+        }
+        printf("worker %d: msgs=%llu ring_full=%llu stall_ms=%.1f\n", i,
+               (unsigned long long) atomic_load_explicit(&w->msgs, memory_order_relaxed),
+               (unsigned long long) w->full, (double) w->stall_ns / 1e6);
+        spsc_free(&w->ring);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->wake);
+    }
+    void *m;
+    while ((m = mpsc_pop(&recycle))) free(m);
+    mpsc_free(&recycle);
+    free(workers);
+}
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stop = 1;
 }
 
 int main(int argc, char **argv) {
     // Obtiene los parámetros de la línea de comandos o usa valores por defecto.
-    const char *host = (argc > 1) ? argv[1] : "127.0.0.1";
-    const char *port = (argc > 2) ? argv[2] : "5555";
+    // Las opciones "--..." pueden ir en cualquier posición; el resto son argumentos posicionales.
+    const char *pos[MAX_SUBJECTS + 2];
+    int npos = 0, v2 = 0, latency = 0, compress = 0;
+    long nwork = 0, depth = 1024;
+    const char *from = NULL, *group = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--v2") == 0) v2 = 1;
+        else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) from = argv[++i];
+        else if (strcmp(argv[i], "--group") == 0 && i + 1 < argc) group = argv[++i];
+        else if (strcmp(argv[i], "--latency") == 0) latency = 1;
+        else if (strcmp(argv[i], "--compress") == 0) compress = 1;
+        else if (strcmp(argv[i], "--report-ms") == 0 && i + 1 < argc) report_ms = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) nwork = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--ring-depth") == 0 && i + 1 < argc) depth = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--work-us") == 0 && i + 1 < argc) work_us = strtol(argv[++i], NULL, 10);
+        else if (npos < MAX_SUBJECTS + 2) pos[npos++] = argv[i];
+    }
+    if (report_ms <= 0) report_ms = 1000;
+    if (from && group) {
+        fprintf(stderr, "--from cannot be combined with --group\n");
+        return 1;
+    }
+    if (nwork < 0) nwork = 0;
+    if (nwork > MAX_WORKERS) nwork = MAX_WORKERS;
+    if (depth < 2) depth = 2;
+    const char *host = (npos > 0) ? pos[0] : "127.0.0.1";
+    const char *port = (npos > 1) ? pos[1] : "5555";
 
-    // Conecta al broker TCP.
-    int fd = connect_tcp(host, port);
+    // Conecta al broker TCP y anuncia el rol "SUB" (o "SUB2" para el framing binario).
+    PsClient c;
+    if (ps_open(&c, host, port, PS_SUB, (v2 ? PS_OPT_V2 : 0) | (compress ? PS_OPT_COMPRESS : 0)) < 0) {
+        perror("connect");
+        return 1;
+    }
     printf("Subscriber connected to %s:%s\n", host, port);
 
-    // Envía el rol "SUB" al broker.
-    const char *role = "SUB\n";
-    (void) send(fd, role, strlen(role), 0);
-
-    // Se suscribe a los temas especificados en la línea de comandos.
-    if (argc < 4) {
-        const char *cmd = "SUBSCRIBE test\n"; // Si no se especifican temas, se suscribe a "test".
-        (void) send(fd, cmd, strlen(cmd), 0);
-    } else {
-        for (int i = 3; i < argc; i++) {
-            char line[256];
-            snprintf(line, sizeof(line), "SUBSCRIBE %s\n", argv[i]);
-            (void) send(fd, line, strlen(line), 0);
+    // Se suscribe a los temas especificados en la línea de comandos (todo sale en una sola escritura).
+    if (npos < 3) pos[npos++] = "test"; // Si no se especifican temas, se suscribe a "test".
+    for (int i = 2; i < npos; i++)
+        if (ps_subscribe(&c, pos[i], from, group) < 0) fprintf(stderr, "cannot subscribe to '%s'\n", pos[i]);
+    if (ps_flush(&c) < 0) {
+        perror("send");
+        return 1;
+    }
+    if (nwork > 0 && workers_start((int) nwork, depth, latency) < 0) {
+        perror("workers");
+        return 1;
+    }
+    if (latency && nwork == 0) {
+        tracker = lat_tracker_new();
+        if (!tracker) {
+            perror("malloc");
+            return 1;
         }
     }
+    if (latency || nwork > 0) {
+        // Ctrl+C corta el bucle para mostrar los acumulados; el timeout permite reportar sin tráfico.
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        struct timeval tv = {0, 100000};
+        (void) setsockopt(c.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
 
-    while (1) {
-        char header[512];
-        // Lee la cabecera del mensaje.
-        int r = read_line(fd, header, sizeof(header));
-        if (r <= 0) {
+    // Cada vuelta es un recv() que entrega todos los mensajes completos que trajo.
+    uint64_t next_report = lat_now_ns() + (uint64_t) report_ms * 1000000ull;
+    while (!stop) {
+        int k = ps_poll(&c, on_frame, NULL);
+        // despierta a los trabajadores que recibieron algo en esta lectura (una vez por recv, no por mensaje)
+        for (int i = 0; i < nworkers; i++)
+            if (workers[i].pushed) worker_wake(&workers[i]);
+        if (k == 0) {
             printf("Connection closed.\n");
             break;
         }
-        char tag[32], subject[128];
-        size_t len = 0;
-        // Parsea la cabecera para obtener el tag, el tema y la longitud del payload.
-        if (sscanf(header, "%31s %127s %zu", tag, subject, &len) == 3 && strcmp(tag, "MESSAGE") == 0) {
-            // Reserva memoria para el payload.
-            char *payload = (char *) malloc(len + 1);
-            size_t got = 0;
-            // Lee el payload del socket.
-            while (got < len) {
-                ssize_t n = recv(fd, payload + got, len - got, 0);
-                if (n <= 0) {
-                    got = 0;
-                    break;
-                }
-                got += (size_t) n;
-            }
-            // Si se recibió el payload completo, lo imprime.
-            if (got == len) {
-                payload[len] = '\0';
-                printf("[%s] %s\n", subject, payload);
-            } else { printf("[%s] <truncated>\n", subject); }
-            free(payload);
-        } else if (strncmp(header, "OK", 2) == 0) {
-            // Ignora los mensajes "OK" del broker.
-        } else if (strncmp(header, "ERR", 3) == 0) {
-            // Imprime los mensajes de error del broker.
-            fputs(header, stdout);
-        } else {
-            // Imprime cualquier otro mensaje para depuración.
-            fputs(header, stdout);
+        if (tracker && lat_now_ns() >= next_report) {
+            lat_tracker_report(tracker, stdout, 0);
+            next_report = lat_now_ns() + (uint64_t) report_ms * 1000000ull;
         }
     }
+    if (nworkers > 0) workers_stop();
+    if (tracker) {
+        lat_tracker_report(tracker, stdout, 1);
+        lat_tracker_free(tracker);
+    }
 
     // Cierra la conexión.
-    close(fd);
+    ps_close(&c);
     return 0;
 }
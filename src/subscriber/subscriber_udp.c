@@ -1,22 +1,413 @@
 // subscriber_udp.c
+// Uso: subscriber_udp [host] [puerto] [tema...] [--v2] [--latency] [--report-ms N] [--reliable]
+//                       [--from SEQ|last|-N] [--group NOMBRE]
+// Con --v2 usa frames binarios (common/proto_v2.h). Si llega un MESSAGE con un id cuyo OK se perdió,
+// se vuelven a enviar los SUBSCRIBE (como mucho una vez por segundo) para recuperar la tabla de ids.
+// Con --latency reporta por tema tasa, percentiles de latencia, huecos y reordenamientos en lugar de
+// imprimir cada mensaje (igual que subscriber_tcp).
+// Si el broker corre con --multicast, el OK trae el grupo del tema: el suscriptor se une con
+// IP_ADD_MEMBERSHIP en la interfaz por la que llega al broker y recibe los MESSAGE desde el grupo.
+// Como varios temas comparten grupo, se descartan los MESSAGE de temas que no coinciden con ninguna
+// suscripción.
+// Con --reliable (y el broker con --reliable N) sigue la secuencia de cada tema: los huecos se piden
+// agrupados en un datagrama NACK y se reintentan cada NACK_RETRY_MS hasta NACK_TRIES veces. Los
+// mensajes recuperados se entregan apenas llegan (fuera de orden) y al salir se muestra un resumen.
+// Con --from cada SUBSCRIBE pide además lo que el broker retuvo del tema (broker con --retain N) desde
+// esa secuencia, el último mensaje (last) o los últimos N (-N), antes de lo que llegue en vivo.
+// Con --group se suscribe como miembro de ese grupo de cola: el broker entrega cada mensaje del tema a
+// un solo miembro del grupo, por unicast. No se combina con --from.
+// Cada KEEPALIVE_S manda "PING\n" para que el broker no lo olvide (--peer-timeout) y al salir con
+// Ctrl+C se da de baja con UNSUBSCRIBE, así un grupo deja de contarlo en la ronda enseguida.
 
-#include <arpa/inet.h>      // htonl(), htons() si se necesitaran; struct in_addr
-#include <netdb.h>          // getaddrinfo(), freeaddrinfo(), gai_strerror()
-#include <netinet/in.h>     // struct sockaddr_in
+#define _GNU_SOURCE         // recvmmsg()
+
+#include <arpa/inet.h>      // htonl(), htons(), inet_pton(), inet_ntoa(); struct in_addr
+#include <errno.h>          // errno, EINTR
+#include <netdb.h>          // freeaddrinfo()
+#include <netinet/in.h>     // struct sockaddr_in, struct ip_mreq, IP_ADD_MEMBERSHIP
+#include <poll.h>           // poll()
+#include <signal.h>         // sigaction(), SIGINT, SIGTERM
 #include <stdio.h>          // printf(), fprintf()
-#include <stdlib.h>         // exit()
-#include <string.h>         // memset(), memcpy(), snprintf(), memchr(), strcmp(), sscanf()
-#include <sys/socket.h>     // socket(), bind(), sendto(), recvfrom()
+#include <stdlib.h>         // exit(), strtol(), calloc(), realloc()
+#include <string.h>         // memset(), memcpy(), memmove(), snprintf(), memchr(), strcmp(), strlen(), sscanf()
+#include <sys/socket.h>     // socket(), bind(), connect(), sendto(), recvmmsg()
 #include <sys/types.h>      // tipos básicos
+#include <time.h>           // time()
 #include <unistd.h>         // close()
 
+#include "client/pubsub.h" // parseo de datagramas, SUBSCRIBE y tabla de ids (libpubsub)
+#include "common/frag.h" // reensamblado de mensajes fragmentados
+#include "common/latency.h" // estadísticas de latencia por tema
+#include "common/proto_v2.h" // framing binario v2
+#include "common/subject_trie.h" // subject_pattern_match()
+
+#define MAX_SUBJECTS 256 // temas por línea de comandos
+#define MAX_GROUPS 256 // grupos multicast a los que unirse
+#define MAX_MISSING 4096 // secuencias pendientes de recuperar por tema
+#define NACK_DELAY_MS 2 // espera antes del primer NACK (agrupa huecos y tolera reordenamiento)
+#define NACK_RETRY_MS 20 // espera entre NACKs de una misma secuencia
+#define NACK_TRIES 10 // NACKs por secuencia antes de darla por perdida
+#define NACK_DGRAM 1400 // tamaño máximo de un datagrama de NACKs
+#define REASM_BYTES (64u << 20) // bytes retenidos como máximo en mensajes a medio reensamblar
+#define REASM_TIMEOUT_NS 2000000000ull // descartar un mensaje incompleto después de 2 s
+#define RCVBUF_BYTES (4 << 20) // buffer de recepción pedido (los fragmentos de un mensaje llegan en ráfaga)
+#define RECV_BATCH 64 // datagramas leídos por recvmmsg()
+#define MAX_DGRAM 2048 // datagrama más grande que envía el broker
+#define KEEPALIVE_S 10 // segundos entre PING (el broker olvida a los 30 s sin tráfico)
+
+// Tabla id -> nombre para los temas confirmados por el broker en modo v2.
+static PsIds ids;
+
+// Registro de latencias por tema (solo con --latency).
+static LatTracker *tracker = NULL;
+
+static volatile sig_atomic_t stop = 0;
+
+// Suscripción actual
+static int sock = -1; // socket unicast con el broker
+static const struct addrinfo *broker; // dirección del broker
+static const char **subjects; // temas suscritos
+static int nsubjects;
+static int v2 = 0;
+static time_t last_resub;
+static time_t last_ping; // último PING enviado
+
+// Secuencia de un tema (--reliable)
+typedef struct {
+    uint64_t seq; // secuencia faltante
+    uint64_t due_ns; // próximo NACK
+    int tries; // NACKs enviados
+} Missing;
+
+typedef struct {
+    char name[V2_MAX_SUBJECT + 1];
+    uint64_t expected; // próxima secuencia esperada (0 = todavía no llegó ninguna)
+    Missing *missing; // faltantes en orden creciente
+    size_t nmissing;
+} SeqTrack;
+
+static FragTable *reasm; // mensajes fragmentados en reensamblado
+static int reliable = 0;
+static SeqTrack tracks[MAX_SUBJECTS];
+static size_t ntracks = 0;
+static size_t total_missing = 0; // suma de nmissing de todos los temas
+static unsigned long long recovered = 0, lost = 0, duplicates = 0, nacks_sent = 0;
+
+// Multicast: socket ligado al puerto de los grupos (se crea con el primer OK que trae un grupo)
+static int msock = -1;
+static uint16_t mport; // puerto de los grupos (orden de host)
+static struct in_addr join_if; // interfaz local por la que se llega al broker
+static uint32_t groups[MAX_GROUPS]; // grupos a los que ya se unió (orden de red)
+static size_t ngroups = 0;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stop = 1;
+}
+
+// Entrega un mensaje: en modo latencia se registra, si no se imprime.
+static void on_message(const char *subject, const char *payload, size_t len) {
+    if (tracker) lat_tracker_record(tracker, subject, strlen(subject), payload, len, lat_now_ns());
+    else printf("[%s] %.*s\n", subject, (int) len, payload);
+}
+
+static const char *group = NULL; // --group: grupo de cola (NULL = suscripción normal)
+
+// Envía la suscripción a un tema en el formato elegido; 'from' (o NULL) pide reproducir lo retenido.
+static void send_subscribe(int fd, const struct addrinfo *res, const char *subject, int use_v2, const char *from) {
+    char f[V2_HDR_LEN + V2_MAX_SUBJECT + PS_MAX_FROM + PS_MAX_GROUP];
+    size_t n = ps_subscribe_frame(f, sizeof(f), use_v2, subject, from, group);
+    if (n) (void) sendto(fd, f, n, 0, res->ai_addr, res->ai_addrlen);
+}
+
+// Interfaz local que usa el kernel para llegar al broker (sin enviar nada: connect() en UDP solo fija
+// el destino). Unirse al grupo en esa interfaz hace que funcione también por loopback.
+static struct in_addr local_if_for(const struct addrinfo *res) {
+    struct in_addr a = {htonl(INADDR_ANY)};
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return a;
+    struct sockaddr_in l;
+    socklen_t llen = sizeof(l);
+    if (connect(fd, res->ai_addr, res->ai_addrlen) == 0 && getsockname(fd, (struct sockaddr *) &l, &llen) == 0)
+        a = l.sin_addr;
+    close(fd);
+    return a;
+}
+
+// Da de baja todas las suscripciones (en texto también en v2, como los NACK).
+static void send_unsubscribes(void) {
+    for (int i = 0; i < nsubjects; i++) {
+        char line[V2_MAX_SUBJECT + PS_MAX_GROUP + 32];
+        int n = group ? snprintf(line, sizeof(line), "UNSUBSCRIBE %s GROUP %s\n", subjects[i], group)
+                      : snprintf(line, sizeof(line), "UNSUBSCRIBE %s\n", subjects[i]);
+        if (n > 0 && (size_t) n < sizeof(line))
+            (void) sendto(sock, line, (size_t) n, 0, broker->ai_addr, broker->ai_addrlen);
+    }
+}
+
+// Unirse a un grupo multicast anunciado por el broker. Todos los grupos comparten puerto.
+static void join_group(uint32_t addr, uint16_t port) {
+    for (size_t i = 0; i < ngroups; i++)
+        if (groups[i] == addr) return;
+    if (ngroups == MAX_GROUPS) return;
+    if (msock < 0) {
+        msock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (msock < 0) {
+            perror("socket");
+            return;
+        }
+        // Varios suscriptores en el mismo host comparten el puerto de los grupos.
+        int one = 1, zero = 0;
+        (void) setsockopt(msock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        // Recibir solo los grupos a los que se unió este socket, no los de otros procesos.
+        (void) setsockopt(msock, IPPROTO_IP, IP_MULTICAST_ALL, &zero, sizeof(zero));
+        struct sockaddr_in a;
+        memset(&a, 0, sizeof(a));
+        a.sin_family = AF_INET;
+        a.sin_addr.s_addr = htonl(INADDR_ANY);
+        a.sin_port = htons(port);
+        if (bind(msock, (struct sockaddr *) &a, sizeof(a)) < 0) {
+            perror("bind multicast");
+            close(msock);
+            msock = -1;
+            return;
+        }
+        int rcvbuf = RCVBUF_BYTES;
+        (void) setsockopt(msock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        mport = port;
+    } else if (port != mport) {
+        fprintf(stderr, "multicast group on port %u ignored (already on %u)\n", (unsigned) port, (unsigned) mport);
+        return;
+    }
+    struct ip_mreq mr;
+    mr.imr_multiaddr.s_addr = addr;
+    mr.imr_interface = join_if;
+    if (setsockopt(msock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0) {
+        perror("IP_ADD_MEMBERSHIP");
+        return;
+    }
+    groups[ngroups++] = addr;
+}
+
+// Indica si un tema recibido corresponde a alguna de las suscripciones (exactas o con comodines). Un
+// grupo multicast puede llevar varios temas, incluso de otros suscriptores.
+static int subscribed(const char *subject, size_t len) {
+    for (int i = 0; i < nsubjects; i++)
+        if (subject_pattern_match(subjects[i], subject, len)) return 1;
+    return 0;
+}
+
+static SeqTrack *find_track(const char *subject) {
+    for (size_t i = 0; i < ntracks; i++)
+        if (strcmp(tracks[i].name, subject) == 0) return &tracks[i];
+    if (ntracks == MAX_SUBJECTS) return NULL;
+    SeqTrack *t = &tracks[ntracks++];
+    snprintf(t->name, sizeof(t->name), "%s", subject);
+    t->missing = (Missing *) calloc(MAX_MISSING, sizeof(Missing));
+    if (!t->missing) {
+        ntracks--;
+        return NULL;
+    }
+    return t;
+}
+
+// Quitar el faltante i conservando el orden
+static void drop_missing(SeqTrack *t, size_t i) {
+    memmove(&t->missing[i], &t->missing[i + 1], (t->nmissing - i - 1) * sizeof(Missing));
+    t->nmissing--;
+    total_missing--;
+}
+
+// Registra la secuencia de un mensaje. Devuelve 0 si es un duplicado que no hay que entregar.
+static int track_seq(const char *subject, uint64_t seq) {
+    SeqTrack *t = find_track(subject);
+    if (!t) return 1;
+    if (t->expected == 0 || seq == t->expected) {
+        // El primer mensaje visto marca el inicio (el suscriptor pudo llegar tarde).
+        t->expected = seq + 1;
+        return 1;
+    }
+    if (seq > t->expected) {
+        // Hueco: anotar las faltantes para pedirlas con NACK.
+        uint64_t due = lat_now_ns() + NACK_DELAY_MS * 1000000ull;
+        for (uint64_t q = t->expected; q < seq; q++) {
+            if (t->nmissing == MAX_MISSING) {
+                lost += seq - q; // no hay lugar para seguirlas
+                break;
+            }
+            t->missing[t->nmissing++] = (Missing) {q, due, 0};
+            total_missing++;
+        }
+        t->expected = seq + 1;
+        return 1;
+    }
+    // Anterior a la esperada: o es una recuperada o un duplicado.
+    for (size_t i = 0; i < t->nmissing; i++) {
+        if (t->missing[i].seq == seq) {
+            drop_missing(t, i);
+            recovered++;
+            return 1;
+        }
+        if (t->missing[i].seq > seq) break;
+    }
+    duplicates++;
+    return 0;
+}
+
+// El broker ya no tiene [from, from + count) de un tema: dejar de pedirlas.
+static void mark_lost(const char *subject, uint64_t from, uint64_t count) {
+    SeqTrack *t = find_track(subject);
+    if (!t) return;
+    for (size_t i = 0; i < t->nmissing;) {
+        if (t->missing[i].seq >= from && t->missing[i].seq < from + count) {
+            drop_missing(t, i);
+            lost++;
+        } else {
+            i++;
+        }
+    }
+}
+
+// Envía el datagrama de NACKs armado hasta ahora y lo vacía
+static void flush_nacks(const char *dgram, size_t *dlen) {
+    (void) sendto(sock, dgram, *dlen, 0, broker->ai_addr, broker->ai_addrlen);
+    nacks_sent++;
+    *dlen = 0;
+}
+
+// Envía los NACK vencidos de todos los temas, agrupados en la menor cantidad de datagramas.
+static void send_nacks(void) {
+    if (total_missing == 0) return;
+    uint64_t now = lat_now_ns();
+    char dgram[NACK_DGRAM + 256];
+    size_t dlen = 0;
+    for (size_t k = 0; k < ntracks; k++) {
+        SeqTrack *t = &tracks[k];
+        int open = 0; // ya se escribió "NACK <tema>" en este datagrama
+        uint64_t run_from = 0, run_n = 0;
+        for (size_t i = 0; i <= t->nmissing; i++) {
+            Missing *m = i < t->nmissing ? &t->missing[i] : NULL;
+            if (m && m->due_ns > now) continue;
+            if (m && m->tries >= NACK_TRIES) {
+                drop_missing(t, i--);
+                lost++;
+                continue;
+            }
+            // Extender el rango actual o cerrarlo y empezar otro.
+            if (m && run_n && m->seq == run_from + run_n) {
+                run_n++;
+            } else {
+                if (run_n) {
+                    if (!open) {
+                        // una línea nueva con un tema largo no entra al final de un datagrama casi lleno
+                        if (dlen && dlen + strlen(t->name) + 48 > NACK_DGRAM) flush_nacks(dgram, &dlen);
+                        dlen += (size_t) snprintf(dgram + dlen, sizeof(dgram) - dlen, "NACK %s", t->name);
+                        open = 1;
+                    }
+                    dlen += (size_t) snprintf(dgram + dlen, sizeof(dgram) - dlen, " %llu %llu",
+                                              (unsigned long long) run_from, (unsigned long long) run_n);
+                    if (dlen >= NACK_DGRAM) {
+                        // Datagrama lleno: cerrar la línea, enviarlo y seguir en otro.
+                        dgram[dlen++] = '\n';
+                        flush_nacks(dgram, &dlen);
+                        open = 0;
+                    }
+                }
+                if (m) {
+                    run_from = m->seq;
+                    run_n = 1;
+                }
+            }
+            if (m) {
+                m->tries++;
+                m->due_ns = now + NACK_RETRY_MS * 1000000ull;
+            }
+        }
+        if (open) dgram[dlen++] = '\n';
+    }
+    if (dlen) flush_nacks(dgram, &dlen);
+}
+
+// Procesa un datagrama del broker o de un grupo multicast. Los frames v2 llegan también sin --v2:
+// en multicast el broker siempre envía frames v2 con el nombre del tema, y los mensajes fragmentados
+// van siempre en v2.
+static void handle_datagram(const char *buf, size_t n) {
+    PsMsg m;
+    if (ps_parse_dgram(buf, n, &ids, &m) < 0) return;
+    char name[V2_MAX_SUBJECT + 1];
+    if (m.subject) {
+        size_t slen = m.subject_len < V2_MAX_SUBJECT ? m.subject_len : V2_MAX_SUBJECT;
+        memcpy(name, m.subject, slen);
+        name[slen] = '\0';
+    }
+    if (m.kind == PS_OK) {
+        if (m.subject && m.len == 6) {
+            // v2 en multicast: el payload trae u32 grupo | u16 puerto.
+            uint32_t grp;
+            uint16_t port;
+            memcpy(&grp, m.payload, 4);
+            memcpy(&port, m.payload + 4, 2);
+            join_group(grp, ntohs(port));
+        } else if (!m.subject && m.len > 6 && m.len < 64 && memcmp(m.payload, "MCAST ", 6) == 0) {
+            // texto: "OK MCAST <grupo> <puerto>"
+            char line[64], grp_s[48];
+            unsigned port = 0;
+            struct in_addr grp;
+            memcpy(line, m.payload, m.len);
+            line[m.len] = '\0';
+            if (sscanf(line, "MCAST %47s %u", grp_s, &port) == 2 && inet_pton(AF_INET, grp_s, &grp) == 1)
+                join_group(grp.s_addr, (uint16_t) port);
+        }
+    } else if (m.kind == PS_LOST) {
+        mark_lost(name, m.seq, m.count);
+    } else if (m.kind == PS_MESSAGE) {
+        // El broker asigna grupos multicast por hash del tema: descartar los temas que no se pidieron.
+        if (m.subject && !subscribed(m.subject, m.subject_len)) return;
+        if (!m.subject && time(NULL) != last_resub) {
+            // Se perdió el OK: pedir de nuevo los ids.
+            last_resub = time(NULL);
+            for (int i = 0; i < nsubjects; i++) send_subscribe(sock, broker, subjects[i], 1, NULL);
+        }
+        const char *body = m.payload;
+        size_t len = m.len;
+        char *whole = NULL; // mensaje reensamblado
+        if (m.frag) {
+            // Todos los fragmentos vienen del broker (unicast o grupo), que numera sus mensajes.
+            whole = frag_table_add(reasm, 0, &m.fr, body, len, lat_now_ns(), &len);
+            if (!whole) return;
+            body = whole;
+        }
+        if (!reliable || !m.seq || !m.subject || track_seq(name, m.seq)) on_message(m.subject ? name : "?", body, len);
+        free(whole);
+    }
+}
+
 int main(int argc, char **argv) {
     // Obtiene los parámetros de la línea de comandos o usa valores por defecto.
-    const char *host = (argc > 1) ? argv[1] : "127.0.0.1";
-    const char *port = (argc > 2) ? argv[2] : "5556"; // puerto UDP del broker
+    // Las opciones "--..." pueden ir en cualquier posición; el resto son argumentos posicionales.
+    const char *pos[MAX_SUBJECTS + 2];
+    int npos = 0, latency = 0;
+    long report_ms = 1000;
+    const char *from = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--v2") == 0) v2 = 1;
+        else if (strcmp(argv[i], "--latency") == 0) latency = 1;
+        else if (strcmp(argv[i], "--reliable") == 0) reliable = 1;
+        else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) from = argv[++i];
+        else if (strcmp(argv[i], "--group") == 0 && i + 1 < argc) group = argv[++i];
+        else if (strcmp(argv[i], "--report-ms") == 0 && i + 1 < argc) report_ms = strtol(argv[++i], NULL, 10);
+        else if (npos < MAX_SUBJECTS + 2) pos[npos++] = argv[i];
+    }
+    if (report_ms <= 0) report_ms = 1000;
+    if (from && group) {
+        fprintf(stderr, "--from cannot be combined with --group\n");
+        return 1;
+    }
+    const char *host = (npos > 0) ? pos[0] : "127.0.0.1";
+    const char *port = (npos > 1) ? pos[1] : "5556"; // puerto UDP del broker
 
     // Crea un socket UDP.
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
         perror("socket");
         return 1;
@@ -32,64 +423,101 @@ int main(int argc, char **argv) {
         perror("bind");
         return 1;
     }
+    // Un mensaje grande llega como una ráfaga de fragmentos; el kernel acota esto a rmem_max.
+    int rcvbuf = RCVBUF_BYTES;
+    (void) setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 
     // Resuelve la dirección del broker.
-    struct addrinfo hints, *res;
-    int rc;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
-    if ((rc = getaddrinfo(host, port, &hints, &res)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
-        return 1;
-    }
+    struct addrinfo *res = ps_resolve(host, port, SOCK_DGRAM);
+    if (!res) return 1;
 
     printf("Subscriber connected to %s:%s\n", host, port);
+    broker = res;
+    join_if = local_if_for(res);
+    reasm = frag_table_new(REASM_BYTES, REASM_TIMEOUT_NS);
+    if (!reasm) {
+        perror("malloc");
+        return 1;
+    }
 
     // Envía los mensajes de suscripción al broker.
-    if (argc < 4) {
-        const char *line = "SUBSCRIBE test\n";
-        (void) sendto(sock, line, strlen(line), 0, res->ai_addr, res->ai_addrlen);
-    } else {
-        for (int i = 3; i < argc; i++) {
-            char line[256];
-            snprintf(line, sizeof(line), "SUBSCRIBE %s\n", argv[i]);
-            (void) sendto(sock, line, strlen(line), 0, res->ai_addr, res->ai_addrlen);
+    if (npos < 3) pos[npos++] = "test";
+    subjects = pos + 2;
+    nsubjects = npos - 2;
+    if (v2) (void) sendto(sock, "SUB2\n", 5, 0, res->ai_addr, res->ai_addrlen);
+    for (int i = 0; i < nsubjects; i++) send_subscribe(sock, res, subjects[i], v2, from);
+
+    if (latency) {
+        tracker = lat_tracker_new();
+        if (!tracker) {
+            perror("malloc");
+            return 1;
         }
     }
+    // Ctrl+C corta el bucle para darse de baja y mostrar los acumulados.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-    char buf[2048];
-    while (1) {
-        // Espera a recibir un datagrama.
-        struct sockaddr_in from;
-        socklen_t fromlen = sizeof(from);
-        ssize_t n = recvfrom(sock, buf, sizeof(buf) - 1, 0, (struct sockaddr *) &from, &fromlen);
-        if (n <= 0) continue;
-        buf[n] = '\0';
-        // Busca el salto de línea para separar la cabecera del payload.
-        char *nl = memchr(buf, '\n', (size_t) n);
-        if (!nl) continue;
-        size_t header_len = (size_t) (nl - buf + 1);
-        char header[512];
-        // Copia la cabecera a un buffer separado.
-        size_t cpy = header_len < sizeof(header) - 1 ? header_len : sizeof(header) - 1;
-        memcpy(header, buf, cpy);
-        header[cpy] = '\0';
-        char tag[32], subject[128];
-        size_t len = 0;
-        // Parsea la cabecera.
-        if (sscanf(header, "%31s %127s %zu", tag, subject, &len) == 3 && strcmp(tag, "MESSAGE") == 0) {
-            size_t avail = (size_t) n - header_len;
-            if (len > avail) len = avail;
-            char save = ((char *) buf)[header_len + len];
-            ((char *) buf)[header_len + len] = '\0';
-            // Imprime el mensaje.
-            printf("[%s] %s\n", subject, (char *) buf + header_len);
-            ((char *) buf)[header_len + len] = save;
+    // Cada despertar drena con recvmmsg() los datagramas que ya estén en cola.
+    static char rbuf[RECV_BATCH][MAX_DGRAM];
+    static struct iovec riov[RECV_BATCH];
+    static struct mmsghdr rmsgs[RECV_BATCH];
+    for (int i = 0; i < RECV_BATCH; i++) {
+        riov[i].iov_base = rbuf[i];
+        riov[i].iov_len = MAX_DGRAM;
+        rmsgs[i].msg_hdr.msg_iov = &riov[i];
+        rmsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    last_resub = last_ping = time(NULL);
+    uint64_t next_report = lat_now_ns() + (uint64_t) report_ms * 1000000ull;
+    while (!stop) {
+        if (tracker && lat_now_ns() >= next_report) {
+            lat_tracker_report(tracker, stdout, 0);
+            next_report = lat_now_ns() + (uint64_t) report_ms * 1000000ull;
         }
+        // Espera datagramas del broker y, si ya se unió a algún grupo, del socket multicast. En modo
+        // latencia el timeout permite reportar sin tráfico.
+        if (time(NULL) - last_ping >= KEEPALIVE_S) {
+            (void) sendto(sock, "PING\n", 5, 0, res->ai_addr, res->ai_addrlen);
+            last_ping = time(NULL);
+        }
+        struct pollfd pfd[2] = {{sock, POLLIN, 0}, {msock, POLLIN, 0}};
+        int timeout = tracker ? 100 : KEEPALIVE_S * 1000;
+        if (total_missing) timeout = NACK_DELAY_MS; // revisar pronto los NACK pendientes
+        int r = poll(pfd, msock >= 0 ? 2 : 1, timeout);
+        if (reliable) send_nacks();
+        frag_table_expire(reasm, lat_now_ns());
+        if (r <= 0) continue;
+        for (int k = 0; k < 2; k++) {
+            if (k == 1 && msock < 0) break;
+            if (!(pfd[k].revents & POLLIN)) continue;
+            int n = recvmmsg(pfd[k].fd, rmsgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+            for (int i = 0; i < n; i++) handle_datagram(rbuf[i], rmsgs[i].msg_len);
+        }
+    }
+    send_unsubscribes();
+    if (tracker) {
+        lat_tracker_report(tracker, stdout, 1);
+        lat_tracker_free(tracker);
+    }
+    uint64_t expired, evicted;
+    frag_table_stats(reasm, &expired, &evicted);
+    if (expired || evicted)
+        printf("Fragmented messages dropped: %llu timed out, %llu evicted\n", (unsigned long long) expired,
+               (unsigned long long) evicted);
+    frag_table_free(reasm);
+    ps_ids_free(&ids);
+    if (reliable) {
+        // Lo que sigue pendiente al salir se cuenta como perdido.
+        printf("Reliable: recovered=%llu lost=%llu duplicates=%llu nacks=%llu\n", recovered, lost + total_missing,
+               duplicates, nacks_sent);
     }
 
     freeaddrinfo(res);
+    if (msock >= 0) close(msock);
     close(sock);
     return 0;
 }